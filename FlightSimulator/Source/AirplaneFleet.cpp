@@ -0,0 +1,169 @@
+#include "AirplaneFleet.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include <glm/glm.hpp>
+
+#include "Physics.h"
+#include "Threading.h"
+
+void AirplaneArrays::resize(int size) {
+	std::vector<float>* floatArrays[] = {
+		&positionX, &positionY, &positionZ, &velocityX, &velocityY, &velocityZ,
+		&forwardX, &forwardY, &forwardZ, &upX, &upY, &upZ,
+		&aileronAngle, &flapAngle, &centerToGroundContactPoint
+	};
+	for (int i = 0; i < sizeof(floatArrays) / sizeof(floatArrays[0]); i++) {
+		floatArrays[i]->resize(size);
+	}
+	thrust.resize(size);
+	roll.resize(size);
+	pitch.resize(size);
+}
+
+int addAirplane(AirplaneFleet &fleet, glm::vec3 position, glm::vec3 forward, glm::vec3 up, float centerToGroundContactPoint) {
+	int airplane = fleet.numAirplanes;
+	fleet.numAirplanes++;
+	AirplaneArrays &a = fleet.airplanes;
+	a.resize(fleet.numAirplanes);
+	a.positionX[airplane] = position.x;
+	a.positionY[airplane] = position.y;
+	a.positionZ[airplane] = position.z;
+	a.velocityX[airplane] = 0;
+	a.velocityY[airplane] = 0;
+	a.velocityZ[airplane] = 0;
+	a.forwardX[airplane] = forward.x;
+	a.forwardY[airplane] = forward.y;
+	a.forwardZ[airplane] = forward.z;
+	a.upX[airplane] = up.x;
+	a.upY[airplane] = up.y;
+	a.upZ[airplane] = up.z;
+	a.aileronAngle[airplane] = 0;
+	a.flapAngle[airplane] = 0;
+	a.centerToGroundContactPoint[airplane] = centerToGroundContactPoint;
+	a.thrust[airplane] = 0;
+	a.roll[airplane] = 0;
+	a.pitch[airplane] = 0;
+	return airplane;
+}
+
+void setAirplaneControls(AirplaneFleet &fleet, int airplane, int thrust, int roll, int pitch) {
+	fleet.airplanes.thrust[airplane] = (signed char)thrust;
+	fleet.airplanes.roll[airplane] = (signed char)roll;
+	fleet.airplanes.pitch[airplane] = (signed char)pitch;
+}
+
+glm::vec3 getAirplanePosition(const AirplaneFleet &fleet, int airplane) {
+	const AirplaneArrays &a = fleet.airplanes;
+	return glm::vec3(a.positionX[airplane], a.positionY[airplane], a.positionZ[airplane]);
+}
+
+// Same as steerAirplane does to the control surface entities. Without input the surface
+// swings back towards its center, past the limit it snaps to the limit of the input.
+static float moveControlSurface(float angle, int input, float dt) {
+	float step = dt * CONTROL_SURFACE_SPEED;
+	if (input) {
+		angle += step * input;
+	} else {
+		angle += angle < 0 ? step : -step;
+	}
+	if (std::abs(angle) > MAX_CONTROL_SURFACE_ANGLE) {
+		angle = input * MAX_CONTROL_SURFACE_ANGLE;
+	}
+	return angle;
+}
+
+// Rotates v around the unit vector axis, the same as glm::rotate
+static glm::vec3 rotateAround(glm::vec3 v, glm::vec3 axis, float cosAngle, float sinAngle) {
+	return v * cosAngle + glm::cross(axis, v) * sinAngle + axis * glm::dot(axis, v) * (1 - cosAngle);
+}
+
+static void updateAirplanes(AirplaneArrays &a, int first, int last, float *heightmap, int size, float tileSize, float dt) {
+	const float maxPosition = (size - 1) * tileSize - 0.01f;
+	for (int i = first; i < last; i++) {
+		glm::vec3 position = glm::vec3(a.positionX[i], a.positionY[i], a.positionZ[i]);
+		glm::vec3 velocity = glm::vec3(a.velocityX[i], a.velocityY[i], a.velocityZ[i]);
+		glm::vec3 forward = glm::vec3(a.forwardX[i], a.forwardY[i], a.forwardZ[i]);
+		glm::vec3 up = glm::vec3(a.upX[i], a.upY[i], a.upZ[i]);
+
+		// Steering
+		float aileronAngle = moveControlSurface(a.aileronAngle[i], a.roll[i], dt);
+		float flapAngle = moveControlSurface(a.flapAngle[i], a.pitch[i], dt);
+		a.aileronAngle[i] = aileronAngle;
+		a.flapAngle[i] = flapAngle;
+		float speed = glm::length(velocity);
+		glm::vec3 thrustForce = forward * airplaneThrustForce(a.thrust[i], speed);
+
+		// Physics, as in airplanePhysics
+		glm::vec3 airResistance = glm::vec3(0, 0, 0);
+		if (speed > 0) {
+			glm::vec3 direction = velocity / speed;
+			float areaTopBottom = 1 + 1.3f * std::abs(glm::dot(up, direction));
+			float areaLeftRight = 1 + .01f * std::abs(glm::dot(glm::normalize(glm::cross(up, forward)), direction));
+			airResistance = -direction * speed * speed * AIRPLANE_AIR_RESISTANCE_CONSTANT * areaTopBottom * areaLeftRight;
+		}
+
+		// The flaps' angle of attack is their angle, the ailerons' is the opposite
+		float pitchAngle = AIRPLANE_PITCH_RATE * flapAngle * speed * dt;
+		glm::vec3 right = glm::normalize(glm::cross(forward, up));
+		float cosPitch = std::cos(pitchAngle);
+		float sinPitch = std::sin(pitchAngle);
+		up = glm::normalize(rotateAround(up, right, cosPitch, sinPitch));
+		forward = glm::normalize(rotateAround(forward, right, cosPitch, sinPitch));
+
+		float rollAngle = AIRPLANE_ROLL_RATE * -aileronAngle * speed * dt;
+		up = glm::normalize(rotateAround(up, forward, std::cos(rollAngle), std::sin(rollAngle)));
+
+		glm::vec3 liftForce = up * glm::dot(forward, velocity) * AIRPLANE_LIFT_CONSTANT;
+		glm::vec3 gravity = glm::vec3(0, -AIRPLANE_MASS * AIRPLANE_GRAVITATIONAL_ACCELERATION, 0);
+		glm::vec3 acceleration = (gravity + thrustForce + airResistance + liftForce) / AIRPLANE_MASS;
+		velocity = velocity + acceleration * dt;
+		position = position + velocity * dt;
+
+		// Terrain collision
+		float height = getHeightAt(heightmap, size, tileSize, std::min(std::max(position.x, 0.0f), maxPosition), std::min(std::max(position.z, 0.0f), maxPosition));
+		if (height > position.y + a.centerToGroundContactPoint[i]) {
+			position.y = height - a.centerToGroundContactPoint[i];
+			velocity.y = 0;
+		}
+
+		a.positionX[i] = position.x;
+		a.positionY[i] = position.y;
+		a.positionZ[i] = position.z;
+		a.velocityX[i] = velocity.x;
+		a.velocityY[i] = velocity.y;
+		a.velocityZ[i] = velocity.z;
+		a.forwardX[i] = forward.x;
+		a.forwardY[i] = forward.y;
+		a.forwardZ[i] = forward.z;
+		a.upX[i] = up.x;
+		a.upY[i] = up.y;
+		a.upZ[i] = up.z;
+	}
+}
+
+void updateAirplaneFleet(AirplaneFleet &fleet, float *heightmap, int size, float tileSize, float dt) {
+	// One job per range, so idle workers steal ranges from busy ones
+	int numAirplanes = fleet.numAirplanes;
+	int numRanges = (numAirplanes + AIRPLANES_PER_RANGE - 1) / AIRPLANES_PER_RANGE;
+	parallelFor(0, numRanges, numRanges, [&](int firstRange, int lastRange) {
+		updateAirplanes(fleet.airplanes, firstRange * AIRPLANES_PER_RANGE, std::min(lastRange * AIRPLANES_PER_RANGE, numAirplanes), heightmap, size, tileSize, dt);
+	});
+}
+
+void airplaneToEntities(const AirplaneFleet &fleet, int airplane, Entity &main, Entity &aileronLeft, Entity &aileronRight, Entity &leftFlap, Entity &rightFlap) {
+	const AirplaneArrays &a = fleet.airplanes;
+	main.position = glm::vec3(a.positionX[airplane], a.positionY[airplane], a.positionZ[airplane]);
+	main.velocity = glm::vec3(a.velocityX[airplane], a.velocityY[airplane], a.velocityZ[airplane]);
+	main.forward = glm::vec3(a.forwardX[airplane], a.forwardY[airplane], a.forwardZ[airplane]);
+	main.up = glm::vec3(a.upX[airplane], a.upY[airplane], a.upZ[airplane]);
+
+	Entity *surfaces[] = { &aileronLeft, &aileronRight, &leftFlap, &rightFlap };
+	float angles[] = { a.aileronAngle[airplane], -a.aileronAngle[airplane], a.flapAngle[airplane], a.flapAngle[airplane] };
+	for (int i = 0; i < 4; i++) {
+		surfaces[i]->forward = DEFAULT_FORWARD;
+		surfaces[i]->up = DEFAULT_UP;
+		rotateEntity(*surfaces[i], glm::vec3(1, 0, 0), angles[i]);
+	}
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <glm\vec3.hpp>
+#include <vector>
+
+#include "Common.h"
+
+// Airplanes per range of updateAirplaneFleet, fewer than this are updated on the calling thread
+const int AIRPLANES_PER_RANGE = 512;
+
+// Airplanes stored as one array per attribute, airplane i is element i of every array
+struct AirplaneArrays {
+	std::vector<float> positionX, positionY, positionZ;
+	std::vector<float> velocityX, velocityY, velocityZ;
+	std::vector<float> forwardX, forwardY, forwardZ;
+	std::vector<float> upX, upY, upZ;
+	// Rotation in radians of the left aileron and the flaps around their hinges, the
+	// control surfaces steerAirplane turns as entities
+	std::vector<float> aileronAngle;
+	std::vector<float> flapAngle;
+	std::vector<float> centerToGroundContactPoint;
+	// Input as given to steerAirplane, -1, 0 or 1
+	std::vector<signed char> thrust, roll, pitch;
+
+	void resize(int size);
+};
+
+// Many airplanes flown by the same model as steerAirplane and airplanePhysics, without an
+// entity per control surface
+struct AirplaneFleet {
+	AirplaneFleet() : numAirplanes(0) {
+	}
+	int numAirplanes;
+	AirplaneArrays airplanes;
+};
+
+// Returns the index of the new airplane, its control surfaces are centered and it has no input
+int addAirplane(AirplaneFleet &fleet, glm::vec3 position, glm::vec3 forward, glm::vec3 up, float centerToGroundContactPoint);
+
+void setAirplaneControls(AirplaneFleet &fleet, int airplane, int thrust, int roll, int pitch);
+
+glm::vec3 getAirplanePosition(const AirplaneFleet &fleet, int airplane);
+
+// Steers and moves every airplane by dt seconds and keeps it above the terrain, in ranges of
+// AIRPLANES_PER_RANGE that each are a job on the worker threads. Airplanes outside the heightmap collide with
+// the height at its closest edge.
+void updateAirplaneFleet(AirplaneFleet &fleet, float *heightmap, int size, float tileSize, float dt);
+
+// Gives the airplane's entity and control surface entities, as loaded by loadJAS39Gripen,
+// the state of one airplane of the fleet
+void airplaneToEntities(const AirplaneFleet &fleet, int airplane, Entity &main, Entity &aileronLeft, Entity &aileronRight, Entity &leftFlap, Entity &rightFlap);
@@ -0,0 +1,236 @@
+#include "BlockCompression.h"
+
+#include <algorithm>
+#include <cstdlib>
+
+#include "Threading.h"
+
+int getBlockSize(BlockFormat format) {
+	return format == BLOCK_FORMAT_BC1 ? 8 : 16;
+}
+
+size_t getCompressedSize(BlockFormat format, int width, int height) {
+	return (size_t)((width + 3) / 4) * ((height + 3) / 4) * getBlockSize(format);
+}
+
+static unsigned short toRGB565(const int color[3]) {
+	int r = std::min(31, (color[0] * 31 + 127) / 255);
+	int g = std::min(63, (color[1] * 63 + 127) / 255);
+	int b = std::min(31, (color[2] * 31 + 127) / 255);
+	return (unsigned short)((r << 11) | (g << 5) | b);
+}
+
+static void fromRGB565(unsigned short packed, int color[3]) {
+	int r = (packed >> 11) & 31;
+	int g = (packed >> 5) & 63;
+	int b = packed & 31;
+	color[0] = (r << 3) | (r >> 2);
+	color[1] = (g << 2) | (g >> 4);
+	color[2] = (b << 3) | (b >> 2);
+}
+
+static void writeLittleEndian(unsigned long long value, int numBytes, unsigned char *bytes) {
+	for (int i = 0; i < numBytes; i++) {
+		bytes[i] = (unsigned char)(value >> (i * 8));
+	}
+}
+
+// The closest of the four palette colors of the endpoints for each pixel, error is the sum
+// of the squared distances. Equal endpoints are the 3 color mode, where index 0 gives color0.
+static unsigned int assignColorIndices(const unsigned char *pixels, unsigned short color0, unsigned short color1, int &error) {
+	int palette[4][3];
+	fromRGB565(color0, palette[0]);
+	fromRGB565(color1, palette[1]);
+	for (int c = 0; c < 3; c++) {
+		palette[2][c] = (2 * palette[0][c] + palette[1][c]) / 3;
+		palette[3][c] = (palette[0][c] + 2 * palette[1][c]) / 3;
+	}
+	int numColors = color0 == color1 ? 1 : 4;
+	unsigned int indices = 0;
+	error = 0;
+	for (int i = 0; i < 16; i++) {
+		int bestIndex = 0;
+		int bestDistance = 0x7fffffff;
+		for (int j = 0; j < numColors; j++) {
+			int distance = 0;
+			for (int c = 0; c < 3; c++) {
+				int difference = pixels[i * 4 + c] - palette[j][c];
+				distance += difference * difference;
+			}
+			if (distance < bestDistance) {
+				bestDistance = distance;
+				bestIndex = j;
+			}
+		}
+		indices |= bestIndex << (i * 2);
+		error += bestDistance;
+	}
+	return indices;
+}
+
+// Endpoints that fit the pixels best in the least squares sense for the given indices,
+// returns false when all pixels have the same index
+static bool refineColorEndpoints(const unsigned char *pixels, unsigned int indices, int minColor[3], int maxColor[3]) {
+	// Weight of color0 and color1 in each palette entry, in thirds
+	const int weights0[4] = { 3, 0, 2, 1 };
+	float aa = 0, ab = 0, bb = 0;
+	float ap[3] = { 0, 0, 0 };
+	float bp[3] = { 0, 0, 0 };
+	for (int i = 0; i < 16; i++) {
+		int index = (indices >> (i * 2)) & 3;
+		float a = weights0[index] / 3.0f;
+		float b = 1 - a;
+		aa += a * a;
+		ab += a * b;
+		bb += b * b;
+		for (int c = 0; c < 3; c++) {
+			ap[c] += a * pixels[i * 4 + c];
+			bp[c] += b * pixels[i * 4 + c];
+		}
+	}
+	float determinant = aa * bb - ab * ab;
+	if (std::abs(determinant) < 1e-6f) {
+		return false;
+	}
+	for (int c = 0; c < 3; c++) {
+		float color0 = (ap[c] * bb - bp[c] * ab) / determinant;
+		float color1 = (bp[c] * aa - ap[c] * ab) / determinant;
+		maxColor[c] = std::max(0, std::min(255, (int)(color0 + 0.5f)));
+		minColor[c] = std::max(0, std::min(255, (int)(color1 + 0.5f)));
+	}
+	return true;
+}
+
+static void writeColorBlock(unsigned short color0, unsigned short color1, unsigned int indices, unsigned char *block) {
+	writeLittleEndian(color0, 2, block);
+	writeLittleEndian(color1, 2, block + 2);
+	writeLittleEndian(indices, 4, block + 4);
+}
+
+// Endpoints from the bounding box of the colors, on the diagonal the colors spread along and
+// inset a little so the interpolated colors cover the box better, then refined once by least
+// squares if that lowers the error
+static void compressColorBlock(const unsigned char *pixels, unsigned char *block) {
+	int minColor[3] = { 255, 255, 255 };
+	int maxColor[3] = { 0, 0, 0 };
+	for (int i = 0; i < 16; i++) {
+		for (int c = 0; c < 3; c++) {
+			minColor[c] = std::min(minColor[c], (int)pixels[i * 4 + c]);
+			maxColor[c] = std::max(maxColor[c], (int)pixels[i * 4 + c]);
+		}
+	}
+	int covarianceRed = 0;
+	int covarianceGreen = 0;
+	for (int i = 0; i < 16; i++) {
+		int red = pixels[i * 4] * 2 - minColor[0] - maxColor[0];
+		int green = pixels[i * 4 + 1] * 2 - minColor[1] - maxColor[1];
+		int blue = pixels[i * 4 + 2] * 2 - minColor[2] - maxColor[2];
+		covarianceRed += red * blue;
+		covarianceGreen += green * blue;
+	}
+	if (covarianceRed < 0) {
+		std::swap(minColor[0], maxColor[0]);
+	}
+	if (covarianceGreen < 0) {
+		std::swap(minColor[1], maxColor[1]);
+	}
+	for (int c = 0; c < 3; c++) {
+		int inset = (maxColor[c] - minColor[c]) / 16;
+		minColor[c] += inset;
+		maxColor[c] -= inset;
+	}
+
+	// color0 > color1 selects the 4 color mode
+	unsigned short color0 = toRGB565(maxColor);
+	unsigned short color1 = toRGB565(minColor);
+	if (color0 < color1) {
+		std::swap(color0, color1);
+	}
+	int error;
+	unsigned int indices = assignColorIndices(pixels, color0, color1, error);
+	if (error > 0 && color0 != color1 && refineColorEndpoints(pixels, indices, minColor, maxColor)) {
+		unsigned short refined0 = toRGB565(maxColor);
+		unsigned short refined1 = toRGB565(minColor);
+		if (refined0 < refined1) {
+			std::swap(refined0, refined1);
+		}
+		int refinedError;
+		unsigned int refinedIndices = assignColorIndices(pixels, refined0, refined1, refinedError);
+		if (refinedError < error) {
+			writeColorBlock(refined0, refined1, refinedIndices, block);
+			return;
+		}
+	}
+	writeColorBlock(color0, color1, indices, block);
+}
+
+// One channel between its minimum and maximum in 8 steps, channel is 0-3 into RGBA pixels
+static void compressChannelBlock(const unsigned char *pixels, int channel, unsigned char *block) {
+	int minValue = 255;
+	int maxValue = 0;
+	for (int i = 0; i < 16; i++) {
+		minValue = std::min(minValue, (int)pixels[i * 4 + channel]);
+		maxValue = std::max(maxValue, (int)pixels[i * 4 + channel]);
+	}
+	unsigned long long indices = 0;
+	if (maxValue > minValue) {
+		// Index 0 and 1 are the endpoints, 2 to 7 step from maxValue to minValue
+		int palette[8] = { maxValue, minValue };
+		for (int j = 1; j < 7; j++) {
+			palette[j + 1] = ((7 - j) * maxValue + j * minValue) / 7;
+		}
+		for (int i = 0; i < 16; i++) {
+			int value = pixels[i * 4 + channel];
+			int bestIndex = 0;
+			for (int j = 1; j < 8; j++) {
+				if (std::abs(value - palette[j]) < std::abs(value - palette[bestIndex])) {
+					bestIndex = j;
+				}
+			}
+			indices |= (unsigned long long)bestIndex << (i * 3);
+		}
+	}
+	block[0] = (unsigned char)maxValue;
+	block[1] = (unsigned char)minValue;
+	writeLittleEndian(indices, 6, block + 2);
+}
+
+void compressBlock(const unsigned char *pixels, BlockFormat format, unsigned char *block) {
+	switch (format) {
+	case BLOCK_FORMAT_BC1:
+		compressColorBlock(pixels, block);
+		break;
+	case BLOCK_FORMAT_BC3:
+		compressChannelBlock(pixels, 3, block);
+		compressColorBlock(pixels, block + 8);
+		break;
+	case BLOCK_FORMAT_BC5:
+		compressChannelBlock(pixels, 0, block);
+		compressChannelBlock(pixels, 1, block + 8);
+		break;
+	}
+}
+
+void compressImage(const unsigned char *pixels, int width, int height, BlockFormat format, std::vector<unsigned char> &compressed) {
+	int blocksX = (width + 3) / 4;
+	int blocksY = (height + 3) / 4;
+	int blockSize = getBlockSize(format);
+	compressed.resize(getCompressedSize(format, width, height));
+	unsigned char *output = &compressed[0];
+	parallelFor(0, blocksY, getNumWorkerThreads(), [=](int firstRow, int lastRow) {
+		unsigned char blockPixels[16 * 4];
+		for (int blockY = firstRow; blockY < lastRow; blockY++) {
+			for (int blockX = 0; blockX < blocksX; blockX++) {
+				for (int y = 0; y < 4; y++) {
+					int sourceY = std::min(blockY * 4 + y, height - 1);
+					for (int x = 0; x < 4; x++) {
+						int sourceX = std::min(blockX * 4 + x, width - 1);
+						const unsigned char *source = &pixels[((size_t)sourceY * width + sourceX) * 4];
+						std::copy(source, source + 4, &blockPixels[(y * 4 + x) * 4]);
+					}
+				}
+				compressBlock(blockPixels, format, &output[((size_t)blockY * blocksX + blockX) * blockSize]);
+			}
+		}
+	});
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+// GPU block compression formats, every 4x4 pixels stored in a fixed size block
+enum BlockFormat {
+	// Opaque RGB in 8 bytes, 4 bits per pixel
+	BLOCK_FORMAT_BC1,
+	// BC1 colors plus interpolated alpha in 16 bytes
+	BLOCK_FORMAT_BC3,
+	// Red and green as two independently interpolated channels in 16 bytes, for normal maps
+	BLOCK_FORMAT_BC5
+};
+
+int getBlockSize(BlockFormat format);
+
+// Bytes of a width x height image compressed to format, partial blocks at the edges included
+size_t getCompressedSize(BlockFormat format, int width, int height);
+
+// Compresses a block of 4x4 RGBA pixels, given row by row, to getBlockSize(format) bytes
+void compressBlock(const unsigned char *pixels, BlockFormat format, unsigned char *block);
+
+// Compresses tightly packed RGBA pixels block row by block row, repeating the last row and
+// column into blocks that reach past the edges. Block rows are split over the job system.
+void compressImage(const unsigned char *pixels, int width, int height, BlockFormat format, std::vector<unsigned char> &compressed);
@@ -7,6 +7,7 @@
 #include <iostream>
 #include <sstream>
 #include <vector>
+#include <unordered_map>
 #include <string>
 
 #include <glm/mat4x4.hpp>
@@ -19,7 +20,13 @@
 
 #include <lodepng.h>
 
+#include <atomic>
 #include <memory>
+#include <xmmintrin.h>
+
+#include "Threading.h"
+#include "MeshCache.h"
+#include "TextureLoader.h"
 
 #define _USE_MATH_DEFINES
 #include <math.h>
@@ -63,21 +70,172 @@ Entity::Entity() {
 	up = DEFAULT_UP;
 	parentEntity = nullptr;
 	name = "";
+	transformCache.isValid = false;
+	transformCache.parentEntity = nullptr;
+	transformCache.parentVersion = 0;
+	transformCache.version = 0;
+	transformCache.localVersion = 0;
+	sceneNode = -1;
 };
 
-glm::mat4 getEntityTransformation(Entity const &entity) {
-	glm::mat4 toPivot = glm::translate(glm::mat4(), -entity.getRotationPivot());
-	glm::mat4 translation = glm::translate(glm::mat4(), entity.position);
-	glm::mat4 scale = glm::scale(glm::mat4(), entity.scale);
-	glm::quat quaternion = directionToQuaternion(entity.forward, entity.up, DEFAULT_FORWARD, DEFAULT_UP);
-	glm::mat4 rotation = glm::toMat4(quaternion);
-	glm::mat4 transformation = translation * glm::inverse(toPivot) * rotation * toPivot * scale;
-	if (entity.getParentEntity()) {
-		return getEntityTransformation(*entity.getParentEntity()) * transformation;
+// Atomic so cached transformations can be read from jobs
+static std::atomic<int> transformRequests(0);
+static std::atomic<int> transformUncachedEvaluations(0);
+static std::atomic<int> transformEvaluations(0);
+static unsigned int nextTransformVersion = 1;
+
+static bool isLocalTransformationCached(const Entity &entity, const TransformCache &cache) {
+	return cache.isValid && cache.position == entity.position && cache.scale == entity.scale && cache.forward == entity.forward
+		&& cache.up == entity.up && cache.rotationPivot == entity.getRotationPivot();
+}
+
+// Rebuilds the local transformation if its inputs have changed, returns whether it was cached.
+// Without isMatrixBuilt only the rotation is computed, the scene graph builds the matrix.
+static bool updateLocalTransformation(const Entity &entity, TransformCache &cache, bool isMatrixBuilt) {
+	if (isLocalTransformationCached(entity, cache)) {
+		return true;
+	}
+	transformEvaluations++;
+	cache.rotation = directionToQuaternion(entity.forward, entity.up, DEFAULT_FORWARD, DEFAULT_UP);
+	if (isMatrixBuilt) {
+		glm::mat4 toPivot = glm::translate(glm::mat4(), -entity.getRotationPivot());
+		glm::mat4 translation = glm::translate(glm::mat4(), entity.position);
+		glm::mat4 scale = glm::scale(glm::mat4(), entity.scale);
+		glm::mat4 rotation = glm::toMat4(cache.rotation);
+		// inverse(toPivot) is a translation by the pivot
+		cache.local = translation * glm::translate(glm::mat4(), entity.getRotationPivot()) * rotation * toPivot * scale;
+	}
+	cache.position = entity.position;
+	cache.scale = entity.scale;
+	cache.forward = entity.forward;
+	cache.up = entity.up;
+	cache.rotationPivot = entity.getRotationPivot();
+	cache.localVersion = nextTransformVersion++;
+	cache.isValid = true;
+	return false;
+}
+
+static const glm::mat4& updateEntityTransformation(const Entity &entity) {
+	TransformCache &cache = entity.getTransformCache();
+	bool isLocalCached = updateLocalTransformation(entity, cache, true);
+
+	const Entity *parentEntity = entity.getParentEntity();
+	if (parentEntity) {
+		const glm::mat4 &parentTransformation = updateEntityTransformation(*parentEntity);
+		unsigned int parentVersion = parentEntity->getTransformCache().version;
+		if (!isLocalCached || cache.parentEntity != parentEntity || cache.parentVersion != parentVersion) {
+			cache.world = parentTransformation * cache.local;
+			cache.parentEntity = parentEntity;
+			cache.parentVersion = parentVersion;
+			cache.version = nextTransformVersion++;
+		}
 	}
-	else {
-		return transformation;
+	else if (!isLocalCached || cache.parentEntity) {
+		cache.world = cache.local;
+		cache.parentEntity = nullptr;
+		cache.version = nextTransformVersion++;
 	}
+	return cache.world;
+}
+
+const glm::mat4& getEntityTransformation(Entity const &entity) {
+	transformRequests++;
+	for (const Entity *parent = &entity; parent; parent = parent->getParentEntity()) {
+		transformUncachedEvaluations++;
+	}
+	return updateEntityTransformation(entity);
+}
+
+static int getEntityDepth(const Entity *entity) {
+	int depth = 0;
+	for (entity = entity->getParentEntity(); entity; entity = entity->getParentEntity()) {
+		depth++;
+	}
+	return depth;
+}
+
+// The scene updated by updateEntityTransformations. Node i belongs to sceneGraphEntities[i]
+// and was last given the local transformation with version sceneGraphLocalVersions[i].
+static SceneGraph sceneGraph;
+static std::vector<Entity*> sceneGraphEntities;
+static std::vector<unsigned int> sceneGraphLocalVersions;
+
+static int getParentSceneNode(const Entity *entity) {
+	return entity->getParentEntity() ? entity->getParentEntity()->getSceneNode() : SceneGraph::NO_PARENT;
+}
+
+void updateEntityTransformations(std::vector<Entity*> &entities) {
+	// Parents have to be in the graph too
+	for (int i = 0; i < entities.size(); i++) {
+		Entity *parent = entities[i]->getParentEntity();
+		if (parent && std::find(entities.begin(), entities.end(), parent) == entities.end()) {
+			entities.push_back(parent);
+		}
+	}
+
+	// Rebuild the graph when the entities or their parents have changed
+	bool isStructureChanged = entities.size() != sceneGraphEntities.size();
+	for (int i = 0; i < entities.size() && !isStructureChanged; i++) {
+		isStructureChanged = entities[i] != sceneGraphEntities[i] || getParentSceneNode(entities[i]) != sceneGraph.getParent(i);
+	}
+	if (isStructureChanged) {
+		// Parents first
+		std::stable_sort(entities.begin(), entities.end(), [](const Entity *a, const Entity *b) -> bool {
+			return getEntityDepth(a) < getEntityDepth(b);
+		});
+		sceneGraph.clear();
+		sceneGraphEntities = entities;
+		sceneGraphLocalVersions.assign(entities.size(), 0);
+		for (int i = 0; i < entities.size(); i++) {
+			entities[i]->setSceneNode(i);
+		}
+		for (int i = 0; i < entities.size(); i++) {
+			sceneGraph.addNode(getParentSceneNode(entities[i]));
+		}
+	}
+
+	for (int i = 0; i < entities.size(); i++) {
+		TransformCache &cache = entities[i]->getTransformCache();
+		updateLocalTransformation(*entities[i], cache, false);
+		if (sceneGraphLocalVersions[i] != cache.localVersion) {
+			sceneGraph.setLocal(i, cache.position, cache.rotation, cache.scale, cache.rotationPivot);
+			sceneGraphLocalVersions[i] = cache.localVersion;
+		}
+	}
+
+	sceneGraph.update();
+
+	// The matrices of the nodes the update didn't touch are already in their caches
+	for (int i = 0; i < entities.size(); i++) {
+		TransformCache &cache = entities[i]->getTransformCache();
+		const Entity *parentEntity = entities[i]->getParentEntity();
+		const glm::mat4 &world = sceneGraph.getWorld(i);
+		bool isWorldChanged = false;
+		if (sceneGraph.isWorldUpdated(i)) {
+			cache.local = sceneGraph.getLocal(i);
+			isWorldChanged = world != cache.world;
+		}
+		if (isWorldChanged || cache.parentEntity != parentEntity) {
+			cache.world = world;
+			cache.version = nextTransformVersion++;
+		}
+		cache.parentEntity = parentEntity;
+		cache.parentVersion = parentEntity ? parentEntity->getTransformCache().version : 0;
+	}
+}
+
+TransformStats getTransformStats() {
+	TransformStats stats;
+	stats.requests = transformRequests;
+	stats.uncachedEvaluations = transformUncachedEvaluations;
+	stats.evaluations = transformEvaluations;
+	return stats;
+}
+
+void resetTransformStats() {
+	transformRequests = 0;
+	transformUncachedEvaluations = 0;
+	transformEvaluations = 0;
 }
 
 std::string readFile(std::string path) {
@@ -86,67 +244,162 @@ std::string readFile(std::string path) {
 	return str;
 }
 
-// Converts heightmap to a mesh
-Model heightmapToModel(float *heightmap, int width, int height, float scaleX, float scaleY, float scaleZ, float textureScale) {
-	std::unique_ptr<float> positions(new float[width * height * 3]);
-	std::unique_ptr<float> normals(new float[width * height * 3]);
-	std::unique_ptr<float> textureCoordinates(new float[width * height * 2]);
-	std::unique_ptr<int> indices(new int[(width - 1) * (height - 1) * 6]);
-
-	for (int z = 0; z < height; z++) {
-		for (int x = 0; x < width; x++) {
-			positions.get()[(z * width + x) * 3] = x * scaleX;
-			positions.get()[(z * width + x) * 3 + 1] = heightmap[width * z + x] * scaleY;
-			positions.get()[(z * width + x) * 3 + 2] = z * scaleZ;
-			textureCoordinates.get()[(z * width + x) * 2] = ((float)x / (float)(width - 1)) * textureScale;
-			textureCoordinates.get()[(z * width + x) * 2 + 1] = (1 - (float)z / (float)(height - 1)) * textureScale;
-
-			// Calc normals
-			if (x == width - 1 || z == height - 1 || x == 0 || z == 0) {
-				normals.get()[(z * width + x) * 3] = 0;
-				normals.get()[(z * width + x) * 3 + 1] = 1;
-				normals.get()[(z * width + x) * 3 + 2] = 0;
-			} else {
-				glm::vec3 a = glm::vec3(x * scaleX, heightmap[width * z + x] * scaleY, z * scaleZ);
-				glm::vec3 ab = a - glm::vec3((x + 1) * scaleX, heightmap[width * z + x + 1] * scaleY, z * scaleZ);
-				glm::vec3 ac = a - glm::vec3(x * scaleX, heightmap[width * (z + 1) + x] * scaleY, (z + 1) * scaleZ);
-				glm::vec3 normal1 = glm::normalize(glm::cross(ac, ab));
-				glm::vec3 normal = normal1;
-				if (!FAST_MODE) {
-					glm::vec3 ad = a - glm::vec3((x - 1) * scaleX, heightmap[width * z + x - 1] * scaleY, z * scaleZ);
-					glm::vec3 ae = a - glm::vec3(x * scaleX, heightmap[width * (z - 1) + x] * scaleY, (z - 1) * scaleZ);
-					glm::vec3 normal2 = glm::normalize(glm::cross(ae, ad));
-					glm::vec3 af = a - glm::vec3((x - 1) * scaleX, heightmap[width * z + x - 1] * scaleY, z * scaleZ);
-					glm::vec3 ag = a - glm::vec3(x * scaleX, heightmap[width * (z + 1) + x] * scaleY, (z + 1) * scaleZ);
-					glm::vec3 normal3 = glm::normalize(glm::cross(af, ag));
-					glm::vec3 ah = a - glm::vec3((x + 1) * scaleX, heightmap[width * z + x + 1] * scaleY, z * scaleZ);
-					glm::vec3 ai = a - glm::vec3(x * scaleX, heightmap[width * (z - 1) + x] * scaleY, (z - 1) * scaleZ);
-					glm::vec3 normal4 = glm::normalize(glm::cross(ah, ai));
-					normal = glm::normalize(normal1 + normal2 + normal3 + normal4);
-				}
-				normals.get()[(z * width + x) * 3] = normal.x;
-				normals.get()[(z * width + x) * 3 + 1] = normal.y;
-				normals.get()[(z * width + x) * 3 + 2] = normal.z;
-			}
+static void writeHeightmapVertex(float *heightmap, int width, int height, float scaleX, float scaleY, float scaleZ, float textureScale, int x, int z, glm::vec3 normal, float *vertices) {
+	float *vertex = &vertices[(z * width + x) * HEIGHTMAP_VERTEX_SIZE];
+	vertex[0] = x * scaleX;
+	vertex[1] = heightmap[width * z + x] * scaleY;
+	vertex[2] = z * scaleZ;
+	vertex[3] = normal.x;
+	vertex[4] = normal.y;
+	vertex[5] = normal.z;
+	vertex[6] = ((float)x / (float)(width - 1)) * textureScale;
+	vertex[7] = (1 - (float)z / (float)(height - 1)) * textureScale;
+}
 
-			// Indices
-			if (x != width - 1 && z != height - 1) {
-				int index = z * width + x;
-				int arrayIndex = z * (width - 1) + x;
-				indices.get()[arrayIndex * 6] = index;
-				indices.get()[arrayIndex * 6 + 1] = index + 1;
-				indices.get()[arrayIndex * 6 + 2] = index + width;
-				indices.get()[arrayIndex * 6 + 3] = index + 1;
-				indices.get()[arrayIndex * 6 + 4] = index + width + 1;
-				indices.get()[arrayIndex * 6 + 5] = index + width;
-			}
+// Normal from central differences, (h(x - 1) - h(x + 1), 2, h(z - 1) - h(z + 1)) scaled to world units.
+// Same operations in the same order as the SSE columns of buildHeightmapRow, so the columns
+// left over give the same bits.
+static glm::vec3 heightmapNormal(float *heightmap, int width, float scaleX, float scaleY, float scaleZ, int x, int z) {
+	int index = width * z + x;
+	float nx = (heightmap[index - 1] - heightmap[index + 1]) * (scaleY / (2 * scaleX));
+	float nz = (heightmap[index - width] - heightmap[index + width]) * (scaleY / (2 * scaleZ));
+	float inverseLength = 1.0f / std::sqrt(nx * nx + nz * nz + 1.0f);
+	return glm::vec3(nx * inverseLength, inverseLength, nz * inverseLength);
+}
+
+// Fills one interior row (0 < z < height - 1). Four vertices at a time with SSE, the
+// first and last column and the columns left over at the end are written one by one.
+static void buildHeightmapRow(float *heightmap, int width, int height, float scaleX, float scaleY, float scaleZ, float textureScale, int z, float *vertices) {
+	const glm::vec3 up = glm::vec3(0, 1, 0);
+	writeHeightmapVertex(heightmap, width, height, scaleX, scaleY, scaleZ, textureScale, 0, z, up, vertices);
+	writeHeightmapVertex(heightmap, width, height, scaleX, scaleY, scaleZ, textureScale, width - 1, z, up, vertices);
+
+	const float *row = &heightmap[width * z];
+	const float *rowAbove = row - width;
+	const float *rowBelow = row + width;
+	const __m128 scaleXs = _mm_set1_ps(scaleX);
+	const __m128 scaleYs = _mm_set1_ps(scaleY);
+	const __m128 textureScales = _mm_set1_ps(textureScale);
+	const __m128 lastColumn = _mm_set1_ps((float)(width - 1));
+	const __m128 slopeScaleX = _mm_set1_ps(scaleY / (2 * scaleX));
+	const __m128 slopeScaleZ = _mm_set1_ps(scaleY / (2 * scaleZ));
+	const __m128 ones = _mm_set1_ps(1.0f);
+	const __m128 positionZ = _mm_set1_ps(z * scaleZ);
+	const __m128 textureY = _mm_set1_ps((1 - (float)z / (float)(height - 1)) * textureScale);
+
+	int x = 1;
+	for (; x + 4 <= width - 1; x += 4) {
+		__m128 left = _mm_loadu_ps(&row[x - 1]);
+		__m128 right = _mm_loadu_ps(&row[x + 1]);
+		__m128 above = _mm_loadu_ps(&rowAbove[x]);
+		__m128 below = _mm_loadu_ps(&rowBelow[x]);
+		__m128 center = _mm_loadu_ps(&row[x]);
+
+		__m128 nx = _mm_mul_ps(_mm_sub_ps(left, right), slopeScaleX);
+		__m128 nz = _mm_mul_ps(_mm_sub_ps(above, below), slopeScaleZ);
+		__m128 length = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, nx), _mm_mul_ps(nz, nz)), ones));
+		__m128 inverseLength = _mm_div_ps(ones, length);
+		nx = _mm_mul_ps(nx, inverseLength);
+		__m128 ny = inverseLength;
+		nz = _mm_mul_ps(nz, inverseLength);
+
+		__m128 columns = _mm_set_ps((float)(x + 3), (float)(x + 2), (float)(x + 1), (float)x);
+		__m128 positionX = _mm_mul_ps(columns, scaleXs);
+		__m128 positionY = _mm_mul_ps(center, scaleYs);
+		__m128 textureX = _mm_mul_ps(_mm_div_ps(columns, lastColumn), textureScales);
+
+		// Turn the eight attribute vectors into four interleaved vertices
+		__m128 first0 = positionX, first1 = positionY, first2 = positionZ, first3 = nx;
+		__m128 second0 = ny, second1 = nz, second2 = textureX, second3 = textureY;
+		_MM_TRANSPOSE4_PS(first0, first1, first2, first3);
+		_MM_TRANSPOSE4_PS(second0, second1, second2, second3);
+
+		float *vertex = &vertices[(z * width + x) * HEIGHTMAP_VERTEX_SIZE];
+		_mm_storeu_ps(vertex, first0);
+		_mm_storeu_ps(vertex + 4, second0);
+		_mm_storeu_ps(vertex + 8, first1);
+		_mm_storeu_ps(vertex + 12, second1);
+		_mm_storeu_ps(vertex + 16, first2);
+		_mm_storeu_ps(vertex + 20, second2);
+		_mm_storeu_ps(vertex + 24, first3);
+		_mm_storeu_ps(vertex + 28, second3);
+	}
+
+	for (; x < width - 1; x++) {
+		glm::vec3 normal = heightmapNormal(heightmap, width, scaleX, scaleY, scaleZ, x, z);
+		writeHeightmapVertex(heightmap, width, height, scaleX, scaleY, scaleZ, textureScale, x, z, normal, vertices);
+	}
+}
+
+// vertices must hold width * height * HEIGHTMAP_VERTEX_SIZE floats
+void buildHeightmapVertices(float *heightmap, int width, int height, float scaleX, float scaleY, float scaleZ, float textureScale, float *vertices) {
+	// Border vertices point straight up
+	const glm::vec3 up = glm::vec3(0, 1, 0);
+	for (int x = 0; x < width; x++) {
+		writeHeightmapVertex(heightmap, width, height, scaleX, scaleY, scaleZ, textureScale, x, 0, up, vertices);
+		writeHeightmapVertex(heightmap, width, height, scaleX, scaleY, scaleZ, textureScale, x, height - 1, up, vertices);
+	}
+
+	parallelFor(1, height - 1, getNumWorkerThreads(), [&](int firstRow, int lastRow) {
+		for (int z = firstRow; z < lastRow; z++) {
+			buildHeightmapRow(heightmap, width, height, scaleX, scaleY, scaleZ, textureScale, z, vertices);
 		}
+	});
+}
+
+// The index buffer is laid out chunk by chunk as given by the quadtree, followed by the level
+// of detail indices and skirt vertices
+void buildHeightmapMesh(float *heightmap, int width, int height, float scaleX, float scaleY, float scaleZ, float textureScale, const TerrainQuadtree &quadtree, const TerrainLod &lod, std::vector<float> &vertices, std::vector<GLuint> &indices) {
+	const std::vector<unsigned int> &skirtSourceVertices = lod.getSkirtSourceVertices();
+	int numVertices = width * height + skirtSourceVertices.size();
+	vertices.resize(numVertices * HEIGHTMAP_VERTEX_SIZE);
+	indices.resize(quadtree.getNumIndices() + lod.getNumIndices());
+
+	buildHeightmapVertices(heightmap, width, height, scaleX, scaleY, scaleZ, textureScale, &vertices[0]);
+	for (int i = 0; i < skirtSourceVertices.size(); i++) {
+		float *skirtVertex = &vertices[(width * height + i) * HEIGHTMAP_VERTEX_SIZE];
+		memcpy(skirtVertex, &vertices[skirtSourceVertices[i] * HEIGHTMAP_VERTEX_SIZE], sizeof(float) * HEIGHTMAP_VERTEX_SIZE);
+		skirtVertex[1] -= lod.getSkirtDepth();
 	}
+	quadtree.buildIndices(&indices[0]);
+	lod.buildIndices(&indices[quadtree.getNumIndices()]);
+}
+
+Model heightmapToModel(float *heightmap, int width, int height, float scaleX, float scaleY, float scaleZ, float textureScale, const TerrainQuadtree &quadtree, const TerrainLod &lod) {
+	std::vector<float> vertices;
+	std::vector<GLuint> indices;
+	buildHeightmapMesh(heightmap, width, height, scaleX, scaleY, scaleZ, textureScale, quadtree, lod, vertices, indices);
+	return modelFromInterleavedVertexData(&vertices[0], vertices.size() / HEIGHTMAP_VERTEX_SIZE, &indices[0], indices.size());
+}
+
+// Vertices are laid out as HEIGHTMAP_VERTEX_SIZE floats: position, normal, texture coordinate
+Model modelFromInterleavedVertexData(const float vertices[], int numVertices, const void *indices, int numIndices, GLenum indexType) {
+	GLuint vao = 0;
+	glGenVertexArrays(1, &vao);
+	glBindVertexArray(vao);
+
+	GLuint vertexBuffer = 0;
+	glGenBuffers(1, &vertexBuffer);
+	glBindBuffer(GL_ARRAY_BUFFER, vertexBuffer);
+	glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat) * HEIGHTMAP_VERTEX_SIZE * numVertices, vertices, GL_STATIC_DRAW);
+	const GLsizei stride = sizeof(GLfloat) * HEIGHTMAP_VERTEX_SIZE;
+	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, stride, (void*)0);
+	glEnableVertexAttribArray(0);
+	glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, stride, (void*)(3 * sizeof(GLfloat)));
+	glEnableVertexAttribArray(1);
+	glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, stride, (void*)(6 * sizeof(GLfloat)));
+	glEnableVertexAttribArray(2);
 
-	return modelFromVertexData(positions.get(), width * height * 3,
-							  normals.get(), width * height * 3,
-							  textureCoordinates.get(), width * height * 2,
-							  indices.get(), (width - 1) * (height - 1) * 6);
+	GLuint indexBuffer = 0;
+	glGenBuffers(1, &indexBuffer);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indexBuffer);
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER, getIndexSize(indexType) * numIndices, indices, GL_STATIC_DRAW);
+
+	Model m;
+	m.vao = vao;
+	m.numIndices = numIndices;
+	m.indexType = indexType;
+	return m;
 }
 
 // Sizes given in amounts (that is size of the array)
@@ -238,15 +491,23 @@ Model tinyObjLoader(std::string filename) {
 		}
 	}
 
-	float *vertexData = &vertices[0];
-	float *normalData = &normals[0];
-	float *textureData = &textures[0];
-	int *indexData = &indices[0];
-
-	return modelFromVertexData(vertexData, vertices.size(), normalData, normals.size(), textureData, textures.size(), indexData, indices.size());
+	MeshData mesh;
+	mesh.vertices.swap(vertices);
+	mesh.normals.swap(normals);
+	mesh.textureCoordinates.swap(textures);
+	mesh.indices.swap(indices);
+	std::vector<float> weldedVertices;
+	std::vector<unsigned int> weldedIndices;
+	weldVertices(mesh, weldedVertices, weldedIndices);
+	int numVertices = weldedVertices.size() / WELDED_VERTEX_SIZE;
+	GLenum indexType = chooseIndexType(numVertices);
+	printWeldStats(filename, weldedIndices.size(), numVertices, WELDED_VERTEX_SIZE, indexType);
+
+	std::vector<unsigned char> packedIndices = packIndices(weldedIndices, indexType);
+	return modelFromInterleavedVertexData(&weldedVertices[0], numVertices, &packedIndices[0], weldedIndices.size(), indexType);
 }
 
-std::vector<Entity*> loadJAS39Gripen(std::string filename) {
+std::vector<Entity*> loadJAS39GripenMesh(std::string filename, MeshData &mesh) {
 	tinyobj::attrib_t attrib;
 	std::vector<tinyobj::shape_t> shapes;
 	std::vector<tinyobj::material_t> materials;
@@ -257,15 +518,13 @@ std::vector<Entity*> loadJAS39Gripen(std::string filename) {
 		std::cerr << err << std::endl;
 	}
 
-	std::vector<float> vertices;
-	std::vector<float> normals;
-	std::vector<float> textures;
-	std::vector<int> indices;
+	std::vector<float> &vertices = mesh.vertices;
+	std::vector<float> &normals = mesh.normals;
+	std::vector<float> &textures = mesh.textureCoordinates;
+	std::vector<int> &indices = mesh.indices;
 
 	std::vector<Entity*> entities;
 
-	GLuint textureId = loadPNGTexture("Resources/jas.png");
-
 	// Loop over shapes
 	int i = 0;
 	for (size_t s = 0; s < shapes.size(); s++) {
@@ -291,9 +550,7 @@ std::vector<Entity*> loadJAS39Gripen(std::string filename) {
 
 		// Add materials
 		tinyobj::material_t material = materials[shapes[s].mesh.material_ids[0]];
-		if (material.diffuse_texname != "") {
-			m.map_Kd = textureId;
-		}
+		mesh.diffuseTextures.push_back(material.diffuse_texname);
 		m.illum = material.illum;
 		m.Ns = material.shininess;
 		m.d = material.dissolve;
@@ -326,48 +583,119 @@ std::vector<Entity*> loadJAS39Gripen(std::string filename) {
 			// per-face material
 			shapes[s].mesh.material_ids[f];
 		}
-	
+
 		m.numIndices = i - m.offset;
 		entity->setModel(m);
 		entities.push_back(entity);
 	}
 
-	float *vertexData = &vertices[0];
-	float *normalData = &normals[0];
-	float *textureData = &textures[0];
-	int *indexData = &indices[0];
+	for (int i = 1; i < entities.size(); i++) {
+		entities[i]->setParentEntity(entities[0]);
+	}
 
-	Model completeModel = modelFromVertexData(vertexData, vertices.size(), normalData, normals.size(), textureData, textures.size(), indexData, indices.size());
-	
-	GLfloat *tangentData = new GLfloat[vertices.size()];
-	GLfloat *bitangentData = new GLfloat[vertices.size()];
-	calculateTangents(vertexData, textureData, vertices.size() / 3, tangentData, bitangentData);
+	return entities;
+}
 
-	GLuint tangentBuffer = 0;
-	glGenBuffers(1, &tangentBuffer);
-	glBindBuffer(GL_ARRAY_BUFFER, tangentBuffer);
-	glBufferData(GL_ARRAY_BUFFER, 3 * sizeof(GLfloat) * vertices.size() / 3, tangentData, GL_STATIC_DRAW);
-	glVertexAttribPointer(3, 3, GL_FLOAT, GL_FALSE, 0, 0);
-	glEnableVertexAttribArray(3);
+std::vector<Entity*> loadJAS39Gripen(std::string filename, GLuint diffuseTexture) {
+	// The OBJ is only parsed when its mesh cache is missing or stale
+	std::string cacheFilename = filename + ".cache";
+	MappedFile cacheFile;
+	MeshCacheBuffers converted;
+	MeshCacheData cache;
+	if (!openMeshCache(cacheFilename, filename, cacheFile, cache)) {
+		MeshData mesh;
+		std::vector<Entity*> entities = loadJAS39GripenMesh(filename, mesh);
+		convertToMeshCache(entities, mesh, converted);
+		for (int i = 0; i < entities.size(); i++) {
+			delete entities[i];
+		}
+		cache = converted.data;
+		if (!writeMeshCache(cacheFilename, filename, cache)) {
+			std::cerr << "Error! Could not write mesh cache " << cacheFilename << std::endl;
+		}
+	}
+	printWeldStats(filename, cache.numIndices, cache.numVertices, MESH_VERTEX_SIZE, cache.indexType);
+
+	std::vector<Entity*> entities = createMeshCacheEntities(cache);
+	GLuint vao = uploadMeshCache(cache);
+	for (int i = 0; i < entities.size(); i++) {
+		entities[i]->getModel().vao = vao;
+		if (cache.submeshes[i].diffuseTexture[0] != '\0') {
+			entities[i]->getModel().map_Kd = diffuseTexture;
+		}
+		if (i > 0) {
+			entities[i]->setParentEntity(entities[0]);
+		}
+	}
+	return entities;
+}
 
-	GLuint bitangentBuffer = 0;
-	glGenBuffers(1, &bitangentBuffer);
-	glBindBuffer(GL_ARRAY_BUFFER, bitangentBuffer);
-	glBufferData(GL_ARRAY_BUFFER, 3 * sizeof(GLfloat) * vertices.size() / 3, bitangentData, GL_STATIC_DRAW);
-	glVertexAttribPointer(4, 3, GL_FLOAT, GL_FALSE, 0, 0);
-	glEnableVertexAttribArray(4);
+// Welded vertex, compared bit for bit
+struct WeldVertex {
+	float values[WELDED_VERTEX_SIZE];
+
+	bool operator==(const WeldVertex &other) const {
+		return memcmp(values, other.values, sizeof(values)) == 0;
+	}
+};
+
+struct WeldVertexHash {
+	size_t operator()(const WeldVertex &vertex) const {
+		size_t hash = 2166136261u;
+		const unsigned int *words = (const unsigned int*)vertex.values;
+		for (int i = 0; i < WELDED_VERTEX_SIZE; i++) {
+			hash = (hash ^ words[i]) * 16777619u;
+		}
+		return hash;
+	}
+};
+
+void weldVertices(const MeshData &mesh, std::vector<float> &vertices, std::vector<unsigned int> &indices) {
+	vertices.clear();
+	indices.resize(mesh.indices.size());
+	std::unordered_map<WeldVertex, unsigned int, WeldVertexHash> vertexIndices;
+	vertexIndices.reserve(mesh.indices.size());
+	for (int i = 0; i < mesh.indices.size(); i++) {
+		int corner = mesh.indices[i];
+		WeldVertex vertex;
+		memcpy(&vertex.values[0], &mesh.vertices[corner * 3], 3 * sizeof(float));
+		memcpy(&vertex.values[3], &mesh.normals[corner * 3], 3 * sizeof(float));
+		memcpy(&vertex.values[6], &mesh.textureCoordinates[corner * 2], 2 * sizeof(float));
+		std::pair<std::unordered_map<WeldVertex, unsigned int, WeldVertexHash>::iterator, bool> inserted = vertexIndices.insert(std::make_pair(vertex, (unsigned int)vertexIndices.size()));
+		if (inserted.second) {
+			vertices.insert(vertices.end(), vertex.values, vertex.values + WELDED_VERTEX_SIZE);
+		}
+		indices[i] = inserted.first->second;
+	}
+}
+
+GLenum chooseIndexType(int numVertices) {
+	return numVertices <= 65536 ? GL_UNSIGNED_SHORT : GL_UNSIGNED_INT;
+}
 
-	delete tangentData;
-	delete bitangentData;
+int getIndexSize(GLenum indexType) {
+	return indexType == GL_UNSIGNED_SHORT ? sizeof(GLushort) : sizeof(GLuint);
+}
 
-	for (std::vector<Entity*>::iterator iter = entities.begin(); iter != entities.end(); iter++) {
-		(*iter)->getModel().vao = completeModel.vao;
-		if (iter != entities.begin()) {
-			(*iter)->setParentEntity(entities[0]);
+std::vector<unsigned char> packIndices(const std::vector<unsigned int> &indices, GLenum indexType) {
+	std::vector<unsigned char> packed(indices.size() * getIndexSize(indexType));
+	if (indexType == GL_UNSIGNED_SHORT) {
+		GLushort *shortIndices = (GLushort*)&packed[0];
+		for (int i = 0; i < indices.size(); i++) {
+			shortIndices[i] = (GLushort)indices[i];
 		}
+	} else if (!indices.empty()) {
+		memcpy(&packed[0], &indices[0], packed.size());
 	}
+	return packed;
+}
 
-	return std::move(entities);
+void printWeldStats(const std::string &name, int numCorners, int numVertices, int vertexSize, GLenum indexType) {
+	// Unwelded, every corner has its own vertex and a 32 bit index
+	int bytesBefore = numCorners * (vertexSize * sizeof(float) + sizeof(GLuint));
+	int bytesAfter = numVertices * vertexSize * sizeof(float) + numCorners * getIndexSize(indexType);
+	std::cout << name << ": " << numCorners << " -> " << numVertices << " vertices, " << bytesBefore / 1024 << " kB -> "
+		<< bytesAfter / 1024 << " kB with " << getIndexSize(indexType) * 8 << " bit indices" << std::endl;
 }
 
 void rotateEntity(Entity &entity, glm::vec3 axis, float amount) {
@@ -576,26 +904,32 @@ Model getVAOCube() {
 	return model;
 }
 
+// Tangent and bitangent of the triangle abc
+static void triangleTangents(glm::vec3 a, glm::vec3 b, glm::vec3 c, glm::vec2 texCoord1, glm::vec2 texCoord2, glm::vec2 texCoord3, glm::vec3 &tangent, glm::vec3 &bitangent) {
+	glm::vec3 deltaPos1 = glm::normalize(b - a);
+	glm::vec3 deltaPos2 = glm::normalize(c - a);
+
+	glm::vec2 deltaTex1 = glm::normalize(texCoord2 - texCoord1);
+	glm::vec2 deltaTex2 = glm::normalize(texCoord3 - texCoord1);
+
+	float r = 1.0f / (deltaTex1.x * deltaTex2.y - deltaTex1.y * deltaTex2.x);
+	tangent = glm::normalize((deltaPos1 * deltaTex2.y - deltaPos2 * deltaTex1.y) * r);
+	bitangent = glm::normalize((deltaPos2 * deltaTex1.x - deltaPos1 * deltaTex2.x) * r);
+}
+
 // assumes three vertices per face
-void calculateTangents(float *vertexData, float *textureData, int numVertices, float *tangentData, float *bitangentData) {
+void calculateTangents(const float *vertexData, const float *textureData, int numVertices, float *tangentData, float *bitangentData) {
 	for (int i = 0; i < numVertices * 3; i += 9) { // Once per triangle
 		glm::vec3 a = glm::vec3(vertexData[i], vertexData[i + 1], vertexData[i + 2]);
 		glm::vec3 b = glm::vec3(vertexData[i + 3], vertexData[i + 4], vertexData[i + 5]);
 		glm::vec3 c = glm::vec3(vertexData[i + 6], vertexData[i + 7], vertexData[i + 8]);
 
-		glm::vec3 deltaPos1 = glm::normalize(b - a);
-		glm::vec3 deltaPos2 = glm::normalize(c - a);
-
 		glm::vec2 texCoord1 = glm::vec2(textureData[i / 3 * 2], textureData[i / 3 * 2 + 1]);
 		glm::vec2 texCoord2 = glm::vec2(textureData[i / 3 * 2 + 2], textureData[i / 3 * 2 + 3]);
 		glm::vec2 texCoord3 = glm::vec2(textureData[i / 3 * 2 + 4], textureData[i / 3 * 2 + 5]);
 
-		glm::vec2 deltaTex1 = glm::normalize(texCoord2 - texCoord1);
-		glm::vec2 deltaTex2 = glm::normalize(texCoord3 - texCoord1);
-
-		float r = 1.0f / (deltaTex1.x * deltaTex2.y - deltaTex1.y * deltaTex2.x);
-		glm::vec3 tangent = glm::normalize((deltaPos1 * deltaTex2.y - deltaPos2 * deltaTex1.y) * r);
-		glm::vec3 bitangent = glm::normalize((deltaPos2 * deltaTex1.x - deltaPos1 * deltaTex2.x) * r);
+		glm::vec3 tangent, bitangent;
+		triangleTangents(a, b, c, texCoord1, texCoord2, texCoord3, tangent, bitangent);
 
 		tangentData[i] = tangent.x;
 		tangentData[i + 1] = tangent.y;
@@ -618,27 +952,37 @@ void calculateTangents(float *vertexData, float *textureData, int numVertices, f
 	}
 }
 
-GLuint loadPNGTexture(std::string filename) {
-	const char* filenameC = (const char*)filename.c_str();
-	std::vector<unsigned char> image;
-	unsigned width, height;
-	unsigned error = lodepng::decode(image, width, height, filename);
-
-	std::vector<unsigned char> imageCopy(width * height * 4);
-	for (unsigned i = 0; i < height; i++) {
-		memcpy(&imageCopy[(height - i - 1) * width * 4], &image[i * width * 4], width * 4);
+void calculateIndexedTangents(const float *vertices, int vertexSize, int numVertices, const unsigned int *indices, int numIndices, float *tangentData, float *bitangentData) {
+	std::vector<glm::vec3> tangents(numVertices, glm::vec3(0, 0, 0));
+	std::vector<glm::vec3> bitangents(numVertices, glm::vec3(0, 0, 0));
+	for (int i = 0; i + 2 < numIndices; i += 3) {
+		const float *a = &vertices[indices[i] * vertexSize];
+		const float *b = &vertices[indices[i + 1] * vertexSize];
+		const float *c = &vertices[indices[i + 2] * vertexSize];
+		glm::vec3 tangent, bitangent;
+		triangleTangents(glm::vec3(a[0], a[1], a[2]), glm::vec3(b[0], b[1], b[2]), glm::vec3(c[0], c[1], c[2]),
+			glm::vec2(a[6], a[7]), glm::vec2(b[6], b[7]), glm::vec2(c[6], c[7]), tangent, bitangent);
+		// Degenerate triangles give NaN and are left out
+		if (tangent != tangent || bitangent != bitangent) {
+			continue;
+		}
+		for (int corner = 0; corner < 3; corner++) {
+			tangents[indices[i + corner]] += tangent;
+			bitangents[indices[i + corner]] += bitangent;
+		}
 	}
+	for (int i = 0; i < numVertices; i++) {
+		glm::vec3 tangent = glm::length(tangents[i]) > 0 ? glm::normalize(tangents[i]) : glm::vec3(1, 0, 0);
+		glm::vec3 bitangent = glm::length(bitangents[i]) > 0 ? glm::normalize(bitangents[i]) : glm::vec3(0, 1, 0);
+		memcpy(&tangentData[i * 3], &tangent[0], 3 * sizeof(float));
+		memcpy(&bitangentData[i * 3], &bitangent[0], 3 * sizeof(float));
+	}
+}
 
-	GLuint texId;
-	glGenTextures(1, &texId);
-	glEnable(GL_TEXTURE_2D);
-	glActiveTexture(GL_TEXTURE0);
-	glBindTexture(GL_TEXTURE_2D, texId);
-	glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
-	glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-	glTexImage2D(GL_TEXTURE_2D, 0, 4, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, &imageCopy[0]);
-	glGenerateMipmap(GL_TEXTURE_2D);
-	return texId;
+GLuint loadPNGTexture(std::string filename) {
+	DecodedImage image;
+	decodePNG(filename, true, image);
+	return createTexture(image);
 }
 
 
@@ -660,13 +1004,7 @@ int sign(float i) {
 }
 
 std::vector<unsigned char> loadPNG(std::string filename) {
-	const char* filenameC = (const char*)filename.c_str();
-	std::vector<unsigned char> image;
-	unsigned width, height;
-	unsigned error = lodepng::decode(image, width, height, filename);
-	std::vector<unsigned char> imageCopy(width * height * 4);
-	for (unsigned i = 0; i < height; i++) {
-		memcpy(&imageCopy[(height - i - 1) * width * 4], &image[i * width * 4], width * 4);
-	}
-	return image;
-}
\ No newline at end of file
+	DecodedImage image;
+	decodePNG(filename, false, image);
+	return image.pixels;
+}
@@ -6,6 +6,12 @@
 #include <glm/gtx/quaternion.hpp>
 #include <iostream>
 #include <vector>
+#include <chrono>
+
+#include "SceneGraph.h"
+#include "SimdAllocator.h"
+#include "TerrainQuadtree.h"
+#include "TerrainLod.h"
 
 #ifndef COMMON_H
 #define COMMON_H
@@ -16,10 +22,27 @@ const bool FAST_MODE = false;
 const glm::vec3 DEFAULT_FORWARD = glm::vec3(0, 0, 1);
 const glm::vec3 DEFAULT_UP = glm::vec3(0, 1, 0);
 
+// Measures wall clock time since construction or the last reset
+class Timer {
+public:
+	Timer() {
+		reset();
+	}
+	void reset() {
+		start = std::chrono::high_resolution_clock::now();
+	}
+	double elapsedMilliseconds() const {
+		return std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+	}
+private:
+	std::chrono::high_resolution_clock::time_point start;
+};
+
 struct Model {
 public:
 	Model() : offset(0) {
 		offset = 0;
+		indexType = GL_UNSIGNED_INT;
 		Ns = 0;
 		Ni = 1;
 		d = 1;
@@ -31,8 +54,11 @@ public:
 		color = glm::vec4(0, 0, 0, 0);
 	}
 	GLuint vao;
+	// In indices, not bytes
 	int offset;
 	int numIndices;
+	// GL_UNSIGNED_SHORT or GL_UNSIGNED_INT
+	GLenum indexType;
 	float Ns; // Specular expondent
 	float Ni; // Optical density
 	float d; // Transparencey (0 to 1)
@@ -45,6 +71,26 @@ public:
 	glm::vec4 color;
 };
 
+// getEntityTransformation's cache of an entity's matrices and the values they were built from
+struct TransformCache {
+	glm::vec3 position;
+	glm::vec3 scale;
+	glm::vec3 forward;
+	glm::vec3 up;
+	glm::vec3 rotationPivot;
+	glm::quat rotation; // From forward and up
+	// Changes whenever local changes
+	unsigned int localVersion;
+	const void *parentEntity;
+	// Version of the parent's world transformation that world was built from
+	unsigned int parentVersion;
+	// Changes whenever world changes, unique across all entities
+	unsigned int version;
+	bool isValid;
+	glm::mat4 local;
+	glm::mat4 world;
+};
+
 class Entity {
 public:
 	Entity();
@@ -81,15 +127,46 @@ public:
 	std::string& getName() {
 		return name;
 	}
+	TransformCache& getTransformCache() const {
+		return transformCache;
+	}
+	// Index in the scene graph of updateEntityTransformations, -1 when not in it
+	int getSceneNode() const {
+		return sceneNode;
+	}
+	void setSceneNode(int sceneNode) {
+		this->sceneNode = sceneNode;
+	}
 private:
 	std::string name;
 	Entity *parentEntity;
 	Model model;
 	glm::vec3 rotationPivot;
+	mutable TransformCache transformCache;
+	int sceneNode;
 };
 
 glm::quat directionToQuaternion(glm::vec3 forward, glm::vec3 up, glm::vec3 defaultForward, glm::vec3 defaultUp);
-glm::mat4 getEntityTransformation(Entity const &entity);
+
+// Model to world matrix including all parents. The matrices are cached per entity and only
+// rebuilt when the entity's position, scale, forward, up or pivot, or its parent's
+// transformation, has changed since the last call. Only safe to call from several threads
+// at once for entities whose transformations are already up to date.
+const glm::mat4& getEntityTransformation(Entity const &entity);
+
+// Brings the cached transformations of all entities up to date. The entities (and any
+// parents missing from the list) are kept in a SceneGraph, so their local matrices are
+// built and composed in batches, parents before children. The list is reordered.
+void updateEntityTransformations(std::vector<Entity*> &entities);
+
+// Counts of getEntityTransformation work since the last reset
+struct TransformStats {
+	int requests; // Calls to getEntityTransformation
+	int uncachedEvaluations; // Matrices the calls would have built without the cache, one per level of parents
+	int evaluations; // Matrices actually built
+};
+TransformStats getTransformStats();
+void resetTransformStats();
 
 class Terrain : public Entity {
 public:
@@ -111,10 +188,31 @@ public:
 	void setTextureId4(GLuint textureId4) {
 		this->textureId4 = textureId4;
 	}
+	// Of the terrain's virtual texture
+	GLuint getPageTableTextureId() {
+		return pageTableTextureId;
+	}
+	GLuint getAtlasTextureId() {
+		return atlasTextureId;
+	}
+	void setVirtualTexture(GLuint pageTableTextureId, GLuint atlasTextureId) {
+		this->pageTableTextureId = pageTableTextureId;
+		this->atlasTextureId = atlasTextureId;
+	}
+	TerrainQuadtree& getQuadtree() {
+		return quadtree;
+	}
+	TerrainLod& getLod() {
+		return lod;
+	}
 private:
+	TerrainQuadtree quadtree;
+	TerrainLod lod;
 	GLuint textureId2;
 	GLuint textureId3;
 	GLuint textureId4;
+	GLuint pageTableTextureId;
+	GLuint atlasTextureId;
 };
 
 enum LightType { DIRECTIONAL_LIGHT, POINT_LIGHT, SPOTLIGHT };
@@ -134,20 +232,77 @@ public:
 
 std::string readFile(std::string path);
 
-Model heightmapToModel(float *heightmap, int width, int height, float scaleX, float scaleY, float scaleZ, float textureScale);
+// Quads per side of a terrain chunk, the unit the terrain is culled in
+const int TERRAIN_CHUNK_SIZE = 64;
+
+// Largest error in pixels the terrain level of detail may give, toggle it with L
+const float TERRAIN_LOD_MAX_PIXEL_ERROR = 2.0f;
+
+// Floats per vertex in height-field meshes: position (3), normal (3), texture coordinate (2)
+const int HEIGHTMAP_VERTEX_SIZE = 8;
+
+// Interior rows four vertices at a time with SSE, split over the worker threads
+void buildHeightmapVertices(float *heightmap, int width, int height, float scaleX, float scaleY, float scaleZ, float textureScale, float *vertices);
+
+// The mesh heightmapToModel uploads, HEIGHTMAP_VERTEX_SIZE floats per vertex
+void buildHeightmapMesh(float *heightmap, int width, int height, float scaleX, float scaleY, float scaleZ, float textureScale, const TerrainQuadtree &quadtree, const TerrainLod &lod, std::vector<float> &vertices, std::vector<GLuint> &indices);
+
+Model heightmapToModel(float *heightmap, int width, int height, float scaleX, float scaleY, float scaleZ, float textureScale, const TerrainQuadtree &quadtree, const TerrainLod &lod);
+
+Model modelFromInterleavedVertexData(const float vertices[], int numVertices, const void *indices, int numIndices, GLenum indexType = GL_UNSIGNED_INT);
 
 Model modelFromVertexData(float vertexCoordinates[], int vertexCoordinatesSize, float normals[], int normalsSize, float textureCoordinates[], int textureCoordinatesSize, int indices[], int indicesSize);
 
 Model tinyObjLoader(std::string fileName);
 
-std::vector<Entity*> loadJAS39Gripen(std::string filename);
+// Vertex data of a model before it is uploaded, sizes are in floats and ints
+struct MeshData {
+	std::vector<float> vertices;
+	std::vector<float> normals;
+	std::vector<float> textureCoordinates;
+	std::vector<int> indices;
+	// Per entity sharing the mesh, empty when it has no diffuse texture
+	std::vector<std::string> diffuseTextures;
+};
+
+// Floats per vertex of welded meshes, laid out as the heightmap vertices: position (3),
+// normal (3), texture coordinate (2)
+const int WELDED_VERTEX_SIZE = HEIGHTMAP_VERTEX_SIZE;
+
+// Merges the corners of a mesh with one vertex per triangle corner, as the OBJ loaders read
+// them, that have the same position, normal and texture coordinate. Index i of the result is
+// corner i's vertex, so index ranges into the corners stay valid.
+void weldVertices(const MeshData &mesh, std::vector<float> &vertices, std::vector<unsigned int> &indices);
+
+// GL_UNSIGNED_SHORT when every vertex can be indexed with 16 bits, else GL_UNSIGNED_INT
+GLenum chooseIndexType(int numVertices);
+
+int getIndexSize(GLenum indexType);
+
+// The indices as indexType
+std::vector<unsigned char> packIndices(const std::vector<unsigned int> &indices, GLenum indexType);
+
+// Prints the vertex count and vertex and index buffer sizes of a mesh before and after welding
+void printWeldStats(const std::string &name, int numCorners, int numVertices, int vertexSize, GLenum indexType);
+
+// Reads the airplane without touching OpenGL. The first entity is the body and the rest are
+// its parts, each drawing its own range of mesh. Their models have no vao until uploaded.
+std::vector<Entity*> loadJAS39GripenMesh(std::string filename, MeshData &mesh);
+
+// Loads the airplane from filename + ".cache", which is converted from the OBJ when it is
+// missing or stale. Submeshes with a diffuse texture get diffuseTexture as their map_Kd.
+std::vector<Entity*> loadJAS39Gripen(std::string filename, GLuint diffuseTexture);
 
 void rotateEntity(Entity &entity, glm::vec3 axis, float amount);
 
 Model getVAOCube();
 Model getVAOQuad();
 
-void calculateTangents(float *vertexData, float *textureData, int numVertices, float *tangentData, float *bitangentData);
+void calculateTangents(const float *vertexData, const float *textureData, int numVertices, float *tangentData, float *bitangentData);
+
+// Tangents and bitangents of an indexed mesh, per vertex the average of the triangles sharing
+// it. The vertices are vertexSize floats laid out as WELDED_VERTEX_SIZE ones.
+void calculateIndexedTangents(const float *vertices, int vertexSize, int numVertices, const unsigned int *indices, int numIndices, float *tangentData, float *bitangentData);
 
 GLuint loadPNGTexture(std::string filename);
 
@@ -4,13 +4,49 @@
 #include <iostream>
 #include <ctime> 
 
+#include "Threading.h"
+
 #define WORLD_TO_INDEX(x, y, width) ((y) * (width) + (x))
 
-static int random(int min, int max) {
-	if (max - min == 0) {
-		return 0;
+// Counter based replacement for srand/rand. Produces the same stream as the MSVC rand()
+// (state = state * 214013 + 2531011, output bits 16..30), but can jump straight to the
+// n:th number. Every cell knows its index in the stream, so cells can be generated on any
+// thread and the heightmap only depends on the seed.
+class RandomStream {
+public:
+	RandomStream(unsigned int seed, unsigned long long index) {
+		unsigned int multiplier = 214013u;
+		unsigned int increment = 2531011u;
+		unsigned int accumulatedMultiplier = 1u;
+		unsigned int accumulatedIncrement = 0u;
+		while (index > 0) {
+			if (index & 1) {
+				accumulatedMultiplier *= multiplier;
+				accumulatedIncrement = accumulatedIncrement * multiplier + increment;
+			}
+			increment = (multiplier + 1u) * increment;
+			multiplier *= multiplier;
+			index >>= 1;
+		}
+		state = accumulatedMultiplier * seed + accumulatedIncrement;
+	}
+	int random(int min, int max) {
+		state = state * 214013u + 2531011u;
+		if (max - min == 0) {
+			return 0;
+		}
+		return (int)((state >> 16) & 0x7fff) % (max - min) + min;
 	}
-	return (rand() % (max - min)) + min;
+private:
+	unsigned int state;
+};
+
+// Index in the random stream of the first diamond on a row in the square step,
+// rows alternate between numSquares and numSquares + 1 diamonds
+inline unsigned long long squareStepRowOffset(int row, int numSquares) {
+	unsigned long long evenRows = (row + 1) / 2;
+	unsigned long long oddRows = row / 2;
+	return evenRows * numSquares + oddRows * (numSquares + 1);
 }
 
 // x and y is top left of square
@@ -45,51 +81,60 @@ void squareStep(int x, int y, int stepSize, int size, T *heightmap, float r) {
 
 // Heightmap must be of size 2^n + 1
 // Smoothness
+// Each diamond and square pass is split over numThreads threads. The result is the same
+// for any number of threads.
 template<typename T>
-T *diamondSquare(T *heightmap, const int size, float smoothness, time_t seed = -1) {
+T *diamondSquare(T *heightmap, const int size, float smoothness, time_t seed = -1, int numThreads = getNumWorkerThreads()) {
 	
 	assert((float)(int)(log2(size - 1)) == log2(size - 1));
 
 	if (seed == -1) {
 		seed = time(NULL);
 	}
-	srand(seed);
+	unsigned int streamSeed = (unsigned int)seed;
 
 	// Pre seed corners
-	heightmap[WORLD_TO_INDEX(0, 0, size)] = (random(0, 500) - 250) / smoothness;
-	heightmap[WORLD_TO_INDEX(size - 1, 0, size)] = (random(0, 500) - 250) / smoothness;
-	heightmap[WORLD_TO_INDEX(0, size - 1, size)] = (random(0, 500) - 250) / smoothness;
-	heightmap[WORLD_TO_INDEX(size - 1, size - 1, size)] = (random(0, 500) - 250) / smoothness;
+	RandomStream cornerStream(streamSeed, 0);
+	heightmap[WORLD_TO_INDEX(0, 0, size)] = (cornerStream.random(0, 500) - 250) / smoothness;
+	heightmap[WORLD_TO_INDEX(size - 1, 0, size)] = (cornerStream.random(0, 500) - 250) / smoothness;
+	heightmap[WORLD_TO_INDEX(0, size - 1, size)] = (cornerStream.random(0, 500) - 250) / smoothness;
+	heightmap[WORLD_TO_INDEX(size - 1, size - 1, size)] = (cornerStream.random(0, 500) - 250) / smoothness;
+	unsigned long long streamOffset = 4;
 
 	int stepSize = size - 1;
 	while (stepSize > 1) {
 		smoothness = smoothness * 2;
-		for (int y = 0; y < size - stepSize; y += stepSize) {
-			for (int x = 0; x < size - stepSize; x += stepSize) {
-				float r = (random(0, 500) - 250) / smoothness;
-				diamondStep(x, y, stepSize, size, &heightmap[0], r);
+		const int halfStep = stepSize / 2;
+		const int numSquares = (size - 1) / stepSize; // Per row
+		// Spawning threads is not worth it for the first, tiny, levels
+		const int passThreads = numSquares >= 64 ? numThreads : 1;
+
+		// Diamond step, one random number per square in row major order
+		parallelFor(0, numSquares, passThreads, [&](int firstRow, int lastRow) {
+			RandomStream stream(streamSeed, streamOffset + (unsigned long long)firstRow * numSquares);
+			for (int row = firstRow; row < lastRow; row++) {
+				for (int x = 0; x < size - stepSize; x += stepSize) {
+					float r = (stream.random(0, 500) - 250) / smoothness;
+					diamondStep(x, row * stepSize, stepSize, size, &heightmap[0], r);
+				}
 			}
-		}
+		});
+		streamOffset += (unsigned long long)numSquares * numSquares;
 
-		int i = 0;
-		for (int y = 0; y < size; y += stepSize / 2) {
-			i++;
-			for (int x = (i % 2 == 0) ? 0 : stepSize / 2; x < size; x += stepSize) {
-				float r = (random(0, 500) - 250) / smoothness;
-				squareStep(x, y, stepSize, size, &heightmap[0], r);
+		// Square step, only reads corners and centers so rows are independent
+		parallelFor(0, 2 * numSquares + 1, passThreads, [&](int firstRow, int lastRow) {
+			RandomStream stream(streamSeed, streamOffset + squareStepRowOffset(firstRow, numSquares));
+			for (int row = firstRow; row < lastRow; row++) {
+				for (int x = (row % 2 == 0) ? halfStep : 0; x < size; x += stepSize) {
+					float r = (stream.random(0, 500) - 250) / smoothness;
+					squareStep(x, row * halfStep, stepSize, size, &heightmap[0], r);
+				}
 			}
-		}
+		});
+		streamOffset += squareStepRowOffset(2 * numSquares + 1, numSquares);
 
 		stepSize = stepSize / 2;
 	}
 
-	// Print heightmap
-	//for (int y = 0; y < size; y += stepSize) {
-	//	for (int x = 0; x < size; x += stepSize) {
-	//		std::cout << heightmap[WORLD_TO_INDEX(x, y, size)] << "  ";
-	//	}
-	//	std::cout << std::endl;
-	//}
-
 	return heightmap;
 }
\ No newline at end of file
@@ -0,0 +1,46 @@
+#include "Frustum.h"
+
+#include <glm/glm.hpp>
+
+Frustum::Frustum(const glm::mat4 &matrix) {
+	// glm is column major, matrix[column][row]
+	glm::vec4 rows[4];
+	for (int i = 0; i < 4; i++) {
+		rows[i] = glm::vec4(matrix[0][i], matrix[1][i], matrix[2][i], matrix[3][i]);
+	}
+	planes[0] = rows[3] + rows[0]; // Left
+	planes[1] = rows[3] - rows[0]; // Right
+	planes[2] = rows[3] + rows[1]; // Bottom
+	planes[3] = rows[3] - rows[1]; // Top
+	planes[4] = rows[3] + rows[2]; // Near
+	planes[5] = rows[3] - rows[2]; // Far
+	for (int i = 0; i < 6; i++) {
+		planes[i] = planes[i] / glm::length(glm::vec3(planes[i]));
+	}
+}
+
+FrustumTest Frustum::testAABB(const AABB &box) const {
+	FrustumTest result = INSIDE_FRUSTUM;
+	for (int i = 0; i < 6; i++) {
+		const glm::vec4 &plane = planes[i];
+		// Corner furthest along the plane normal, and the one furthest against it
+		glm::vec3 positive = glm::vec3(plane.x >= 0 ? box.max.x : box.min.x, plane.y >= 0 ? box.max.y : box.min.y, plane.z >= 0 ? box.max.z : box.min.z);
+		glm::vec3 negative = glm::vec3(plane.x >= 0 ? box.min.x : box.max.x, plane.y >= 0 ? box.min.y : box.max.y, plane.z >= 0 ? box.min.z : box.max.z);
+		if (glm::dot(glm::vec3(plane), positive) + plane.w < 0) {
+			return OUTSIDE_FRUSTUM;
+		}
+		if (glm::dot(glm::vec3(plane), negative) + plane.w < 0) {
+			result = INTERSECTS_FRUSTUM;
+		}
+	}
+	return result;
+}
+
+bool Frustum::intersectsSphere(glm::vec3 center, float radius) const {
+	for (int i = 0; i < 6; i++) {
+		if (glm::dot(glm::vec3(planes[i]), center) + planes[i].w < -radius) {
+			return false;
+		}
+	}
+	return true;
+}
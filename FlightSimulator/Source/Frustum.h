@@ -0,0 +1,26 @@
+#pragma once
+
+#include <glm/vec3.hpp>
+#include <glm/vec4.hpp>
+#include <glm/mat4x4.hpp>
+
+// Axis aligned bounding box
+struct AABB {
+	glm::vec3 min;
+	glm::vec3 max;
+};
+
+enum FrustumTest { OUTSIDE_FRUSTUM, INTERSECTS_FRUSTUM, INSIDE_FRUSTUM };
+
+class Frustum {
+public:
+	// Extracts the six clip planes from a projection * view (* model) matrix. The planes
+	// end up in the space the matrix transforms from, so passing perspective * worldToView
+	// gives world space planes.
+	Frustum(const glm::mat4 &matrix);
+	FrustumTest testAABB(const AABB &box) const;
+	bool intersectsSphere(glm::vec3 center, float radius) const;
+private:
+	// Normalized, pointing inwards: dot(plane.xyz, point) + plane.w >= 0 inside
+	glm::vec4 planes[6];
+};
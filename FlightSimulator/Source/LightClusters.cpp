@@ -0,0 +1,130 @@
+#include "LightClusters.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+
+#include <glm/glm.hpp>
+
+LightClusters::LightClusters() : near(0.1f), far(1000), projectionX(1), projectionY(1), depthSliceScale(0), depthSliceBias(0) {
+}
+
+void LightClusters::setProjection(const glm::mat4 &perspective) {
+	// glm::perspective puts 1 / tan(fovY / 2) (divided by the aspect for x) on the diagonal
+	// and the near and far planes in the depth terms
+	projectionX = perspective[0][0];
+	projectionY = perspective[1][1];
+	near = perspective[3][2] / (perspective[2][2] - 1);
+	far = perspective[3][2] / (perspective[2][2] + 1);
+
+	float logDepthRange = std::log(far / near);
+	depthSliceScale = LIGHT_CLUSTERS_Z / logDepthRange;
+	depthSliceBias = -LIGHT_CLUSTERS_Z * std::log(near) / logDepthRange;
+	sliceDepths.resize(LIGHT_CLUSTERS_Z + 1);
+	for (int z = 0; z <= LIGHT_CLUSTERS_Z; z++) {
+		sliceDepths[z] = near * std::pow(far / near, z / (float)LIGHT_CLUSTERS_Z);
+	}
+
+	clusterBounds.resize(NUM_LIGHT_CLUSTERS);
+	for (int z = 0; z < LIGHT_CLUSTERS_Z; z++) {
+		float depths[2] = { sliceDepths[z], sliceDepths[z + 1] };
+		for (int y = 0; y < LIGHT_CLUSTERS_Y; y++) {
+			for (int x = 0; x < LIGHT_CLUSTERS_X; x++) {
+				float ndcX[2] = { 2.0f * x / LIGHT_CLUSTERS_X - 1, 2.0f * (x + 1) / LIGHT_CLUSTERS_X - 1 };
+				float ndcY[2] = { 2.0f * y / LIGHT_CLUSTERS_Y - 1, 2.0f * (y + 1) / LIGHT_CLUSTERS_Y - 1 };
+				AABB &bounds = clusterBounds[(z * LIGHT_CLUSTERS_Y + y) * LIGHT_CLUSTERS_X + x];
+				bounds.min = glm::vec3(INFINITY, INFINITY, -depths[1]);
+				bounds.max = glm::vec3(-INFINITY, -INFINITY, -depths[0]);
+				// The cluster is a frustum, its bounds are the bounds of its corners
+				for (int i = 0; i < 2; i++) {
+					for (int j = 0; j < 2; j++) {
+						glm::vec3 corner = glm::vec3(ndcX[j] * depths[i] / projectionX, ndcY[j] * depths[i] / projectionY, 0);
+						bounds.min = glm::min(bounds.min, glm::vec3(corner.x, corner.y, bounds.min.z));
+						bounds.max = glm::max(bounds.max, glm::vec3(corner.x, corner.y, bounds.max.z));
+					}
+				}
+			}
+		}
+	}
+}
+
+// Range of tiles that the interval [low, high] in view space covers somewhere between the
+// two depths, for a projection scale and a number of tiles
+static void tileRange(float low, float high, float depth0, float depth1, float projection, int numTiles, int &first, int &last) {
+	// x / depth is smallest at the near depth for negative x and at the far depth otherwise
+	float ndcLow = projection * low / (low < 0 ? depth0 : depth1);
+	float ndcHigh = projection * high / (high > 0 ? depth0 : depth1);
+	first = std::max(0, (int)std::floor((ndcLow * 0.5f + 0.5f) * numTiles));
+	last = std::min(numTiles - 1, (int)std::floor((ndcHigh * 0.5f + 0.5f) * numTiles));
+}
+
+static bool sphereIntersectsAABB(glm::vec3 center, float radius, const AABB &box) {
+	glm::vec3 closest = glm::clamp(center, box.min, box.max);
+	glm::vec3 offset = center - closest;
+	return glm::dot(offset, offset) <= radius * radius;
+}
+
+void LightClusters::assignLights(const std::vector<LightData> &lights, const glm::mat4 &worldToView) {
+	assignments.clear();
+	for (int i = 0; i < lights.size(); i++) {
+		const LightData &light = lights[i];
+		if (light.type == LIGHT_DATA_DIRECTIONAL || light.radius <= 0) {
+			continue;
+		}
+		if (light.radius == FLT_MAX) {
+			for (int cluster = 0; cluster < NUM_LIGHT_CLUSTERS; cluster++) {
+				Assignment assignment;
+				assignment.cluster = cluster;
+				assignment.light = i;
+				assignments.push_back(assignment);
+			}
+			continue;
+		}
+		glm::vec3 center = glm::vec3(worldToView * glm::vec4(light.position, 1));
+		float radius = light.radius;
+		float depth = -center.z;
+		float minDepth = std::max(near, depth - radius);
+		float maxDepth = std::min(far, depth + radius);
+		if (minDepth > maxDepth) {
+			continue;
+		}
+		int firstSlice = std::max(0, (int)(std::log(minDepth) * depthSliceScale + depthSliceBias));
+		int lastSlice = std::min(LIGHT_CLUSTERS_Z - 1, (int)(std::log(maxDepth) * depthSliceScale + depthSliceBias));
+		for (int z = firstSlice; z <= lastSlice; z++) {
+			float depth0 = std::max(minDepth, sliceDepths[z]);
+			float depth1 = std::min(maxDepth, sliceDepths[z + 1]);
+			int firstX, lastX, firstY, lastY;
+			tileRange(center.x - radius, center.x + radius, depth0, depth1, projectionX, LIGHT_CLUSTERS_X, firstX, lastX);
+			tileRange(center.y - radius, center.y + radius, depth0, depth1, projectionY, LIGHT_CLUSTERS_Y, firstY, lastY);
+			for (int y = firstY; y <= lastY; y++) {
+				for (int x = firstX; x <= lastX; x++) {
+					int cluster = (z * LIGHT_CLUSTERS_Y + y) * LIGHT_CLUSTERS_X + x;
+					if (sphereIntersectsAABB(center, radius, clusterBounds[cluster])) {
+						Assignment assignment;
+						assignment.cluster = cluster;
+						assignment.light = i;
+						assignments.push_back(assignment);
+					}
+				}
+			}
+		}
+	}
+
+	// Counting sort of the pairs by cluster gives every cluster a contiguous index range
+	clusters.assign(NUM_LIGHT_CLUSTERS, LightCluster());
+	for (int i = 0; i < assignments.size(); i++) {
+		clusters[assignments[i].cluster].numLights++;
+	}
+	unsigned int offset = 0;
+	for (int i = 0; i < NUM_LIGHT_CLUSTERS; i++) {
+		clusters[i].offset = offset;
+		offset += clusters[i].numLights;
+		clusters[i].numLights = 0;
+	}
+	lightIndices.resize(assignments.size());
+	for (int i = 0; i < assignments.size(); i++) {
+		LightCluster &cluster = clusters[assignments[i].cluster];
+		lightIndices[cluster.offset + cluster.numLights] = assignments[i].light;
+		cluster.numLights++;
+	}
+}
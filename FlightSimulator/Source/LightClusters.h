@@ -0,0 +1,76 @@
+#pragma once
+
+#include <vector>
+
+#include <glm/mat4x4.hpp>
+
+#include "Frustum.h"
+#include "LightCulling.h"
+
+// Size of the cluster grid, tiles across the screen and exponential slices in depth
+const int LIGHT_CLUSTERS_X = 16;
+const int LIGHT_CLUSTERS_Y = 9;
+const int LIGHT_CLUSTERS_Z = 24;
+const int NUM_LIGHT_CLUSTERS = LIGHT_CLUSTERS_X * LIGHT_CLUSTERS_Y * LIGHT_CLUSTERS_Z;
+
+// A range in the light index list, layout matches uvec2 in common.glsl
+struct LightCluster {
+	unsigned int offset;
+	unsigned int numLights;
+};
+
+// Splits the view frustum into a grid of clusters and finds the point lights and spotlights
+// that reach each of them, so a fragment only has to evaluate the lights of its cluster.
+// Clusters are numbered x first, then y, then z (away from the camera).
+// Knows nothing about OpenGL so it can be used without a context.
+class LightClusters {
+public:
+	LightClusters();
+
+	// Computes the cluster bounds for a perspective matrix made by glm::perspective. Only
+	// needs to be called again when the projection changes.
+	void setProjection(const glm::mat4 &perspective);
+
+	// Assigns every light to the clusters its sphere of influence touches. Directional lights
+	// are skipped since the shader lights every fragment with them, unattenuated lights
+	// (radius FLT_MAX) go to every cluster.
+	// The light indices are positions in the given vector.
+	void assignLights(const std::vector<LightData> &lights, const glm::mat4 &worldToView);
+
+	const std::vector<LightCluster>& getClusters() const {
+		return clusters;
+	}
+	const std::vector<unsigned int>& getLightIndices() const {
+		return lightIndices;
+	}
+	// View space bounds of a cluster
+	const AABB& getClusterBounds(int cluster) const {
+		return clusterBounds[cluster];
+	}
+	// The depth slice of a view space depth d is log(d) * scale + bias
+	float getDepthSliceScale() const {
+		return depthSliceScale;
+	}
+	float getDepthSliceBias() const {
+		return depthSliceBias;
+	}
+private:
+	struct Assignment {
+		int cluster;
+		int light;
+	};
+
+	float near;
+	float far;
+	// Projection scale in x and y, x_ndc = projectionX * x_view / depth
+	float projectionX;
+	float projectionY;
+	float depthSliceScale;
+	float depthSliceBias;
+	std::vector<float> sliceDepths; // LIGHT_CLUSTERS_Z + 1 depths
+	std::vector<AABB> clusterBounds;
+	std::vector<LightCluster> clusters;
+	std::vector<unsigned int> lightIndices;
+	// (cluster, light) pairs found while assigning, kept to avoid reallocating
+	std::vector<Assignment> assignments;
+};
@@ -0,0 +1,58 @@
+#include "LightCulling.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+
+#include <glm/glm.hpp>
+
+float lightRadius(int type, float intensity, glm::vec3 color, float attenuationC1) {
+	if (type == LIGHT_DATA_DIRECTIONAL || attenuationC1 <= 0) {
+		return FLT_MAX;
+	}
+	// calculateLight uses 1 / (1 + c1 * d + c1 * d^2), solve for where
+	// brightness * attenuation drops to the threshold
+	const float threshold = 1 / 256.0f;
+	float brightness = intensity * std::max(color.x, std::max(color.y, color.z));
+	float c = 1 - brightness / threshold;
+	if (c >= 0) {
+		return 0;
+	}
+	float a = attenuationC1;
+	return (-a + std::sqrt(a * a - 4 * a * c)) / (2 * a);
+}
+
+namespace {
+	struct SortedLight {
+		float key;
+		int index;
+		bool operator<(const SortedLight &other) const {
+			return key < other.key || (key == other.key && index < other.index);
+		}
+	};
+}
+
+void cullLights(const std::vector<LightData> &lights, const Frustum &frustum, glm::vec3 cameraPosition, int maxLights, std::vector<LightData> &visibleLights) {
+	std::vector<SortedLight> sorted;
+	sorted.reserve(lights.size());
+	for (int i = 0; i < lights.size(); i++) {
+		const LightData &light = lights[i];
+		SortedLight entry;
+		entry.index = i;
+		if (light.type == LIGHT_DATA_DIRECTIONAL) {
+			entry.key = -1; // Always come first
+		} else {
+			if (light.radius == 0 || !frustum.intersectsSphere(light.position, light.radius)) {
+				continue;
+			}
+			entry.key = std::max(0.0f, glm::length(light.position - cameraPosition) - light.radius);
+		}
+		sorted.push_back(entry);
+	}
+	std::sort(sorted.begin(), sorted.end());
+
+	visibleLights.clear();
+	for (int i = 0; i < sorted.size() && i < maxLights; i++) {
+		visibleLights.push_back(lights[sorted[i].index]);
+	}
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <vector>
+
+#include <glm/vec3.hpp>
+
+#include "Frustum.h"
+
+// Largest number of lights that are uploaded per frame, sizes the light storage buffer
+const int MAX_LIGHTS = 4096;
+
+// Same values as LightType and the isDirectional/isPoint/isSpot checks in common.glsl
+const int LIGHT_DATA_DIRECTIONAL = 0;
+const int LIGHT_DATA_POINT = 1;
+const int LIGHT_DATA_SPOT = 2;
+
+// A light in world space. The layout matches the std430 Light struct in common.glsl.
+struct LightData {
+	glm::vec3 position;
+	int type;
+	glm::vec3 direction;
+	float cosCutoffAngle;
+	glm::vec3 color;
+	float intensity;
+	float attenuationC1;
+	float attenuationC2;
+	float cosOuterCutoffAngle;
+	// Distance at which the light no longer changes the image, see lightRadius
+	float radius;
+};
+
+// Distance from a point light or spotlight beyond which its contribution is less than
+// 1/256, one step of an 8 bit color channel. Uses the same attenuation as calculateLight
+// in common.glsl, which only depends on attenuationC1. Directional lights and lights
+// without attenuation never fall off and get FLT_MAX.
+float lightRadius(int type, float intensity, glm::vec3 color, float attenuationC1);
+
+// Keeps the lights that can affect what the camera sees: directional lights and lights
+// whose sphere of influence intersects the frustum. The result is sorted with directional
+// lights first and the rest by distance to the camera, and cut off at maxLights, so
+// the lights that matter most survive when there are too many.
+// Knows nothing about OpenGL so it can be used without a context.
+void cullLights(const std::vector<LightData> &lights, const Frustum &frustum, glm::vec3 cameraPosition, int maxLights, std::vector<LightData> &visibleLights);
@@ -1,6 +1,13 @@
 #include <iostream>
 #include <vector>
 #include <string>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <atomic>
+#include <thread>
 #define _USE_MATH_DEFINES
 #include <math.h>
 
@@ -23,73 +30,108 @@
 #include "Common.h"
 #include "DiamondSquare.h"
 #include "Physics.h"
+#include "AirplaneFleet.h"
 #include "EntityFactory.h"
-
-
-float getHeightAt(float *heightmap, int size, float tileSize, float positionX, float positionZ) {
-	int tileX = positionX / tileSize;
-	int tileZ = positionZ / tileSize;
-
-	// Find the four corners of the grid
-	glm::vec3 topLeftCorner = glm::vec3(tileX * tileSize, heightmap[tileX + tileZ * size], tileZ * tileSize);
-	glm::vec3 bottomRightCorner = glm::vec3((tileX + 1) * tileSize, heightmap[tileX + (tileZ + 1) * size + 1], (tileZ + 1) * tileSize);
-	glm::vec3 topRightCorner = glm::vec3((tileX + 1) * tileSize, heightmap[tileX + tileZ * size + 1], tileZ * tileSize);
-	glm::vec3 bottomLeftCorner = glm::vec3(tileX  * tileSize, heightmap[tileX + (tileZ + 1) * size], (tileZ + 1) * tileSize);
-
-	// Calculate tile penetration
-	float tilePenetrationX = ((int)(positionX * 100) % (int)(tileSize * 100)) / (tileSize * 100);
-	float tilePenetrationZ = ((int)(positionZ * 100) % (int)(tileSize * 100)) / (tileSize * 100);
-
-	float calculatedY;
-	// Check if top left triangle
-	if (tilePenetrationX <= 1 - tilePenetrationZ) {
-		glm::vec3 one = topLeftCorner;
-		glm::vec3 two = topRightCorner;
-		glm::vec3 three = bottomLeftCorner;
-		GLfloat lambda1N = ((two.z - three.z)*(positionX - three.x) + (three.x - two.x)*(positionZ - three.z));
-		GLfloat lambda1D = ((two.z - three.z)*(one.x - three.x) + (three.x - two.x)*(one.z - three.z));
-		GLfloat lambda1 = lambda1N / lambda1D;
-		GLfloat lambda2N = ((three.z - one.z)*(positionX - three.x) + (one.x - three.x)*(positionZ - three.z));
-		GLfloat lambda2D = ((two.z - three.z)*(one.x - three.x) + (three.x - two.x)*(one.z - three.z));
-		GLfloat lambda2 = lambda2N / lambda2D;
-		GLfloat lambda3 = 1 - lambda1 - lambda2;
-		calculatedY = one.y * lambda1 + two.y * lambda2 + three.y * lambda3;
-	} else {
-		glm::vec3 one = bottomRightCorner;
-		glm::vec3 two = topRightCorner;
-		glm::vec3 three = bottomLeftCorner;
-		GLfloat lambda1N = ((two.z - three.z)*(positionX - three.x) + (three.x - two.x)*(positionZ - three.z));
-		GLfloat lambda1D = ((two.z - three.z)*(one.x - three.x) + (three.x - two.x)*(one.z - three.z));
-		GLfloat lambda1 = lambda1N / lambda1D;
-		GLfloat lambda2N = ((three.z - one.z)*(positionX - three.x) + (one.x - three.x)*(positionZ - three.z));
-		GLfloat lambda2D = ((two.z - three.z)*(one.x - three.x) + (three.x - two.x)*(one.z - three.z));
-		GLfloat lambda2 = lambda2N / lambda2D;
-		GLfloat lambda3 = 1 - lambda1 - lambda2;
-		calculatedY = one.y * lambda1 + two.y * lambda2 + three.y * lambda3;
-	}
-
-	return calculatedY;
-}
-
-// Should also interpolate over triangle
-void terrainCollision(float *heightmap, int size, float tileSize, Entity &entity) {
-	float height = getHeightAt(heightmap, size, tileSize, entity.position.x, entity.position.z);
-	if (height > entity.position.y + entity.centerToGroundContactPoint) {
-		entity.position.y = height - entity.centerToGroundContactPoint;
-		entity.velocity.y = 0;
-	}
-}
-
-int steerMode = 0;
+#include "Threading.h"
+#include "TripleBuffer.h"
+#include "TerrainCache.h"
+#include "MeshCache.h"
+#include "TextureManager.h"
+#include "TextureContainer.h"
+#include "TerrainVirtualTexture.h"
+
+
+// Input is set by the key callback on the main thread and read by the simulation thread
+std::atomic<int> steerMode(0);
+std::atomic<bool> useTerrainLod(true);
 glm::vec3 cameraPosition = glm::vec3(10, 10, 10);
 glm::vec3 cameraForward = glm::vec3(0.0f, 0.0f, 1.0f);
 glm::vec3 cameraUp = glm::vec3(0.0f, 1.0f, 0.0f);
 Entity *entityToFollow = nullptr;
-bool isForward, isBackward, isLeft, isUp, isRight, isDown, isStrideLeft, isStrideRight, jump, isShift;
+std::atomic<bool> isForward(false), isBackward(false), isLeft(false), isUp(false), isRight(false), isDown(false), isStrideLeft(false), isStrideRight(false), jump(false), isShift(false);
+
+// Rate the simulation is stepped at, independent of the frame rate. Change it with --tick-rate
+const int DEFAULT_TICKS_PER_SECOND = 120;
+// Longest frame the simulation catches up on, so a hitch doesn't lead to ever more ticks per frame
+const float MAX_FRAME_SECONDS = 0.25f;
+
+struct ProgramOptions {
+	int ticksPerSecond;
+	// Simulated seconds to fly without a window or OpenGL, 0 to run the game as usual
+	double headlessSeconds;
+	// Airplane inputs for headless runs, full thrust straight ahead when empty
+	std::string scriptFile;
+	// CSV file headless runs write the airplane's state to after every tick, none when empty
+	std::string traceFile;
+	// Chrome trace file the job timings of the first JOB_TRACE_FRAMES frames are written to on exit
+	std::string jobTraceFile;
+	// Simulate and render each frame one after the other on the main thread, instead of
+	// simulating the next frame on its own thread while the current one is rendered
+	bool isSerial;
+	// Upload textures through a pixel buffer object instead of straight from client memory
+	bool usePixelBuffers;
+	// Load textures from their baked containers when up to date, instead of decoding the PNGs
+	bool useTextureContainers;
+	// Set the camera, material and samplers per draw call as uniforms looked up by name,
+	// instead of through the uniform blocks, to compare the render CPU time of the two
+	bool useLegacyUniforms;
+	// Headless runs also follow the airplane with the game's camera, cull and select the
+	// terrain's level of detail every frame and count the triangles drawn with and without it
+	bool isTerrainLodBenchmark;
+};
+
+const int JOB_TRACE_FRAMES = 600;
+
+// The game's window and vertical field of view, in radians
+const int WINDOW_WIDTH = 1700;
+const int WINDOW_HEIGHT = 900;
+const float FIELD_OF_VIEW = 0.8f;
+const float FAR_PLANE = 1500;
+
+// Frames per second the terrain is drawn at in --benchmark-terrain-lod runs
+const int TERRAIN_LOD_BENCHMARK_FPS = 60;
+// Flown by --benchmark-terrain-lod when no --script is given
+const std::string TERRAIN_LOD_BENCHMARK_SCRIPT = "Resources/terrain-lod-flight.txt";
+
+// Steering of the airplane, each -1, 0 or 1 as given to steerAirplane
+struct AirplaneControls {
+	int thrust;
+	int roll;
+	int pitch;
+};
+
+// Controls that apply from a point in simulated time until the next one
+struct ScriptedInput {
+	float time;
+	AirplaneControls controls;
+};
+
+// One "seconds thrust roll pitch" per line, in increasing time. Lines starting with # are skipped.
+std::vector<ScriptedInput> loadInputScript(std::string filename) {
+	std::vector<ScriptedInput> script;
+	std::ifstream file(filename);
+	if (!file) {
+		std::cerr << "Error! Could not open input script " << filename << std::endl;
+		return script;
+	}
+	std::string line;
+	while (std::getline(file, line)) {
+		if (line.empty() || line[0] == '#') {
+			continue;
+		}
+		std::istringstream values(line);
+		ScriptedInput input;
+		if (values >> input.time >> input.controls.thrust >> input.controls.roll >> input.controls.pitch) {
+			script.push_back(input);
+		}
+	}
+	return script;
+}
 
-void basicSteering(glm::vec3 &position, glm::vec3 &forward, glm::vec3 &up) {
-	GLfloat rotationSpeed = 0.03f;
-	GLfloat speed = 0.09f * (isShift ? 100 : 1);
+// dt in seconds
+void basicSteering(glm::vec3 &position, glm::vec3 &forward, glm::vec3 &up, float dt) {
+	GLfloat rotationSpeed = 1.8f * dt;
+	GLfloat speed = 5.4f * dt * (isShift ? 100 : 1);
 	if (isForward)
 	{
 		position = position + forward * speed;
@@ -136,7 +178,7 @@ void printVector(glm::vec3 &v) {
 	std::cout << v.x << ", " << v.y << ", " << v.z << std::endl;
 }
 
-void handleKeyChange(bool* currentValue, int action) {
+void handleKeyChange(std::atomic<bool>* currentValue, int action) {
 	if (action == GLFW_PRESS) {
 		*currentValue = true;
 	} else if (action == GLFW_RELEASE) {
@@ -153,12 +195,13 @@ void interpolateCamera(glm::vec3 &targetPosition, glm::vec3 &cameraPosition, flo
 
 void key_callback(GLFWwindow* window, int key, int scancode, int action, int mods) {
 	if (key == GLFW_KEY_I && action == GLFW_PRESS) {
-		steerMode++;
-		if (steerMode == 3) {
-			steerMode = 0;
-		}
+		steerMode = (steerMode + 1) % 3;
 	}
 	
+	if (key == GLFW_KEY_L && action == GLFW_PRESS) {
+		useTerrainLod = !useTerrainLod;
+	}
+
 	if (key == GLFW_KEY_LEFT_SHIFT) {
 		handleKeyChange(&isShift, action);
 	}
@@ -213,6 +256,54 @@ void makeRunwayOnHeightmap(float *heightmap, int size) {
 	}
 }
 
+// The terrain flown over, the same in the game and headless runs
+const int WORLD_SIZE = 2049;
+const int WORLD_TILE_SIZE_XZ = 2;
+const float WORLD_SMOOTHNESS = 0.3f;
+const int WORLD_TILE_SIZE_Y = 1;
+const int WORLD_TEXTURE_SCALE = 500; // Must also change terrain fragment shader
+const unsigned int WORLD_SEED = 1519128009; // Splat map is built after this seed, so don't change it
+
+// What the terrain's color is blended from, the detail textures weighted by the splat map's
+// red, green and blue
+const std::string TERRAIN_SPLATMAP = "Resources/terrain-splatmap.png";
+const std::string TERRAIN_DETAIL_TEXTURES[3] = { "Resources/grass512.png", "Resources/asphalt512.png", "Resources/sand512.png" };
+
+// Heightmap and terrain mesh of the world, written by the first launch
+const std::string TERRAIN_CACHE_FILE = "Resources/terrain.cache";
+
+float *createWorldHeightmap(int size, float smoothness) {
+	float *heightmap = new float[size * size];
+	Timer terrainTimer;
+	diamondSquare(heightmap, size, smoothness, WORLD_SEED);
+	std::cout << "Generated " << size << "x" << size << " heightmap on " << getNumWorkerThreads() << " threads in " << terrainTimer.elapsedMilliseconds() << " ms" << std::endl;
+	makeRunwayOnHeightmap(heightmap, size);
+	return heightmap;
+}
+
+TerrainCacheKey getWorldCacheKey() {
+	TerrainCacheKey key = { WORLD_SIZE, WORLD_SMOOTHNESS, WORLD_SEED, (float)WORLD_TILE_SIZE_XZ, (float)WORLD_TILE_SIZE_Y, (float)WORLD_TEXTURE_SCALE, TERRAIN_CHUNK_SIZE };
+	return key;
+}
+
+// The world's heightmap, copied out of the terrain cache if it is up to date and generated
+// otherwise. The cache is left open for its mesh, isCached tells whether it is.
+float *loadWorldHeightmap(MappedFile &cacheFile, TerrainCacheData &cache, bool &isCached) {
+	isCached = openTerrainCache(TERRAIN_CACHE_FILE, getWorldCacheKey(), cacheFile, cache);
+	if (!isCached) {
+		return createWorldHeightmap(WORLD_SIZE, WORLD_SMOOTHNESS);
+	}
+	float *heightmap = new float[WORLD_SIZE * WORLD_SIZE];
+	memcpy(heightmap, cache.heightmap, WORLD_SIZE * WORLD_SIZE * sizeof(float));
+	return heightmap;
+}
+
+void placeAirplane(std::vector<Entity*> &airplane) {
+	airplane[0]->position = glm::vec3(20, 10, 20);
+	airplane[0]->scale = glm::vec3(0.2f, 0.2f, 0.2f);
+	airplane[0]->centerToGroundContactPoint = -0.2f;
+}
+
 void log(std::string output) {
 	std::cout << output << std::endl;
 }
@@ -307,17 +398,1211 @@ void glDebugMessageCallbackFunction(GLenum source, GLenum type, GLuint id, GLenu
 	log(message);
 }
 
-int program();
+// Times diamondSquare on 1 to N threads for a few heightmap sizes, N at least 4 so the split
+// is checked on small machines too, and compares every heightmap bit for bit with the one
+// generated on 1 thread
+void benchmarkDiamondSquare() {
+	const int numSizes = 4;
+	const int sizes[numSizes] = { 513, 1025, 2049, 4097 };
+	const int numRuns = 3;
+	const int maxThreads = std::max(getNumWorkerThreads(), 4);
+	for (int i = 0; i < numSizes; i++) {
+		int size = sizes[i];
+		std::vector<float> reference(size * size);
+		std::vector<float> heightmap(size * size);
+		double singleThreadMilliseconds = 0;
+		for (int numThreads = 1; numThreads <= maxThreads; numThreads++) {
+			std::vector<float> &result = numThreads == 1 ? reference : heightmap;
+			Timer timer;
+			for (int run = 0; run < numRuns; run++) {
+				diamondSquare(&result[0], size, WORLD_SMOOTHNESS, WORLD_SEED, numThreads);
+			}
+			double milliseconds = timer.elapsedMilliseconds() / numRuns;
+			if (numThreads == 1) {
+				singleThreadMilliseconds = milliseconds;
+			}
+			bool isIdentical = memcmp(&result[0], &reference[0], reference.size() * sizeof(float)) == 0;
+			std::cout << size << "x" << size << " on " << numThreads << " threads: " << milliseconds << " ms, "
+				<< singleThreadMilliseconds / milliseconds << "x, " << (isIdentical ? "identical" : "different") << std::endl;
+			if (!isIdentical) {
+				std::cerr << "Error! The " << size << "x" << size << " heightmap on " << numThreads << " threads differs from the one on 1 thread" << std::endl;
+			}
+		}
+	}
+	std::cout << getNumWorkerThreads() << " threads available" << std::endl;
+}
+
+// Times building the terrain's vertices and chunk indices on the world heightmap against the
+// previous heightmapToModel loop, which averaged four cross products per normal and wrote
+// positions, normals and texture coordinates to separate arrays for three vertex buffers.
+// Positions and texture coordinates must match bit for bit, normals differ slightly since
+// they are now central differences.
+void benchmarkHeightmapVertices() {
+	const int size = WORLD_SIZE;
+	const int numRuns = 10;
+	const float scaleX = WORLD_TILE_SIZE_XZ;
+	const float scaleY = WORLD_TILE_SIZE_Y;
+	const float scaleZ = WORLD_TILE_SIZE_XZ;
+	const float textureScale = WORLD_TEXTURE_SCALE;
+	std::vector<float> heightmapVector(size * size);
+	float *heightmap = &heightmapVector[0];
+	diamondSquare(heightmap, size, WORLD_SMOOTHNESS, WORLD_SEED);
+
+	std::vector<float> positions(size * size * 3);
+	std::vector<float> normals(size * size * 3);
+	std::vector<float> textureCoordinates(size * size * 2);
+	std::vector<int> referenceIndices((size - 1) * (size - 1) * 6);
+	Timer timer;
+	for (int run = 0; run < numRuns; run++) {
+		for (int z = 0; z < size; z++) {
+			for (int x = 0; x < size; x++) {
+				positions[(z * size + x) * 3] = x * scaleX;
+				positions[(z * size + x) * 3 + 1] = heightmap[size * z + x] * scaleY;
+				positions[(z * size + x) * 3 + 2] = z * scaleZ;
+				textureCoordinates[(z * size + x) * 2] = ((float)x / (float)(size - 1)) * textureScale;
+				textureCoordinates[(z * size + x) * 2 + 1] = (1 - (float)z / (float)(size - 1)) * textureScale;
+
+				glm::vec3 normal = glm::vec3(0, 1, 0);
+				if (x != size - 1 && z != size - 1 && x != 0 && z != 0) {
+					glm::vec3 a = glm::vec3(x * scaleX, heightmap[size * z + x] * scaleY, z * scaleZ);
+					glm::vec3 ab = a - glm::vec3((x + 1) * scaleX, heightmap[size * z + x + 1] * scaleY, z * scaleZ);
+					glm::vec3 ac = a - glm::vec3(x * scaleX, heightmap[size * (z + 1) + x] * scaleY, (z + 1) * scaleZ);
+					glm::vec3 normal1 = glm::normalize(glm::cross(ac, ab));
+					glm::vec3 ad = a - glm::vec3((x - 1) * scaleX, heightmap[size * z + x - 1] * scaleY, z * scaleZ);
+					glm::vec3 ae = a - glm::vec3(x * scaleX, heightmap[size * (z - 1) + x] * scaleY, (z - 1) * scaleZ);
+					glm::vec3 normal2 = glm::normalize(glm::cross(ae, ad));
+					glm::vec3 af = a - glm::vec3((x - 1) * scaleX, heightmap[size * z + x - 1] * scaleY, z * scaleZ);
+					glm::vec3 ag = a - glm::vec3(x * scaleX, heightmap[size * (z + 1) + x] * scaleY, (z + 1) * scaleZ);
+					glm::vec3 normal3 = glm::normalize(glm::cross(af, ag));
+					glm::vec3 ah = a - glm::vec3((x + 1) * scaleX, heightmap[size * z + x + 1] * scaleY, z * scaleZ);
+					glm::vec3 ai = a - glm::vec3(x * scaleX, heightmap[size * (z - 1) + x] * scaleY, (z - 1) * scaleZ);
+					glm::vec3 normal4 = glm::normalize(glm::cross(ah, ai));
+					normal = glm::normalize(normal1 + normal2 + normal3 + normal4);
+				}
+				normals[(z * size + x) * 3] = normal.x;
+				normals[(z * size + x) * 3 + 1] = normal.y;
+				normals[(z * size + x) * 3 + 2] = normal.z;
+
+				if (x != size - 1 && z != size - 1) {
+					int index = z * size + x;
+					int arrayIndex = z * (size - 1) + x;
+					referenceIndices[arrayIndex * 6] = index;
+					referenceIndices[arrayIndex * 6 + 1] = index + 1;
+					referenceIndices[arrayIndex * 6 + 2] = index + size;
+					referenceIndices[arrayIndex * 6 + 3] = index + 1;
+					referenceIndices[arrayIndex * 6 + 4] = index + size + 1;
+					referenceIndices[arrayIndex * 6 + 5] = index + size;
+				}
+			}
+		}
+	}
+	double referenceMilliseconds = timer.elapsedMilliseconds() / numRuns;
+
+	// The quadtree is built for culling anyway, only its index buffer is part of the mesh
+	TerrainQuadtree quadtree;
+	quadtree.build(heightmap, size, size, scaleX, scaleY, scaleZ, TERRAIN_CHUNK_SIZE);
+	std::vector<float> vertices(size * size * HEIGHTMAP_VERTEX_SIZE);
+	std::vector<unsigned int> indices(quadtree.getNumIndices());
+	timer.reset();
+	for (int run = 0; run < numRuns; run++) {
+		buildHeightmapVertices(heightmap, size, size, scaleX, scaleY, scaleZ, textureScale, &vertices[0]);
+		quadtree.buildIndices(&indices[0]);
+	}
+	double milliseconds = timer.elapsedMilliseconds() / numRuns;
+
+	int numDifferent = 0;
+	float maxNormalDegrees = 0;
+	for (int i = 0; i < size * size; i++) {
+		const float *vertex = &vertices[i * HEIGHTMAP_VERTEX_SIZE];
+		if (memcmp(vertex, &positions[i * 3], 3 * sizeof(float)) != 0 || memcmp(vertex + 6, &textureCoordinates[i * 2], 2 * sizeof(float)) != 0) {
+			numDifferent++;
+		}
+		float cosAngle = glm::dot(glm::vec3(vertex[3], vertex[4], vertex[5]), glm::vec3(normals[i * 3], normals[i * 3 + 1], normals[i * 3 + 2]));
+		maxNormalDegrees = std::max(maxNormalDegrees, glm::degrees(std::acos(std::min(1.0f, cosAngle))));
+	}
+	std::cout << size << "x" << size << " vertices: " << referenceMilliseconds << " ms before, " << milliseconds << " ms on "
+		<< getNumWorkerThreads() << " threads (" << referenceMilliseconds / milliseconds << "x), " << numDifferent
+		<< " positions or texture coordinates differ, normals at most " << maxNormalDegrees << " degrees apart" << std::endl;
+	if (numDifferent > 0 || indices.size() != referenceIndices.size()) {
+		std::cerr << "Error! The heightmap vertices or their number of indices differ from the previous ones" << std::endl;
+	}
+}
+
+// Culls the chunks of a quadtree over rolling hills for a few cameras, within the terrain and
+// outside it, and checks the result against the chunks' own vertices and bounds: every chunk
+// with a vertex in view must be returned and no chunk entirely behind the camera may be
+void benchmarkTerrainCulling() {
+	const int size = 1025;
+	const float scaleXZ = WORLD_TILE_SIZE_XZ;
+	const float scaleY = WORLD_TILE_SIZE_Y;
+	const float extent = (size - 1) * scaleXZ;
+	std::vector<float> heightmap(size * size);
+	for (int z = 0; z < size; z++) {
+		for (int x = 0; x < size; x++) {
+			heightmap[z * size + x] = 30 + 30 * std::sin(x * 0.02f) * std::cos(z * 0.013f);
+		}
+	}
+	TerrainQuadtree quadtree;
+	quadtree.build(&heightmap[0], size, size, scaleXZ, scaleY, scaleXZ, TERRAIN_CHUNK_SIZE);
+
+	const int numCameras = 6;
+	const glm::vec3 cameras[numCameras][3] = { // Position, target and up
+		{ glm::vec3(extent / 2, 70, extent / 2), glm::vec3(extent, 40, extent / 2), glm::vec3(0, 1, 0) },
+		{ glm::vec3(extent / 2, 70, extent / 2), glm::vec3(extent / 2, 20, 0), glm::vec3(0, 1, 0) },
+		{ glm::vec3(-200, 150, -200), glm::vec3(extent / 2, 0, extent / 2), glm::vec3(0, 1, 0) },
+		{ glm::vec3(extent / 3, 400, extent / 3), glm::vec3(extent / 3, 0, extent / 3), glm::vec3(0, 0, -1) },
+		{ glm::vec3(extent - 10, 50, extent / 2), glm::vec3(2 * extent, 50, extent / 2), glm::vec3(0, 1, 0) },
+		{ glm::vec3(100, 40, 900), glm::vec3(300, 120, 1000), glm::vec3(0, 1, 0) },
+	};
+	const int numRuns = 100;
+	glm::mat4 perspective = glm::perspective<GLfloat>(FIELD_OF_VIEW, WINDOW_WIDTH / (float)WINDOW_HEIGHT, .1f, FAR_PLANE);
+	for (int camera = 0; camera < numCameras; camera++) {
+		glm::mat4 worldToView = glm::lookAt(cameras[camera][0], cameras[camera][1], cameras[camera][2]);
+		glm::mat4 worldToClip = perspective * worldToView;
+		std::vector<const TerrainQuadtree::Node*> visibleNodes;
+		Timer timer;
+		for (int run = 0; run < numRuns; run++) {
+			visibleNodes.clear();
+			quadtree.cull(Frustum(worldToClip), visibleNodes);
+		}
+		double milliseconds = timer.elapsedMilliseconds() / numRuns;
+
+		std::vector<bool> isReturned(quadtree.getNumChunks(), false);
+		int numReturned = 0;
+		for (int i = 0; i < visibleNodes.size(); i++) {
+			for (int chunk = visibleNodes[i]->firstChunk; chunk < visibleNodes[i]->firstChunk + visibleNodes[i]->numChunks; chunk++) {
+				isReturned[chunk] = true;
+				numReturned++;
+			}
+		}
+
+		int numInView = 0;
+		int numMissing = 0;
+		int numBehind = 0;
+		int numBehindReturned = 0;
+		for (int i = 0; i < quadtree.getNumChunks(); i++) {
+			const TerrainQuadtree::Chunk &chunk = quadtree.getChunk(i);
+			// A hair inside the frustum, so vertices on a plane don't depend on rounding. Depth is
+			// checked in view space, clip space z is too close to w in the distance.
+			bool isInView = false;
+			for (int z = chunk.z; z <= chunk.z + chunk.depth && !isInView; z++) {
+				for (int x = chunk.x; x <= chunk.x + chunk.width && !isInView; x++) {
+					glm::vec4 position = glm::vec4(x * scaleXZ, heightmap[z * size + x] * scaleY, z * scaleXZ, 1);
+					glm::vec4 clip = worldToClip * position;
+					float depth = -(worldToView * position).z;
+					float w = clip.w * 0.999f;
+					isInView = depth > 0.2f && depth < FAR_PLANE * 0.999f && std::abs(clip.x) <= w && std::abs(clip.y) <= w;
+				}
+			}
+			bool isBehind = true;
+			for (int corner = 0; corner < 8; corner++) {
+				glm::vec3 position = glm::vec3(corner & 1 ? chunk.bounds.max.x : chunk.bounds.min.x,
+					corner & 2 ? chunk.bounds.max.y : chunk.bounds.min.y, corner & 4 ? chunk.bounds.max.z : chunk.bounds.min.z);
+				isBehind = isBehind && (worldToView * glm::vec4(position, 1)).z > 0;
+			}
+			numInView += isInView;
+			numMissing += isInView && !isReturned[i];
+			numBehind += isBehind;
+			numBehindReturned += isBehind && isReturned[i];
+		}
+
+		std::cout << "Camera " << camera << ": " << numReturned << "/" << quadtree.getNumChunks() << " chunks returned in "
+			<< visibleNodes.size() << " nodes, " << milliseconds << " ms per cull, " << numInView << " with vertices in view ("
+			<< numMissing << " missing), " << numBehind << " behind the camera (" << numBehindReturned << " returned)" << std::endl;
+		if (numMissing > 0 || numBehindReturned > 0) {
+			std::cerr << "Error! Camera " << camera << " culled chunks in view or kept chunks behind it" << std::endl;
+		}
+	}
+}
+
+// Times light cluster assignment for 1k and 10k random point lights over the terrain and
+// checks that no light is missing from a cluster whose center it covers
+void benchmarkLightClusters() {
+	glm::mat4 perspective = glm::perspective<GLfloat>(0.8f, 1700 / 900.0f, .1f, 1500);
+	glm::mat4 worldToView = glm::lookAt(glm::vec3(400, 60, 400), glm::vec3(500, 40, 600), glm::vec3(0, 1, 0));
+	LightClusters clusters;
+	clusters.setProjection(perspective);
+
+	const int numLightCounts = 2;
+	const int lightCounts[numLightCounts] = { 1000, 10000 };
+	const int numRuns = 20;
+	srand(1);
+	for (int i = 0; i < numLightCounts; i++) {
+		std::vector<LightData> lights(lightCounts[i]);
+		for (int j = 0; j < lights.size(); j++) {
+			LightData &light = lights[j];
+			light.type = LIGHT_DATA_POINT;
+			light.position = glm::vec3(rand() % 1000, rand() % 100, rand() % 1000);
+			light.radius = 1 + rand() % 40;
+		}
+
+		Timer timer;
+		for (int run = 0; run < numRuns; run++) {
+			clusters.assignLights(lights, worldToView);
+		}
+		double milliseconds = timer.elapsedMilliseconds() / numRuns;
+
+		int numMissing = 0;
+		std::vector<bool> assigned(lights.size());
+		for (int cluster = 0; cluster < NUM_LIGHT_CLUSTERS; cluster++) {
+			const LightCluster &range = clusters.getClusters()[cluster];
+			std::fill(assigned.begin(), assigned.end(), false);
+			for (unsigned int j = 0; j < range.numLights; j++) {
+				assigned[clusters.getLightIndices()[range.offset + j]] = true;
+			}
+			const AABB &bounds = clusters.getClusterBounds(cluster);
+			glm::vec3 center = (bounds.min + bounds.max) * 0.5f;
+			for (int j = 0; j < lights.size(); j++) {
+				glm::vec3 lightPosition = glm::vec3(worldToView * glm::vec4(lights[j].position, 1));
+				if (!assigned[j] && glm::length(lightPosition - center) < lights[j].radius) {
+					numMissing++;
+				}
+			}
+		}
+
+		std::cout << lights.size() << " lights: " << milliseconds << " ms per assignment, "
+			<< clusters.getLightIndices().size() << " cluster light indices, "
+			<< numMissing << " missing" << std::endl;
+	}
+}
+
+// Compares particle update throughput of the structure of arrays store against the
+// previous array of structures update, which swap-removed dead particles while integrating
+void benchmarkParticles() {
+	struct ReferenceParticle {
+		Entity *parentEntity;
+		glm::vec3 scale;
+		glm::vec3 position;
+		float rotation;
+		glm::vec3 velocity;
+		float timeAlive;
+		float lifetime;
+	};
+
+	const int numParticleCounts = 3;
+	const int particleCounts[numParticleCounts] = { 1000, 20000, 200000 };
+	const int numFrames = 100;
+	const float dt = 1 / 60.0f;
+	for (int i = 0; i < numParticleCounts; i++) {
+		int count = particleCounts[i];
+		std::vector<ReferenceParticle> reference(count);
+		ParticleSystem particleSystem(count);
+		srand(1);
+		for (int j = 0; j < count; j++) {
+			ReferenceParticle &particle = reference[j];
+			particle.parentEntity = nullptr;
+			particle.scale = glm::vec3(1, 1, 1);
+			particle.position = glm::vec3(rand() % 100, rand() % 100, rand() % 100);
+			particle.rotation = 0;
+			particle.velocity = glm::vec3(rand() % 10, rand() % 10, rand() % 10);
+			particle.timeAlive = 0;
+			// Long enough that most particles survive the benchmark
+			particle.lifetime = 0.5f + (rand() % 1000) / 100.0f;
+
+			ParticleArrays &particles = particleSystem.particles;
+			particles.positionX[j] = particle.position.x;
+			particles.positionY[j] = particle.position.y;
+			particles.positionZ[j] = particle.position.z;
+			particles.velocityX[j] = particle.velocity.x;
+			particles.velocityY[j] = particle.velocity.y;
+			particles.velocityZ[j] = particle.velocity.z;
+			particles.size[j] = 1;
+			particles.rotation[j] = 0;
+			particles.timeAlive[j] = 0;
+			particles.lifetime[j] = particle.lifetime;
+		}
+		particleSystem.numParticles = count;
+
+		long long referenceUpdates = 0;
+		int numReference = count;
+		Timer timer;
+		for (int frame = 0; frame < numFrames; frame++) {
+			referenceUpdates += numReference;
+			for (int j = 0; j < numReference; j++) {
+				reference[j].position = reference[j].position + reference[j].velocity * dt;
+				reference[j].timeAlive += dt;
+				if (reference[j].timeAlive >= reference[j].lifetime) {
+					numReference -= 1;
+					if (numReference > 0) {
+						reference[j] = reference[numReference];
+						j--;
+					}
+				}
+			}
+		}
+		double referenceMilliseconds = timer.elapsedMilliseconds();
+
+		long long updates = 0;
+		timer.reset();
+		for (int frame = 0; frame < numFrames; frame++) {
+			updates += particleSystem.numParticles;
+			integrateParticles(particleSystem, dt);
+			removeDeadParticles(particleSystem);
+		}
+		double milliseconds = timer.elapsedMilliseconds();
+
+		std::cout << count << " particles: " << referenceUpdates / referenceMilliseconds << " particles/ms before, "
+			<< updates / milliseconds << " particles/ms now, "
+			<< numReference << "/" << particleSystem.numParticles << " alive" << std::endl;
+	}
+}
+
+// Times sortParticles on shuffled particles and again after they have moved a little,
+// against the previous sort which allocated and std::sorted pairs and copied whole particles
+void benchmarkParticleSort() {
+	struct ReferenceParticle {
+		Entity *parentEntity;
+		glm::vec3 scale;
+		glm::vec3 position;
+		float rotation;
+		glm::vec3 velocity;
+		float timeAlive;
+		float lifetime;
+	};
+
+	const int numParticleCounts = 3;
+	const int particleCounts[numParticleCounts] = { 1000, 20000, 200000 };
+	const int numRuns = 10;
+	glm::vec3 cameraPosition = glm::vec3(0, 0, 0);
+	glm::vec3 cameraForward = glm::normalize(glm::vec3(1, 0.2f, 1));
+	for (int i = 0; i < numParticleCounts; i++) {
+		int count = particleCounts[i];
+		std::vector<ReferenceParticle> reference(count);
+		ParticleSystem particleSystem(count);
+		particleSystem.parentEntity = nullptr;
+		ParticleArrays &particles = particleSystem.particles;
+		srand(1);
+		for (int j = 0; j < count; j++) {
+			reference[j] = ReferenceParticle();
+			reference[j].position = glm::vec3(rand() % 1000, rand() % 1000, rand() % 1000) * 0.1f;
+			particles.positionX[j] = reference[j].position.x;
+			particles.positionY[j] = reference[j].position.y;
+			particles.positionZ[j] = reference[j].position.z;
+			particles.velocityX[j] = (rand() % 100 - 50) * 0.01f;
+			particles.velocityY[j] = (rand() % 100 - 50) * 0.01f;
+			particles.velocityZ[j] = (rand() % 100 - 50) * 0.01f;
+		}
+		particleSystem.numParticles = count;
+
+		Timer timer;
+		for (int run = 0; run < numRuns; run++) {
+			std::pair<float, int> *sortArray = new std::pair<float, int>[count];
+			for (int j = 0; j < count; j++) {
+				glm::vec3 distance = reference[j].position - cameraPosition;
+				sortArray[j].first = glm::dot(distance, cameraForward) + run; // Keep every run unsorted
+				sortArray[j].second = (j * 7919 + run) % count;
+			}
+			ReferenceParticle *particleCopy = new ReferenceParticle[count];
+			for (int j = 0; j < count; j++) {
+				particleCopy[j] = reference[j];
+			}
+			std::sort(sortArray, sortArray + count, [](std::pair<float, int> const &a, std::pair<float, int> const &b) -> bool {
+				return a.first > b.first;
+			});
+			for (int j = 0; j < count; j++) {
+				reference[j] = particleCopy[sortArray[j].second];
+			}
+			delete[] particleCopy;
+			delete[] sortArray;
+		}
+		double referenceMilliseconds = timer.elapsedMilliseconds() / numRuns;
+
+		timer.reset();
+		sortParticles(particleSystem, cameraPosition, cameraForward);
+		double shuffledMilliseconds = timer.elapsedMilliseconds();
+
+		timer.reset();
+		for (int run = 0; run < numRuns; run++) {
+			integrateParticles(particleSystem, 1 / 60.0f);
+			sortParticles(particleSystem, cameraPosition, cameraForward);
+		}
+		double coherentMilliseconds = timer.elapsedMilliseconds() / numRuns;
+
+		bool isSorted = true;
+		for (int j = 1; j < count; j++) {
+			glm::vec3 previous = glm::vec3(particles.positionX[j - 1], particles.positionY[j - 1], particles.positionZ[j - 1]);
+			glm::vec3 current = glm::vec3(particles.positionX[j], particles.positionY[j], particles.positionZ[j]);
+			isSorted = isSorted && glm::dot(previous - cameraPosition, cameraForward) >= glm::dot(current - cameraPosition, cameraForward);
+		}
+
+		std::cout << count << " particles: " << referenceMilliseconds << " ms before, "
+			<< shuffledMilliseconds << " ms shuffled, " << coherentMilliseconds << " ms per frame after, "
+			<< (isSorted ? "sorted" : "NOT SORTED") << std::endl;
+	}
+}
+
+// Composes the world matrices of 100k nodes with SceneGraph and with one glm matrix chain
+// per node, like getEntityTransformation builds them. Then moves 1% of the nodes and times
+// the update that only rebuilds them and their descendants.
+void benchmarkSceneGraph() {
+	const int numNodes = 100000;
+	const int numRuns = 10;
+	SceneGraph sceneGraph;
+	std::vector<glm::vec3> positions(numNodes);
+	std::vector<glm::quat> rotations(numNodes);
+	std::vector<glm::vec3> scales(numNodes);
+	std::vector<glm::vec3> pivots(numNodes);
+	srand(1);
+	for (int i = 0; i < numNodes; i++) {
+		// Shallow trees like the aircraft, a root every 20 nodes
+		int parent = i % 20 == 0 ? SceneGraph::NO_PARENT : i - 1 - rand() % (i % 20);
+		sceneGraph.addNode(parent);
+		positions[i] = glm::vec3(rand() % 100, rand() % 100, rand() % 100) * 0.1f;
+		rotations[i] = glm::normalize(glm::quat(rand() % 100 + 1, rand() % 100 - 50, rand() % 100 - 50, rand() % 100 - 50));
+		scales[i] = glm::vec3(1 + rand() % 3, 1, 0.5f);
+		pivots[i] = glm::vec3(rand() % 3, 0, 1);
+		sceneGraph.setLocal(i, positions[i], rotations[i], scales[i], pivots[i]);
+	}
+
+	std::vector<glm::mat4> reference(numNodes);
+	auto buildReference = [&]() {
+		for (int i = 0; i < numNodes; i++) {
+			glm::mat4 local = glm::translate(glm::mat4(), positions[i]) * glm::translate(glm::mat4(), pivots[i]) * glm::toMat4(rotations[i])
+				* glm::translate(glm::mat4(), -pivots[i]) * glm::scale(glm::mat4(), scales[i]);
+			int parent = sceneGraph.getParent(i);
+			reference[i] = parent == SceneGraph::NO_PARENT ? local : reference[parent] * local;
+		}
+	};
+	auto largestDifference = [&]() {
+		float maxError = 0;
+		for (int i = 0; i < numNodes; i++) {
+			for (int column = 0; column < 4; column++) {
+				glm::vec4 error = glm::abs(reference[i][column] - sceneGraph.getWorld(i)[column]) / (glm::abs(reference[i][column]) + 1.0f);
+				maxError = std::max(maxError, std::max(std::max(error.x, error.y), std::max(error.z, error.w)));
+			}
+		}
+		return maxError;
+	};
 
-int main() {
-	program();
+	Timer timer;
+	for (int run = 0; run < numRuns; run++) {
+		buildReference();
+	}
+	double referenceMilliseconds = timer.elapsedMilliseconds() / numRuns;
+
+	// Every node set again, so every run rebuilds all of them
+	double milliseconds = 0;
+	for (int run = 0; run < numRuns; run++) {
+		for (int i = 0; i < numNodes; i++) {
+			sceneGraph.setLocal(i, positions[i], rotations[i], scales[i], pivots[i]);
+		}
+		timer.reset();
+		sceneGraph.update();
+		milliseconds += timer.elapsedMilliseconds();
+	}
+	milliseconds /= numRuns;
+	float maxError = largestDifference();
+
+	double partialMilliseconds = 0;
+	int numUpdatedNodes = 0;
+	for (int run = 0; run < numRuns; run++) {
+		for (int i = run; i < numNodes; i += 100) {
+			positions[i].y += 1;
+			sceneGraph.setLocal(i, positions[i], rotations[i], scales[i], pivots[i]);
+		}
+		timer.reset();
+		sceneGraph.update();
+		partialMilliseconds += timer.elapsedMilliseconds();
+		numUpdatedNodes += sceneGraph.getNumUpdatedNodes();
+	}
+	partialMilliseconds /= numRuns;
+	buildReference();
+	float maxPartialError = largestDifference();
+
+	std::cout << numNodes << " nodes: " << referenceMilliseconds << " ms with glm, " << milliseconds << " ms with SceneGraph, "
+		<< "largest relative difference " << maxError << std::endl;
+	std::cout << "1% of the nodes moved: " << partialMilliseconds << " ms with SceneGraph, " << numUpdatedNodes / numRuns
+		<< " nodes rebuilt, largest relative difference " << maxPartialError << std::endl;
+}
+
+// Checks one airplane of an AirplaneFleet against steerAirplane and airplanePhysics on
+// entities, then times updateAirplaneFleet with 1, 1k and 100k airplanes over the terrain
+void benchmarkAirplaneFleet() {
+	int size = WORLD_SIZE;
+	int tileSizeXZ = WORLD_TILE_SIZE_XZ;
+	float *heightmapData = createWorldHeightmap(size, WORLD_SMOOTHNESS);
+	const float tickSeconds = 1.0f / DEFAULT_TICKS_PER_SECOND;
+
+	// Changing inputs for 10 seconds, from the runway
+	const glm::vec3 start = glm::vec3(20, 10, 20);
+	Entity main, aileronLeft, aileronRight, leftFlap, rightFlap;
+	main.position = start;
+	main.centerToGroundContactPoint = -0.2f;
+	AirplaneFleet single;
+	addAirplane(single, start, DEFAULT_FORWARD, DEFAULT_UP, -0.2f);
+	float maxDistance = 0;
+	for (int tick = 0; tick < 10 * DEFAULT_TICKS_PER_SECOND; tick++) {
+		int second = tick / DEFAULT_TICKS_PER_SECOND;
+		int thrust = second < 7 ? 1 : (second == 9 ? -1 : 0);
+		int roll = second == 6 ? 1 : (second == 8 ? -1 : 0);
+		int pitch = second == 5 ? -1 : (second == 7 ? 1 : 0);
+		steerAirplane(main, aileronLeft, aileronRight, leftFlap, rightFlap, thrust, roll, pitch, tickSeconds);
+		airplanePhysics(main, aileronLeft, leftFlap, tickSeconds);
+		terrainCollision(heightmapData, size, tileSizeXZ, main);
+		setAirplaneControls(single, 0, thrust, roll, pitch);
+		updateAirplaneFleet(single, heightmapData, size, tileSizeXZ, tickSeconds);
+		maxDistance = std::max(maxDistance, glm::length(getAirplanePosition(single, 0) - main.position));
+	}
+	std::cout << "Largest distance between fleet and entity airplane in 10 s: " << maxDistance << " m, after flying "
+		<< glm::length(main.position - start) << " m" << std::endl;
+
+	const int numAirplanesToTime[] = { 1, 1000, 100000 };
+	for (int run = 0; run < 3; run++) {
+		int numAirplanes = numAirplanesToTime[run];
+		AirplaneFleet fleet;
+		srand(1);
+		for (int i = 0; i < numAirplanes; i++) {
+			glm::vec3 position = glm::vec3(rand() % 3000 + 500, 400 + rand() % 200, rand() % 3000 + 500);
+			int airplane = addAirplane(fleet, position, DEFAULT_FORWARD, DEFAULT_UP, -0.2f);
+			setAirplaneControls(fleet, airplane, 1, rand() % 3 - 1, rand() % 3 - 1);
+		}
+		// About 2M steps each
+		int numTicks = std::max(20, 2000000 / numAirplanes);
+		Timer timer;
+		for (int tick = 0; tick < numTicks; tick++) {
+			updateAirplaneFleet(fleet, heightmapData, size, tileSizeXZ, tickSeconds);
+		}
+		double milliseconds = timer.elapsedMilliseconds();
+		std::cout << numAirplanes << " airplanes: " << milliseconds / numTicks << " ms per tick, "
+			<< (double)numAirplanes * numTicks / (milliseconds / 1000) << " airplane steps per second" << std::endl;
+	}
+
+	delete[] heightmapData;
+}
+
+static void deleteEntities(std::vector<Entity*> &entities) {
+	for (int i = 0; i < entities.size(); i++) {
+		delete entities[i];
+	}
+	entities.clear();
 }
 
-int program() {
-	const int windowHeight = 900;
-	const int windowWidth = 1700;
-	glm::mat4 perspective = glm::perspective<GLfloat>(0.8f, windowWidth / (float)windowHeight, .1f, 1500);
-	glm::mat4 perspectiveForSun = glm::perspective<GLfloat>(0.8f, windowWidth / (float)windowHeight, .1f, 51500);
+// Times reading the airplane from the OBJ against reading it from its mesh cache, both up to
+// the point where the mesh would be uploaded
+void benchmarkMeshCache() {
+	const std::string filename = "Resources/jas.obj";
+	const std::string cacheFilename = filename + ".cache";
+	const int numRuns = 10;
+
+	Timer timer;
+	MeshData mesh;
+	std::vector<Entity*> entities;
+	for (int run = 0; run < numRuns; run++) {
+		deleteEntities(entities);
+		mesh = MeshData();
+		entities = loadJAS39GripenMesh(filename, mesh);
+	}
+	double objMilliseconds = timer.elapsedMilliseconds() / numRuns;
+
+	timer.reset();
+	MeshCacheBuffers converted;
+	convertToMeshCache(entities, mesh, converted);
+	bool isWritten = writeMeshCache(cacheFilename, filename, converted.data);
+	double convertMilliseconds = timer.elapsedMilliseconds();
+	deleteEntities(entities);
+	printWeldStats(filename, converted.data.numIndices, converted.data.numVertices, MESH_VERTEX_SIZE, converted.data.indexType);
+	if (!isWritten) {
+		std::cerr << "Error! Could not write mesh cache " << cacheFilename << std::endl;
+		return;
+	}
+
+	timer.reset();
+	int numVertices = 0;
+	size_t cacheSize = 0;
+	for (int run = 0; run < numRuns; run++) {
+		MappedFile cacheFile;
+		MeshCacheData cache;
+		if (!openMeshCache(cacheFilename, filename, cacheFile, cache)) {
+			std::cerr << "Error! Could not read mesh cache " << cacheFilename << std::endl;
+			return;
+		}
+		entities = createMeshCacheEntities(cache);
+		deleteEntities(entities);
+		numVertices = cache.numVertices;
+		cacheSize = cacheFile.getSize();
+	}
+	double cacheMilliseconds = timer.elapsedMilliseconds() / numRuns;
+
+	std::cout << "OBJ: " << objMilliseconds << " ms, " << mesh.vertices.size() / 3 << " vertices" << std::endl;
+	std::cout << "Mesh cache: " << cacheMilliseconds << " ms, " << numVertices << " vertices, " << cacheSize / 1024 << " kB, converted in " << convertMilliseconds << " ms" << std::endl;
+}
+
+// The 2D textures program() loads, baked by --bake-textures. All use the default TextureSettings.
+const char *BAKED_TEXTURES[] = {
+	"Resources/grass512.png",
+	"Resources/asphalt512.png",
+	"Resources/sand512.png",
+	"Resources/terrain-splatmap.png",
+	"Resources/jas.png",
+	"Resources/normalmap.png",
+	"Resources/particle-atlas2.png",
+	"Resources/particle-atlas3.png"
+};
+const int NUM_BAKED_TEXTURES = sizeof(BAKED_TEXTURES) / sizeof(BAKED_TEXTURES[0]);
+
+// Cubemap faces in the order of TextureLoader::requestCubemap
+const std::string DAY_SKYBOX_FACES[6] = { "Resources/skybox-x-.png", "Resources/skybox-x+.png", "Resources/skybox-y+.png", "Resources/skybox-y-.png", "Resources/skybox-z-.png", "Resources/skybox-z+.png" };
+const std::string NIGHT_SKYBOX_FACES[6] = { "Resources/skybox-night-x-.png", "Resources/skybox-night-x+.png", "Resources/skybox-night-y+.png", "Resources/skybox-night-y-.png", "Resources/skybox-night-z-.png", "Resources/skybox-night-z+.png" };
+
+// Bakes the faces into one cubemap container, each face halved in size when isHalved
+static bool bakeSkybox(const std::string faces[6], bool isCompressed, bool isHalved) {
+	std::string containerFilename = getCubemapContainerFilename(faces);
+	Timer timer;
+	DecodedImage images[6];
+	for (int i = 0; i < 6; i++) {
+		if (!decodePNG(faces[i], false, images[i])) {
+			return false;
+		}
+		if (isHalved) {
+			DecodedImage halved;
+			downsampleImage(images[i], halved);
+			images[i] = halved;
+		}
+	}
+	// BC3 for all faces if any has transparency
+	TextureContainerFormat format = chooseContainerFormat(faces[0], images[0], isCompressed);
+	for (int i = 1; i < 6; i++) {
+		format = std::max(format, chooseContainerFormat(faces[i], images[i], isCompressed));
+	}
+	TextureContainerBuffers baked;
+	bakeTextureContainer(images, 6, false, false, format, baked);
+	if (!writeTextureContainer(containerFilename, std::vector<std::string>(faces, faces + 6), baked.data)) {
+		std::cerr << "Error! Could not write texture container " << containerFilename << std::endl;
+		return false;
+	}
+	std::cout << "Baked " << containerFilename << ": 6 faces of " << images[0].width << "x" << images[0].height << " " << getContainerFormatName(format) << ", "
+		<< baked.data.payloadSize / 1024 << " kB in " << timer.elapsedMilliseconds() << " ms" << std::endl;
+	return true;
+}
+
+// Bakes a container next to each of BAKED_TEXTURES, with mipmaps and compressed unless not
+// isCompressed, and one for each skybox, optionally at half resolution
+int bakeTextures(bool isCompressed, bool isSkyboxHalved) {
+	if (!bakeSkybox(DAY_SKYBOX_FACES, isCompressed, isSkyboxHalved) || !bakeSkybox(NIGHT_SKYBOX_FACES, isCompressed, isSkyboxHalved)) {
+		return 1;
+	}
+	TextureSettings settings;
+	for (int i = 0; i < NUM_BAKED_TEXTURES; i++) {
+		std::string filename = BAKED_TEXTURES[i];
+		std::string containerFilename = filename + TEXTURE_CONTAINER_EXTENSION;
+		Timer timer;
+		DecodedImage image;
+		if (!decodePNG(filename, settings.isFlipped, image)) {
+			return 1;
+		}
+		TextureContainerFormat format = chooseContainerFormat(filename, image, isCompressed);
+		TextureContainerBuffers baked;
+		bakeTextureContainer(&image, 1, settings.isFlipped, settings.hasMipmaps, format, baked);
+		if (!writeTextureContainer(containerFilename, std::vector<std::string>(1, filename), baked.data)) {
+			std::cerr << "Error! Could not write texture container " << containerFilename << std::endl;
+			return 1;
+		}
+		std::cout << "Baked " << containerFilename << ": " << image.width << "x" << image.height << " " << getContainerFormatName(format) << ", "
+			<< baked.data.numLevels << " levels, " << baked.data.payloadSize / 1024 << " kB in " << timer.elapsedMilliseconds() << " ms" << std::endl;
+	}
+	return 0;
+}
+
+// Times decoding each of BAKED_TEXTURES and the skyboxes against reading their baked containers,
+// up to the point where they would be uploaded, and compares the GPU memory they take
+void benchmarkTextures() {
+	const int numRuns = 5;
+	double totalPngMilliseconds = 0;
+	double totalContainerMilliseconds = 0;
+	size_t totalPngBytes = 0;
+	size_t totalContainerBytes = 0;
+	for (int i = 0; i < NUM_BAKED_TEXTURES; i++) {
+		std::string filename = BAKED_TEXTURES[i];
+		Timer timer;
+		DecodedImage image;
+		for (int run = 0; run < numRuns; run++) {
+			decodePNG(filename, true, image);
+		}
+		double pngMilliseconds = timer.elapsedMilliseconds() / numRuns;
+		// With the mip chain glGenerateMipmap adds, a third more
+		size_t pngBytes = image.pixels.size() * 4 / 3;
+
+		timer.reset();
+		TextureContainerData baked;
+		for (int run = 0; run < numRuns; run++) {
+			MappedFile container;
+			if (!openTextureContainer(filename + TEXTURE_CONTAINER_EXTENSION, std::vector<std::string>(1, filename), container, baked)) {
+				std::cerr << "Error! No up to date container for " << filename << ", run with --bake-textures first" << std::endl;
+				return;
+			}
+		}
+		double containerMilliseconds = timer.elapsedMilliseconds() / numRuns;
+
+		std::cout << filename << ": PNG " << pngMilliseconds << " ms, " << pngBytes / 1024 << " kB, container " << getContainerFormatName(baked.format)
+			<< " " << containerMilliseconds << " ms, " << baked.payloadSize / 1024 << " kB" << std::endl;
+		totalPngMilliseconds += pngMilliseconds;
+		totalContainerMilliseconds += containerMilliseconds;
+		totalPngBytes += pngBytes;
+		totalContainerBytes += baked.payloadSize;
+	}
+	const std::string *skyboxes[2] = { DAY_SKYBOX_FACES, NIGHT_SKYBOX_FACES };
+	for (int i = 0; i < 2; i++) {
+		const std::string *faces = skyboxes[i];
+		Timer timer;
+		DecodedImage images[6];
+		for (int run = 0; run < numRuns; run++) {
+			parallelFor(0, 6, 6, [&](int first, int last) {
+				for (int face = first; face < last; face++) {
+					decodePNG(faces[face], false, images[face]);
+				}
+			});
+		}
+		double pngMilliseconds = timer.elapsedMilliseconds() / numRuns;
+		size_t pngBytes = 0;
+		for (int face = 0; face < 6; face++) {
+			pngBytes += images[face].pixels.size();
+		}
+
+		timer.reset();
+		TextureContainerData baked;
+		// The levels point into the mapped file, which is closed after each run
+		unsigned int bakedSize = 0;
+		for (int run = 0; run < numRuns; run++) {
+			MappedFile container;
+			if (!openTextureContainer(getCubemapContainerFilename(faces), std::vector<std::string>(faces, faces + 6), container, baked)) {
+				std::cerr << "Error! No up to date container for the skybox " << faces[0] << ", run with --bake-textures first" << std::endl;
+				return;
+			}
+			bakedSize = baked.levels[0].width;
+		}
+		double containerMilliseconds = timer.elapsedMilliseconds() / numRuns;
+
+		std::cout << faces[0] << " cubemap: PNG " << pngMilliseconds << " ms, " << pngBytes / 1024 << " kB, container " << getContainerFormatName(baked.format)
+			<< " " << bakedSize << "x" << bakedSize << " " << containerMilliseconds << " ms, " << baked.payloadSize / 1024 << " kB" << std::endl;
+		totalPngMilliseconds += pngMilliseconds;
+		totalContainerMilliseconds += containerMilliseconds;
+		totalPngBytes += pngBytes;
+		totalContainerBytes += baked.payloadSize;
+	}
+	std::cout << "PNG: " << totalPngMilliseconds << " ms, " << totalPngBytes / (1024 * 1024) << " MB of GPU memory" << std::endl;
+	std::cout << "Containers: " << totalContainerMilliseconds << " ms, " << totalContainerBytes / (1024 * 1024) << " MB of GPU memory" << std::endl;
+}
+
+// Flies a camera in a widening spiral over the terrain against the page cache of its virtual
+// texture, without OpenGL. Pages that fault in one frame are baked on the workers and mapped
+// in the next, as program() does, and the page table is checked after every frame.
+void benchmarkVirtualTexture() {
+	Timer timer;
+	DecodedImage splatmap;
+	DecodedImage detailImages[3];
+	bool isDecoded = decodePNG(TERRAIN_SPLATMAP, true, splatmap);
+	for (int i = 0; i < 3; i++) {
+		isDecoded = decodePNG(TERRAIN_DETAIL_TEXTURES[i], true, detailImages[i]) && isDecoded;
+	}
+	if (!isDecoded) {
+		return;
+	}
+	const DecodedImage *details[3] = { &detailImages[0], &detailImages[1], &detailImages[2] };
+	TerrainPageSources sources;
+	buildTerrainPageSources(splatmap, details, WORLD_TEXTURE_SCALE, sources);
+	std::cout << "Decoded the page sources in " << timer.elapsedMilliseconds() << " ms" << std::endl;
+
+	VirtualTextureCache cache(TERRAIN_VIRTUAL_PAGES, TERRAIN_ATLAS_SLOTS);
+	const int numFrames = 2000;
+	std::vector<VirtualPage> faults;
+	std::vector<VirtualPage> baking;
+	std::vector<std::vector<unsigned char>> pixels(TERRAIN_MAX_BAKING_PAGES, std::vector<unsigned char>(TERRAIN_PAGE_SIZE * TERRAIN_PAGE_SIZE * 4));
+	double bakeMilliseconds = 0;
+	int numBaked = 0;
+	int numDropped = 0;
+	bool isConsistent = true;
+	// Once the pages around the start are baked, after a second at 60 frames/s
+	const int numWarmUpFrames = 60;
+	float maxMissRate = 0;
+	for (int frame = 0; frame < numFrames; frame++) {
+		// About 5 m per frame
+		float t = (float)frame / numFrames;
+		float angle = t * 4 * glm::pi<float>();
+		float u = 0.5f + 0.45f * t * cos(angle);
+		float v = 0.5f + 0.45f * t * sin(angle);
+
+		cache.beginFrame();
+		faults.clear();
+		cache.requestAround(u, v, TERRAIN_PAGE_RADIUS, faults);
+		if (frame >= numWarmUpFrames) {
+			maxMissRate = std::max(maxMissRate, cache.getFrameMissRate());
+		}
+		for (int i = 0; i < baking.size(); i++) {
+			numDropped += cache.map(baking[i]) < 0 ? 1 : 0;
+		}
+		cache.updatePageTable();
+		isConsistent = isConsistent && cache.isPageTableConsistent();
+
+		baking.clear();
+		for (int i = 0; i < faults.size() && baking.size() < TERRAIN_MAX_BAKING_PAGES; i++) {
+			cache.setPending(faults[i]);
+			baking.push_back(faults[i]);
+		}
+		timer.reset();
+		parallelFor(0, baking.size(), getNumWorkerThreads(), [&](int first, int last) {
+			for (int i = first; i < last; i++) {
+				bakeTerrainPage(sources, baking[i], &pixels[i][0]);
+			}
+		});
+		bakeMilliseconds += timer.elapsedMilliseconds();
+		numBaked += baking.size();
+	}
+
+	long long numRequests = cache.getNumRequests();
+	std::cout << numFrames << " frames: " << numRequests << " page requests, " << cache.getNumMisses() << " page faults ("
+		<< 100.0 * cache.getNumMisses() / numRequests << "% missed, at most " << maxMissRate * 100 << "% in a frame after the first " << numWarmUpFrames << "), "
+		<< cache.getNumEvictions() << " evictions, " << numDropped << " baked pages found no slot" << std::endl;
+	std::cout << numBaked << " pages baked in " << bakeMilliseconds << " ms on " << getNumWorkerThreads() << " threads, "
+		<< bakeMilliseconds / std::max(numBaked, 1) << " ms per page" << std::endl;
+	if (!isConsistent) {
+		std::cerr << "Error! The page table pointed a page at the wrong slot" << std::endl;
+	} else {
+		std::cout << "The page table was consistent after every frame" << std::endl;
+	}
+}
+
+// Everything program() draws a frame from, so it can be drawn while the simulation thread
+// moves the entities for the next one. Written by the simulation, only read by rendering.
+struct FrameSnapshot {
+	glm::mat4 worldToView;
+	glm::mat4 skyboxTransformation;
+	float skyboxInterpolation;
+	glm::mat4 groundTransformation;
+	std::vector<IndexRange> terrainRanges;
+	// Model to world matrices of the entities drawn with the model shader, in drawing order
+	std::vector<glm::mat4> transformations;
+	PreparedLights lights;
+	// One per particle system, in the order they are drawn
+	std::vector<ParticleSystemSnapshot> particleSystems;
+
+	// For the window title
+	int ticks;
+	int visibleTerrainChunks;
+	int visibleTerrainTriangles;
+	bool useTerrainLod;
+	int numVisibleLights;
+	TransformStats transformStats;
+	double simulationMilliseconds;
+};
+
+int program(const ProgramOptions &options);
+int headlessProgram(const ProgramOptions &options);
+
+int main(int argc, char *argv[]) {
+	ProgramOptions options;
+	options.ticksPerSecond = DEFAULT_TICKS_PER_SECOND;
+	options.headlessSeconds = 0;
+	options.isSerial = false;
+	options.usePixelBuffers = false;
+	options.useTextureContainers = true;
+	options.useLegacyUniforms = false;
+	options.isTerrainLodBenchmark = false;
+	for (int i = 1; i < argc; i++) {
+		if (std::string(argv[i]) == "--tick-rate" && i + 1 < argc) {
+			options.ticksPerSecond = std::max(1, std::atoi(argv[++i]));
+			continue;
+		}
+		if (std::string(argv[i]) == "--script" && i + 1 < argc) {
+			options.scriptFile = argv[++i];
+			continue;
+		}
+		if (std::string(argv[i]) == "--trace" && i + 1 < argc) {
+			options.traceFile = argv[++i];
+			continue;
+		}
+		if (std::string(argv[i]) == "--job-trace" && i + 1 < argc) {
+			options.jobTraceFile = argv[++i];
+			continue;
+		}
+		if (std::string(argv[i]) == "--serial") {
+			options.isSerial = true;
+			continue;
+		}
+		if (std::string(argv[i]) == "--texture-pbo") {
+			options.usePixelBuffers = true;
+			continue;
+		}
+		if (std::string(argv[i]) == "--png-textures") {
+			options.useTextureContainers = false;
+			continue;
+		}
+		if (std::string(argv[i]) == "--legacy-uniforms") {
+			options.useLegacyUniforms = true;
+			continue;
+		}
+		if (std::string(argv[i]) == "--bake-textures") {
+			bool isCompressed = true;
+			bool isSkyboxHalved = false;
+			for (i++; i < argc; i++) {
+				isCompressed = isCompressed && std::string(argv[i]) != "--uncompressed";
+				isSkyboxHalved = isSkyboxHalved || std::string(argv[i]) == "--half-resolution-skybox";
+			}
+			return bakeTextures(isCompressed, isSkyboxHalved);
+		}
+		if (std::string(argv[i]) == "--headless") {
+			options.headlessSeconds = 60;
+			if (i + 1 < argc && std::atof(argv[i + 1]) > 0) {
+				options.headlessSeconds = std::atof(argv[++i]);
+			}
+			continue;
+		}
+		if (std::string(argv[i]) == "--benchmark-terrain-lod") {
+			options.isTerrainLodBenchmark = true;
+			continue;
+		}
+		if (std::string(argv[i]) == "--benchmark-diamond-square") {
+			benchmarkDiamondSquare();
+			return 0;
+		}
+		if (std::string(argv[i]) == "--benchmark-heightmap-vertices") {
+			benchmarkHeightmapVertices();
+			return 0;
+		}
+		if (std::string(argv[i]) == "--benchmark-terrain-culling") {
+			benchmarkTerrainCulling();
+			return 0;
+		}
+		if (std::string(argv[i]) == "--benchmark-light-clusters") {
+			benchmarkLightClusters();
+			return 0;
+		}
+		if (std::string(argv[i]) == "--benchmark-particles") {
+			benchmarkParticles();
+			return 0;
+		}
+		if (std::string(argv[i]) == "--benchmark-particle-sort") {
+			benchmarkParticleSort();
+			return 0;
+		}
+		if (std::string(argv[i]) == "--benchmark-scene-graph") {
+			benchmarkSceneGraph();
+			return 0;
+		}
+		if (std::string(argv[i]) == "--benchmark-airplane-fleet") {
+			benchmarkAirplaneFleet();
+			return 0;
+		}
+		if (std::string(argv[i]) == "--benchmark-mesh-cache") {
+			benchmarkMeshCache();
+			return 0;
+		}
+		if (std::string(argv[i]) == "--benchmark-textures") {
+			benchmarkTextures();
+			return 0;
+		}
+		if (std::string(argv[i]) == "--benchmark-virtual-texture") {
+			benchmarkVirtualTexture();
+			return 0;
+		}
+	}
+	if (options.isTerrainLodBenchmark) {
+		if (options.scriptFile.empty()) {
+			options.scriptFile = TERRAIN_LOD_BENCHMARK_SCRIPT;
+		}
+		if (options.headlessSeconds == 0) {
+			options.headlessSeconds = 60;
+		}
+	}
+	if (options.headlessSeconds > 0) {
+		return headlessProgram(options);
+	}
+	return program(options);
+}
+
+// Terrain drawn during a --benchmark-terrain-lod run
+struct TerrainLodStats {
+	int numFrames;
+	long long numTriangles;
+	long long numLodTriangles;
+	int maxLodTriangles;
+	double selectMilliseconds;
+	int numCheckedChunks;
+	int numWrongLevels;
+};
+
+// Whether lodScreenSpaceError gives the height in pixels that the game's projection makes of
+// an error, for errors seen straight ahead from a few distances
+static bool checkScreenSpaceError() {
+	glm::mat4 perspective = glm::perspective<GLfloat>(FIELD_OF_VIEW, WINDOW_WIDTH / (float)WINDOW_HEIGHT, .1f, FAR_PLANE);
+	float projectionScale = lodProjectionScale(FIELD_OF_VIEW, WINDOW_HEIGHT);
+	const float distances[] = { 1, 10, 100, 1000 };
+	const float errors[] = { 0.01f, 0.5f, 4 };
+	for (int i = 0; i < 4; i++) {
+		for (int j = 0; j < 3; j++) {
+			glm::vec4 bottom = perspective * glm::vec4(0, 0, -distances[i], 1);
+			glm::vec4 top = perspective * glm::vec4(0, errors[j], -distances[i], 1);
+			float pixels = (top.y / top.w - bottom.y / bottom.w) * WINDOW_HEIGHT / 2;
+			float expected = lodScreenSpaceError(errors[j], distances[i], projectionScale);
+			if (std::abs(pixels - expected) > 0.001f * expected) {
+				std::cerr << "Error! An error of " << errors[j] << " at " << distances[i] << " projects to " << pixels << " pixels, lodScreenSpaceError gives " << expected << std::endl;
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+// Culls the terrain and selects its level of detail the way program() does, for a camera at
+// cameraPosition looking at target. When isChecked, the level of every visible chunk is checked
+// against geometric errors recomputed from the heightmap: it must be the coarsest level whose
+// error is within TERRAIN_LOD_MAX_PIXEL_ERROR pixels.
+static void measureTerrainLod(const TerrainQuadtree &quadtree, const TerrainLod &lod, float *heightmap, int size, float tileSizeY, glm::vec3 cameraPosition, glm::vec3 target, glm::vec3 up, bool isChecked, TerrainLodStats &stats) {
+	glm::mat4 perspective = glm::perspective<GLfloat>(FIELD_OF_VIEW, WINDOW_WIDTH / (float)WINDOW_HEIGHT, .1f, FAR_PLANE);
+	float projectionScale = lodProjectionScale(FIELD_OF_VIEW, WINDOW_HEIGHT);
+	std::vector<const TerrainQuadtree::Node*> visibleNodes;
+	quadtree.cull(Frustum(perspective * glm::lookAt(cameraPosition, target, up)), visibleNodes);
+	int numTriangles = 0;
+	for (int i = 0; i < visibleNodes.size(); i++) {
+		numTriangles += visibleNodes[i]->numIndices / 3;
+	}
+
+	Timer timer;
+	std::vector<IndexRange> ranges;
+	lod.select(visibleNodes, cameraPosition, projectionScale, TERRAIN_LOD_MAX_PIXEL_ERROR, ranges);
+	stats.selectMilliseconds += timer.elapsedMilliseconds();
+	int numLodTriangles = 0;
+	for (int i = 0; i < ranges.size(); i++) {
+		numLodTriangles += ranges[i].numIndices / 3;
+	}
+	stats.numFrames++;
+	stats.numTriangles += numTriangles;
+	stats.numLodTriangles += numLodTriangles;
+	stats.maxLodTriangles = std::max(stats.maxLodTriangles, numLodTriangles);
+	if (!isChecked) {
+		return;
+	}
+
+	for (int n = 0; n < visibleNodes.size(); n++) {
+		for (int i = visibleNodes[n]->firstChunk; i < visibleNodes[n]->firstChunk + visibleNodes[n]->numChunks; i++) {
+			const TerrainQuadtree::Chunk &chunk = quadtree.getChunk(i);
+			float distance = distanceToAABB(cameraPosition, chunk.bounds);
+			int level = lod.selectLevel(i, cameraPosition, projectionScale, TERRAIN_LOD_MAX_PIXEL_ERROR);
+			// A level's error is never taken smaller than the ones of the finer levels
+			float error = 0;
+			bool isRight = true;
+			for (int l = 1; l < lod.getNumLevels(i) && l <= level + 1; l++) {
+				error = std::max(error, lodGeometricError(heightmap, size, chunk.x, chunk.z, chunk.width, chunk.depth, 1 << l) * tileSizeY);
+				float pixels = lodScreenSpaceError(error, distance, projectionScale);
+				isRight = isRight && (l <= level ? pixels <= TERRAIN_LOD_MAX_PIXEL_ERROR : pixels > TERRAIN_LOD_MAX_PIXEL_ERROR);
+			}
+			stats.numCheckedChunks++;
+			stats.numWrongLevels += isRight ? 0 : 1;
+		}
+	}
+}
+
+// Flies the airplane over the terrain without a window or OpenGL, as fast as possible
+int headlessProgram(const ProgramOptions &options) {
+	int size = WORLD_SIZE;
+	int tileSizeXZ = WORLD_TILE_SIZE_XZ;
+	MappedFile terrainCacheFile;
+	TerrainCacheData terrainCache;
+	bool isTerrainCached = false;
+	float *heightmapData = loadWorldHeightmap(terrainCacheFile, terrainCache, isTerrainCached);
+	terrainCacheFile.close();
+
+	MeshData airplaneMesh;
+	std::vector<Entity*> airplane = loadJAS39GripenMesh("Resources/jas.obj", airplaneMesh);
+	placeAirplane(airplane);
+
+	std::vector<ScriptedInput> script;
+	AirplaneControls controls = { 1, 0, 0 };
+	if (!options.scriptFile.empty()) {
+		script = loadInputScript(options.scriptFile);
+		controls = { 0, 0, 0 };
+	}
+
+	// The terrain as program() builds it, with the ground at the origin
+	TerrainQuadtree quadtree;
+	TerrainLod lod;
+	TerrainLodStats lodStats = {};
+	glm::vec3 lodCameraPosition = cameraPosition;
+	bool isScreenSpaceErrorRight = true;
+	if (options.isTerrainLodBenchmark) {
+		quadtree.build(heightmapData, size, size, tileSizeXZ, WORLD_TILE_SIZE_Y, tileSizeXZ, TERRAIN_CHUNK_SIZE);
+		lod.build(heightmapData, size, size, WORLD_TILE_SIZE_Y, quadtree);
+		isScreenSpaceErrorRight = checkScreenSpaceError();
+	}
+	const int ticksPerFrame = std::max(1, options.ticksPerSecond / TERRAIN_LOD_BENCHMARK_FPS);
+
+	std::ofstream trace;
+	if (!options.traceFile.empty()) {
+		trace.open(options.traceFile);
+		trace.precision(9);
+		trace << "tick,time,thrust,roll,pitch,positionX,positionY,positionZ,velocityX,velocityY,velocityZ,forwardX,forwardY,forwardZ,upX,upY,upZ" << std::endl;
+	}
+
+	const float tickSeconds = 1.0f / options.ticksPerSecond;
+	const int numTicks = (int)std::ceil(options.headlessSeconds * options.ticksPerSecond);
+	int scriptPosition = 0;
+	// Time spent stepping, not writing the trace
+	double simulationMilliseconds = 0;
+	for (int tick = 0; tick < numTicks; tick++) {
+		float time = tick * tickSeconds;
+		while (scriptPosition < script.size() && script[scriptPosition].time <= time) {
+			controls = script[scriptPosition].controls;
+			scriptPosition++;
+		}
+
+		Timer tickTimer;
+		steerAirplane(*airplane[0], *airplane[18], *airplane[1], *airplane[2], *airplane[14], controls.thrust, controls.roll, controls.pitch, tickSeconds);
+		airplanePhysics(*airplane[0], *airplane[18], *airplane[2], tickSeconds);
+		terrainCollision(heightmapData, size, tileSizeXZ, *airplane[0]);
+		simulationMilliseconds += tickTimer.elapsedMilliseconds();
+
+		// The game's chase camera, every frame of a run drawn at TERRAIN_LOD_BENCHMARK_FPS
+		if (options.isTerrainLodBenchmark && (tick + 1) % ticksPerFrame == 0) {
+			const Entity &body = *airplane[0];
+			glm::vec3 targetPosition = body.position - body.forward * 2.5f + body.up * 1.0f;
+			interpolateCamera(targetPosition, lodCameraPosition, ticksPerFrame * tickSeconds);
+			float terrainHeightAtCamera = getHeightAt(heightmapData, size, tileSizeXZ, lodCameraPosition.x, lodCameraPosition.z);
+			if (lodCameraPosition.y <= terrainHeightAtCamera + 0.05f) {
+				lodCameraPosition.y = terrainHeightAtCamera + 0.05f;
+			}
+			bool isChecked = lodStats.numFrames % TERRAIN_LOD_BENCHMARK_FPS == 0;
+			measureTerrainLod(quadtree, lod, heightmapData, size, WORLD_TILE_SIZE_Y, lodCameraPosition, body.position, body.up, isChecked, lodStats);
+		}
+
+		if (trace.is_open()) {
+			const Entity &body = *airplane[0];
+			trace << tick + 1 << "," << time + tickSeconds << "," << controls.thrust << "," << controls.roll << "," << controls.pitch
+				<< "," << body.position.x << "," << body.position.y << "," << body.position.z
+				<< "," << body.velocity.x << "," << body.velocity.y << "," << body.velocity.z
+				<< "," << body.forward.x << "," << body.forward.y << "," << body.forward.z
+				<< "," << body.up.x << "," << body.up.y << "," << body.up.z << "\n";
+		}
+	}
+
+	std::cout << numTicks << " ticks of " << tickSeconds * 1000 << " ms in " << simulationMilliseconds << " ms: "
+		<< numTicks / (simulationMilliseconds / 1000) << " ticks per second, "
+		<< options.headlessSeconds / (simulationMilliseconds / 1000) << "x real time" << std::endl;
+	std::cout << "Final position " << airplane[0]->position.x << ", " << airplane[0]->position.y << ", " << airplane[0]->position.z << std::endl;
+	if (options.isTerrainLodBenchmark && lodStats.numFrames > 0) {
+		std::cout << "Terrain LOD over " << lodStats.numFrames << " frames of " << options.scriptFile << ": " << lodStats.numTriangles / lodStats.numFrames
+			<< " triangles per frame without LOD, " << lodStats.numLodTriangles / lodStats.numFrames << " with (" << lodStats.maxLodTriangles << " at the most, "
+			<< 100.0 * lodStats.numLodTriangles / std::max(lodStats.numTriangles, 1LL) << "%), select " << lodStats.selectMilliseconds / lodStats.numFrames << " ms per frame" << std::endl;
+		std::cout << "Checked the level of " << lodStats.numCheckedChunks << " visible chunks, " << lodStats.numWrongLevels << " wrong" << std::endl;
+		if (lodStats.numWrongLevels > 0) {
+			std::cerr << "Error! " << lodStats.numWrongLevels << " chunks were not drawn at the coarsest level within " << TERRAIN_LOD_MAX_PIXEL_ERROR << " pixels" << std::endl;
+		}
+		if (isScreenSpaceErrorRight) {
+			std::cout << "Screen-space errors match the projection" << std::endl;
+		}
+	}
+
+	delete[] heightmapData;
+	for (std::vector<Entity*>::iterator iter = airplane.begin(); iter != airplane.end(); iter++) {
+		delete *iter;
+	}
+	return 0;
+}
+
+int program(const ProgramOptions &options) {
+	const int windowHeight = WINDOW_HEIGHT;
+	const int windowWidth = WINDOW_WIDTH;
+	const float fieldOfView = FIELD_OF_VIEW;
+	glm::mat4 perspective = glm::perspective<GLfloat>(fieldOfView, windowWidth / (float)windowHeight, .1f, FAR_PLANE);
+	glm::mat4 perspectiveForSun = glm::perspective<GLfloat>(fieldOfView, windowWidth / (float)windowHeight, .1f, 51500);
 
 	glfwSetErrorCallback(error_callback);
 	if (!glfwInit()) {
@@ -343,76 +1628,120 @@ int program() {
 	glDebugMessageControl(GL_DEBUG_SOURCE_API, GL_DEBUG_TYPE_OTHER, GL_DONT_CARE, 1, ids, GL_FALSE);
 	glDebugMessageCallback(glDebugMessageCallbackFunction, 0);
 
-	GLuint modelShader = getShader("Source/modelVS.glsl", "Source/modelFS.glsl");
-	GLuint skyboxShader = getShader("Source/skyboxVS.glsl", "Source/skyboxFS.glsl");
-	GLuint terrainShader = getShader("Source/terrainVS.glsl", "Source/terrainFS.glsl");
-	GLuint instancedShader = getShader("Source/instancedVS.glsl", "Source/instancedFS.glsl");
-	int uniformLocationInstanceShaderTransformation[NUM_PARTICLES_PER_DRAW_CALL];
-	int uniformLocationInstanceShaderProgress[NUM_PARTICLES_PER_DRAW_CALL];
-	for (int i = 0; i < NUM_PARTICLES_PER_DRAW_CALL; i++) {
-		std::string uniformName = std::string("modelToWorld[") + std::to_string(i) + std::string("]");
-		std::string uniformNameColor = std::string("progress[") + std::to_string(i) + std::string("]");
-		uniformLocationInstanceShaderTransformation[i] = glGetUniformLocation(instancedShader, uniformName.c_str());
-		uniformLocationInstanceShaderProgress[i] = glGetUniformLocation(instancedShader, uniformNameColor.c_str());
-	}
-
-	int size = 2049;
-	int tileSizeXZ = 2;
-	int textureScale = 500; // Must also change terrain fragment shader
-	int tileSizeY = 1;
-	float smothness = 0.3f;
+	initUniformBuffers();
+	setLegacyUniforms(options.useLegacyUniforms);
+	Shader modelShader = getShader("Source/modelVS.glsl", "Source/modelFS.glsl");
+	Shader skyboxShader = getShader("Source/skyboxVS.glsl", "Source/skyboxFS.glsl");
+	Shader terrainShader = getShader("Source/terrainVS.glsl", "Source/terrainFS.glsl");
+	Shader instancedShader = getShader("Source/instancedVS.glsl", "Source/instancedFS.glsl");
+
+	int size = WORLD_SIZE;
+	int tileSizeXZ = WORLD_TILE_SIZE_XZ;
+	int textureScale = WORLD_TEXTURE_SCALE;
+	int tileSizeY = WORLD_TILE_SIZE_Y;
 	if (FAST_MODE) {
 		//size = 129;
 		//tileSizeXZ = 10;
-		//smothness = 1;
 	}
 
-	time_t seed = 1519128009; // Splat map is built after this seed, so don't change it
-	float *heightmapData = new float[size * size];
-	diamondSquare(heightmapData, size, smothness, seed);
-	makeRunwayOnHeightmap(heightmapData, size);
-
-	Model terrain = heightmapToModel(heightmapData, size, size, tileSizeXZ, tileSizeY, tileSizeXZ,  textureScale);
+	// Textures decode on the workers while the terrain is loaded or generated below, and are
+	// uploaded as they are needed after it. Repeated loads of the same image share one texture.
+	Timer textureTimer;
+	TextureLoader textureLoader(options.usePixelBuffers, options.useTextureContainers);
+	TextureManager textures(textureLoader);
+	// The terrain's virtual texture pages are baked on the CPU from the same decoded images
+	TextureSettings terrainSourceSettings;
+	terrainSourceSettings.isImageKept = true;
+	TextureHandle grassTexture = textures.acquire(TERRAIN_DETAIL_TEXTURES[0], terrainSourceSettings);
+	TextureHandle asphaltTexture = textures.acquire(TERRAIN_DETAIL_TEXTURES[1], terrainSourceSettings);
+	TextureHandle sandTexture = textures.acquire(TERRAIN_DETAIL_TEXTURES[2], terrainSourceSettings);
+	TextureHandle splatmapTexture = textures.acquire(TERRAIN_SPLATMAP, terrainSourceSettings);
+	TextureHandle jasTexture = textures.acquire("Resources/jas.png");
+	TextureHandle jasNormalMap = textures.acquire("Resources/normalmap.png");
+	std::string daySkyboxFaces[6];
+	std::string nightSkyboxFaces[6];
+	std::copy(DAY_SKYBOX_FACES, DAY_SKYBOX_FACES + 6, daySkyboxFaces);
+	std::copy(NIGHT_SKYBOX_FACES, NIGHT_SKYBOX_FACES + 6, nightSkyboxFaces);
+	if (FAST_MODE) {
+		for (int i = 0; i < 6; i++) {
+			daySkyboxFaces[i] = daySkyboxFaces[0];
+			nightSkyboxFaces[i] = daySkyboxFaces[0];
+		}
+	}
+	TextureHandle daySkybox = textures.acquireCubemap(daySkyboxFaces);
+	TextureHandle nightSkybox = textures.acquireCubemap(nightSkyboxFaces);
+	TextureHandle cubeTexture = textures.acquire("Resources/grass512.png", terrainSourceSettings);
+	TextureHandle cubeNormalMap = textures.acquire("Resources/normalmap.png");
+	TextureHandle smokeTexture = textures.acquire("Resources/particle-atlas2.png");
+	TextureHandle wingtipTexture = textures.acquire("Resources/particle-atlas3.png");
+	TextureHandle wingtip2Texture = textures.acquire("Resources/particle-atlas3.png");
+	// Waits for the decodes of the terrain textures, not their uploads
+	TerrainPageSources terrainPageSources;
+	JobCounter terrainPageSourcesLoaded;
+	runJob("Terrain page sources", [&]() {
+		const DecodedImage *details[3] = { &grassTexture.getImage(), &asphaltTexture.getImage(), &sandTexture.getImage() };
+		buildTerrainPageSources(splatmapTexture.getImage(), details, WORLD_TEXTURE_SCALE, terrainPageSources);
+	}, &terrainPageSourcesLoaded);
+
+	// The mesh is uploaded straight from the mapped cache when it is up to date, otherwise
+	// it is built and cached for the next launch
+	Timer terrainTimer;
+	MappedFile terrainCacheFile;
+	TerrainCacheData terrainCache;
+	bool isTerrainCached = false;
+	float *heightmapData = loadWorldHeightmap(terrainCacheFile, terrainCache, isTerrainCached);
 
 	Terrain ground = Terrain();
+	ground.getQuadtree().build(heightmapData, size, size, tileSizeXZ, tileSizeY, tileSizeXZ, TERRAIN_CHUNK_SIZE);
+	ground.getLod().build(heightmapData, size, size, tileSizeY, ground.getQuadtree());
+	Model terrain;
+	if (isTerrainCached) {
+		terrain = modelFromInterleavedVertexData(terrainCache.vertices, terrainCache.numVertices, terrainCache.indices, terrainCache.numIndices);
+		terrainCacheFile.close();
+	} else {
+		std::vector<float> terrainVertices;
+		std::vector<GLuint> terrainIndices;
+		buildHeightmapMesh(heightmapData, size, size, tileSizeXZ, tileSizeY, tileSizeXZ, textureScale, ground.getQuadtree(), ground.getLod(), terrainVertices, terrainIndices);
+		int numTerrainVertices = terrainVertices.size() / HEIGHTMAP_VERTEX_SIZE;
+		terrain = modelFromInterleavedVertexData(&terrainVertices[0], numTerrainVertices, &terrainIndices[0], terrainIndices.size());
+		if (!writeTerrainCache(TERRAIN_CACHE_FILE, getWorldCacheKey(), heightmapData, &terrainVertices[0], numTerrainVertices, &terrainIndices[0], terrainIndices.size())) {
+			std::cerr << "Error! Could not write terrain cache " << TERRAIN_CACHE_FILE << std::endl;
+		}
+	}
+	std::cout << "Terrain ready in " << terrainTimer.elapsedMilliseconds() << " ms, " << (isTerrainCached ? "warm start from " : "cold start, generated and cached to ") << TERRAIN_CACHE_FILE << std::endl;
+
 	ground.setModel(terrain);
 	ground.position = glm::vec3(0, 0, 0);
 	ground.scale = glm::vec3(1, 1, 1);
-	ground.textureId = loadPNGTexture("Resources/grass512.png");
-	ground.setTextureId2(loadPNGTexture("Resources/asphalt512.png"));
-	ground.setTextureId3(loadPNGTexture("Resources/sand512.png"));
-	ground.setTextureId4(loadPNGTexture("Resources/terrain-splatmap.png"));
-
-	GLuint jasTexture = loadPNGTexture("Resources/jas.png");
-	GLuint jasNormalMap = loadPNGTexture("Resources/normalmap.png");
-	std::vector<Entity*> airplane = loadJAS39Gripen("Resources/jas.obj");
-	airplane[0]->position = glm::vec3(20, 10, 20);
-	airplane[0]->scale = glm::vec3(0.2f, 0.2f, 0.2f);
-	airplane[0]->centerToGroundContactPoint = -0.2f;
+	ground.textureId = grassTexture.getId();
+	ground.setTextureId2(asphaltTexture.getId());
+	ground.setTextureId3(sandTexture.getId());
+	ground.setTextureId4(splatmapTexture.getId());
+	waitForCounter(terrainPageSourcesLoaded);
+	TerrainVirtualTexture terrainTexture(terrainPageSources);
+	ground.setVirtualTexture(terrainTexture.getPageTableTexture(), terrainTexture.getAtlasTexture());
+	const float terrainExtent = (size - 1) * tileSizeXZ;
+
+	std::vector<Entity*> airplane = loadJAS39Gripen("Resources/jas.obj", jasTexture.getId());
+	placeAirplane(airplane);
 	for (std::vector<Entity*>::iterator iter = airplane.begin(); iter != airplane.end(); iter++) {
-		(*iter)->textureId = jasTexture;
-		(*iter)->normalMapId = jasNormalMap;
+		(*iter)->textureId = jasTexture.getId();
+		(*iter)->normalMapId = jasNormalMap.getId();
 	}
 
 	Entity skybox = Entity();
 	skybox.setModel(getVAOCube());
 	skybox.scale = glm::vec3(20, 20, 20);
 	skybox.position = glm::vec3(0, -10, 0);
-	GLuint secondSkybox;
-	if (FAST_MODE) {
-		skybox.textureId = createSkybox("Resources/skybox-x-.png", "Resources/skybox-x+.png", "Resources/skybox-y+.png", "Resources/skybox-y-.png", "Resources/skybox-z-.png", "Resources/skybox-z+.png");
-		secondSkybox = skybox.textureId;
-	} else {
-		skybox.textureId = createSkybox("Resources/skybox-x-.png", "Resources/skybox-x+.png", "Resources/skybox-y+.png", "Resources/skybox-y-.png", "Resources/skybox-z-.png", "Resources/skybox-z+.png");
-		secondSkybox = createSkybox("Resources/skybox-night-x-.png", "Resources/skybox-night-x+.png", "Resources/skybox-night-y+.png", "Resources/skybox-night-y-.png", "Resources/skybox-night-z-.png", "Resources/skybox-night-z+.png");
-	}
+	skybox.textureId = daySkybox.getId();
+	GLuint secondSkybox = nightSkybox.getId();
 
 	Entity cube = Entity();
 	cube.setModel(getVAOCube());
 	cube.scale = glm::vec3(0.1, 0.1, 0.1);
 	cube.position = glm::vec3(0, 0, 0);
-	cube.textureId = loadPNGTexture("Resources/grass512.png");
-	cube.normalMapId = loadPNGTexture("Resources/normalmap.png");
+	cube.textureId = cubeTexture.getId();
+	cube.normalMapId = cubeNormalMap.getId();
 
 	Entity player = Entity();
 	player.setModel(getVAOCube());
@@ -446,6 +1775,14 @@ int program() {
 	worldGreenMovingLight.centerToGroundContactPoint = -10;
 	lights.push_back(&worldGreenMovingLight);
 
+	// Everything with a transformation, updated once per frame
+	std::vector<Entity*> sceneEntities = airplane;
+	sceneEntities.push_back(&ground);
+	sceneEntities.push_back(&skybox);
+	sceneEntities.push_back(&cube);
+	sceneEntities.push_back(&player);
+	sceneEntities.insert(sceneEntities.end(), lights.begin(), lights.end());
+
 	// Particles
 	Model particleModel = getVAOQuad();
 	ParticleSystem smoke = ParticleSystem(300 * 2);
@@ -457,7 +1794,7 @@ int program() {
 	smoke.minSize = 0.2f;
 	smoke.maxSize = 0.4f;
 	smoke.sphereRadiusSpawn = 1.0f;
-	smoke.textureId = loadPNGTexture("Resources/particle-atlas2.png");
+	smoke.textureId = smokeTexture.getId();
 	smoke.atlasSize = 8;
 	smoke.velocity = 3.25f;
 	smoke.position = glm::vec3(0, 0.25f, -5.9f);
@@ -475,7 +1812,7 @@ int program() {
 	wingtip.minSize = .03f;
 	wingtip.maxSize = .1f;
 	wingtip.sphereRadiusSpawn = 0.2f;
-	wingtip.textureId = loadPNGTexture("Resources/particle-atlas3.png");
+	wingtip.textureId = wingtipTexture.getId();
 	wingtip.atlasSize = 8;
 	wingtip.velocity = 0.0000001f;
 	wingtip.position = glm::vec3(4.0f, 0.0f, -4.2f);
@@ -492,7 +1829,7 @@ int program() {
 	wingtip2.minSize = .03f;
 	wingtip2.maxSize = .1f;
 	wingtip2.sphereRadiusSpawn = 0.2f;
-	wingtip2.textureId = loadPNGTexture("Resources/particle-atlas3.png");
+	wingtip2.textureId = wingtip2Texture.getId();
 	wingtip2.atlasSize = 8;
 	wingtip2.velocity = 0.0000001f;
 	wingtip2.position = glm::vec3(-4.0f, 0.0f, -4.2f);
@@ -500,6 +1837,15 @@ int program() {
 	wingtip2.parentEntity = airplane[0];
 	wingtip2.followParent = false;
 
+	std::vector<ParticleSystem*> particleSystems;
+	particleSystems.push_back(&smoke);
+	particleSystems.push_back(&wingtip);
+	particleSystems.push_back(&wingtip2);
+
+	textureLoader.printStats();
+	textures.printStats();
+	std::cout << "Textures ready " << textureTimer.elapsedMilliseconds() << " ms after their decodes were queued" << std::endl;
+
 
 	glClearColor(1, 0.43, 0.66, 0.0f);
 	glEnable(GL_DEPTH_TEST);
@@ -508,71 +1854,67 @@ int program() {
 	//glFrontFace(GL_CW);
 	//glCullFace(GL_BACK);
 
-	bool boom = false;
-	float lastTime = glfwGetTime();
-	float currentTime;
-	while (!glfwWindowShouldClose(window)) {
-		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-		glEnable(GL_BLEND);
-		glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+	std::vector<const TerrainQuadtree::Node*> visibleTerrainNodes;
+	const float terrainLodProjectionScale = lodProjectionScale(fieldOfView, windowHeight);
 
-		float currentTime = glfwGetTime();
-		float dt = currentTime - lastTime;
-		lastTime = currentTime;
-		std::string title = std::string("Frame time: ") + std::to_string(dt) + std::string(" micro seconds");
-		glfwSetWindowTitle(window, title.c_str());
+	// Drawn with the model shader, in this order
+	std::vector<Entity*> modelEntities;
+	for (int i = 0; i < airplane.size(); i++) {
+		if (i == 8 || i == 0) {
+			continue;
+		}
+		modelEntities.push_back(airplane[i]);
+	}
+	modelEntities.push_back(&player);
+	modelEntities.push_back(airplane[0]);
+	modelEntities.push_back(airplane[8]);
+	modelEntities.push_back(&cube);
 
+	bool boom = false;
+	float skyboxInterpolation = 0;
+	double simulationTime = 0;
+	const float tickSeconds = 1.0f / options.ticksPerSecond;
+
+	// Advances everything that moves by one fixed step of tickSeconds
+	auto simulationTick = [&]() {
 		if (steerMode == 0) { // Camera
-			basicSteering(cameraPosition, cameraForward, cameraUp);
+			basicSteering(cameraPosition, cameraForward, cameraUp, tickSeconds);
 			entityToFollow = nullptr;
 		} else if (steerMode == 1) { // Airplane
 			if (!boom) {
-				steerAirplane(*airplane[0], *airplane[18], *airplane[1], *airplane[2], *airplane[14], isForward ? 1 : (isBackward ? -1 : 0), isLeft ? 1 : (isRight ? -1 : 0), isDown ? 1 : (isUp ? -1 : 0), dt);
+				steerAirplane(*airplane[0], *airplane[18], *airplane[1], *airplane[2], *airplane[14], isForward ? 1 : (isBackward ? -1 : 0), isLeft ? 1 : (isRight ? -1 : 0), isDown ? 1 : (isUp ? -1 : 0), tickSeconds);
 				entityToFollow = airplane[0];
 			}
 		} else if (steerMode == 2) { // Player
 			entityToFollow = &player;
-			basicSteering(player.position, player.forward, player.up);
+			basicSteering(player.position, player.forward, player.up, tickSeconds);
 		}
 
 		bool collision = getHeightAt(heightmapData, size, tileSizeXZ, airplane[0]->position.x, airplane[0]->position.z) >= airplane[0]->position.y - 0.2f;
 
-		airplanePhysics(*airplane[0], *airplane[18], *airplane[2], dt);	
+		airplanePhysics(*airplane[0], *airplane[18], *airplane[2], tickSeconds);
 		terrainCollision(heightmapData, size, tileSizeXZ, *airplane[0]);
-		runPhysics(player, dt);
+		runPhysics(player, tickSeconds);
 		terrainCollision(heightmapData, size, tileSizeXZ, player);
 
 		for (int i = 0; i < lights.size(); i++) {
 			if (lights[i]->getParentEntity()) {
 				continue;
 			}
-			runPhysics(*lights[i], dt);
+			runPhysics(*lights[i], tickSeconds);
 			terrainCollision(heightmapData, size, tileSizeXZ, *lights[i]);
 		}
 
-		// Camera
-		glm::mat4 cam = glm::lookAt(cameraPosition, cameraPosition + cameraForward * 14.0f, cameraUp);
-		if (entityToFollow) {
-			glm::vec3 targetPosition = entityToFollow->position + -entityToFollow->forward * 2.5f * (boom ? 2.0f : 1.0f) + entityToFollow->up * 1.0f  * (boom ? 2.0f : 1.0f);
-			//cameraPosition = targetPosition;
-			interpolateCamera(targetPosition, cameraPosition, dt);
-			float terrainHeightAtCamera = getHeightAt(heightmapData, size, tileSizeXZ, cameraPosition.x, cameraPosition.z);
-			if (cameraPosition.y <= terrainHeightAtCamera + 0.05f) {
-				cameraPosition.y = terrainHeightAtCamera + 0.05f;
-			}
-			cameraForward = glm::normalize(entityToFollow->position - cameraPosition);
-			cam = glm::lookAt(cameraPosition, entityToFollow->position, entityToFollow->up);
-			cameraUp = entityToFollow->up;
-		}
+		simulationTime += tickSeconds;
 
-		worldGreenMovingLight.position.x = 100 * sin(glfwGetTime() / (float)10) + 400;
-		worldGreenMovingLight.position.z = 100 * cos(glfwGetTime() / (float)10) + 400;
-		worldGreenMovingLight.intensity = 4 * sin(glfwGetTime() * 2) + 4;
+		worldGreenMovingLight.position.x = 100 * sin(simulationTime / (float)10) + 400;
+		worldGreenMovingLight.position.z = 100 * cos(simulationTime / (float)10) + 400;
+		worldGreenMovingLight.intensity = 4 * sin(simulationTime * 2) + 4;
 
 		// Airplane lights
 		airplaneWingLight.intensity = 4;
 		airplaneWingLightLeft.intensity = 4;
-		if ((int)(glfwGetTime() * 10) % 10 != 0) {
+		if ((int)(simulationTime * 10) % 10 != 0) {
 			airplaneWingLight.intensity = 0;
 			airplaneWingLightLeft.intensity = 0;
 		}
@@ -580,55 +1922,293 @@ int program() {
 		// Animate sun (make sure direction always faces middle of ground
 		float centerPosition = (float)(size * tileSizeXZ) / 2.0f;
 		glm::vec3 center = glm::vec3(centerPosition, getHeightAt(heightmapData, size, tileSizeXZ, centerPosition, centerPosition), centerPosition);
-		float time = glfwGetTime() / 8 + 10;
+		float time = simulationTime / 8 + 10;
 		sun.position.z = centerPosition;
 		sun.position.y = cos(time) * centerPosition * 2 + center.y;
 		sun.position.x = sin(time) * centerPosition * 2 + centerPosition;
 		sun.up = glm::vec3(0, 0, 1);
 		sun.forward = glm::normalize(center - sun.position);
-		float interpolation = (cos(time) + 1) / 2.0f;
-
-		// Render entities
-		renderSkybox(skybox, secondSkybox, interpolation, skyboxShader, cam, perspective);
-		bindLight(terrainShader, lights);
-		bindLight(modelShader, lights);
-		renderTerrain(ground, terrainShader, cam, perspective);
-		for (int i = 0; i < airplane.size(); i++) {
-			if (i == 8 || i == 0) {
-				continue;
+		skyboxInterpolation = (cos(time) + 1) / 2.0f;
+
+		// Particles, one job per system. The parents' transformations are brought up to date
+		// first so the jobs only read them. Sorting is left to the frame.
+		JobCounter particlesDone;
+		for (int i = 0; i < particleSystems.size(); i++) {
+			ParticleSystem *particleSystem = particleSystems[i];
+			if (particleSystem->parentEntity) {
+				getEntityTransformation(*particleSystem->parentEntity);
+			}
+			runJob("Particle update", [particleSystem, tickSeconds]() {
+				simulateParticleSystem(*particleSystem, tickSeconds);
+			}, &particlesDone);
+		}
+		waitForCounter(particlesDone);
+	};
+
+	// Rendering is done alpha of the way between the states before and after the last tick.
+	// updateEntityTransformations reorders sceneEntities, so the states are kept for a copy
+	std::vector<Entity*> simulatedEntities = sceneEntities;
+	std::vector<PhysicsState> previousStates;
+	std::vector<PhysicsState> currentStates;
+	savePhysicsStates(simulatedEntities, previousStates);
+	PhysicsState previousCamera = { cameraPosition, cameraForward, cameraUp };
+	PhysicsState currentCamera = previousCamera;
+	float accumulator = 0;
+
+	// Runs the ticks of a frame dt seconds long and fills the snapshot it is drawn from. Only
+	// touches the entities and particle systems, never OpenGL, so it can run on its own thread.
+	auto simulateFrame = [&](FrameSnapshot &frame, float dt) {
+		Timer simulationTimer;
+		double startMicroseconds = getJobTraceMicroseconds();
+
+		accumulator += dt;
+		int frameTicks = 0;
+		while (accumulator >= tickSeconds) {
+			savePhysicsStates(simulatedEntities, previousStates);
+			previousCamera = { cameraPosition, cameraForward, cameraUp };
+			simulationTick();
+			accumulator -= tickSeconds;
+			frameTicks++;
+		}
+		savePhysicsStates(simulatedEntities, currentStates);
+		currentCamera = { cameraPosition, cameraForward, cameraUp };
+		float alpha = accumulator / tickSeconds;
+		interpolatePhysicsStates(simulatedEntities, previousStates, currentStates, alpha);
+
+		// Camera
+		PhysicsState renderCamera = interpolatePhysicsState(previousCamera, currentCamera, alpha);
+		glm::mat4 cam = glm::lookAt(renderCamera.position, renderCamera.position + renderCamera.forward * 14.0f, renderCamera.up);
+		if (entityToFollow) {
+			glm::vec3 targetPosition = entityToFollow->position + -entityToFollow->forward * 2.5f * (boom ? 2.0f : 1.0f) + entityToFollow->up * 1.0f  * (boom ? 2.0f : 1.0f);
+			//cameraPosition = targetPosition;
+			interpolateCamera(targetPosition, cameraPosition, dt);
+			float terrainHeightAtCamera = getHeightAt(heightmapData, size, tileSizeXZ, cameraPosition.x, cameraPosition.z);
+			if (cameraPosition.y <= terrainHeightAtCamera + 0.05f) {
+				cameraPosition.y = terrainHeightAtCamera + 0.05f;
+			}
+			cameraForward = glm::normalize(entityToFollow->position - cameraPosition);
+			cam = glm::lookAt(cameraPosition, entityToFollow->position, entityToFollow->up);
+			cameraUp = entityToFollow->up;
+			renderCamera.position = cameraPosition;
+			renderCamera.forward = cameraForward;
+		}
+
+		// CPU work of the frame as jobs, everything reading transformations waits for them.
+		// The transformation counts include the previous frame's ticks and snapshot.
+		frame.transformStats = getTransformStats();
+		resetTransformStats();
+		JobCounter transformsDone;
+		JobCounter frameJobsDone;
+		runJob("Transforms", [&]() {
+			updateEntityTransformations(sceneEntities);
+		}, &transformsDone);
+
+		// Terrain culling and level of detail, in terrain model space
+		frame.useTerrainLod = useTerrainLod;
+		frame.visibleTerrainChunks = 0;
+		frame.visibleTerrainTriangles = 0;
+		runJob("Terrain culling", [&]() {
+			glm::mat4 groundTransformation = getEntityTransformation(ground);
+			std::vector<IndexRange> &terrainRanges = frame.terrainRanges;
+			visibleTerrainNodes.clear();
+			terrainRanges.clear();
+			ground.getQuadtree().cull(Frustum(perspective * cam * groundTransformation), visibleTerrainNodes);
+			for (int i = 0; i < visibleTerrainNodes.size(); i++) {
+				frame.visibleTerrainChunks += visibleTerrainNodes[i]->numChunks;
+			}
+			if (frame.useTerrainLod) {
+				glm::vec3 cameraPositionTerrainSpace = glm::vec3(glm::inverse(groundTransformation) * glm::vec4(renderCamera.position, 1));
+				ground.getLod().select(visibleTerrainNodes, cameraPositionTerrainSpace, terrainLodProjectionScale, TERRAIN_LOD_MAX_PIXEL_ERROR, terrainRanges);
+			} else {
+				for (int i = 0; i < visibleTerrainNodes.size(); i++) {
+					IndexRange range;
+					range.offset = visibleTerrainNodes[i]->offset;
+					range.numIndices = visibleTerrainNodes[i]->numIndices;
+					terrainRanges.push_back(range);
+				}
+			}
+			for (int i = 0; i < terrainRanges.size(); i++) {
+				frame.visibleTerrainTriangles += terrainRanges[i].numIndices / 3;
 			}
-			renderEntity(*airplane[i], modelShader, cam, perspective, true);
+		}, &frameJobsDone, &transformsDone);
+
+		runJob("Light culling", [&]() {
+			frame.numVisibleLights = prepareLights(lights, cam, perspective, frame.lights);
+		}, &frameJobsDone, &transformsDone);
+
+		frame.particleSystems.resize(particleSystems.size());
+		for (int i = 0; i < particleSystems.size(); i++) {
+			ParticleSystem *particleSystem = particleSystems[i];
+			ParticleSystemSnapshot *particleSnapshot = &frame.particleSystems[i];
+			runJob("Particle sort", [particleSystem, particleSnapshot, &renderCamera]() {
+				sortParticles(*particleSystem, renderCamera.position, renderCamera.forward);
+				snapshotParticleSystem(*particleSystem, *particleSnapshot);
+			}, &frameJobsDone, &transformsDone);
 		}
-		renderEntity(player, modelShader, cam, perspective, true);
-		renderEntity(*airplane[0], modelShader, cam, perspective, true);
-		renderEntity(*airplane[8], modelShader, cam, perspective, true);
-		renderEntity(cube, modelShader, cam, perspective, true);
 
-		// Particles
-		Entity parentEntity = *airplane[0];
-		updateParticleSystem(smoke, cameraPosition, cameraForward, dt);
-		updateParticleSystem(wingtip, cameraPosition, cameraForward, dt);
-		updateParticleSystem(wingtip2, cameraPosition, cameraForward, dt);
-		if (smoke.numParticles > 0) {
-			renderParticleSystem(smoke, instancedShader, uniformLocationInstanceShaderTransformation, uniformLocationInstanceShaderProgress, cam, perspective);
+		waitForCounter(transformsDone);
+		waitForCounter(frameJobsDone);
+
+		frame.worldToView = cam;
+		frame.skyboxTransformation = getEntityTransformation(skybox);
+		frame.skyboxInterpolation = skyboxInterpolation;
+		frame.groundTransformation = getEntityTransformation(ground);
+		frame.transformations.resize(modelEntities.size());
+		for (int i = 0; i < modelEntities.size(); i++) {
+			frame.transformations[i] = getEntityTransformation(*modelEntities[i]);
 		}
-		if (wingtip.numParticles > 0) {
-			renderParticleSystem(wingtip, instancedShader, uniformLocationInstanceShaderTransformation, uniformLocationInstanceShaderProgress, cam, perspective);
+		frame.ticks = frameTicks;
+
+		// Back to where the simulation is for the next tick
+		loadPhysicsStates(simulatedEntities, currentStates);
+
+		addJobTraceEvent("Simulation", startMicroseconds, getJobTraceMicroseconds());
+		frame.simulationMilliseconds = simulationTimer.elapsedMilliseconds();
+	};
+
+	// Draws a frame from its snapshot alone, so the simulation may already be moving the entities
+	auto renderFrame = [&](const FrameSnapshot &frame) {
+		// The terrain's virtual texture pages around the camera, in the splat map's coordinates
+		glm::vec4 cameraPositionTerrainSpace = glm::inverse(frame.groundTransformation) * glm::inverse(frame.worldToView)[3];
+		terrainTexture.update(cameraPositionTerrainSpace.x / terrainExtent, 1 - cameraPositionTerrainSpace.z / terrainExtent);
+
+		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+		glEnable(GL_BLEND);
+		glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+
+		bindCamera(frame.worldToView, perspective);
+		renderSkybox(skybox, frame.skyboxTransformation, secondSkybox, frame.skyboxInterpolation, skyboxShader);
+		uploadLights(frame.lights);
+		renderTerrain(ground, frame.groundTransformation, terrainShader, frame.terrainRanges);
+		for (int i = 0; i < modelEntities.size(); i++) {
+			renderEntity(*modelEntities[i], frame.transformations[i], modelShader, true);
 		}
-		if (wingtip2.numParticles > 0) {
-			renderParticleSystem(wingtip2, instancedShader, uniformLocationInstanceShaderTransformation, uniformLocationInstanceShaderProgress, cam, perspective);
+
+		for (int i = 0; i < particleSystems.size(); i++) {
+			if (!frame.particleSystems[i].instances.empty()) {
+				renderParticleSystem(*particleSystems[i], frame.particleSystems[i], instancedShader, frame.worldToView);
+			}
 		}
+	};
+
+	// The simulation fills one snapshot while the render thread draws another
+	TripleBuffer<FrameSnapshot> snapshots;
+	std::atomic<bool> isRunning(true);
+	std::thread simulationThread;
+	if (!options.isSerial) {
+		simulationThread = std::thread([&]() {
+			float lastTime = glfwGetTime();
+			while (isRunning) {
+				float currentTime = glfwGetTime();
+				float dt = std::min(currentTime - lastTime, MAX_FRAME_SECONDS);
+				lastTime = currentTime;
+				simulateFrame(snapshots.getWriteBuffer(), dt);
+				snapshots.publish();
+				// At most one frame ahead, the next frame starts once rendering has taken this one
+				snapshots.waitUntilAcquired();
+			}
+		});
+	}
 
-		// Draw lights
-		for (int i = 0; i < lights.size(); i++) {
-			//renderEntity(*lights[i], modelShader, cam, perspectiveForSun, false);
+	// Jobs run during the previous frame
+	std::vector<JobTraceEvent> frameJobEvents;
+	int frameJobs = 0;
+	double frameJobMilliseconds = 0;
+	std::vector<JobTraceEvent> jobTrace;
+	int frameNumber = 0;
+	setJobTracing(true);
+
+	// Frame time is measured between buffer swaps, so it covers simulation and rendering in
+	// serial mode and the slower of the two when pipelined
+	Timer frameTimer;
+	double frameMilliseconds = 0;
+	double totalFrameMilliseconds = 0;
+	double totalSimulationMilliseconds = 0;
+	double totalRenderMilliseconds = 0;
+	std::string mode = std::string(options.isSerial ? "serial" : "pipelined") + std::string(options.useLegacyUniforms ? ", legacy uniforms" : "");
+
+	float lastTime = glfwGetTime();
+	while (!glfwWindowShouldClose(window)) {
+		if (options.isSerial) {
+			float currentTime = glfwGetTime();
+			float dt = std::min(currentTime - lastTime, MAX_FRAME_SECONDS);
+			lastTime = currentTime;
+			simulateFrame(snapshots.getWriteBuffer(), dt);
+			snapshots.publish();
 		}
+		snapshots.waitForNewValue();
+		snapshots.acquire();
+		const FrameSnapshot &frame = snapshots.getReadBuffer();
+
+		double renderStartMicroseconds = getJobTraceMicroseconds();
+		Timer renderTimer;
+		renderFrame(frame);
+		double renderMilliseconds = renderTimer.elapsedMilliseconds();
+
+		std::string title = std::string("Frame time: ") + std::to_string(frameMilliseconds) + std::string(" ms (") + mode + std::string(")")
+			+ std::string(", simulation: ") + std::to_string(frame.simulationMilliseconds) + std::string(" ms")
+			+ std::string(", ticks: ") + std::to_string(frame.ticks) + std::string(" at ") + std::to_string(options.ticksPerSecond) + std::string("/s")
+			+ std::string(", render CPU time: ") + std::to_string(renderMilliseconds) + std::string(" ms")
+			+ std::string(", terrain chunks: ") + std::to_string(frame.visibleTerrainChunks) + std::string("/") + std::to_string(ground.getQuadtree().getNumChunks())
+			+ std::string(", terrain triangles: ") + std::to_string(frame.visibleTerrainTriangles)
+			+ std::string(frame.useTerrainLod ? " (LOD)" : "")
+			+ std::string(", terrain page misses: ") + std::to_string((int)(terrainTexture.getCache().getFrameMissRate() * 100)) + std::string("% (")
+			+ std::to_string(terrainTexture.getNumBakingPages()) + std::string(" baking)")
+			+ std::string(", lights: ") + std::to_string(frame.numVisibleLights) + std::string("/") + std::to_string(lights.size())
+			+ std::string(", transforms built: ") + std::to_string(frame.transformStats.evaluations) + std::string(" (")
+			+ std::to_string(frame.transformStats.uncachedEvaluations) + std::string(" uncached)")
+			+ std::string(", jobs: ") + std::to_string(frameJobs) + std::string(" (") + std::to_string(frameJobMilliseconds) + std::string(" ms)");
+		glfwSetWindowTitle(window, title.c_str());
 
 		glfwSwapBuffers(window);
 		glfwPollEvents();
+		addJobTraceEvent("Render", renderStartMicroseconds, getJobTraceMicroseconds());
+
+		frameMilliseconds = frameTimer.elapsedMilliseconds();
+		frameTimer.reset();
+		totalFrameMilliseconds += frameMilliseconds;
+		totalSimulationMilliseconds += frame.simulationMilliseconds;
+		totalRenderMilliseconds += renderMilliseconds;
+
+		// Job timings
+		frameJobEvents.clear();
+		takeJobTrace(frameJobEvents);
+		frameJobs = 0;
+		frameJobMilliseconds = 0;
+		for (int i = 0; i < frameJobEvents.size(); i++) {
+			std::string name = frameJobEvents[i].name;
+			if (name != "Simulation" && name != "Render") {
+				frameJobs++;
+				frameJobMilliseconds += frameJobEvents[i].durationMicroseconds / 1000;
+			}
+		}
+		if (!options.jobTraceFile.empty() && frameNumber < JOB_TRACE_FRAMES) {
+			jobTrace.insert(jobTrace.end(), frameJobEvents.begin(), frameJobEvents.end());
+		}
+		frameNumber++;
+	}
+
+	// Wakes the simulation thread if it waits for the frame that won't be rendered
+	isRunning = false;
+	snapshots.close();
+	if (simulationThread.joinable()) {
+		simulationThread.join();
+	}
+
+	if (frameNumber > 0) {
+		double averageFrameMilliseconds = totalFrameMilliseconds / frameNumber;
+		std::cout << "Rendered " << frameNumber << " frames (" << mode << "): " << averageFrameMilliseconds << " ms per frame ("
+			<< 1000 / averageFrameMilliseconds << " frames/s), simulation " << totalSimulationMilliseconds / frameNumber
+			<< " ms, render CPU time " << totalRenderMilliseconds / frameNumber << " ms" << std::endl;
+	}
+	terrainTexture.printStats();
+
+	if (!options.jobTraceFile.empty()) {
+		writeChromeTrace(options.jobTraceFile, jobTrace);
+		std::cout << "Wrote " << jobTrace.size() << " job timings to " << options.jobTraceFile << std::endl;
 	}
 
-	delete heightmapData;
+	delete[] heightmapData;
 	
 	for (std::vector<Entity*>::iterator iter = airplane.begin(); iter != airplane.end(); iter++) {
 		delete *iter;
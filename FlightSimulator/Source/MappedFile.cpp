@@ -0,0 +1,119 @@
+#include "MappedFile.h"
+
+#include <cstring>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef _WIN32
+
+MappedFile::MappedFile() : data(nullptr), size(0), file(INVALID_HANDLE_VALUE), mapping(nullptr) {
+}
+
+bool MappedFile::open(const std::string &filename) {
+	close();
+	file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+	if (file == INVALID_HANDLE_VALUE) {
+		return false;
+	}
+	LARGE_INTEGER fileSize;
+	if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0) {
+		close();
+		return false;
+	}
+	mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (!mapping) {
+		close();
+		return false;
+	}
+	data = (const unsigned char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	if (!data) {
+		close();
+		return false;
+	}
+	size = (size_t)fileSize.QuadPart;
+	return true;
+}
+
+void MappedFile::close() {
+	if (data) {
+		UnmapViewOfFile(data);
+	}
+	if (mapping) {
+		CloseHandle(mapping);
+	}
+	if (file != INVALID_HANDLE_VALUE) {
+		CloseHandle(file);
+	}
+	data = nullptr;
+	size = 0;
+	mapping = nullptr;
+	file = INVALID_HANDLE_VALUE;
+}
+
+#else
+
+MappedFile::MappedFile() : data(nullptr), size(0), file(-1) {
+}
+
+bool MappedFile::open(const std::string &filename) {
+	close();
+	file = ::open(filename.c_str(), O_RDONLY);
+	if (file < 0) {
+		return false;
+	}
+	struct stat status;
+	if (fstat(file, &status) != 0 || status.st_size == 0) {
+		close();
+		return false;
+	}
+	void *mapped = mmap(nullptr, (size_t)status.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+	if (mapped == MAP_FAILED) {
+		close();
+		return false;
+	}
+	data = (const unsigned char*)mapped;
+	size = (size_t)status.st_size;
+	return true;
+}
+
+void MappedFile::close() {
+	if (data) {
+		munmap((void*)data, size);
+	}
+	if (file >= 0) {
+		::close(file);
+	}
+	data = nullptr;
+	size = 0;
+	file = -1;
+}
+
+#endif
+
+MappedFile::~MappedFile() {
+	close();
+}
+
+unsigned long long checksumBytes(const void *bytes, size_t size, unsigned long long checksum) {
+	const unsigned long long prime = 1099511628211ull;
+	const unsigned char *data = (const unsigned char*)bytes;
+	size_t i = 0;
+	for (; i + 8 <= size; i += 8) {
+		unsigned long long word;
+		memcpy(&word, data + i, 8);
+		checksum = (checksum ^ word) * prime;
+	}
+	for (; i < size; i++) {
+		checksum = (checksum ^ data[i]) * prime;
+	}
+	return checksum;
+}
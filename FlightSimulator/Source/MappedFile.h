@@ -0,0 +1,42 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+// A whole file mapped read only into memory, unmapped when closed or destroyed. Pages are
+// read from disk on first access, so opening is cheap however large the file is.
+class MappedFile {
+public:
+	MappedFile();
+	~MappedFile();
+	// Returns false if the file can't be opened or is empty
+	bool open(const std::string &filename);
+	void close();
+	bool isOpen() const {
+		return data != nullptr;
+	}
+	const unsigned char* getData() const {
+		return data;
+	}
+	size_t getSize() const {
+		return size;
+	}
+private:
+	MappedFile(const MappedFile&);
+	MappedFile& operator=(const MappedFile&);
+
+	const unsigned char *data;
+	size_t size;
+#ifdef _WIN32
+	void *file;
+	void *mapping;
+#else
+	int file;
+#endif
+};
+
+const unsigned long long CHECKSUM_SEED = 14695981039346656037ull;
+
+// FNV-1a over 8 byte words, enough to notice a truncated or damaged file. Continue a checksum
+// over several arrays by passing the previous result as checksum.
+unsigned long long checksumBytes(const void *bytes, size_t size, unsigned long long checksum = CHECKSUM_SEED);
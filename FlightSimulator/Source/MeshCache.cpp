@@ -0,0 +1,209 @@
+#include "MeshCache.h"
+
+#include <cstring>
+#include <fstream>
+
+// Start of a cache file, followed by the submeshes, vertices and indices
+struct MeshCacheHeader {
+	char magic[4];
+	unsigned int version;
+	// Of the source file the cache was converted from
+	unsigned long long sourceSize;
+	unsigned long long sourceChecksum;
+	unsigned int numSubmeshes;
+	unsigned int numVertices;
+	unsigned int numIndices;
+	unsigned int indexType;
+	// Of the submeshes, vertices and indices, in that order
+	unsigned long long checksum;
+};
+
+static const char MESH_CACHE_MAGIC[4] = { 'F', 'S', 'M', 'C' };
+
+static bool checksumSource(const std::string &sourceFilename, unsigned long long &size, unsigned long long &checksum) {
+	MappedFile source;
+	if (!source.open(sourceFilename)) {
+		return false;
+	}
+	size = source.getSize();
+	checksum = checksumBytes(source.getData(), source.getSize());
+	return true;
+}
+
+static unsigned long long checksumMesh(const MeshCacheData &data) {
+	unsigned long long checksum = checksumBytes(data.submeshes, data.numSubmeshes * sizeof(MeshCacheSubmesh));
+	checksum = checksumBytes(data.vertices, (size_t)data.numVertices * MESH_VERTEX_SIZE * sizeof(float), checksum);
+	return checksumBytes(data.indices, (size_t)data.numIndices * getIndexSize(data.indexType), checksum);
+}
+
+bool openMeshCache(const std::string &filename, const std::string &sourceFilename, MappedFile &file, MeshCacheData &data) {
+	unsigned long long sourceSize, sourceChecksum;
+	if (!checksumSource(sourceFilename, sourceSize, sourceChecksum) || !file.open(filename)) {
+		return false;
+	}
+	MeshCacheHeader header;
+	if (file.getSize() < sizeof(header)) {
+		file.close();
+		return false;
+	}
+	memcpy(&header, file.getData(), sizeof(header));
+	size_t expectedSize = sizeof(header) + (size_t)header.numSubmeshes * sizeof(MeshCacheSubmesh)
+		+ (size_t)header.numVertices * MESH_VERTEX_SIZE * sizeof(float) + (size_t)header.numIndices * getIndexSize(header.indexType);
+	bool isValid = memcmp(header.magic, MESH_CACHE_MAGIC, sizeof(header.magic)) == 0
+		&& header.version == MESH_CACHE_VERSION
+		&& (header.indexType == GL_UNSIGNED_SHORT || header.indexType == GL_UNSIGNED_INT)
+		&& header.sourceSize == sourceSize
+		&& header.sourceChecksum == sourceChecksum
+		&& file.getSize() == expectedSize;
+	if (!isValid) {
+		file.close();
+		return false;
+	}
+
+	const unsigned char *payload = file.getData() + sizeof(header);
+	data.submeshes = (const MeshCacheSubmesh*)payload;
+	data.numSubmeshes = header.numSubmeshes;
+	data.vertices = (const float*)(data.submeshes + header.numSubmeshes);
+	data.numVertices = header.numVertices;
+	data.indices = data.vertices + (size_t)header.numVertices * MESH_VERTEX_SIZE;
+	data.numIndices = header.numIndices;
+	data.indexType = header.indexType;
+	if (checksumMesh(data) != header.checksum) {
+		file.close();
+		return false;
+	}
+	return true;
+}
+
+static void copyName(char *destination, const std::string &name) {
+	memset(destination, 0, MESH_CACHE_NAME_LENGTH);
+	strncpy(destination, name.c_str(), MESH_CACHE_NAME_LENGTH - 1);
+}
+
+void convertToMeshCache(std::vector<Entity*> &entities, const MeshData &mesh, MeshCacheBuffers &converted) {
+	std::vector<float> weldedVertices;
+	std::vector<unsigned int> indices;
+	weldVertices(mesh, weldedVertices, indices);
+	int numVertices = weldedVertices.size() / WELDED_VERTEX_SIZE;
+	std::vector<float> tangents(numVertices * 3);
+	std::vector<float> bitangents(numVertices * 3);
+	calculateIndexedTangents(&weldedVertices[0], WELDED_VERTEX_SIZE, numVertices, &indices[0], indices.size(), &tangents[0], &bitangents[0]);
+
+	std::vector<float> &vertices = converted.vertices;
+	vertices.resize(numVertices * MESH_VERTEX_SIZE);
+	for (int i = 0; i < numVertices; i++) {
+		float *vertex = &vertices[i * MESH_VERTEX_SIZE];
+		memcpy(vertex, &weldedVertices[i * WELDED_VERTEX_SIZE], WELDED_VERTEX_SIZE * sizeof(float));
+		memcpy(vertex + WELDED_VERTEX_SIZE, &tangents[i * 3], 3 * sizeof(float));
+		memcpy(vertex + WELDED_VERTEX_SIZE + 3, &bitangents[i * 3], 3 * sizeof(float));
+	}
+	GLenum indexType = chooseIndexType(numVertices);
+	converted.indices = packIndices(indices, indexType);
+
+	std::vector<MeshCacheSubmesh> &submeshes = converted.submeshes;
+	submeshes.resize(entities.size());
+	for (int i = 0; i < entities.size(); i++) {
+		Entity &entity = *entities[i];
+		Model &model = entity.getModel();
+		MeshCacheSubmesh &submesh = submeshes[i];
+		memset(&submesh, 0, sizeof(submesh));
+		copyName(submesh.name, entity.getName());
+		copyName(submesh.diffuseTexture, mesh.diffuseTextures[i]);
+		submesh.offset = model.offset;
+		submesh.numIndices = model.numIndices;
+		glm::vec3 pivot = entity.getRotationPivot();
+		memcpy(submesh.rotationPivot, &pivot[0], sizeof(submesh.rotationPivot));
+		submesh.illum = model.illum;
+		submesh.Ns = model.Ns;
+		submesh.d = model.d;
+		memcpy(submesh.Ka, &model.Ka[0], sizeof(submesh.Ka));
+		memcpy(submesh.Kd, &model.Kd[0], sizeof(submesh.Kd));
+		memcpy(submesh.Ks, &model.Ks[0], sizeof(submesh.Ks));
+	}
+
+	MeshCacheData &data = converted.data;
+	data.submeshes = &submeshes[0];
+	data.numSubmeshes = submeshes.size();
+	data.vertices = &vertices[0];
+	data.numVertices = numVertices;
+	data.indices = &converted.indices[0];
+	data.numIndices = indices.size();
+	data.indexType = indexType;
+}
+
+bool writeMeshCache(const std::string &filename, const std::string &sourceFilename, const MeshCacheData &data) {
+	unsigned long long sourceSize, sourceChecksum;
+	if (!checksumSource(sourceFilename, sourceSize, sourceChecksum)) {
+		return false;
+	}
+	MeshCacheHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, MESH_CACHE_MAGIC, sizeof(header.magic));
+	header.version = MESH_CACHE_VERSION;
+	header.sourceSize = sourceSize;
+	header.sourceChecksum = sourceChecksum;
+	header.numSubmeshes = data.numSubmeshes;
+	header.numVertices = data.numVertices;
+	header.numIndices = data.numIndices;
+	header.indexType = data.indexType;
+	header.checksum = checksumMesh(data);
+
+	std::ofstream file(filename, std::ios::binary | std::ios::trunc);
+	if (!file) {
+		return false;
+	}
+	file.write((const char*)&header, sizeof(header));
+	file.write((const char*)data.submeshes, (std::streamsize)data.numSubmeshes * sizeof(MeshCacheSubmesh));
+	file.write((const char*)data.vertices, (std::streamsize)data.numVertices * MESH_VERTEX_SIZE * sizeof(float));
+	file.write((const char*)data.indices, (std::streamsize)data.numIndices * getIndexSize(data.indexType));
+	return (bool)file;
+}
+
+std::vector<Entity*> createMeshCacheEntities(const MeshCacheData &data) {
+	std::vector<Entity*> entities;
+	for (int i = 0; i < data.numSubmeshes; i++) {
+		const MeshCacheSubmesh &submesh = data.submeshes[i];
+		Entity *entity = new Entity();
+		std::string name = submesh.name;
+		entity->setName(name);
+		entity->setRotationPivot(glm::vec3(submesh.rotationPivot[0], submesh.rotationPivot[1], submesh.rotationPivot[2]));
+		Model model = Model();
+		model.offset = submesh.offset;
+		model.numIndices = submesh.numIndices;
+		model.indexType = data.indexType;
+		model.illum = submesh.illum;
+		model.Ns = submesh.Ns;
+		model.d = submesh.d;
+		model.Ka = glm::vec3(submesh.Ka[0], submesh.Ka[1], submesh.Ka[2]);
+		model.Kd = glm::vec3(submesh.Kd[0], submesh.Kd[1], submesh.Kd[2]);
+		model.Ks = glm::vec3(submesh.Ks[0], submesh.Ks[1], submesh.Ks[2]);
+		entity->setModel(model);
+		entities.push_back(entity);
+	}
+	return entities;
+}
+
+GLuint uploadMeshCache(const MeshCacheData &data) {
+	GLuint vao = 0;
+	glGenVertexArrays(1, &vao);
+	glBindVertexArray(vao);
+
+	GLuint vertexBuffer = 0;
+	glGenBuffers(1, &vertexBuffer);
+	glBindBuffer(GL_ARRAY_BUFFER, vertexBuffer);
+	glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat) * MESH_VERTEX_SIZE * data.numVertices, data.vertices, GL_STATIC_DRAW);
+	const GLsizei stride = sizeof(GLfloat) * MESH_VERTEX_SIZE;
+	const GLint attributeSizes[] = { 3, 3, 2, 3, 3 };
+	int offset = 0;
+	for (GLuint attribute = 0; attribute < 5; attribute++) {
+		glVertexAttribPointer(attribute, attributeSizes[attribute], GL_FLOAT, GL_FALSE, stride, (void*)(offset * sizeof(GLfloat)));
+		glEnableVertexAttribArray(attribute);
+		offset += attributeSizes[attribute];
+	}
+
+	GLuint indexBuffer = 0;
+	glGenBuffers(1, &indexBuffer);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indexBuffer);
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER, getIndexSize(data.indexType) * data.numIndices, data.indices, GL_STATIC_DRAW);
+	return vao;
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "Common.h"
+#include "MappedFile.h"
+
+// Change whenever the file layout or how meshes are processed changes, older caches are then stale
+const unsigned int MESH_CACHE_VERSION = 2;
+
+// Floats per vertex in cached meshes: position (3), normal (3), texture coordinate (2),
+// tangent (3), bitangent (3), the attribute locations of modelVS.glsl in order
+const int MESH_VERTEX_SIZE = 14;
+
+const int MESH_CACHE_NAME_LENGTH = 64;
+
+// One entity of a cached model, drawing its own range of the shared index buffer
+struct MeshCacheSubmesh {
+	char name[MESH_CACHE_NAME_LENGTH];
+	// Empty when the submesh has no diffuse texture
+	char diffuseTexture[MESH_CACHE_NAME_LENGTH];
+	int offset;
+	int numIndices;
+	float rotationPivot[3];
+	int illum;
+	float Ns;
+	float d;
+	float Ka[3];
+	float Kd[3];
+	float Ks[3];
+};
+
+// A cached model, pointing into the mapped cache file
+struct MeshCacheData {
+	const MeshCacheSubmesh *submeshes;
+	int numSubmeshes;
+	const float *vertices;
+	int numVertices;
+	// numIndices of GL_UNSIGNED_SHORT or GL_UNSIGNED_INT
+	const void *indices;
+	int numIndices;
+	GLenum indexType;
+};
+
+// A model converted to the cache format in memory, data points into the arrays
+struct MeshCacheBuffers {
+	std::vector<MeshCacheSubmesh> submeshes;
+	std::vector<float> vertices;
+	std::vector<unsigned char> indices;
+	MeshCacheData data;
+};
+
+// Maps the cache file and checks it against the source file it was converted from and its
+// own checksum. Returns false if either file is missing or the cache is stale or corrupted.
+bool openMeshCache(const std::string &filename, const std::string &sourceFilename, MappedFile &file, MeshCacheData &data);
+
+// Converts the entities and mesh loadJAS39GripenMesh reads: welds the vertices, computes
+// their tangents, interleaves the attributes and picks the smallest index type
+void convertToMeshCache(std::vector<Entity*> &entities, const MeshData &mesh, MeshCacheBuffers &converted);
+
+// Returns false if the file can't be written
+bool writeMeshCache(const std::string &filename, const std::string &sourceFilename, const MeshCacheData &data);
+
+// One entity per submesh with its model's material and index range, the models have no vao
+std::vector<Entity*> createMeshCacheEntities(const MeshCacheData &data);
+
+// Uploads the interleaved vertices and indices straight from the cache, returns the vao
+GLuint uploadMeshCache(const MeshCacheData &data);
@@ -1,4 +1,5 @@
 #include <algorithm>
+#include <cstring>
 
 #include <glm/gtc/type_ptr.hpp> 
 
@@ -21,84 +22,225 @@ glm::vec3 generateParticleDirection(ParticleSystem &particleSystem) {
 	return direction;
 }
 
-void sortParticles(ParticleSystem &particleSystem, Particle *particle, int numParticles, glm::vec3 cameraPosition, glm::vec3 cameraForward) {
+// Maps a float to an unsigned int with the same order, so the keys can be radix sorted
+static inline unsigned int floatToSortableKey(float value) {
+	unsigned int bits;
+	memcpy(&bits, &value, sizeof(bits));
+	// Negative floats have their order reversed, positive ones need to end up above them
+	return bits ^ ((bits >> 31) ? 0xFFFFFFFF : 0x80000000);
+}
+
+// Sorts keys and their indices in ascending key order, gives up and returns false once
+// more than maxMoves elements have been shifted. The arrays are partially sorted then.
+static bool insertionSort(unsigned int *keys, unsigned int *indices, int count, int maxMoves) {
+	int numMoves = 0;
+	for (int i = 1; i < count; i++) {
+		unsigned int key = keys[i];
+		unsigned int index = indices[i];
+		int j = i - 1;
+		while (j >= 0 && keys[j] > key) {
+			keys[j + 1] = keys[j];
+			indices[j + 1] = indices[j];
+			j--;
+		}
+		numMoves += i - 1 - j;
+		keys[j + 1] = key;
+		indices[j + 1] = index;
+		if (numMoves > maxMoves) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// LSD radix sort of keys and their indices, 8 bits per pass. Passes where every key has
+// the same digit are skipped. The sorted result ends up in keys and indices.
+static void radixSort(std::vector<unsigned int> &keys, std::vector<unsigned int> &indices, std::vector<unsigned int> &keysScratch, std::vector<unsigned int> &indicesScratch, int count) {
+	unsigned int counts[4][256] = {};
+	for (int i = 0; i < count; i++) {
+		unsigned int key = keys[i];
+		counts[0][key & 0xFF]++;
+		counts[1][(key >> 8) & 0xFF]++;
+		counts[2][(key >> 16) & 0xFF]++;
+		counts[3][key >> 24]++;
+	}
+
+	for (int pass = 0; pass < 4; pass++) {
+		int shift = pass * 8;
+		unsigned int *passCounts = counts[pass];
+		if (passCounts[(keys[0] >> shift) & 0xFF] == count) {
+			continue;
+		}
+		unsigned int offset = 0;
+		for (int digit = 0; digit < 256; digit++) {
+			unsigned int digitCount = passCounts[digit];
+			passCounts[digit] = offset;
+			offset += digitCount;
+		}
+		for (int i = 0; i < count; i++) {
+			unsigned int destination = passCounts[(keys[i] >> shift) & 0xFF]++;
+			keysScratch[destination] = keys[i];
+			indicesScratch[destination] = indices[i];
+		}
+		keys.swap(keysScratch);
+		indices.swap(indicesScratch);
+	}
+}
+
+void sortParticles(ParticleSystem &particleSystem, glm::vec3 cameraPosition, glm::vec3 cameraForward) {
+	int numParticles = particleSystem.numParticles;
 	if (numParticles == 0) {
 		return;
 	}
 
-	LARGE_INTEGER startingTime, endingTime, elapsedMicroseconds;
-	LARGE_INTEGER frequency;
-	QueryPerformanceFrequency(&frequency);
-	QueryPerformanceCounter(&startingTime);
-
 	// Rembember that parentTransformation will be column major
 	const float *parentTransformation = nullptr;
-	if (particle->getParentEntity() && particleSystem.followParent) {
-		parentTransformation = glm::value_ptr(getEntityTransformation(*particle->getParentEntity()));
+	glm::mat4 parentMatrix;
+	if (particleSystem.parentEntity && particleSystem.followParent) {
+		parentMatrix = getEntityTransformation(*particleSystem.parentEntity);
+		parentTransformation = glm::value_ptr(parentMatrix);
+	}
+
+	ParticleArrays &particles = particleSystem.particles;
+	ParticleSortBuffers &buffers = particleSystem.sortBuffers;
+	if (buffers.keys.size() < numParticles) {
+		int capacity = particleSystem.maxNumParticles;
+		buffers.keys.resize(capacity);
+		buffers.indices.resize(capacity);
+		buffers.keysScratch.resize(capacity);
+		buffers.indicesScratch.resize(capacity);
+		buffers.gather.resize(particles.positionX.size());
 	}
 
-	std::pair<float, int> *sortArray = new std::pair<float, int>[numParticles];
-	Particle *particleIterator = particle;
 	glm::vec3 position;
 	glm::vec3 distance;
 	for (int i = 0; i < numParticles; i++) {
+		glm::vec3 particlePosition = glm::vec3(particles.positionX[i], particles.positionY[i], particles.positionZ[i]);
 		if (parentTransformation) {
-			position.x = parentTransformation[0] * particleIterator->position.x + parentTransformation[4] * particleIterator->position.y + parentTransformation[8] * particleIterator->position.z + parentTransformation[12];
-			position.y = parentTransformation[1] * particleIterator->position.x + parentTransformation[5] * particleIterator->position.y + parentTransformation[9] * particleIterator->position.z + parentTransformation[13];
-			position.z = parentTransformation[2] * particleIterator->position.x + parentTransformation[6] * particleIterator->position.y + parentTransformation[10] * particleIterator->position.z + parentTransformation[14];
+			position.x = parentTransformation[0] * particlePosition.x + parentTransformation[4] * particlePosition.y + parentTransformation[8] * particlePosition.z + parentTransformation[12];
+			position.y = parentTransformation[1] * particlePosition.x + parentTransformation[5] * particlePosition.y + parentTransformation[9] * particlePosition.z + parentTransformation[13];
+			position.z = parentTransformation[2] * particlePosition.x + parentTransformation[6] * particlePosition.y + parentTransformation[10] * particlePosition.z + parentTransformation[14];
 		}
 		else {
-			position = particleIterator->position;
+			position = particlePosition;
 		}
 
 		distance = position - cameraPosition;
-		sortArray[i].first = distance.x * cameraForward.x + distance.y * cameraForward.y + distance.z * cameraForward.z;
-		sortArray[i].second = i;
+		// Inverted so that ascending keys draw the particles furthest away first
+		buffers.keys[i] = ~floatToSortableKey(distance.x * cameraForward.x + distance.y * cameraForward.y + distance.z * cameraForward.z);
+		buffers.indices[i] = i;
+	}
 
-		particleIterator++;
+	// The particles were sorted last frame and have barely moved since, so the order is
+	// usually nearly right and an insertion sort finishes quickly. Newly spawned and
+	// swap-removed particles can be far off though, so fall back to the radix sort when
+	// the insertion sort turns out to be the more expensive one.
+	if (!insertionSort(&buffers.keys[0], &buffers.indices[0], numParticles, 2 * numParticles)) {
+		radixSort(buffers.keys, buffers.indices, buffers.keysScratch, buffers.indicesScratch, numParticles);
 	}
 
-	Particle *particleCopy = new Particle[numParticles];
-	for (int i = 0; i < numParticles; i++) {
-		particleCopy[i] = particle[i];
+	bool isSorted = true;
+	for (int i = 0; i < numParticles && isSorted; i++) {
+		isSorted = buffers.indices[i] == i;
+	}
+	if (isSorted) {
+		return;
 	}
 
-	std::pair<float, int> *last = &sortArray[numParticles - 1];
-	std::sort(sortArray, last, [](std::pair<float, int> const &a, std::pair<float, int> const  &b) -> bool {
-		return a.first > b.first;
-	});
+	// Gather every array in sorted order
+	SimdFloatVector *arrays[] = {
+		&particles.positionX, &particles.positionY, &particles.positionZ,
+		&particles.velocityX, &particles.velocityY, &particles.velocityZ,
+		&particles.size, &particles.rotation, &particles.timeAlive, &particles.lifetime,
+	};
+	for (int a = 0; a < sizeof(arrays) / sizeof(arrays[0]); a++) {
+		SimdFloatVector &array = *arrays[a];
+		for (int i = 0; i < numParticles; i++) {
+			buffers.gather[i] = array[buffers.indices[i]];
+		}
+		array.swap(buffers.gather);
+	}
+}
 
-	for (int i = 0; i < numParticles; i++) {
-		particle[i] = particleCopy[sortArray[i].second];
+void ParticleArrays::resize(int capacity) {
+	// Room for a whole SSE vector past the last particle
+	int paddedCapacity = (capacity + 3) & ~3;
+	SimdFloatVector *arrays[] = {
+		&positionX, &positionY, &positionZ,
+		&velocityX, &velocityY, &velocityZ,
+		&size, &rotation, &timeAlive, &lifetime,
+	};
+	for (int i = 0; i < sizeof(arrays) / sizeof(arrays[0]); i++) {
+		arrays[i]->resize(paddedCapacity, 0);
 	}
+}
+
+void ParticleArrays::copy(int from, int to) {
+	positionX[to] = positionX[from];
+	positionY[to] = positionY[from];
+	positionZ[to] = positionZ[from];
+	velocityX[to] = velocityX[from];
+	velocityY[to] = velocityY[from];
+	velocityZ[to] = velocityZ[from];
+	size[to] = size[from];
+	rotation[to] = rotation[from];
+	timeAlive[to] = timeAlive[from];
+	lifetime[to] = lifetime[from];
+}
 
-	delete[] particleCopy;
-	delete[] sortArray;
+void integrateParticles(ParticleSystem &particleSystem, float dt) {
+	ParticleArrays &particles = particleSystem.particles;
+	float *positionX = particles.positionX.data();
+	float *positionY = particles.positionY.data();
+	float *positionZ = particles.positionZ.data();
+	const float *velocityX = particles.velocityX.data();
+	const float *velocityY = particles.velocityY.data();
+	const float *velocityZ = particles.velocityZ.data();
+	float *timeAlive = particles.timeAlive.data();
 
-	QueryPerformanceCounter(&endingTime);
-	elapsedMicroseconds.QuadPart = endingTime.QuadPart - startingTime.QuadPart;
-	elapsedMicroseconds.QuadPart *= 1000000;
-	elapsedMicroseconds.QuadPart /= frequency.QuadPart;
-	std::cout << elapsedMicroseconds.QuadPart << std::endl;
+	// The arrays are padded, so the last vector can run past numParticles
+	__m128 dt4 = _mm_set1_ps(dt);
+	for (int i = 0; i < particleSystem.numParticles; i += 4) {
+		_mm_store_ps(positionX + i, _mm_add_ps(_mm_load_ps(positionX + i), _mm_mul_ps(_mm_load_ps(velocityX + i), dt4)));
+		_mm_store_ps(positionY + i, _mm_add_ps(_mm_load_ps(positionY + i), _mm_mul_ps(_mm_load_ps(velocityY + i), dt4)));
+		_mm_store_ps(positionZ + i, _mm_add_ps(_mm_load_ps(positionZ + i), _mm_mul_ps(_mm_load_ps(velocityZ + i), dt4)));
+		_mm_store_ps(timeAlive + i, _mm_add_ps(_mm_load_ps(timeAlive + i), dt4));
+	}
 }
 
-void updateParticle(ParticleSystem &particleSystem, Particle &particle, float dt) {
-	particle.position = particle.position + particle.velocity * dt;
-	particle.timeAlive += dt;
+void removeDeadParticles(ParticleSystem &particleSystem) {
+	ParticleArrays &particles = particleSystem.particles;
+	const float *timeAlive = particles.timeAlive.data();
+	const float *lifetime = particles.lifetime.data();
+	int numParticles = particleSystem.numParticles;
+
+	int i = 0;
+	while (i < numParticles) {
+		// Skip 4 particles at a time while they are all alive
+		if (i + 4 <= numParticles && _mm_movemask_ps(_mm_cmplt_ps(_mm_loadu_ps(timeAlive + i), _mm_loadu_ps(lifetime + i))) == 0xF) {
+			i += 4;
+			continue;
+		}
+		if (timeAlive[i] >= lifetime[i]) {
+			// Replace with the last particle, which is checked next
+			numParticles--;
+			particles.copy(numParticles, i);
+		} else {
+			i++;
+		}
+	}
+	particleSystem.numParticles = numParticles;
 }
 
 void updateParticleSystem(ParticleSystem &particleSystem, glm::vec3 cameraPosition, glm::vec3 cameraDirection, float dt) {
+	simulateParticleSystem(particleSystem, dt);
+	sortParticles(particleSystem, cameraPosition, cameraDirection);
+}
+
+void simulateParticleSystem(ParticleSystem &particleSystem, float dt) {
 	// Update particles
-	for (int i = 0; i < particleSystem.numParticles; i++) {
-		updateParticle(particleSystem, particleSystem.particles[i], dt);
-		if (particleSystem.particles[i].timeAlive >= particleSystem.particles[i].lifetime) {
-			particleSystem.numParticles -= 1;
-			if (particleSystem.numParticles > 0) {
-				particleSystem.particles[i] = particleSystem.particles[particleSystem.numParticles];
-				i--;
-			}
-		}
-	}
+	integrateParticles(particleSystem, dt);
+	removeDeadParticles(particleSystem);
 
 	// Spawn new particles
 	particleSystem.timeSinceLastSpawn += dt;
@@ -111,26 +253,47 @@ void updateParticleSystem(ParticleSystem &particleSystem, glm::vec3 cameraPositi
 	glm::vec3 oldParentPositionDir = (parentPosition - particleSystem.parentEntityLastPosition);
 	glm::vec3 newOldPosition = parentTransformation[3];
 
+	ParticleArrays &particles = particleSystem.particles;
 	for (int i = 0; i < numParticlesToSpawn && particleSystem.numParticles < particleSystem.maxNumParticles; i++) {
-		Particle p = Particle();
-		float scale = random(particleSystem.minSize * 100, particleSystem.maxSize * 100) / 100.0f;
-		p.scale = glm::vec3(scale, scale, 1.0f);
-		p.lifetime = random(particleSystem.minLifetime * 100, particleSystem.maxLifetime * 100) / 100.0f;
-		p.velocity = generateParticleDirection(particleSystem) * particleSystem.velocity;
-		p.position = /*glm::normalize(p.velocity) * particleSystem.sphereRadiusSpawn */ /** dt * (float)i/(float)numParticlesToSpawn*/  particleSystem.position;
-		p.rotation = random(0, 3.14 * 100) / 100.0f;
+		int p = particleSystem.numParticles;
+		particles.size[p] = random(particleSystem.minSize * 100, particleSystem.maxSize * 100) / 100.0f;
+		particles.lifetime[p] = random(particleSystem.minLifetime * 100, particleSystem.maxLifetime * 100) / 100.0f;
+		particles.timeAlive[p] = 0;
+		glm::vec3 velocity = generateParticleDirection(particleSystem) * particleSystem.velocity;
+		glm::vec3 position = /*glm::normalize(velocity) * particleSystem.sphereRadiusSpawn */ /** dt * (float)i/(float)numParticlesToSpawn*/  particleSystem.position;
+		particles.rotation[p] = random(0, 3.14 * 100) / 100.0f;
 		if (!particleSystem.followParent) {
 			parentTransformation[3] = glm::vec4(parentPosition + oldParentPositionDir * (float)(i) / (float)numParticlesToSpawn, 1);
-			p.position = glm::vec3(parentTransformation * glm::vec4(p.position.x, p.position.y, p.position.z, 1));
+			position = glm::vec3(parentTransformation * glm::vec4(position.x, position.y, position.z, 1));
 		}
-		p.setParentEntity(particleSystem.parentEntity);
-		particleSystem.particles[particleSystem.numParticles] = p;
+		particles.positionX[p] = position.x;
+		particles.positionY[p] = position.y;
+		particles.positionZ[p] = position.z;
+		particles.velocityX[p] = velocity.x;
+		particles.velocityY[p] = velocity.y;
+		particles.velocityZ[p] = velocity.z;
 		particleSystem.numParticles += 1;
 		particleSystem.timeSinceLastSpawn = 0;
 	}
 	particleSystem.parentEntityLastPosition = newOldPosition;
+}
+void snapshotParticleSystem(ParticleSystem &particleSystem, ParticleSystemSnapshot &snapshot) {
+	snapshot.parentTransformation = glm::mat4();
+	snapshot.rotateBack = glm::mat4();
+	Entity *parentEntity = particleSystem.parentEntity;
+	if (parentEntity && particleSystem.followParent) {
+		snapshot.parentTransformation = getEntityTransformation(*parentEntity);
+		glm::quat rotation = directionToQuaternion(parentEntity->forward, parentEntity->up, DEFAULT_FORWARD, DEFAULT_UP);
+		snapshot.rotateBack = glm::inverse(glm::toMat4(rotation));
+	}
 
-	// Sort particles
-
-	sortParticles(particleSystem, particleSystem.particles, particleSystem.numParticles, cameraPosition, cameraDirection);
-}
\ No newline at end of file
+	const ParticleArrays &particles = particleSystem.particles;
+	snapshot.instances.resize(particleSystem.numParticles);
+	for (int i = 0; i < particleSystem.numParticles; i++) {
+		ParticleInstance &instance = snapshot.instances[i];
+		instance.position = glm::vec3(particles.positionX[i], particles.positionY[i], particles.positionZ[i]);
+		instance.rotation = particles.rotation[i];
+		instance.scale = glm::vec3(particles.size[i], particles.size[i], 1);
+		instance.progress = particles.timeAlive[i] / particles.lifetime[i];
+	}
+}
@@ -4,45 +4,50 @@
 
 #include "Common.h"
 
-// Make sure to update shader if this value changes
-const int NUM_PARTICLES_PER_DRAW_CALL = 100;
+// Instance buffers per particle system, the CPU writes one while the GPU may still read the others
+const int NUM_PARTICLE_INSTANCE_BUFFERS = 3;
 
-class Particle {
-public:
-	Particle(glm::vec3 position, glm::vec3 scale, glm::vec3 velocity, float lifetime) {
-		this->position = position;
-		this->velocity = velocity;
-		this->scale = scale;
-		this->lifetime = lifetime;
-	}
-	Particle() {
-
-	}
-	void setParentEntity(Entity *parentEntity) {
-		this->parentEntity = parentEntity;
-	}
-	Entity *getParentEntity() {
-		return this->parentEntity;
-	}
-	Entity *parentEntity;
-	glm::vec3 scale;
+// Per particle vertex attributes for instancedVS.glsl
+struct ParticleInstance {
 	glm::vec3 position;
-	float rotation = 0;
-	glm::vec3 velocity;
-	// Denotes the duration in seconds this particle has lived
-	float timeAlive = 0;
-	// Denotes the duration in seconds this particle should live
-	float lifetime;
+	float rotation;
+	glm::vec3 scale;
+	float progress;
+};
+
+// Particles stored as one array per attribute, particle i is element i of every array.
+// The arrays are aligned and padded to a multiple of 4 so they can be updated 4 particles
+// at a time with SSE. Particles are square, size scales x and y.
+struct ParticleArrays {
+	SimdFloatVector positionX, positionY, positionZ;
+	SimdFloatVector velocityX, velocityY, velocityZ;
+	SimdFloatVector size;
+	SimdFloatVector rotation;
+	// Duration in seconds the particle has lived
+	SimdFloatVector timeAlive;
+	// Duration in seconds the particle should live
+	SimdFloatVector lifetime;
+
+	void resize(int capacity);
+	// Copies particle from to particle to in every array
+	void copy(int from, int to);
+};
+
+// Scratch memory for sortParticles, kept between frames so sorting doesn't allocate
+struct ParticleSortBuffers {
+	std::vector<unsigned int> keys;
+	std::vector<unsigned int> indices;
+	std::vector<unsigned int> keysScratch;
+	std::vector<unsigned int> indicesScratch;
+	SimdFloatVector gather;
 };
 
 class ParticleSystem {
 public:
 	ParticleSystem(int maxNumParticles) {
 		this->maxNumParticles = maxNumParticles;
-		particles = new Particle[maxNumParticles];
-	}
-	~ParticleSystem() {
-		delete particles;
+		this->numParticles = 0;
+		particles.resize(maxNumParticles);
 	}
 	void setDirection(float minX, float maxX, float minY, float maxY, float minZ, float maxZ) {
 		this->minX = minX;
@@ -66,13 +71,49 @@ public:
 	float minSize = 1;
 	float maxSize = 1;
 	float sphereRadiusSpawn = 1;
-	Particle *particles;
+	ParticleArrays particles;
+	ParticleSortBuffers sortBuffers;
 	float minX, maxX, minZ, maxZ, minY, maxY;
+	// Particles are in the space of the parent entity when followParent is set
 	Entity *parentEntity;
 	// Used for spawning particles in between frames
 	glm::vec3 parentEntityLastPosition = glm::vec3(0, 0, 0);
 	bool followParent = false;
+	// Persistently mapped, NUM_PARTICLE_INSTANCE_BUFFERS * maxNumParticles instances.
+	// Created on the first renderParticleSystem.
+	GLuint instanceBuffer = 0;
+	ParticleInstance *instances = nullptr;
+	GLsync instanceBufferFences[NUM_PARTICLE_INSTANCE_BUFFERS] = {};
+	int currentInstanceBuffer = 0;
 };
 
+// Moves every particle along its velocity and ages it by dt seconds
+void integrateParticles(ParticleSystem &particleSystem, float dt);
+
+// Removes the particles that have outlived their lifetime by moving the last particles into their place
+void removeDeadParticles(ParticleSystem &particleSystem);
+
+// Orders the particles back to front along cameraForward for blending
+void sortParticles(ParticleSystem &particleSystem, glm::vec3 cameraPosition, glm::vec3 cameraForward);
+
+// Integrates, removes and spawns particles. Safe to run as a job alongside other particle
+// systems once the parent entity's transformation is up to date.
+void simulateParticleSystem(ParticleSystem &particleSystem, float dt);
+
+// What renderParticleSystem draws of a particle system, taken so it can be drawn while the
+// system and its parent entity are updated for the next frame
+struct ParticleSystemSnapshot {
+	std::vector<ParticleInstance> instances;
+	// Identity unless the particles follow the parent entity
+	glm::mat4 parentTransformation;
+	// Undoes the parent's rotation before the particles are turned to face the camera
+	glm::mat4 rotateBack;
+};
+
+// Copies the particles, in their current order, and the parent's transformation. The
+// parent's transformation has to be up to date.
+void snapshotParticleSystem(ParticleSystem &particleSystem, ParticleSystemSnapshot &snapshot);
+
+// simulateParticleSystem and sortParticles
 // cameraPosition and cameraDirection is needed for depth sorting
-void updateParticleSystem(ParticleSystem &particleSystem, glm::vec3 cameraPosition, glm::vec3 cameraDirection, float dt);
\ No newline at end of file
+void updateParticleSystem(ParticleSystem &particleSystem, glm::vec3 cameraPosition, glm::vec3 cameraDirection, float dt);
@@ -8,7 +8,7 @@
 void steerAirplane(Entity &main, Entity &aileronLeft, Entity &aileronRight, Entity &leftFlap, Entity &rightFlap, int thrust, int roll, int pitch, float dt) {
 	// Roll
 	{
-		float rotAmountRoll = -dt * 1.9f;
+		float rotAmountRoll = -dt * CONTROL_SURFACE_SPEED;
 		if (roll) {
 			rotAmountRoll *= (float)roll;
 		}
@@ -17,7 +17,7 @@ void steerAirplane(Entity &main, Entity &aileronLeft, Entity &aileronRight, Enti
 		}
 
 		glm::vec3 rotAxis = glm::normalize(glm::vec3(1, 0, 0));
-		const float maxAngleRoll = 0.7f;
+		const float maxAngleRoll = MAX_CONTROL_SURFACE_ANGLE;
 
 		rotateEntity(aileronLeft, rotAxis, -rotAmountRoll);
 		rotateEntity(aileronRight, rotAxis, rotAmountRoll);
@@ -34,7 +34,7 @@ void steerAirplane(Entity &main, Entity &aileronLeft, Entity &aileronRight, Enti
 	
 	// Pitch
 	{
-		float rotAmountPitch = -dt * 1.9f;
+		float rotAmountPitch = -dt * CONTROL_SURFACE_SPEED;
 		if (pitch) {
 			rotAmountPitch *= -(float)pitch;
 		}
@@ -43,7 +43,7 @@ void steerAirplane(Entity &main, Entity &aileronLeft, Entity &aileronRight, Enti
 		}
 
 		glm::vec3 rotAxis = glm::normalize(glm::vec3(1, 0, 0));
-		const float maxAnglePitch = 0.7f;
+		const float maxAnglePitch = MAX_CONTROL_SURFACE_ANGLE;
 
 		rotateEntity(leftFlap, rotAxis, rotAmountPitch);
 		rotateEntity(rightFlap, rotAxis, rotAmountPitch);
@@ -58,22 +58,26 @@ void steerAirplane(Entity &main, Entity &aileronLeft, Entity &aileronRight, Enti
 		}
 	}
 
-	float maxThrustForce = 40000 * log(1 + glm::length(main.velocity) / 60) + 1000; // Newtons
+	glm::vec3 thrustForce = main.forward * airplaneThrustForce(thrust, glm::length(main.velocity));
+	main.impulse = thrustForce;
+}
+
+float airplaneThrustForce(int thrust, float speed) {
+	float maxThrustForce = 40000 * log(1 + speed / 60) + 1000; // Newtons
 
 	//std::cout << maxThrustForce << std::endl;
 
-	float maxBreakForce = glm::length(main.velocity) * 1000 + 1000; // Newtons
-	glm::vec3 thrustForce = main.forward * (float)thrust * (thrust == 1 ? maxThrustForce : maxBreakForce);
-	main.impulse = thrustForce;
+	float maxBreakForce = speed * 1000 + 1000; // Newtons
+	return (float)thrust * (thrust == 1 ? maxThrustForce : maxBreakForce);
 }
 
 // dt in seconds
 // assumes 1 distance unit in the game is 1 meter
 void airplanePhysics(Entity &entity, Entity &aileronLeft, Entity &leftFlap, float dt) {
-	float mass = 1000;
-	float gravitationalAcceleration = 4.82f;
-	float airResistanceConstant = 10; // Includes density and area
-	float liftConstant = 160;
+	float mass = AIRPLANE_MASS;
+	float gravitationalAcceleration = AIRPLANE_GRAVITATIONAL_ACCELERATION;
+	float airResistanceConstant = AIRPLANE_AIR_RESISTANCE_CONSTANT;
+	float liftConstant = AIRPLANE_LIFT_CONSTANT;
 
 	glm::vec3 &up = entity.up;
 	glm::vec3 &forward = entity.forward;
@@ -96,7 +100,7 @@ void airplanePhysics(Entity &entity, Entity &aileronLeft, Entity &leftFlap, floa
 	if (glm::dot(leftFlap.forward, DEFAULT_UP) < 0) { // Lift
 		attackAnglePitch = -attackAnglePitch;
 	}
-	float rotationSpeedPitch = 0.0003f * attackAnglePitch * glm::length(velocity);
+	float rotationSpeedPitch = AIRPLANE_PITCH_RATE * attackAnglePitch * glm::length(velocity) * dt;
 	glm::vec3 right = glm::normalize(glm::cross(forward, up));
 	rotateEntity(entity, right, rotationSpeedPitch);
 	
@@ -105,7 +109,7 @@ void airplanePhysics(Entity &entity, Entity &aileronLeft, Entity &leftFlap, floa
 	if (glm::dot(aileronLeft.forward, DEFAULT_UP) < 0) { // Lift
 		attackAngleRoll = -attackAngleRoll;
 	}
-	float rotationSpeedRoll = 0.001f * attackAngleRoll * glm::length(velocity);
+	float rotationSpeedRoll = AIRPLANE_ROLL_RATE * attackAngleRoll * glm::length(velocity) * dt;
 	up = glm::normalize(glm::rotate(up, rotationSpeedRoll, forward));
 
 
@@ -130,10 +134,104 @@ void normalPhysics(Entity &entity, float dt) {
 	entity.position = entity.position + entity.velocity * dt;
 }
 
+// dt in seconds, impulse is a change in velocity applied once
 void runPhysics(Entity &entity, float dt) {
-	glm::vec3 gravity = glm::vec3(0, -0.4f, 0);
-	glm::vec3 netForce = entity.impulse + gravity;
+	glm::vec3 gravity = glm::vec3(0, -24.0f, 0); // Was 0.4 per frame at 60 frames per second
+	entity.velocity = entity.velocity + entity.impulse + gravity * dt;
 	entity.impulse = glm::vec3(0, 0, 0);
-	entity.velocity = entity.velocity + netForce;
 	entity.position = entity.position + entity.velocity * dt;
-}
\ No newline at end of file
+}
+
+void savePhysicsStates(const std::vector<Entity*> &entities, std::vector<PhysicsState> &states) {
+	states.resize(entities.size());
+	for (int i = 0; i < entities.size(); i++) {
+		states[i].position = entities[i]->position;
+		states[i].forward = entities[i]->forward;
+		states[i].up = entities[i]->up;
+	}
+}
+
+void loadPhysicsStates(std::vector<Entity*> &entities, const std::vector<PhysicsState> &states) {
+	for (int i = 0; i < entities.size(); i++) {
+		entities[i]->position = states[i].position;
+		entities[i]->forward = states[i].forward;
+		entities[i]->up = states[i].up;
+	}
+}
+
+PhysicsState interpolatePhysicsState(const PhysicsState &previous, const PhysicsState &current, float alpha) {
+	PhysicsState state;
+	state.position = glm::mix(previous.position, current.position, alpha);
+	// Directions turn very little in one tick, so normalized linear interpolation is close enough to slerp
+	state.forward = glm::normalize(glm::mix(previous.forward, current.forward, alpha));
+	state.up = glm::normalize(glm::mix(previous.up, current.up, alpha));
+	return state;
+}
+
+void interpolatePhysicsStates(std::vector<Entity*> &entities, const std::vector<PhysicsState> &previous, const std::vector<PhysicsState> &current, float alpha) {
+	for (int i = 0; i < entities.size(); i++) {
+		const PhysicsState &from = previous[i];
+		const PhysicsState &to = current[i];
+		if (from.position == to.position && from.forward == to.forward && from.up == to.up) {
+			continue;
+		}
+		PhysicsState state = interpolatePhysicsState(from, to, alpha);
+		entities[i]->position = state.position;
+		entities[i]->forward = state.forward;
+		entities[i]->up = state.up;
+	}
+}
+
+float getHeightAt(float *heightmap, int size, float tileSize, float positionX, float positionZ) {
+	int tileX = positionX / tileSize;
+	int tileZ = positionZ / tileSize;
+
+	// Find the four corners of the grid
+	glm::vec3 topLeftCorner = glm::vec3(tileX * tileSize, heightmap[tileX + tileZ * size], tileZ * tileSize);
+	glm::vec3 bottomRightCorner = glm::vec3((tileX + 1) * tileSize, heightmap[tileX + (tileZ + 1) * size + 1], (tileZ + 1) * tileSize);
+	glm::vec3 topRightCorner = glm::vec3((tileX + 1) * tileSize, heightmap[tileX + tileZ * size + 1], tileZ * tileSize);
+	glm::vec3 bottomLeftCorner = glm::vec3(tileX  * tileSize, heightmap[tileX + (tileZ + 1) * size], (tileZ + 1) * tileSize);
+
+	// Calculate tile penetration
+	float tilePenetrationX = ((int)(positionX * 100) % (int)(tileSize * 100)) / (tileSize * 100);
+	float tilePenetrationZ = ((int)(positionZ * 100) % (int)(tileSize * 100)) / (tileSize * 100);
+
+	float calculatedY;
+	// Check if top left triangle
+	if (tilePenetrationX <= 1 - tilePenetrationZ) {
+		glm::vec3 one = topLeftCorner;
+		glm::vec3 two = topRightCorner;
+		glm::vec3 three = bottomLeftCorner;
+		GLfloat lambda1N = ((two.z - three.z)*(positionX - three.x) + (three.x - two.x)*(positionZ - three.z));
+		GLfloat lambda1D = ((two.z - three.z)*(one.x - three.x) + (three.x - two.x)*(one.z - three.z));
+		GLfloat lambda1 = lambda1N / lambda1D;
+		GLfloat lambda2N = ((three.z - one.z)*(positionX - three.x) + (one.x - three.x)*(positionZ - three.z));
+		GLfloat lambda2D = ((two.z - three.z)*(one.x - three.x) + (three.x - two.x)*(one.z - three.z));
+		GLfloat lambda2 = lambda2N / lambda2D;
+		GLfloat lambda3 = 1 - lambda1 - lambda2;
+		calculatedY = one.y * lambda1 + two.y * lambda2 + three.y * lambda3;
+	} else {
+		glm::vec3 one = bottomRightCorner;
+		glm::vec3 two = topRightCorner;
+		glm::vec3 three = bottomLeftCorner;
+		GLfloat lambda1N = ((two.z - three.z)*(positionX - three.x) + (three.x - two.x)*(positionZ - three.z));
+		GLfloat lambda1D = ((two.z - three.z)*(one.x - three.x) + (three.x - two.x)*(one.z - three.z));
+		GLfloat lambda1 = lambda1N / lambda1D;
+		GLfloat lambda2N = ((three.z - one.z)*(positionX - three.x) + (one.x - three.x)*(positionZ - three.z));
+		GLfloat lambda2D = ((two.z - three.z)*(one.x - three.x) + (three.x - two.x)*(one.z - three.z));
+		GLfloat lambda2 = lambda2N / lambda2D;
+		GLfloat lambda3 = 1 - lambda1 - lambda2;
+		calculatedY = one.y * lambda1 + two.y * lambda2 + three.y * lambda3;
+	}
+
+	return calculatedY;
+}
+
+// Should also interpolate over triangle
+void terrainCollision(float *heightmap, int size, float tileSize, Entity &entity) {
+	float height = getHeightAt(heightmap, size, tileSize, entity.position.x, entity.position.z);
+	if (height > entity.position.y + entity.centerToGroundContactPoint) {
+		entity.position.y = height - entity.centerToGroundContactPoint;
+		entity.velocity.y = 0;
+	}
+}
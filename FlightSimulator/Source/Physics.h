@@ -1,13 +1,52 @@
 #pragma once
 
 #include <glm\vec3.hpp>
+#include <vector>
 
 #include "Common.h"
 
+// Flight model constants shared by airplanePhysics and the airplanes of an AirplaneFleet
+const float AIRPLANE_MASS = 1000; // Kilograms
+const float AIRPLANE_GRAVITATIONAL_ACCELERATION = 4.82f;
+const float AIRPLANE_AIR_RESISTANCE_CONSTANT = 10; // Includes density and area
+const float AIRPLANE_LIFT_CONSTANT = 160;
+// Radians per second per unit of speed the airplane turns with a control surface at 1 radian
+const float AIRPLANE_PITCH_RATE = 0.018f;
+const float AIRPLANE_ROLL_RATE = 0.06f;
+// Radians per second the control surfaces move, and how far they can move
+const float CONTROL_SURFACE_SPEED = 1.9f;
+const float MAX_CONTROL_SURFACE_ANGLE = 0.7f;
+
 void steerAirplane(Entity &main, Entity &aileronLeft, Entity &aileronRight, Entity &leftFlap, Entity &rightFlap, int thrust, int roll, int pitch, float dt);
 
+// Force in Newtons along forward for thrust 1, or against it when braking with -1
+float airplaneThrustForce(int thrust, float speed);
+
 void airplanePhysics(Entity &entity, Entity &aileronLeft, Entity &leftFlap, float dt);
 
 void normalPhysics(Entity &entity, float dt);
 
-void runPhysics(Entity &entity, float dt);
\ No newline at end of file
+void runPhysics(Entity &entity, float dt);
+
+// Height of the terrain at a world position inside the heightmap
+float getHeightAt(float *heightmap, int size, float tileSize, float positionX, float positionZ);
+
+void terrainCollision(float *heightmap, int size, float tileSize, Entity &entity);
+
+// Where an entity is at the end of a simulation tick, rendering blends between the last two
+struct PhysicsState {
+	glm::vec3 position;
+	glm::vec3 forward;
+	glm::vec3 up;
+};
+
+void savePhysicsStates(const std::vector<Entity*> &entities, std::vector<PhysicsState> &states);
+
+void loadPhysicsStates(std::vector<Entity*> &entities, const std::vector<PhysicsState> &states);
+
+// alpha 0 gives previous and 1 gives current
+PhysicsState interpolatePhysicsState(const PhysicsState &previous, const PhysicsState &current, float alpha);
+
+// Moves the entities alpha of the way from their previous to their current states. Entities
+// that didn't move are left untouched so their cached transformations stay valid.
+void interpolatePhysicsStates(std::vector<Entity*> &entities, const std::vector<PhysicsState> &previous, const std::vector<PhysicsState> &current, float alpha);
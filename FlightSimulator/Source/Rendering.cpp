@@ -8,111 +8,331 @@
 #include <glm/gtx/rotate_vector.hpp> 
 #include <glm/gtx/quaternion.hpp>
 
+#include <algorithm>
+#include <cstddef>
+
 #include "Rendering.h"
 
-void bindLight(GLuint shaderProgram, std::vector<Light*> lights) {
-	glUseProgram(shaderProgram);
+// Layouts match the std140 blocks in common.glsl
+struct CameraBlock {
+	glm::mat4 worldToView;
+	glm::mat4 projectionMatrix;
+	glm::vec4 viewPosition;
+};
+
+struct MaterialBlock {
+	glm::vec3 Ka;
+	float specularExponent;
+	glm::vec3 Kd;
+	float dissolve;
+	glm::vec3 Ks;
+	int useLights;
+	glm::vec4 color;
+};
+
+// Layout of the std430 Lights block in common.glsl, followed by numLights LightData
+struct LightBlockHeader {
+	int numLights;
+	int numDirectionalLights;
+	int padding[2];
+};
+
+// Layout of the std430 LightClusters block in common.glsl, followed by NUM_LIGHT_CLUSTERS LightCluster
+struct LightClusterBlockHeader {
+	glm::ivec4 gridSize;
+	glm::vec4 depthSlice; // Scale and bias
+};
+
+static GLuint cameraBuffer = 0;
+static GLuint materialBuffer = 0;
+static GLuint lightBuffer = 0;
+static GLuint lightClusterBuffer = 0;
+static GLuint lightIndexBuffer = 0;
+static GLsizeiptr lightIndexBufferSize = 0;
+static LightClusters lightClusters;
+static glm::mat4 lightClusterProjection = glm::mat4(0);
+static bool useLegacyUniforms = false;
+static CameraBlock legacyCamera;
+
+static const char *shaderUniformNames[NUM_SHADER_UNIFORMS] = {
+	"modelToWorld",
+	"parentTransformation",
+	"interpolation",
+	"atlasSize",
+	"billboardRotation",
+};
+
+// Samplers always read from the same texture unit, so they are only set once at link time,
+// unless with legacy uniforms
+static const struct {
+	const char *name;
+	GLint textureUnit;
+} samplerTextureUnits[] = {
+	{ "tex", 0 },
+	{ "tex2", 1 },
+	{ "tex3", 2 },
+	{ "tex4", 3 },
+	{ "normalMap", 4 },
+	{ "virtualPageTable", 5 },
+	{ "virtualAtlas", 6 },
+	{ "cubeMap", 10 },
+	{ "cubeMap2", 11 },
+};
+
+void setLegacyUniforms(bool isLegacy) {
+	useLegacyUniforms = isLegacy;
+}
+
+// With legacy uniforms the location is looked up by name on every call
+static GLint getUniformLocation(const Shader &shader, ShaderUniform uniform) {
+	return useLegacyUniforms ? glGetUniformLocation(shader.program, shaderUniformNames[uniform]) : shader.getUniformLocation(uniform);
+}
+
+// Sets the camera, the material if there is one and the samplers of the program in use as
+// plain uniforms, looking every one up by name
+static void uploadLegacyUniforms(GLuint program, const MaterialBlock *material) {
+	glUniformMatrix4fv(glGetUniformLocation(program, "worldToView"), 1, GL_FALSE, glm::value_ptr(legacyCamera.worldToView));
+	glUniformMatrix4fv(glGetUniformLocation(program, "projectionMatrix"), 1, GL_FALSE, glm::value_ptr(legacyCamera.projectionMatrix));
+	glUniform4fv(glGetUniformLocation(program, "viewPosition"), 1, glm::value_ptr(legacyCamera.viewPosition));
+	if (material) {
+		glUniform3fv(glGetUniformLocation(program, "Ka"), 1, glm::value_ptr(material->Ka));
+		glUniform3fv(glGetUniformLocation(program, "Kd"), 1, glm::value_ptr(material->Kd));
+		glUniform3fv(glGetUniformLocation(program, "Ks"), 1, glm::value_ptr(material->Ks));
+		glUniform1f(glGetUniformLocation(program, "specularExponent"), material->specularExponent);
+		glUniform1f(glGetUniformLocation(program, "dissolve"), material->dissolve);
+		glUniform4fv(glGetUniformLocation(program, "color"), 1, glm::value_ptr(material->color));
+		glUniform1i(glGetUniformLocation(program, "useLights"), material->useLights);
+	}
+	for (int i = 0; i < sizeof(samplerTextureUnits) / sizeof(samplerTextureUnits[0]); i++) {
+		GLint location = glGetUniformLocation(program, samplerTextureUnits[i].name);
+		if (location != -1) {
+			glUniform1i(location, samplerTextureUnits[i].textureUnit);
+		}
+	}
+}
+
+static GLuint createStorageBuffer(GLsizeiptr size, GLuint binding) {
+	GLuint buffer = 0;
+	glGenBuffers(1, &buffer);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffer);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, size, nullptr, GL_DYNAMIC_DRAW);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, binding, buffer);
+	return buffer;
+}
+
+static GLuint createUniformBuffer(GLsizeiptr size, GLuint binding) {
+	GLuint buffer = 0;
+	glGenBuffers(1, &buffer);
+	glBindBuffer(GL_UNIFORM_BUFFER, buffer);
+	glBufferData(GL_UNIFORM_BUFFER, size, nullptr, GL_DYNAMIC_DRAW);
+	glBindBufferBase(GL_UNIFORM_BUFFER, binding, buffer);
+	return buffer;
+}
+
+void initUniformBuffers() {
+	cameraBuffer = createUniformBuffer(sizeof(CameraBlock), CAMERA_UNIFORM_BINDING);
+	materialBuffer = createUniformBuffer(sizeof(MaterialBlock), MATERIAL_UNIFORM_BINDING);
+	lightBuffer = createStorageBuffer(sizeof(LightBlockHeader) + MAX_LIGHTS * sizeof(LightData), LIGHT_STORAGE_BINDING);
+	lightClusterBuffer = createStorageBuffer(sizeof(LightClusterBlockHeader) + NUM_LIGHT_CLUSTERS * sizeof(LightCluster), LIGHT_CLUSTER_STORAGE_BINDING);
+	// Grows when needed, see uploadLights
+	lightIndexBufferSize = NUM_LIGHT_CLUSTERS * sizeof(GLuint);
+	lightIndexBuffer = createStorageBuffer(lightIndexBufferSize, LIGHT_INDEX_STORAGE_BINDING);
+}
+
+void bindCamera(const glm::mat4 &worldToView, const glm::mat4 &perspective) {
+	CameraBlock camera;
+	camera.worldToView = worldToView;
+	camera.projectionMatrix = perspective;
+	camera.viewPosition = glm::inverse(worldToView)[3];
+	if (useLegacyUniforms) {
+		legacyCamera = camera;
+		return;
+	}
+	glNamedBufferSubData(cameraBuffer, 0, sizeof(CameraBlock), &camera);
+}
+
+GLint Shader::getUniformLocation(const std::string &name) const {
+	std::unordered_map<std::string, GLint>::const_iterator iter = uniformsByName.find(name);
+	return iter == uniformsByName.end() ? -1 : iter->second;
+}
+
+int prepareLights(std::vector<Light*> &lights, const glm::mat4 &worldToView, const glm::mat4 &perspective, PreparedLights &prepared) {
+	static std::vector<LightData> worldLights;
+	worldLights.clear();
 	for (int i = 0; i < lights.size(); i++) {
 		Light *light = lights[i];
 		glm::mat4 transformation = getEntityTransformation(*light);
-		glm::vec4 worldPosition = transformation * glm::vec4(0, 0, 0, 1);
-		glm::vec4 worldForward = glm::normalize(transformation * glm::vec4(0, 0, 1, 0));
-		glUniform3f(glGetUniformLocation(shaderProgram, (std::string("lights[") + std::to_string(i) + std::string("].position")).c_str()), worldPosition.x, worldPosition.y, worldPosition.z);
-		glUniform3f(glGetUniformLocation(shaderProgram, (std::string("lights[") + std::to_string(i) + std::string("].direction")).c_str()), worldForward.x, worldForward.y, worldForward.z);
-		glUniform3f(glGetUniformLocation(shaderProgram, (std::string("lights[") + std::to_string(i) + std::string("].color")).c_str()), light->color.x, light->color.y, light->color.z);
-		glUniform1f(glGetUniformLocation(shaderProgram, (std::string("lights[") + std::to_string(i) + std::string("].intensity")).c_str()), light->intensity);
-		glUniform1i(glGetUniformLocation(shaderProgram, (std::string("lights[") + std::to_string(i) + std::string("].type")).c_str()), light->lightType);
-		glUniform1f(glGetUniformLocation(shaderProgram, (std::string("lights[") + std::to_string(i) + std::string("].cutoffAngle")).c_str()), light->cutoffAngle);
-		glUniform1f(glGetUniformLocation(shaderProgram, (std::string("lights[") + std::to_string(i) + std::string("].attenuationC1")).c_str()), light->attenuationC1);
-		glUniform1f(glGetUniformLocation(shaderProgram, (std::string("lights[") + std::to_string(i) + std::string("].attenuationC2")).c_str()), light->attenuationC2);
-		light++;
+		LightData data;
+		data.position = glm::vec3(transformation * glm::vec4(0, 0, 0, 1));
+		data.direction = glm::normalize(glm::vec3(transformation * glm::vec4(0, 0, 1, 0)));
+		data.type = light->lightType;
+		data.color = light->color;
+		data.intensity = light->intensity;
+		data.cosCutoffAngle = cos(light->cutoffAngle);
+		data.cosOuterCutoffAngle = cos(light->cutoffAngle + 0.02f);
+		data.attenuationC1 = light->attenuationC1;
+		data.attenuationC2 = light->attenuationC2;
+		data.radius = lightRadius(data.type, data.intensity, data.color, data.attenuationC1);
+		worldLights.push_back(data);
+	}
+	glm::vec3 cameraPosition = glm::vec3(glm::inverse(worldToView)[3]);
+	std::vector<LightData> &visibleLights = prepared.lights;
+	cullLights(worldLights, Frustum(perspective * worldToView), cameraPosition, MAX_LIGHTS, visibleLights);
+
+	// cullLights sorts the directional lights first
+	prepared.numDirectionalLights = 0;
+	while (prepared.numDirectionalLights < visibleLights.size() && visibleLights[prepared.numDirectionalLights].type == LIGHT_DATA_DIRECTIONAL) {
+		prepared.numDirectionalLights++;
+	}
+
+	if (perspective != lightClusterProjection) {
+		lightClusterProjection = perspective;
+		lightClusters.setProjection(perspective);
 	}
+	lightClusters.assignLights(visibleLights, worldToView);
+	prepared.depthSliceScale = lightClusters.getDepthSliceScale();
+	prepared.depthSliceBias = lightClusters.getDepthSliceBias();
+	prepared.clusters = lightClusters.getClusters();
+	prepared.lightIndices = lightClusters.getLightIndices();
+	return visibleLights.size();
 }
 
-void renderEntity(Entity &entity, GLuint shaderProgram, glm::mat4 &worldToView, glm::mat4 &perspective, bool useLights) {
-	glUseProgram(shaderProgram);
-	glm::mat4 transformation = getEntityTransformation(entity);
-	glUniformMatrix4fv(glGetUniformLocation(shaderProgram, "worldToView"), 1, GL_FALSE, glm::value_ptr(worldToView));
-	glUniformMatrix4fv(glGetUniformLocation(shaderProgram, "projectionMatrix"), 1, GL_FALSE, glm::value_ptr(perspective));
-	glUniformMatrix4fv(glGetUniformLocation(shaderProgram, "modelToWorld"), 1, GL_FALSE, glm::value_ptr(transformation));
+void uploadLights(const PreparedLights &prepared) {
+	const std::vector<LightData> &visibleLights = prepared.lights;
+	LightBlockHeader header = {};
+	header.numLights = visibleLights.size();
+	header.numDirectionalLights = prepared.numDirectionalLights;
+	glNamedBufferSubData(lightBuffer, 0, sizeof(LightBlockHeader), &header);
+	if (!visibleLights.empty()) {
+		glNamedBufferSubData(lightBuffer, sizeof(LightBlockHeader), visibleLights.size() * sizeof(LightData), &visibleLights[0]);
+	}
 
-	Model model = entity.getModel();
-	glUniform3f(glGetUniformLocation(shaderProgram, "Ka"), entity.getModel().Ka.x, entity.getModel().Ka.y, entity.getModel().Ka.z);
-	glUniform3f(glGetUniformLocation(shaderProgram, "Kd"), entity.getModel().Kd.x, entity.getModel().Kd.y, entity.getModel().Kd.z);
-	glUniform3f(glGetUniformLocation(shaderProgram, "Ks"), entity.getModel().Ks.x, entity.getModel().Ks.y, entity.getModel().Ks.z);
-	glUniform1f(glGetUniformLocation(shaderProgram, "specularExponent"), entity.getModel().Ns);
-	glUniform1f(glGetUniformLocation(shaderProgram, "dissolve"), entity.getModel().d);
-	glUniform4f(glGetUniformLocation(shaderProgram, "color"), model.color.x, model.color.y, model.color.z, model.color.w);
+	LightClusterBlockHeader clusterHeader;
+	clusterHeader.gridSize = glm::ivec4(LIGHT_CLUSTERS_X, LIGHT_CLUSTERS_Y, LIGHT_CLUSTERS_Z, 0);
+	clusterHeader.depthSlice = glm::vec4(prepared.depthSliceScale, prepared.depthSliceBias, 0, 0);
+	glNamedBufferSubData(lightClusterBuffer, 0, sizeof(LightClusterBlockHeader), &clusterHeader);
+	glNamedBufferSubData(lightClusterBuffer, sizeof(LightClusterBlockHeader), NUM_LIGHT_CLUSTERS * sizeof(LightCluster), &prepared.clusters[0]);
+
+	const std::vector<unsigned int> &lightIndices = prepared.lightIndices;
+	GLsizeiptr lightIndicesSize = lightIndices.size() * sizeof(GLuint);
+	if (lightIndicesSize > lightIndexBufferSize) {
+		lightIndexBufferSize = std::max(lightIndicesSize, 2 * lightIndexBufferSize);
+		glNamedBufferData(lightIndexBuffer, lightIndexBufferSize, nullptr, GL_DYNAMIC_DRAW);
+	}
+	if (!lightIndices.empty()) {
+		glNamedBufferSubData(lightIndexBuffer, 0, lightIndicesSize, &lightIndices[0]);
+	}
+}
 
-	glUniform1i(glGetUniformLocation(shaderProgram, "useLights"), useLights);
+// Sets up shader, uniforms, textures and vertex array for drawing the entity's model
+static void bindEntity(Entity &entity, const glm::mat4 &transformation, const Shader &shader, bool useLights) {
+	glUseProgram(shader.program);
+	glUniformMatrix4fv(getUniformLocation(shader, UNIFORM_MODEL_TO_WORLD), 1, GL_FALSE, glm::value_ptr(transformation));
+
+	Model &model = entity.getModel();
+	MaterialBlock material;
+	material.Ka = model.Ka;
+	material.Kd = model.Kd;
+	material.Ks = model.Ks;
+	material.specularExponent = model.Ns;
+	material.dissolve = model.d;
+	material.color = model.color;
+	material.useLights = useLights;
+	if (useLegacyUniforms) {
+		uploadLegacyUniforms(shader.program, &material);
+	} else {
+		glNamedBufferSubData(materialBuffer, 0, sizeof(MaterialBlock), &material);
+	}
 
-	glBindVertexArray(entity.getModel().vao);
+	glBindVertexArray(model.vao);
 	glActiveTexture(GL_TEXTURE0);
 	glBindTexture(GL_TEXTURE_2D, entity.textureId);
-	glUniform1i(glGetUniformLocation(shaderProgram, "tex"), 0);
 	glActiveTexture(GL_TEXTURE4);
 	glBindTexture(GL_TEXTURE_2D, entity.normalMapId);
-	glUniform1i(glGetUniformLocation(shaderProgram, "normalMap"), 4);
-	glDrawElements(GL_TRIANGLES, entity.getModel().numIndices, GL_UNSIGNED_INT, (void*)(entity.getModel().offset * sizeof(GLuint)));
 }
 
-void renderTerrain(Terrain &terrain, GLuint shaderProgram, glm::mat4 &worldToView, glm::mat4 &perspective) {
-	glUseProgram(shaderProgram);
+void renderEntity(Entity &entity, const glm::mat4 &transformation, const Shader &shader, bool useLights) {
+	bindEntity(entity, transformation, shader, useLights);
+	Model &model = entity.getModel();
+	glDrawElements(GL_TRIANGLES, model.numIndices, model.indexType, (void*)(size_t)(model.offset * getIndexSize(model.indexType)));
+}
+
+// Only the given index ranges are drawn, in one multi draw call
+void renderTerrain(Terrain &terrain, const glm::mat4 &transformation, const Shader &shader, const std::vector<IndexRange> &ranges) {
+	if (ranges.empty()) {
+		return;
+	}
+
 	glActiveTexture(GL_TEXTURE1);
 	glBindTexture(GL_TEXTURE_2D, terrain.getTextureId2());
 	glActiveTexture(GL_TEXTURE2);
 	glBindTexture(GL_TEXTURE_2D, terrain.getTextureId3());
 	glActiveTexture(GL_TEXTURE3);
 	glBindTexture(GL_TEXTURE_2D, terrain.getTextureId4());
-	glUniform1i(glGetUniformLocation(shaderProgram, "tex2"), 1);
-	glUniform1i(glGetUniformLocation(shaderProgram, "tex3"), 2);
-	glUniform1i(glGetUniformLocation(shaderProgram, "tex4"), 3);
-	renderEntity(terrain, shaderProgram, worldToView, perspective, true);
+	glActiveTexture(GL_TEXTURE5);
+	glBindTexture(GL_TEXTURE_2D, terrain.getPageTableTextureId());
+	glActiveTexture(GL_TEXTURE6);
+	glBindTexture(GL_TEXTURE_2D, terrain.getAtlasTextureId());
+	bindEntity(terrain, transformation, shader, true);
+
+	std::vector<GLsizei> counts(ranges.size());
+	std::vector<const void*> offsets(ranges.size());
+	for (int i = 0; i < ranges.size(); i++) {
+		counts[i] = ranges[i].numIndices;
+		offsets[i] = (void*)(ranges[i].offset * sizeof(GLuint));
+	}
+	glMultiDrawElements(GL_TRIANGLES, &counts[0], GL_UNSIGNED_INT, &offsets[0], ranges.size());
 }
 
-void renderSkybox(Entity &skybox, GLuint secondSkyboxTexture, float interpolation, GLuint shaderProgram, glm::mat4 &worldToView, glm::mat4 &perspective) {
+void renderSkybox(Entity &skybox, const glm::mat4 &transformation, GLuint secondSkyboxTexture, float interpolation, const Shader &shader) {
 	glDisable(GL_DEPTH_TEST);
-	glUseProgram(shaderProgram);
-	glm::mat4 translation = glm::translate(glm::mat4(), skybox.position);
-	glm::mat4 scale = glm::scale(glm::mat4(), skybox.scale);
-	glm::mat4 transformation = translation * scale;
-	glUniformMatrix4fv(glGetUniformLocation(shaderProgram, "worldToView"), 1, GL_FALSE, glm::value_ptr(worldToView));
-	glUniformMatrix4fv(glGetUniformLocation(shaderProgram, "projectionMatrix"), 1, GL_FALSE, glm::value_ptr(perspective));
-	glUniformMatrix4fv(glGetUniformLocation(shaderProgram, "modelToWorld"), 1, GL_FALSE, glm::value_ptr(transformation));
+	glUseProgram(shader.program);
+	glUniformMatrix4fv(getUniformLocation(shader, UNIFORM_MODEL_TO_WORLD), 1, GL_FALSE, glm::value_ptr(transformation));
+	if (useLegacyUniforms) {
+		uploadLegacyUniforms(shader.program, nullptr);
+	}
 	glBindVertexArray(skybox.getModel().vao);
 	glActiveTexture(GL_TEXTURE10);
 	glBindTexture(GL_TEXTURE_CUBE_MAP, skybox.textureId);
-	glUniform1i(glGetUniformLocation(shaderProgram, "cubeMap"), 10);
 	glActiveTexture(GL_TEXTURE11);
 	glBindTexture(GL_TEXTURE_CUBE_MAP, secondSkyboxTexture);
-	glUniform1i(glGetUniformLocation(shaderProgram, "cubeMap2"), 11);
-	glUniform1f(glGetUniformLocation(shaderProgram, "interpolation"), interpolation);
+	glUniform1f(getUniformLocation(shader, UNIFORM_INTERPOLATION), interpolation);
 	glDrawElements(GL_TRIANGLES, skybox.getModel().numIndices, GL_UNSIGNED_INT, (void*)0);
 	glEnable(GL_DEPTH_TEST);
 }
 
-void renderParticleSystem(ParticleSystem &particleSystem, GLuint shaderProgram, int uniformLocationsTransformation[], int uniformLocationsProgress[], glm::mat4 &worldToView, glm::mat4 &perspective) {
-	Particle *particle = particleSystem.particles;
-
-	glUseProgram(shaderProgram);
-	glUniformMatrix4fv(glGetUniformLocation(shaderProgram, "worldToView"), 1, GL_FALSE, glm::value_ptr(worldToView));
-	glUniformMatrix4fv(glGetUniformLocation(shaderProgram, "projectionMatrix"), 1, GL_FALSE, glm::value_ptr(perspective));
-
-	glm::mat4 rotateBack;
-	glm::mat4 identity = glm::mat4();
-	glUniformMatrix4fv(glGetUniformLocation(shaderProgram, "parentTransformation"), 1, GL_FALSE, glm::value_ptr(identity));
-	rotateBack = identity;
-
-	if (particle->getParentEntity()) {
-		Entity parentEntity = *particle->getParentEntity();
-		if (particleSystem.followParent) {
-			glm::mat4 parentTransformation = getEntityTransformation(parentEntity);
-			glUniformMatrix4fv(glGetUniformLocation(shaderProgram, "parentTransformation"), 1, GL_FALSE, glm::value_ptr(parentTransformation));
-			glm::quat quaternion2 = directionToQuaternion(parentEntity.forward, parentEntity.up, DEFAULT_FORWARD, DEFAULT_UP);
-			rotateBack = glm::inverse(glm::toMat4(quaternion2));
-		}
-		// Get rotation matrix for rotating back, from the rotation crated from parent transformation
+// Creates the persistently mapped instance buffer of a particle system
+static void createParticleInstanceBuffer(ParticleSystem &particleSystem) {
+	GLsizeiptr size = NUM_PARTICLE_INSTANCE_BUFFERS * particleSystem.maxNumParticles * sizeof(ParticleInstance);
+	GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+	glCreateBuffers(1, &particleSystem.instanceBuffer);
+	glNamedBufferStorage(particleSystem.instanceBuffer, size, nullptr, flags);
+	particleSystem.instances = (ParticleInstance*)glMapNamedBufferRange(particleSystem.instanceBuffer, 0, size, flags);
+}
+
+// Adds the per instance attributes to a particle model's vertex array, the instance buffer
+// itself is bound per draw since systems can share a model
+static void setupParticleInstanceAttributes(GLuint vao) {
+	glVertexArrayAttribFormat(vao, PARTICLE_INSTANCE_POSITION_ROTATION_ATTRIBUTE, 4, GL_FLOAT, GL_FALSE, offsetof(ParticleInstance, position));
+	glVertexArrayAttribFormat(vao, PARTICLE_INSTANCE_SCALE_PROGRESS_ATTRIBUTE, 4, GL_FLOAT, GL_FALSE, offsetof(ParticleInstance, scale));
+	glVertexArrayAttribBinding(vao, PARTICLE_INSTANCE_POSITION_ROTATION_ATTRIBUTE, PARTICLE_INSTANCE_BINDING);
+	glVertexArrayAttribBinding(vao, PARTICLE_INSTANCE_SCALE_PROGRESS_ATTRIBUTE, PARTICLE_INSTANCE_BINDING);
+	glVertexArrayBindingDivisor(vao, PARTICLE_INSTANCE_BINDING, 1);
+	glEnableVertexArrayAttrib(vao, PARTICLE_INSTANCE_POSITION_ROTATION_ATTRIBUTE);
+	glEnableVertexArrayAttrib(vao, PARTICLE_INSTANCE_SCALE_PROGRESS_ATTRIBUTE);
+}
+
+void renderParticleSystem(ParticleSystem &particleSystem, const ParticleSystemSnapshot &snapshot, const Shader &shader, const glm::mat4 &worldToView) {
+	if (particleSystem.instanceBuffer == 0) {
+		createParticleInstanceBuffer(particleSystem);
+		setupParticleInstanceAttributes(particleSystem.model.vao);
+	}
+
+	glUseProgram(shader.program);
+	if (useLegacyUniforms) {
+		uploadLegacyUniforms(shader.program, nullptr);
 	}
+	glUniformMatrix4fv(getUniformLocation(shader, UNIFORM_PARENT_TRANSFORMATION), 1, GL_FALSE, glm::value_ptr(snapshot.parentTransformation));
 
 	// Extract camera rotation from worldToView
 	glm::mat4 cameraRotation = glm::inverse(worldToView);
@@ -121,84 +341,85 @@ void renderParticleSystem(ParticleSystem &particleSystem, GLuint shaderProgram,
 	cameraRotation[3][2] = 0;
 	cameraRotation[3][3] = 1;
 
-	glm::mat4 totalRotationGLM = rotateBack * cameraRotation;
-	const float *totalRotation = glm::value_ptr(glm::transpose(totalRotationGLM));
+	// Particles are rotated to face the camera in the vertex shader
+	glm::mat4 billboardRotation = snapshot.rotateBack * cameraRotation;
+	glUniformMatrix4fv(getUniformLocation(shader, UNIFORM_BILLBOARD_ROTATION), 1, GL_FALSE, glm::value_ptr(billboardRotation));
+	glUniform1i(getUniformLocation(shader, UNIFORM_ATLAS_SIZE), particleSystem.atlasSize);
+
+	// Wait until the GPU is done with the instances written three frames ago
+	int bufferIndex = particleSystem.currentInstanceBuffer;
+	particleSystem.currentInstanceBuffer = (bufferIndex + 1) % NUM_PARTICLE_INSTANCE_BUFFERS;
+	GLsync &fence = particleSystem.instanceBufferFences[bufferIndex];
+	if (fence) {
+		glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+		glDeleteSync(fence);
+		fence = 0;
+	}
 
-	int numIndices = particleSystem.model.numIndices;
-	int i = 0;
+	int numInstances = std::min((int)snapshot.instances.size(), particleSystem.maxNumParticles);
+	int firstInstance = bufferIndex * particleSystem.maxNumParticles;
+	if (numInstances > 0) {
+		std::copy(snapshot.instances.begin(), snapshot.instances.begin() + numInstances, particleSystem.instances + firstInstance);
+	}
 
 	glBindVertexArray(particleSystem.model.vao);
+	glVertexArrayVertexBuffer(particleSystem.model.vao, PARTICLE_INSTANCE_BINDING, particleSystem.instanceBuffer, firstInstance * sizeof(ParticleInstance), sizeof(ParticleInstance));
 	glActiveTexture(GL_TEXTURE0);
 	glBindTexture(GL_TEXTURE_2D, particleSystem.textureId);
-	glUniform1i(glGetUniformLocation(shaderProgram, "tex"), 0);
 	//glBlendFunc(GL_SRC_ALPHA, GL_ONE);
 	//glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 	//glDisable(GL_DEPTH_TEST);
 
-	std::string uniformNameProgress = std::string("atlasSize");
-	glUniform1i(glGetUniformLocation(shaderProgram, uniformNameProgress.c_str()), particleSystem.atlasSize);
-
-	//LARGE_INTEGER startingTime, endingTime, elapsedMicroseconds;
-	//LARGE_INTEGER frequency;
-	//QueryPerformanceFrequency(&frequency);
-	//QueryPerformanceCounter(&startingTime);
-
-	float transformation[] = {
-		1, 0, 0, 0,
-		0, 1, 0, 0,
-		0, 0, 1, 0,
-		0, 0, 0, 1,
-	};
+	glDrawElementsInstanced(GL_TRIANGLES, particleSystem.model.numIndices, GL_UNSIGNED_INT, 0, numInstances);
+	fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
 
-	for (int j = 0; j < particleSystem.numParticles; i++, j++) {
-		float rotation = particle->rotation;
-
-		// Scale and first xy rotation
-		float index0 = particle->scale.x * cos(rotation);
-		float index1 = particle->scale.y * -sin(rotation);
-		float index4 = particle->scale.x * sin(rotation);
-		float index5 = particle->scale.y * cos(rotation);
-		float index10 = particle->scale.z;
-
-		// Rotation and scale
-		transformation[0] = totalRotation[0] * index0 + totalRotation[1] * index4;
-		transformation[1] = totalRotation[0] * index1 + totalRotation[1] * index5;
-		transformation[2] = totalRotation[2] * index10;
-		transformation[4] = totalRotation[4] * index0 + totalRotation[5] * index4;
-		transformation[5] = totalRotation[4] * index1 + totalRotation[5] * index5;
-		transformation[6] = totalRotation[6] * index10;
-		transformation[8] = totalRotation[8] * index0 + totalRotation[9] * index4;
-		transformation[9] = totalRotation[8] * index1 + totalRotation[9] * index5;
-		transformation[10] = totalRotation[10] * index10;
-
-		// Transform
-		transformation[3] = particle->position.x;
-		transformation[7] = particle->position.y;
-		transformation[11] = particle->position.z;
-
-		glUniformMatrix4fv(uniformLocationsTransformation[i], 1, GL_TRUE, &transformation[0]);
-		glUniform1f(uniformLocationsProgress[i], particle->timeAlive / particle->lifetime);
-		particle++;
-
-		if (i >= NUM_PARTICLES_PER_DRAW_CALL - 1) {
-			glDrawElementsInstanced(GL_TRIANGLES, numIndices, GL_UNSIGNED_INT, 0, i);
-			i = 0;
+// Looks up every active uniform of a linked program
+static void reflectUniforms(Shader &shader) {
+	GLint numUniforms = 0;
+	GLint maxNameLength = 0;
+	glGetProgramiv(shader.program, GL_ACTIVE_UNIFORMS, &numUniforms);
+	glGetProgramiv(shader.program, GL_ACTIVE_UNIFORM_MAX_LENGTH, &maxNameLength);
+	std::vector<GLchar> nameBuffer(maxNameLength + 1);
+	for (GLint i = 0; i < numUniforms; i++) {
+		GLsizei nameLength = 0;
+		GLint arraySize = 0;
+		GLenum type;
+		glGetActiveUniform(shader.program, i, nameBuffer.size(), &nameLength, &arraySize, &type, &nameBuffer[0]);
+		std::string name(&nameBuffer[0], nameLength);
+		GLint location = glGetUniformLocation(shader.program, name.c_str());
+		if (location == -1) { // Uniform block member
+			continue;
+		}
+		shader.uniformsByName[name] = location;
+
+		// Arrays are reported once as "name[0]", add the other elements too
+		if (arraySize > 1 && name.size() > 3 && name.compare(name.size() - 3, 3, "[0]") == 0) {
+			std::string arrayName = name.substr(0, name.size() - 3);
+			shader.uniformsByName[arrayName] = location;
+			for (GLint element = 1; element < arraySize; element++) {
+				std::string elementName = arrayName + "[" + std::to_string(element) + "]";
+				shader.uniformsByName[elementName] = glGetUniformLocation(shader.program, elementName.c_str());
+			}
 		}
 	}
 
-	if (i > 0) {
-		glDrawElementsInstanced(GL_TRIANGLES, numIndices, GL_UNSIGNED_INT, 0, i);
+	for (int i = 0; i < NUM_SHADER_UNIFORMS; i++) {
+		shader.uniformLocations[i] = shader.getUniformLocation(shaderUniformNames[i]);
+	}
+	for (int i = 0; i < sizeof(samplerTextureUnits) / sizeof(samplerTextureUnits[0]); i++) {
+		GLint location = shader.getUniformLocation(samplerTextureUnits[i].name);
+		if (location != -1) {
+			glProgramUniform1i(shader.program, location, samplerTextureUnits[i].textureUnit);
+		}
 	}
-
-	//QueryPerformanceCounter(&endingTime);
-	//elapsedMicroseconds.QuadPart = endingTime.QuadPart - startingTime.QuadPart;
-	//elapsedMicroseconds.QuadPart *= 1000000;
-	//elapsedMicroseconds.QuadPart /= frequency.QuadPart;
-	//std::cout << elapsedMicroseconds.QuadPart << std::endl;
 }
 
-GLuint getShader(std::string vertexShaderPath, std::string fragmentShaderPath) {
+Shader getShader(std::string vertexShaderPath, std::string fragmentShaderPath) {
 	std::string commonSource = readFile("Source/common.glsl");
+	if (useLegacyUniforms) {
+		commonSource.insert(commonSource.find('\n') + 1, "#define LEGACY_UNIFORMS\n");
+	}
 	const GLchar* commonSourceC = (const GLchar *)commonSource.c_str();
 
 	std::string vertexSource = readFile(vertexShaderPath);
@@ -250,51 +471,8 @@ GLuint getShader(std::string vertexShaderPath, std::string fragmentShaderPath) {
 	glAttachShader(program, fragmentShader);
 	glLinkProgram(program);
 
-	return program;
-}
-
-
-GLuint createSkybox(std::string x1, std::string x2, std::string y1, std::string y2, std::string z1, std::string z2) {
-	GLuint texId;
-	glGenTextures(1, &texId);
-	glActiveTexture(GL_TEXTURE10);
-	glBindTexture(GL_TEXTURE_CUBE_MAP, texId);
-
-	std::vector<unsigned char> xPos = loadPNG(x1);
-	std::vector<unsigned char> xNeg;
-	std::vector<unsigned char> yPos;
-	std::vector<unsigned char> yNeg;
-	std::vector<unsigned char> zPos;
-	std::vector<unsigned char> zNeg;
-	const int size = 2048; // Should be returned from loader
-
-	if (FAST_MODE) {
-		xNeg = xPos;
-		yPos = xPos;
-		yNeg = xPos;
-		zPos = xPos;
-		zNeg = xPos;
-	}
-	else {
-		xNeg = loadPNG(x2);
-		yPos = loadPNG(y1);
-		yNeg = loadPNG(y2);
-		zPos = loadPNG(z1);
-		zNeg = loadPNG(z2);
-	}
-
-	glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X, 0, GL_RGBA, size, size, 0, GL_RGBA, GL_UNSIGNED_BYTE, &xPos[0]);
-	glTexImage2D(GL_TEXTURE_CUBE_MAP_NEGATIVE_X, 0, GL_RGBA, size, size, 0, GL_RGBA, GL_UNSIGNED_BYTE, &xNeg[0]);
-	glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_Y, 0, GL_RGBA, size, size, 0, GL_RGBA, GL_UNSIGNED_BYTE, &yPos[0]);
-	glTexImage2D(GL_TEXTURE_CUBE_MAP_NEGATIVE_Y, 0, GL_RGBA, size, size, 0, GL_RGBA, GL_UNSIGNED_BYTE, &yNeg[0]);
-	glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_Z, 0, GL_RGBA, size, size, 0, GL_RGBA, GL_UNSIGNED_BYTE, &zPos[0]);
-	glTexImage2D(GL_TEXTURE_CUBE_MAP_NEGATIVE_Z, 0, GL_RGBA, size, size, 0, GL_RGBA, GL_UNSIGNED_BYTE, &zNeg[0]);
-
-	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
-
-	return texId;
+	Shader shader;
+	shader.program = program;
+	reflectUniforms(shader);
+	return shader;
 }
\ No newline at end of file
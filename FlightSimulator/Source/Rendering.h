@@ -6,17 +6,83 @@
 
 #include "Common.h"
 #include "ParticleSystem.h"
+#include "LightClusters.h"
 
-void bindLight(GLuint shaderProgram, std::vector<Light*> lights);
+#include <unordered_map>
 
-void renderEntity(Entity &entity, GLuint shaderProgram, glm::mat4 &worldToView, glm::mat4 &perspective, bool useLights);
+// Uniforms that are set while rendering, their locations are looked up when the program is linked
+enum ShaderUniform {
+	UNIFORM_MODEL_TO_WORLD,
+	UNIFORM_PARENT_TRANSFORMATION,
+	UNIFORM_INTERPOLATION,
+	UNIFORM_ATLAS_SIZE,
+	UNIFORM_BILLBOARD_ROTATION,
+	NUM_SHADER_UNIFORMS
+};
 
-void renderSkybox(Entity &skybox, GLuint secondSkyboxTexture, float interpolation, GLuint shaderProgram, glm::mat4 &worldToView, glm::mat4 &perspective);
+// A linked shader program with the locations of all its active uniforms
+struct Shader {
+	GLuint program;
+	// -1 for uniforms the program doesn't use
+	GLint uniformLocations[NUM_SHADER_UNIFORMS];
+	// Every active uniform by name, array elements as "name[i]"
+	std::unordered_map<std::string, GLint> uniformsByName;
 
-void renderTerrain(Terrain &terrain, GLuint shaderProgram, glm::mat4 &worldToView, glm::mat4 &perspective);
+	GLint getUniformLocation(ShaderUniform uniform) const {
+		return uniformLocations[uniform];
+	}
+	GLint getUniformLocation(const std::string &name) const;
+};
 
-void renderParticleSystem(ParticleSystem &particleSystem, GLuint shaderProgram, int uniformLocationsTransformation[], int uniformLocationsProgress[], glm::mat4 &worldToView, glm::mat4 &perspective);
+// Uniform buffer binding points, see common.glsl
+const GLuint CAMERA_UNIFORM_BINDING = 0;
+const GLuint MATERIAL_UNIFORM_BINDING = 1;
+// Shader storage buffer binding points of the light list, the light clusters and their light indices
+const GLuint LIGHT_STORAGE_BINDING = 2;
+const GLuint LIGHT_CLUSTER_STORAGE_BINDING = 3;
+const GLuint LIGHT_INDEX_STORAGE_BINDING = 4;
 
-GLuint getShader(std::string vertexShaderPath, std::string fragmentShaderPath);
+// Creates the uniform buffers shared by all shader programs
+void initUniformBuffers();
 
-GLuint createSkybox(std::string x1, std::string x2, std::string y1, std::string y2, std::string z1, std::string z2);
\ No newline at end of file
+// Sets the camera, material and samplers as plain uniforms looked up by name on every draw
+// call, the way they were before the uniform blocks, to compare the two. Before getShader.
+void setLegacyUniforms(bool isLegacy);
+
+// Uploads the camera for all following draw calls
+void bindCamera(const glm::mat4 &worldToView, const glm::mat4 &perspective);
+
+// Lights culled against a camera and assigned to light clusters, as uploadLights takes them
+struct PreparedLights {
+	int numDirectionalLights;
+	std::vector<LightData> lights;
+	float depthSliceScale;
+	float depthSliceBias;
+	std::vector<LightCluster> clusters;
+	std::vector<unsigned int> lightIndices;
+};
+
+// Culls the lights against the camera and assigns them to light clusters, returns how many
+// lights are left. Only does CPU work, so it can run as a job or on another thread while no
+// other prepareLights is running.
+int prepareLights(std::vector<Light*> &lights, const glm::mat4 &worldToView, const glm::mat4 &perspective, PreparedLights &prepared);
+// Uploads the prepared lights for all shader programs, needs the GL context
+void uploadLights(const PreparedLights &prepared);
+
+// The render functions take the model to world matrix instead of getting the entity's,
+// so they can draw a snapshot while the entity is being moved by another thread
+void renderEntity(Entity &entity, const glm::mat4 &transformation, const Shader &shader, bool useLights);
+
+void renderSkybox(Entity &skybox, const glm::mat4 &transformation, GLuint secondSkyboxTexture, float interpolation, const Shader &shader);
+
+void renderTerrain(Terrain &terrain, const glm::mat4 &transformation, const Shader &shader, const std::vector<IndexRange> &ranges);
+
+// Vertex attribute locations and vertex buffer binding of ParticleInstance, see instancedVS.glsl
+const GLuint PARTICLE_INSTANCE_POSITION_ROTATION_ATTRIBUTE = 3;
+const GLuint PARTICLE_INSTANCE_SCALE_PROGRESS_ATTRIBUTE = 4;
+const GLuint PARTICLE_INSTANCE_BINDING = 3;
+
+// Streams the snapshot's particles into the system's instance buffer and draws them with one call
+void renderParticleSystem(ParticleSystem &particleSystem, const ParticleSystemSnapshot &snapshot, const Shader &shader, const glm::mat4 &worldToView);
+
+Shader getShader(std::string vertexShaderPath, std::string fragmentShaderPath);
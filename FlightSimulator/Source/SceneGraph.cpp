@@ -0,0 +1,147 @@
+#include "SceneGraph.h"
+
+#include <cassert>
+
+SceneGraph::SceneGraph() : numUpdatedNodes(0) {
+}
+
+void SceneGraph::clear() {
+	parents.clear();
+	isLocalDirty.clear();
+	isWorldDirty.clear();
+}
+
+int SceneGraph::addNode(int parent) {
+	assert(parent < (int)parents.size());
+	int node = parents.size();
+	parents.push_back(parent);
+	isLocalDirty.push_back(1);
+	isWorldDirty.push_back(0);
+
+	int paddedSize = (parents.size() + 3) & ~3;
+	if (positionX.size() < paddedSize) {
+		SimdFloatVector *zeros[] = { &positionX, &positionY, &positionZ, &rotationX, &rotationY, &rotationZ, &pivotX, &pivotY, &pivotZ };
+		for (int i = 0; i < sizeof(zeros) / sizeof(zeros[0]); i++) {
+			zeros[i]->resize(paddedSize, 0);
+		}
+		SimdFloatVector *ones[] = { &rotationW, &scaleX, &scaleY, &scaleZ };
+		for (int i = 0; i < sizeof(ones) / sizeof(ones[0]); i++) {
+			ones[i]->resize(paddedSize, 1);
+		}
+		local.resize(paddedSize);
+		world.resize(paddedSize);
+	}
+	setLocal(node, glm::vec3(0, 0, 0), glm::quat(), glm::vec3(1, 1, 1), glm::vec3(0, 0, 0));
+	return node;
+}
+
+void SceneGraph::setLocal(int node, glm::vec3 position, glm::quat rotation, glm::vec3 scale, glm::vec3 pivot) {
+	positionX[node] = position.x;
+	positionY[node] = position.y;
+	positionZ[node] = position.z;
+	rotationX[node] = rotation.x;
+	rotationY[node] = rotation.y;
+	rotationZ[node] = rotation.z;
+	rotationW[node] = rotation.w;
+	scaleX[node] = scale.x;
+	scaleY[node] = scale.y;
+	scaleZ[node] = scale.z;
+	pivotX[node] = pivot.x;
+	pivotY[node] = pivot.y;
+	pivotZ[node] = pivot.z;
+	isLocalDirty[node] = 1;
+}
+
+// result = a * b for column major matrices, a column of the result is the columns of a
+// weighted by a column of b
+static inline void multiplyMatrices(const float *a, const float *b, float *result) {
+	__m128 a0 = _mm_load_ps(a);
+	__m128 a1 = _mm_load_ps(a + 4);
+	__m128 a2 = _mm_load_ps(a + 8);
+	__m128 a3 = _mm_load_ps(a + 12);
+	for (int column = 0; column < 4; column++) {
+		const float *b0 = b + column * 4;
+		__m128 sum = _mm_mul_ps(a0, _mm_set1_ps(b0[0]));
+		sum = _mm_add_ps(sum, _mm_mul_ps(a1, _mm_set1_ps(b0[1])));
+		sum = _mm_add_ps(sum, _mm_mul_ps(a2, _mm_set1_ps(b0[2])));
+		sum = _mm_add_ps(sum, _mm_mul_ps(a3, _mm_set1_ps(b0[3])));
+		_mm_store_ps(result + column * 4, sum);
+	}
+}
+
+void SceneGraph::update() {
+	// Local matrices, four nodes per iteration. Each __m128 holds one matrix element of
+	// four nodes, they are transposed into one column per node at the end.
+	const __m128 one = _mm_set1_ps(1);
+	const __m128 two = _mm_set1_ps(2);
+	int numNodes = parents.size();
+	for (int i = 0; i < numNodes; i += 4) {
+		bool isGroupDirty = false;
+		for (int node = i; node < i + 4 && node < numNodes; node++) {
+			isGroupDirty = isGroupDirty || isLocalDirty[node];
+		}
+		if (!isGroupDirty) {
+			continue;
+		}
+		__m128 x = _mm_load_ps(&rotationX[i]);
+		__m128 y = _mm_load_ps(&rotationY[i]);
+		__m128 z = _mm_load_ps(&rotationZ[i]);
+		__m128 w = _mm_load_ps(&rotationW[i]);
+		__m128 xx = _mm_mul_ps(x, x), yy = _mm_mul_ps(y, y), zz = _mm_mul_ps(z, z);
+		__m128 xy = _mm_mul_ps(x, y), xz = _mm_mul_ps(x, z), yz = _mm_mul_ps(y, z);
+		__m128 wx = _mm_mul_ps(w, x), wy = _mm_mul_ps(w, y), wz = _mm_mul_ps(w, z);
+
+		// Rotation matrix, rRowColumn
+		__m128 r00 = _mm_sub_ps(one, _mm_mul_ps(two, _mm_add_ps(yy, zz)));
+		__m128 r10 = _mm_mul_ps(two, _mm_add_ps(xy, wz));
+		__m128 r20 = _mm_mul_ps(two, _mm_sub_ps(xz, wy));
+		__m128 r01 = _mm_mul_ps(two, _mm_sub_ps(xy, wz));
+		__m128 r11 = _mm_sub_ps(one, _mm_mul_ps(two, _mm_add_ps(xx, zz)));
+		__m128 r21 = _mm_mul_ps(two, _mm_add_ps(yz, wx));
+		__m128 r02 = _mm_mul_ps(two, _mm_add_ps(xz, wy));
+		__m128 r12 = _mm_mul_ps(two, _mm_sub_ps(yz, wx));
+		__m128 r22 = _mm_sub_ps(one, _mm_mul_ps(two, _mm_add_ps(xx, yy)));
+
+		// Translation, position + pivot - rotation * pivot
+		__m128 px = _mm_load_ps(&pivotX[i]);
+		__m128 py = _mm_load_ps(&pivotY[i]);
+		__m128 pz = _mm_load_ps(&pivotZ[i]);
+		__m128 tx = _mm_add_ps(_mm_load_ps(&positionX[i]), _mm_sub_ps(px, _mm_add_ps(_mm_add_ps(_mm_mul_ps(r00, px), _mm_mul_ps(r01, py)), _mm_mul_ps(r02, pz))));
+		__m128 ty = _mm_add_ps(_mm_load_ps(&positionY[i]), _mm_sub_ps(py, _mm_add_ps(_mm_add_ps(_mm_mul_ps(r10, px), _mm_mul_ps(r11, py)), _mm_mul_ps(r12, pz))));
+		__m128 tz = _mm_add_ps(_mm_load_ps(&positionZ[i]), _mm_sub_ps(pz, _mm_add_ps(_mm_add_ps(_mm_mul_ps(r20, px), _mm_mul_ps(r21, py)), _mm_mul_ps(r22, pz))));
+
+		// Scale the rotation columns
+		__m128 sx = _mm_load_ps(&scaleX[i]);
+		__m128 sy = _mm_load_ps(&scaleY[i]);
+		__m128 sz = _mm_load_ps(&scaleZ[i]);
+		__m128 columns[4][4] = {
+			{ _mm_mul_ps(r00, sx), _mm_mul_ps(r10, sx), _mm_mul_ps(r20, sx), _mm_setzero_ps() },
+			{ _mm_mul_ps(r01, sy), _mm_mul_ps(r11, sy), _mm_mul_ps(r21, sy), _mm_setzero_ps() },
+			{ _mm_mul_ps(r02, sz), _mm_mul_ps(r12, sz), _mm_mul_ps(r22, sz), _mm_setzero_ps() },
+			{ tx, ty, tz, one },
+		};
+		for (int column = 0; column < 4; column++) {
+			_MM_TRANSPOSE4_PS(columns[column][0], columns[column][1], columns[column][2], columns[column][3]);
+			for (int node = 0; node < 4; node++) {
+				_mm_store_ps(&local[i + node][column][0], columns[column][node]);
+			}
+		}
+	}
+
+	// World matrices, parents come first so theirs are already done
+	numUpdatedNodes = 0;
+	for (int i = 0; i < numNodes; i++) {
+		int parent = parents[i];
+		isWorldDirty[i] = isLocalDirty[i] || (parent != NO_PARENT && isWorldDirty[parent]);
+		isLocalDirty[i] = 0;
+		if (!isWorldDirty[i]) {
+			continue;
+		}
+		if (parent == NO_PARENT) {
+			world[i] = local[i];
+		} else {
+			multiplyMatrices(&world[parent][0][0], &local[i][0][0], &world[i][0][0]);
+		}
+		numUpdatedNodes++;
+	}
+}
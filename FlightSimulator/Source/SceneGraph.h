@@ -0,0 +1,70 @@
+#pragma once
+
+#include <vector>
+
+#include <glm/vec3.hpp>
+#include <glm/mat4x4.hpp>
+#include <glm/gtc/quaternion.hpp>
+
+#include "SimdAllocator.h"
+
+typedef std::vector<glm::mat4, SimdAllocator<glm::mat4>> SimdMatrixVector;
+
+// A flattened transformation hierarchy. Nodes are stored in parent order (every parent
+// before its children) with their local translation, rotation, scale and pivot in one
+// array per component, so update can build the local matrices of four nodes at once and
+// compose the world matrices in a single pass over the arrays. Only the nodes given a new
+// local transformation and their descendants are rebuilt.
+// Knows nothing about OpenGL so it can be used without a context.
+class SceneGraph {
+public:
+	static const int NO_PARENT = -1;
+
+	SceneGraph();
+
+	void clear();
+
+	// Adds a node with an identity transformation and returns its index. The parent must
+	// already have been added.
+	int addNode(int parent);
+
+	// Local transformation: scale, rotate around the pivot, then translate
+	void setLocal(int node, glm::vec3 position, glm::quat rotation, glm::vec3 scale, glm::vec3 pivot);
+
+	// Rebuilds the local matrices set since the last update and the world matrices depending on them
+	void update();
+	// Whether the last update rebuilt the node's world matrix
+	bool isWorldUpdated(int node) const {
+		return isWorldDirty[node] != 0;
+	}
+	int getNumUpdatedNodes() const {
+		return numUpdatedNodes;
+	}
+
+	int getNumNodes() const {
+		return parents.size();
+	}
+	int getParent(int node) const {
+		return parents[node];
+	}
+	const glm::mat4& getLocal(int node) const {
+		return local[node];
+	}
+	const glm::mat4& getWorld(int node) const {
+		return world[node];
+	}
+private:
+	std::vector<int> parents;
+	// Padded to a multiple of 4 nodes
+	SimdFloatVector positionX, positionY, positionZ;
+	SimdFloatVector rotationX, rotationY, rotationZ, rotationW;
+	SimdFloatVector scaleX, scaleY, scaleZ;
+	SimdFloatVector pivotX, pivotY, pivotZ;
+	SimdMatrixVector local;
+	SimdMatrixVector world;
+	// Per node, set by setLocal until the next update
+	std::vector<char> isLocalDirty;
+	// Per node, set by update when the world matrix was rebuilt
+	std::vector<char> isWorldDirty;
+	int numUpdatedNodes;
+};
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <cstddef>
+#include <new>
+#include <vector>
+
+#include <xmmintrin.h>
+
+// Allocator for std::vector that aligns the data for SSE loads and stores
+template <typename T>
+struct SimdAllocator {
+	typedef T value_type;
+	SimdAllocator() {
+	}
+	template <typename U>
+	SimdAllocator(const SimdAllocator<U> &) {
+	}
+	T *allocate(std::size_t n) {
+		void *memory = _mm_malloc(n * sizeof(T), 16);
+		if (!memory) {
+			throw std::bad_alloc();
+		}
+		return (T*)memory;
+	}
+	void deallocate(T *memory, std::size_t) {
+		_mm_free(memory);
+	}
+};
+
+template <typename T, typename U>
+bool operator==(const SimdAllocator<T> &, const SimdAllocator<U> &) {
+	return true;
+}
+
+template <typename T, typename U>
+bool operator!=(const SimdAllocator<T> &, const SimdAllocator<U> &) {
+	return false;
+}
+
+typedef std::vector<float, SimdAllocator<float>> SimdFloatVector;
@@ -0,0 +1,83 @@
+#include "TerrainCache.h"
+
+#include <cstring>
+#include <fstream>
+
+#include "Common.h"
+
+// Start of a cache file, followed by the heightmap, vertices and indices
+struct TerrainCacheHeader {
+	char magic[4];
+	unsigned int version;
+	TerrainCacheKey key;
+	unsigned int numHeights;
+	unsigned int numVertices;
+	unsigned int numIndices;
+	// Of the heightmap, vertices and indices, in that order
+	unsigned long long checksum;
+};
+
+static const char TERRAIN_CACHE_MAGIC[4] = { 'F', 'S', 'T', 'C' };
+
+static unsigned long long checksumTerrain(const float *heightmap, int numHeights, const float *vertices, int numVertices, const unsigned int *indices, int numIndices) {
+	unsigned long long checksum = checksumBytes(heightmap, numHeights * sizeof(float));
+	checksum = checksumBytes(vertices, (size_t)numVertices * HEIGHTMAP_VERTEX_SIZE * sizeof(float), checksum);
+	return checksumBytes(indices, (size_t)numIndices * sizeof(unsigned int), checksum);
+}
+
+bool openTerrainCache(const std::string &filename, const TerrainCacheKey &key, MappedFile &file, TerrainCacheData &data) {
+	if (!file.open(filename)) {
+		return false;
+	}
+	TerrainCacheHeader header;
+	if (file.getSize() < sizeof(header)) {
+		file.close();
+		return false;
+	}
+	memcpy(&header, file.getData(), sizeof(header));
+	size_t expectedSize = sizeof(header) + (size_t)header.numHeights * sizeof(float)
+		+ (size_t)header.numVertices * HEIGHTMAP_VERTEX_SIZE * sizeof(float) + (size_t)header.numIndices * sizeof(unsigned int);
+	bool isValid = memcmp(header.magic, TERRAIN_CACHE_MAGIC, sizeof(header.magic)) == 0
+		&& header.version == TERRAIN_CACHE_VERSION
+		&& memcmp(&header.key, &key, sizeof(key)) == 0
+		&& header.numHeights == (unsigned int)(key.size * key.size)
+		&& file.getSize() == expectedSize;
+	if (!isValid) {
+		file.close();
+		return false;
+	}
+
+	const unsigned char *payload = file.getData() + sizeof(header);
+	data.heightmap = (const float*)payload;
+	data.vertices = data.heightmap + header.numHeights;
+	data.numVertices = header.numVertices;
+	data.indices = (const unsigned int*)(data.vertices + (size_t)header.numVertices * HEIGHTMAP_VERTEX_SIZE);
+	data.numIndices = header.numIndices;
+	if (checksumTerrain(data.heightmap, header.numHeights, data.vertices, data.numVertices, data.indices, data.numIndices) != header.checksum) {
+		file.close();
+		return false;
+	}
+	return true;
+}
+
+bool writeTerrainCache(const std::string &filename, const TerrainCacheKey &key, const float *heightmap, const float *vertices, int numVertices, const unsigned int *indices, int numIndices) {
+	std::ofstream file(filename, std::ios::binary | std::ios::trunc);
+	if (!file) {
+		return false;
+	}
+	TerrainCacheHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, TERRAIN_CACHE_MAGIC, sizeof(header.magic));
+	header.version = TERRAIN_CACHE_VERSION;
+	header.key = key;
+	header.numHeights = key.size * key.size;
+	header.numVertices = numVertices;
+	header.numIndices = numIndices;
+	header.checksum = checksumTerrain(heightmap, header.numHeights, vertices, numVertices, indices, numIndices);
+
+	file.write((const char*)&header, sizeof(header));
+	file.write((const char*)heightmap, (std::streamsize)header.numHeights * sizeof(float));
+	file.write((const char*)vertices, (std::streamsize)numVertices * HEIGHTMAP_VERTEX_SIZE * sizeof(float));
+	file.write((const char*)indices, (std::streamsize)numIndices * sizeof(unsigned int));
+	return (bool)file;
+}
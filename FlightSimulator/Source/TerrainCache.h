@@ -0,0 +1,37 @@
+#pragma once
+
+#include <string>
+
+#include "MappedFile.h"
+
+// Change whenever the heightmap or terrain mesh generation changes, older caches are then stale
+const unsigned int TERRAIN_CACHE_VERSION = 1;
+
+// Everything a generated world depends on, a cache built for other values is stale
+struct TerrainCacheKey {
+	int size;
+	float smoothness;
+	unsigned int seed;
+	float tileSizeXZ;
+	float tileSizeY;
+	float textureScale;
+	int chunkSize;
+};
+
+// A cached world, pointing into the mapped cache file
+struct TerrainCacheData {
+	// size * size heights, runway included
+	const float *heightmap;
+	// HEIGHTMAP_VERTEX_SIZE floats per vertex, as heightmapToModel builds them
+	const float *vertices;
+	int numVertices;
+	const unsigned int *indices;
+	int numIndices;
+};
+
+// Maps the cache file and checks it against the key and its checksum. Returns false if
+// the file is missing, stale or corrupted, in which case the world has to be generated.
+bool openTerrainCache(const std::string &filename, const TerrainCacheKey &key, MappedFile &file, TerrainCacheData &data);
+
+// Returns false if the file can't be written
+bool writeTerrainCache(const std::string &filename, const TerrainCacheKey &key, const float *heightmap, const float *vertices, int numVertices, const unsigned int *indices, int numIndices);
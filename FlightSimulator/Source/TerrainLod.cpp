@@ -0,0 +1,215 @@
+#include "TerrainLod.h"
+
+#include <algorithm>
+#include <math.h>
+
+#include <glm/glm.hpp>
+
+#include "Threading.h"
+
+float lodGeometricError(float *heightmap, int heightmapWidth, int x, int z, int width, int depth, int step) {
+	float maxError = 0;
+	for (int cellZ = z; cellZ < z + depth; cellZ += step) {
+		for (int cellX = x; cellX < x + width; cellX += step) {
+			float h00 = heightmap[cellZ * heightmapWidth + cellX];
+			float h10 = heightmap[cellZ * heightmapWidth + cellX + step];
+			float h01 = heightmap[(cellZ + step) * heightmapWidth + cellX];
+			float h11 = heightmap[(cellZ + step) * heightmapWidth + cellX + step];
+			for (int j = 0; j <= step; j++) {
+				for (int i = 0; i <= step; i++) {
+					float u = (float)i / step;
+					float v = (float)j / step;
+					// Same diagonal as the triangles, from (x + step, z) to (x, z + step)
+					float interpolated;
+					if (u + v <= 1) {
+						interpolated = h00 + u * (h10 - h00) + v * (h01 - h00);
+					} else {
+						interpolated = h11 + (1 - u) * (h01 - h11) + (1 - v) * (h10 - h11);
+					}
+					float error = std::abs(heightmap[(cellZ + j) * heightmapWidth + cellX + i] - interpolated);
+					maxError = std::max(maxError, error);
+				}
+			}
+		}
+	}
+	return maxError;
+}
+
+float lodProjectionScale(float fieldOfViewY, int viewportHeight) {
+	return viewportHeight / (2 * tan(fieldOfViewY / 2));
+}
+
+float lodScreenSpaceError(float geometricError, float distance, float projectionScale) {
+	return geometricError * projectionScale / std::max(distance, 0.0001f);
+}
+
+float distanceToAABB(glm::vec3 point, const AABB &box) {
+	glm::vec3 closest = glm::clamp(point, box.min, box.max);
+	return glm::length(point - closest);
+}
+
+TerrainLod::TerrainLod() {
+	quadtree = nullptr;
+	width = 0;
+	height = 0;
+	numLevels = 0;
+	numIndices = 0;
+	skirtDepth = 0;
+}
+
+void TerrainLod::build(float *heightmap, int width, int height, float scaleY, const TerrainQuadtree &quadtree) {
+	this->quadtree = &quadtree;
+	this->width = width;
+	this->height = height;
+	int numChunks = quadtree.getNumChunks();
+
+	numLevels = 1;
+	while ((1 << numLevels) <= quadtree.getChunk(0).width) {
+		numLevels++;
+	}
+	chunkLevels.assign(numChunks * numLevels, ChunkLevel());
+	chunkNumLevels.assign(numChunks, 1);
+
+	// Skirt copies of all vertices on chunk edges
+	skirtSourceVertices.clear();
+	skirtVertexIndices.assign(width * height, -1);
+	for (int i = 0; i < numChunks; i++) {
+		const TerrainQuadtree::Chunk &chunk = quadtree.getChunk(i);
+		for (int z = chunk.z; z <= chunk.z + chunk.depth; z++) {
+			for (int x = chunk.x; x <= chunk.x + chunk.width; x++) {
+				bool onEdge = x == chunk.x || x == chunk.x + chunk.width || z == chunk.z || z == chunk.z + chunk.depth;
+				if (onEdge && skirtVertexIndices[z * width + x] == -1) {
+					skirtVertexIndices[z * width + x] = width * height + skirtSourceVertices.size();
+					skirtSourceVertices.push_back(z * width + x);
+				}
+			}
+		}
+	}
+
+	// Index ranges, the level 0 grids are the quadtree's own
+	int offset = quadtree.getNumIndices();
+	for (int i = 0; i < numChunks; i++) {
+		const TerrainQuadtree::Chunk &chunk = quadtree.getChunk(i);
+		for (int level = 0; level < numLevels; level++) {
+			int step = 1 << level;
+			if (chunk.width % step != 0 || chunk.depth % step != 0) {
+				break;
+			}
+			chunkNumLevels[i] = level + 1;
+			ChunkLevel &chunkLevel = chunkLevels[i * numLevels + level];
+			if (level == 0) {
+				chunkLevel.grid.offset = chunk.offset;
+				chunkLevel.grid.numIndices = chunk.numIndices;
+			} else {
+				chunkLevel.grid.offset = offset;
+				chunkLevel.grid.numIndices = (chunk.width / step) * (chunk.depth / step) * 6;
+				offset += chunkLevel.grid.numIndices;
+			}
+			chunkLevel.skirt.offset = offset;
+			chunkLevel.skirt.numIndices = 2 * (chunk.width / step + chunk.depth / step) * 6;
+			offset += chunkLevel.skirt.numIndices;
+		}
+	}
+	numIndices = offset - quadtree.getNumIndices();
+
+	// Geometric errors, never smaller than the error of a finer level
+	parallelFor(0, numChunks, getNumWorkerThreads(), [&](int firstChunk, int lastChunk) {
+		for (int i = firstChunk; i < lastChunk; i++) {
+			const TerrainQuadtree::Chunk &chunk = quadtree.getChunk(i);
+			float previousError = 0;
+			for (int level = 1; level < chunkNumLevels[i]; level++) {
+				float error = lodGeometricError(heightmap, width, chunk.x, chunk.z, chunk.width, chunk.depth, 1 << level) * scaleY;
+				previousError = std::max(previousError, error);
+				chunkLevels[i * numLevels + level].geometricError = previousError;
+			}
+		}
+	});
+
+	// Skirts must reach below the largest gap a coarser neighbour can leave
+	skirtDepth = 1;
+	for (int i = 0; i < chunkLevels.size(); i++) {
+		skirtDepth = std::max(skirtDepth, chunkLevels[i].geometricError + 1);
+	}
+}
+
+unsigned int TerrainLod::skirtVertex(int x, int z) const {
+	return skirtVertexIndices[z * width + x];
+}
+
+void TerrainLod::buildIndices(unsigned int *indices) const {
+	const int firstIndex = quadtree->getNumIndices();
+	parallelFor(0, quadtree->getNumChunks(), getNumWorkerThreads(), [&](int firstChunk, int lastChunk) {
+		for (int i = firstChunk; i < lastChunk; i++) {
+			const TerrainQuadtree::Chunk &chunk = quadtree->getChunk(i);
+			for (int level = 0; level < chunkNumLevels[i]; level++) {
+				const ChunkLevel &chunkLevel = chunkLevels[i * numLevels + level];
+				const int step = 1 << level;
+
+				if (level > 0) {
+					unsigned int *grid = &indices[chunkLevel.grid.offset - firstIndex];
+					for (int z = chunk.z; z < chunk.z + chunk.depth; z += step) {
+						for (int x = chunk.x; x < chunk.x + chunk.width; x += step) {
+							unsigned int index = z * width + x;
+							grid[0] = index;
+							grid[1] = index + step;
+							grid[2] = index + step * width;
+							grid[3] = index + step;
+							grid[4] = index + step * width + step;
+							grid[5] = index + step * width;
+							grid += 6;
+						}
+					}
+				}
+
+				// Two triangles between every pair of edge vertices and their skirt copies
+				unsigned int *skirt = &indices[chunkLevel.skirt.offset - firstIndex];
+				const int edges[4][4] = {
+					// Start x, start z, direction x, direction z
+					{ chunk.x, chunk.z, 1, 0 },
+					{ chunk.x, chunk.z + chunk.depth, 1, 0 },
+					{ chunk.x, chunk.z, 0, 1 },
+					{ chunk.x + chunk.width, chunk.z, 0, 1 },
+				};
+				for (int e = 0; e < 4; e++) {
+					int length = edges[e][2] ? chunk.width : chunk.depth;
+					for (int d = 0; d < length; d += step) {
+						int ax = edges[e][0] + edges[e][2] * d;
+						int az = edges[e][1] + edges[e][3] * d;
+						int bx = ax + edges[e][2] * step;
+						int bz = az + edges[e][3] * step;
+						unsigned int a = az * width + ax;
+						unsigned int b = bz * width + bx;
+						skirt[0] = a;
+						skirt[1] = b;
+						skirt[2] = skirtVertex(ax, az);
+						skirt[3] = b;
+						skirt[4] = skirtVertex(bx, bz);
+						skirt[5] = skirtVertex(ax, az);
+						skirt += 6;
+					}
+				}
+			}
+		}
+	});
+}
+
+void TerrainLod::select(const std::vector<const TerrainQuadtree::Node*> &visibleNodes, glm::vec3 cameraPosition, float projectionScale, float maxPixelError, std::vector<IndexRange> &ranges) const {
+	for (int n = 0; n < visibleNodes.size(); n++) {
+		const TerrainQuadtree::Node *node = visibleNodes[n];
+		for (int i = node->firstChunk; i < node->firstChunk + node->numChunks; i++) {
+			const ChunkLevel &chunkLevel = chunkLevels[i * numLevels + selectLevel(i, cameraPosition, projectionScale, maxPixelError)];
+			ranges.push_back(chunkLevel.grid);
+			ranges.push_back(chunkLevel.skirt);
+		}
+	}
+}
+
+int TerrainLod::selectLevel(int chunk, glm::vec3 cameraPosition, float projectionScale, float maxPixelError) const {
+	float distance = distanceToAABB(cameraPosition, quadtree->getChunk(chunk).bounds);
+	// Coarsest level that still looks right from here
+	int level = 0;
+	while (level + 1 < chunkNumLevels[chunk] && lodScreenSpaceError(chunkLevels[chunk * numLevels + level + 1].geometricError, distance, projectionScale) <= maxPixelError) {
+		level++;
+	}
+	return level;
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <vector>
+
+#include "TerrainQuadtree.h"
+
+// Geomipmapped level of detail for the chunks of a TerrainQuadtree. Level n of a chunk
+// uses every 2^n:th heightmap sample. Every chunk also gets a skirt per level, a strip
+// hanging down from its edges, that hides the cracks between chunks of different levels.
+//
+// The extra indices (the grids of level 1 and up, and all skirts) go after the quadtree's
+// own indices in the index buffer, level 0 grids are the quadtree's chunk ranges. The
+// skirts use extra vertices, copies of the chunk edge vertices moved down by the skirt
+// depth, that go after the width * height heightmap vertices.
+// Knows nothing about OpenGL so it can be used without a context.
+class TerrainLod {
+public:
+	TerrainLod();
+
+	// Computes the geometric error of every level of every chunk
+	void build(float *heightmap, int width, int height, float scaleY, const TerrainQuadtree &quadtree);
+
+	// Writes getNumIndices() indices, the first one belongs at quadtree.getNumIndices()
+	void buildIndices(unsigned int *indices) const;
+
+	// Picks a level per visible chunk and appends the ranges to draw for them
+	void select(const std::vector<const TerrainQuadtree::Node*> &visibleNodes, glm::vec3 cameraPosition, float projectionScale, float maxPixelError, std::vector<IndexRange> &ranges) const;
+	// The coarsest level of the chunk whose geometric error is at most maxPixelError pixels
+	// seen from cameraPosition, the level select draws it at
+	int selectLevel(int chunk, glm::vec3 cameraPosition, float projectionScale, float maxPixelError) const;
+	int getNumLevels(int chunk) const {
+		return chunkNumLevels[chunk];
+	}
+
+	int getNumIndices() const {
+		return numIndices;
+	}
+	// Heightmap vertex index for each skirt vertex
+	const std::vector<unsigned int>& getSkirtSourceVertices() const {
+		return skirtSourceVertices;
+	}
+	// How far the skirt vertices are below the vertices they are copied from, in model units
+	float getSkirtDepth() const {
+		return skirtDepth;
+	}
+private:
+	struct ChunkLevel {
+		float geometricError; // Largest height difference to the full resolution mesh, in model units
+		IndexRange grid;
+		IndexRange skirt;
+	};
+
+	unsigned int skirtVertex(int x, int z) const;
+
+	const TerrainQuadtree *quadtree;
+	int width;
+	int height;
+	int numLevels;
+	int numIndices;
+	float skirtDepth;
+	std::vector<ChunkLevel> chunkLevels; // numLevels per chunk
+	std::vector<int> chunkNumLevels;
+	std::vector<unsigned int> skirtSourceVertices;
+	std::vector<int> skirtVertexIndices; // width * height, -1 for vertices without a skirt copy
+};
+
+// Largest difference between the heightmap and the mesh made from every step:th sample,
+// over the part of the heightmap from (x, z) that is width x depth quads
+float lodGeometricError(float *heightmap, int heightmapWidth, int x, int z, int width, int depth, int step);
+
+// Vertical pixels per model unit at distance 1 for a perspective projection
+float lodProjectionScale(float fieldOfViewY, int viewportHeight);
+
+// Size in pixels of a geometric error seen from a distance
+float lodScreenSpaceError(float geometricError, float distance, float projectionScale);
+
+float distanceToAABB(glm::vec3 point, const AABB &box);
@@ -0,0 +1,129 @@
+#include "TerrainQuadtree.h"
+
+#include <algorithm>
+
+#include "Threading.h"
+
+TerrainQuadtree::TerrainQuadtree() {
+	width = 0;
+	height = 0;
+	chunkSize = 0;
+}
+
+void TerrainQuadtree::build(float *heightmap, int width, int height, float scaleX, float scaleY, float scaleZ, int chunkSize) {
+	this->width = width;
+	this->height = height;
+	this->chunkSize = chunkSize;
+	nodes.clear();
+	chunks.clear();
+
+	int numChunksX = (width - 2) / chunkSize + 1;
+	int numChunksZ = (height - 2) / chunkSize + 1;
+	buildNode(heightmap, scaleX, scaleY, scaleZ, 0, 0, numChunksX, numChunksZ);
+}
+
+// Chunks are numbered and given index ranges in the order they are reached, depth first
+int TerrainQuadtree::buildNode(float *heightmap, float scaleX, float scaleY, float scaleZ, int chunkX0, int chunkZ0, int chunkX1, int chunkZ1) {
+	int nodeIndex = nodes.size();
+	nodes.push_back(Node());
+	int offset = chunks.empty() ? 0 : chunks.back().offset + chunks.back().numIndices;
+	int firstChunk = chunks.size();
+
+	Node node;
+	for (int i = 0; i < 4; i++) {
+		node.children[i] = -1;
+	}
+
+	if (chunkX1 - chunkX0 == 1 && chunkZ1 - chunkZ0 == 1) {
+		Chunk chunk;
+		chunk.x = chunkX0 * chunkSize;
+		chunk.z = chunkZ0 * chunkSize;
+		chunk.width = std::min(chunkSize, width - 1 - chunk.x);
+		chunk.depth = std::min(chunkSize, height - 1 - chunk.z);
+		chunk.offset = offset;
+		chunk.numIndices = chunk.width * chunk.depth * 6;
+
+		float minHeight = heightmap[chunk.z * width + chunk.x];
+		float maxHeight = minHeight;
+		for (int z = chunk.z; z <= chunk.z + chunk.depth; z++) {
+			for (int x = chunk.x; x <= chunk.x + chunk.width; x++) {
+				minHeight = std::min(minHeight, heightmap[z * width + x]);
+				maxHeight = std::max(maxHeight, heightmap[z * width + x]);
+			}
+		}
+		chunk.bounds.min = glm::vec3(chunk.x * scaleX, minHeight * scaleY, chunk.z * scaleZ);
+		chunk.bounds.max = glm::vec3((chunk.x + chunk.width) * scaleX, maxHeight * scaleY, (chunk.z + chunk.depth) * scaleZ);
+		chunks.push_back(chunk);
+		node.bounds = chunk.bounds;
+	} else {
+		int middleX = chunkX0 + (chunkX1 - chunkX0 + 1) / 2;
+		int middleZ = chunkZ0 + (chunkZ1 - chunkZ0 + 1) / 2;
+		int xs[3] = { chunkX0, middleX, chunkX1 };
+		int zs[3] = { chunkZ0, middleZ, chunkZ1 };
+		int numChildren = 0;
+		for (int z = 0; z < 2; z++) {
+			for (int x = 0; x < 2; x++) {
+				if (xs[x] == xs[x + 1] || zs[z] == zs[z + 1]) {
+					continue;
+				}
+				int child = buildNode(heightmap, scaleX, scaleY, scaleZ, xs[x], zs[z], xs[x + 1], zs[z + 1]);
+				if (numChildren == 0) {
+					node.bounds = nodes[child].bounds;
+				} else {
+					node.bounds.min = glm::min(node.bounds.min, nodes[child].bounds.min);
+					node.bounds.max = glm::max(node.bounds.max, nodes[child].bounds.max);
+				}
+				node.children[numChildren++] = child;
+			}
+		}
+	}
+
+	node.firstChunk = firstChunk;
+	node.numChunks = chunks.size() - firstChunk;
+	node.offset = offset;
+	node.numIndices = chunks.back().offset + chunks.back().numIndices - offset;
+	nodes[nodeIndex] = node;
+	return nodeIndex;
+}
+
+void TerrainQuadtree::buildIndices(unsigned int *indices) const {
+	parallelFor(0, chunks.size(), getNumWorkerThreads(), [&](int firstChunk, int lastChunk) {
+		for (int i = firstChunk; i < lastChunk; i++) {
+			const Chunk &chunk = chunks[i];
+			unsigned int *chunkIndices = &indices[chunk.offset];
+			for (int z = chunk.z; z < chunk.z + chunk.depth; z++) {
+				for (int x = chunk.x; x < chunk.x + chunk.width; x++) {
+					unsigned int index = z * width + x;
+					chunkIndices[0] = index;
+					chunkIndices[1] = index + 1;
+					chunkIndices[2] = index + width;
+					chunkIndices[3] = index + 1;
+					chunkIndices[4] = index + width + 1;
+					chunkIndices[5] = index + width;
+					chunkIndices += 6;
+				}
+			}
+		}
+	});
+}
+
+void TerrainQuadtree::cull(const Frustum &frustum, std::vector<const Node*> &visibleNodes) const {
+	if (!nodes.empty()) {
+		cullNode(0, frustum, visibleNodes);
+	}
+}
+
+void TerrainQuadtree::cullNode(int nodeIndex, const Frustum &frustum, std::vector<const Node*> &visibleNodes) const {
+	const Node &node = nodes[nodeIndex];
+	FrustumTest test = frustum.testAABB(node.bounds);
+	if (test == OUTSIDE_FRUSTUM) {
+		return;
+	}
+	if (test == INSIDE_FRUSTUM || node.children[0] == -1) {
+		visibleNodes.push_back(&node);
+		return;
+	}
+	for (int i = 0; i < 4 && node.children[i] != -1; i++) {
+		cullNode(node.children[i], frustum, visibleNodes);
+	}
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <vector>
+
+#include "Frustum.h"
+
+// A range in an index buffer to draw
+struct IndexRange {
+	int offset;
+	int numIndices;
+};
+
+// Splits a heightmap mesh into square chunks of quads and indexes them with a quadtree of
+// bounding boxes. The index buffer is laid out in quadtree order, so every node covers one
+// contiguous range of indices and a node that is completely visible is drawn as one range.
+// Knows nothing about OpenGL so it can be used without a context.
+class TerrainQuadtree {
+public:
+	struct Chunk {
+		AABB bounds;
+		int x, z; // First quad
+		int width, depth; // In quads
+		int offset; // First index in the index buffer
+		int numIndices;
+	};
+
+	struct Node {
+		AABB bounds;
+		int children[4]; // -1 when missing
+		int firstChunk;
+		int numChunks;
+		int offset;
+		int numIndices;
+	};
+
+	TerrainQuadtree();
+
+	// Heightmap is width x height vertices with the same scaling as given to heightmapToModel
+	void build(float *heightmap, int width, int height, float scaleX, float scaleY, float scaleZ, int chunkSize);
+
+	// Writes the triangle list of all chunks in quadtree order, getNumIndices() values.
+	// Vertex z * width + x is the heightmap sample at (x, z).
+	void buildIndices(unsigned int *indices) const;
+
+	// Appends the nodes intersecting the frustum. The frustum must be in the same space as
+	// the heightmap vertices.
+	void cull(const Frustum &frustum, std::vector<const Node*> &visibleNodes) const;
+
+	int getNumIndices() const {
+		return nodes.empty() ? 0 : nodes[0].numIndices;
+	}
+	int getNumChunks() const {
+		return chunks.size();
+	}
+	const Chunk &getChunk(int i) const {
+		return chunks[i];
+	}
+private:
+	int buildNode(float *heightmap, float scaleX, float scaleY, float scaleZ, int chunkX0, int chunkZ0, int chunkX1, int chunkZ1);
+	void cullNode(int nodeIndex, const Frustum &frustum, std::vector<const Node*> &visibleNodes) const;
+
+	int width;
+	int height;
+	int chunkSize;
+	std::vector<Node> nodes;
+	std::vector<Chunk> chunks;
+};
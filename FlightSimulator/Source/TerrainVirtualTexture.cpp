@@ -0,0 +1,228 @@
+#include "TerrainVirtualTexture.h"
+
+#include <algorithm>
+#include <cmath>
+#include <iomanip>
+#include <iostream>
+
+#include "Common.h"
+#include "TextureContainer.h"
+
+void buildTerrainPageSources(const DecodedImage &splatmap, const DecodedImage *const details[3], float detailRepeats, TerrainPageSources &sources) {
+	sources.splatmap = &splatmap;
+	sources.detailRepeats = detailRepeats;
+	for (int i = 0; i < 3; i++) {
+		sources.details[i] = details[i];
+	}
+	parallelFor(0, 3, 3, [&](int first, int last) {
+		for (int i = first; i < last; i++) {
+			std::vector<DecodedImage> &mips = sources.detailMips[i];
+			mips.clear();
+			while (true) {
+				const DecodedImage &previous = mips.empty() ? *details[i] : mips.back();
+				if (previous.width <= 1 && previous.height <= 1) {
+					break;
+				}
+				DecodedImage smaller;
+				downsampleImage(previous, smaller);
+				mips.push_back(smaller);
+			}
+		}
+	});
+}
+
+// Bilinearly filtered color at (x, y) in texels, wrapping around the edges or clamping to them
+static void sampleBilinear(const DecodedImage &image, float x, float y, bool isWrapped, float color[4]) {
+	x -= 0.5f;
+	y -= 0.5f;
+	int x0 = (int)std::floor(x);
+	int y0 = (int)std::floor(y);
+	float fractionX = x - x0;
+	float fractionY = y - y0;
+	int width = image.width;
+	int height = image.height;
+	int columns[2] = { x0, x0 + 1 };
+	int rows[2] = { y0, y0 + 1 };
+	for (int i = 0; i < 2; i++) {
+		if (isWrapped) {
+			columns[i] = (columns[i] % width + width) % width;
+			rows[i] = (rows[i] % height + height) % height;
+		} else {
+			columns[i] = std::max(0, std::min(width - 1, columns[i]));
+			rows[i] = std::max(0, std::min(height - 1, rows[i]));
+		}
+	}
+	const unsigned char *texels[4] = {
+		&image.pixels[((size_t)rows[0] * width + columns[0]) * 4],
+		&image.pixels[((size_t)rows[0] * width + columns[1]) * 4],
+		&image.pixels[((size_t)rows[1] * width + columns[0]) * 4],
+		&image.pixels[((size_t)rows[1] * width + columns[1]) * 4]
+	};
+	for (int c = 0; c < 4; c++) {
+		float bottom = texels[0][c] + (texels[1][c] - texels[0][c]) * fractionX;
+		float top = texels[2][c] + (texels[3][c] - texels[2][c]) * fractionX;
+		color[c] = bottom + (top - bottom) * fractionY;
+	}
+}
+
+void bakeTerrainPage(const TerrainPageSources &sources, const VirtualPage &page, unsigned char *pixels) {
+	const int contentSize = TERRAIN_PAGE_SIZE - 2 * TERRAIN_PAGE_BORDER;
+	float levelSize = (float)(TERRAIN_VIRTUAL_PAGES >> page.level) * contentSize;
+
+	// The mip level whose texels are closest in size to a page texel
+	const DecodedImage *details[3];
+	for (int i = 0; i < 3; i++) {
+		const std::vector<DecodedImage> &mips = sources.detailMips[i];
+		float detailTexelsPerTexel = sources.detailRepeats * sources.details[i]->width / levelSize;
+		int level = std::min((int)std::floor(std::log2(std::max(detailTexelsPerTexel, 1.0f)) + 0.5f), (int)mips.size());
+		details[i] = level == 0 ? sources.details[i] : &mips[level - 1];
+	}
+
+	const DecodedImage &splatmap = *sources.splatmap;
+	for (int y = 0; y < TERRAIN_PAGE_SIZE; y++) {
+		float v = (page.y * contentSize + y - TERRAIN_PAGE_BORDER + 0.5f) / levelSize;
+		v = std::max(0.0f, std::min(1.0f, v));
+		for (int x = 0; x < TERRAIN_PAGE_SIZE; x++) {
+			float u = (page.x * contentSize + x - TERRAIN_PAGE_BORDER + 0.5f) / levelSize;
+			u = std::max(0.0f, std::min(1.0f, u));
+			float splat[4];
+			sampleBilinear(splatmap, u * splatmap.width, v * splatmap.height, false, splat);
+			float color[4] = { 0, 0, 0, 0 };
+			for (int i = 0; i < 3; i++) {
+				float detail[4];
+				sampleBilinear(*details[i], u * sources.detailRepeats * details[i]->width, v * sources.detailRepeats * details[i]->height, true, detail);
+				for (int c = 0; c < 4; c++) {
+					color[c] += splat[i] / 255 * detail[c];
+				}
+			}
+			unsigned char *pixel = &pixels[((size_t)y * TERRAIN_PAGE_SIZE + x) * 4];
+			for (int c = 0; c < 4; c++) {
+				pixel[c] = (unsigned char)std::max(0.0f, std::min(255.0f, color[c] + 0.5f));
+			}
+		}
+	}
+}
+
+TerrainVirtualTexture::TerrainVirtualTexture(const TerrainPageSources &sources) : sources(sources), cache(TERRAIN_VIRTUAL_PAGES, TERRAIN_ATLAS_SLOTS) {
+	numBakedPages = 0;
+	numDroppedPages = 0;
+	bakeMilliseconds = 0;
+	uploadMilliseconds = 0;
+
+	// texelFetch reads the page table, each level of it the page table of a level
+	glGenTextures(1, &pageTableTexture);
+	glBindTexture(GL_TEXTURE_2D, pageTableTexture);
+	glTexStorage2D(GL_TEXTURE_2D, cache.getNumLevels(), GL_RGBA8, TERRAIN_VIRTUAL_PAGES, TERRAIN_VIRTUAL_PAGES);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, cache.getNumLevels() - 1);
+
+	int atlasSize = TERRAIN_ATLAS_SLOTS * TERRAIN_PAGE_SIZE;
+	glGenTextures(1, &atlasTexture);
+	glBindTexture(GL_TEXTURE_2D, atlasTexture);
+	glTexStorage2D(GL_TEXTURE_2D, 1, GL_RGBA8, atlasSize, atlasSize);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+	VirtualPage root = { cache.getNumLevels() - 1, 0, 0 };
+	std::vector<unsigned char> pixels(TERRAIN_PAGE_SIZE * TERRAIN_PAGE_SIZE * 4);
+	Timer timer;
+	bakeTerrainPage(sources, root, &pixels[0]);
+	bakeMilliseconds += timer.elapsedMilliseconds();
+	numBakedPages++;
+	uploadPage(cache.map(root), &pixels[0]);
+	cache.updatePageTable();
+	uploadPageTable();
+}
+
+TerrainVirtualTexture::~TerrainVirtualTexture() {
+	for (int i = 0; i < bakingPages.size(); i++) {
+		waitForCounter(bakingPages[i]->baked);
+		delete bakingPages[i];
+	}
+	glDeleteTextures(1, &pageTableTexture);
+	glDeleteTextures(1, &atlasTexture);
+}
+
+void TerrainVirtualTexture::update(float u, float v) {
+	cache.beginFrame();
+	faults.clear();
+	cache.requestAround(u, v, TERRAIN_PAGE_RADIUS, faults);
+
+	// After the requests, so mapping the finished pages doesn't evict pages needed this frame
+	int numBaking = 0;
+	for (int i = 0; i < bakingPages.size(); i++) {
+		BakingPage *baking = bakingPages[i];
+		if (!baking->baked.isDone()) {
+			bakingPages[numBaking++] = baking;
+			continue;
+		}
+		// The job may still hold the counter's mutex
+		waitForCounter(baking->baked);
+		numBakedPages++;
+		bakeMilliseconds += baking->bakeMilliseconds;
+		int slot = cache.map(baking->page);
+		if (slot >= 0) {
+			uploadPage(slot, &baking->pixels[0]);
+		} else {
+			numDroppedPages++;
+		}
+		delete baking;
+	}
+	bakingPages.resize(numBaking);
+	if (cache.updatePageTable()) {
+		uploadPageTable();
+	}
+
+	// Coarse pages first, they are what the fine ones fall back to
+	const TerrainPageSources *pageSources = &sources;
+	for (int i = 0; i < faults.size() && bakingPages.size() < TERRAIN_MAX_BAKING_PAGES; i++) {
+		BakingPage *baking = new BakingPage();
+		baking->page = faults[i];
+		baking->pixels.resize(TERRAIN_PAGE_SIZE * TERRAIN_PAGE_SIZE * 4);
+		baking->bakeMilliseconds = 0;
+		cache.setPending(faults[i]);
+		runJob("Terrain page bake", [baking, pageSources]() {
+			Timer timer;
+			bakeTerrainPage(*pageSources, baking->page, &baking->pixels[0]);
+			baking->bakeMilliseconds = timer.elapsedMilliseconds();
+		}, &baking->baked);
+		bakingPages.push_back(baking);
+	}
+}
+
+void TerrainVirtualTexture::uploadPage(int slot, const unsigned char *pixels) {
+	Timer timer;
+	int slotsAcross = cache.getSlotsAcross();
+	glBindTexture(GL_TEXTURE_2D, atlasTexture);
+	glTexSubImage2D(GL_TEXTURE_2D, 0, (slot % slotsAcross) * TERRAIN_PAGE_SIZE, (slot / slotsAcross) * TERRAIN_PAGE_SIZE,
+		TERRAIN_PAGE_SIZE, TERRAIN_PAGE_SIZE, GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+	uploadMilliseconds += timer.elapsedMilliseconds();
+}
+
+void TerrainVirtualTexture::uploadPageTable() {
+	Timer timer;
+	glBindTexture(GL_TEXTURE_2D, pageTableTexture);
+	for (int level = 0; level < cache.getNumLevels(); level++) {
+		int size = cache.getPagesAcross(level);
+		glTexSubImage2D(GL_TEXTURE_2D, level, 0, 0, size, size, GL_RGBA, GL_UNSIGNED_BYTE, &cache.getPageTable(level)[0]);
+	}
+	uploadMilliseconds += timer.elapsedMilliseconds();
+}
+
+void TerrainVirtualTexture::printStats() const {
+	size_t atlasBytes = (size_t)TERRAIN_ATLAS_SLOTS * TERRAIN_PAGE_SIZE * TERRAIN_ATLAS_SLOTS * TERRAIN_PAGE_SIZE * 4;
+	size_t pageTableBytes = 0;
+	for (int level = 0; level < cache.getNumLevels(); level++) {
+		pageTableBytes += cache.getPageTable(level).size() * 4;
+	}
+	long long numRequests = cache.getNumRequests();
+	std::cout << std::fixed << std::setprecision(1) << "Terrain virtual texture: " << numRequests << " page requests, " << cache.getNumMisses() << " page faults ("
+		<< (numRequests > 0 ? 100.0 * cache.getNumMisses() / numRequests : 0.0) << "% missed), " << cache.getNumEvictions() << " evictions, "
+		<< numBakedPages << " pages baked in " << bakeMilliseconds << " ms on the workers (" << numDroppedPages << " no longer needed), uploads "
+		<< uploadMilliseconds << " ms, " << cache.getNumMappedSlots() << "/" << TERRAIN_ATLAS_SLOTS * TERRAIN_ATLAS_SLOTS << " atlas slots, "
+		<< atlasBytes / (1024.0 * 1024.0) << " MB atlas and " << pageTableBytes / 1024.0 << " kB page table" << std::endl;
+	std::cout << std::defaultfloat;
+}
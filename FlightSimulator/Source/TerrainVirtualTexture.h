@@ -0,0 +1,104 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include <glad/glad.h>
+
+#include "TextureLoader.h"
+#include "Threading.h"
+#include "VirtualTexture.h"
+
+// Texels per side of a page in the atlas, including a border on every side copied from the
+// neighbouring pages so bilinear filtering doesn't bleed across them. Must also change the
+// terrain fragment shader.
+const int TERRAIN_PAGE_SIZE = 128;
+const int TERRAIN_PAGE_BORDER = 1;
+// Pages across level 0, about 8 texels per metre over the 4 km terrain. Must also change the
+// terrain fragment shader.
+const int TERRAIN_VIRTUAL_PAGES = 256;
+// The atlas is this many pages wide and high, 2048x2048 texels
+const int TERRAIN_ATLAS_SLOTS = 16;
+// Pages kept around the camera on every level, 171 pages at the most, which fit the atlas
+const int TERRAIN_PAGE_RADIUS = 2;
+// Pages baked at the same time, and so at most uploaded per frame
+const int TERRAIN_MAX_BAKING_PAGES = 16;
+
+// What terrain pages are baked from, flipped like the textures the terrain is drawn with. The
+// images are the ones the terrain textures were decoded from, owned by whoever decoded them.
+struct TerrainPageSources {
+	// Weights of the detail textures in red, green and blue
+	const DecodedImage *splatmap;
+	// Level 0 of each detail texture
+	const DecodedImage *details[3];
+	// Levels 1 and up of each detail texture's mip chain
+	std::vector<DecodedImage> detailMips[3];
+	// Times the detail textures repeat across the terrain
+	float detailRepeats;
+};
+
+// Points the sources at the decoded images, which must outlive them, and builds the detail
+// mip chains
+void buildTerrainPageSources(const DecodedImage &splatmap, const DecodedImage *const details[3], float detailRepeats, TerrainPageSources &sources);
+
+// Bakes the terrain color of a page the way the terrain fragment shader blends it, into
+// TERRAIN_PAGE_SIZE squared RGBA pixels. Pages coarser than the detail textures read their
+// matching mip level.
+void bakeTerrainPage(const TerrainPageSources &sources, const VirtualPage &page, unsigned char *pixels);
+
+// The terrain color as a virtual texture covering the splat map, which the terrain fragment
+// shader samples through a page table texture pointing into an atlas of baked pages. The
+// pages around the camera are kept resident, missing ones are baked as jobs and uploaded
+// the frame after they are done. Until then the page's closest resident ancestor is drawn.
+class TerrainVirtualTexture {
+public:
+	// Bakes the page covering the whole terrain right away, needs the OpenGL context. sources
+	// must outlive the virtual texture.
+	explicit TerrainVirtualTexture(const TerrainPageSources &sources);
+	// Waits for the pages still baking
+	~TerrainVirtualTexture();
+	// Uploads the pages that finished baking, requests the pages around (u, v) in the splat
+	// map's coordinates and starts baking those that are missing. Once per frame on the
+	// thread owning the OpenGL context.
+	void update(float u, float v);
+	GLuint getPageTableTexture() const {
+		return pageTableTexture;
+	}
+	GLuint getAtlasTexture() const {
+		return atlasTexture;
+	}
+	const VirtualTextureCache& getCache() const {
+		return cache;
+	}
+	int getNumBakingPages() const {
+		return bakingPages.size();
+	}
+	// Page faults, miss rate, evictions, baking times and GPU memory
+	void printStats() const;
+private:
+	TerrainVirtualTexture(const TerrainVirtualTexture&);
+	TerrainVirtualTexture& operator=(const TerrainVirtualTexture&);
+
+	struct BakingPage {
+		VirtualPage page;
+		std::vector<unsigned char> pixels;
+		double bakeMilliseconds;
+		JobCounter baked;
+	};
+
+	void uploadPage(int slot, const unsigned char *pixels);
+	void uploadPageTable();
+
+	const TerrainPageSources &sources;
+	VirtualTextureCache cache;
+	GLuint pageTableTexture;
+	GLuint atlasTexture;
+	// In the order they were started
+	std::vector<BakingPage*> bakingPages;
+	std::vector<VirtualPage> faults;
+	int numBakedPages;
+	// Baked pages that were no longer needed when done and found no slot
+	int numDroppedPages;
+	double bakeMilliseconds;
+	double uploadMilliseconds;
+};
@@ -0,0 +1,237 @@
+#include "TextureContainer.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+
+// Start of a container, followed by the levels and the payload
+struct TextureContainerHeader {
+	char magic[4];
+	unsigned int version;
+	// Of the source images, in order
+	unsigned long long sourceSize;
+	unsigned long long sourceChecksum;
+	unsigned int format;
+	unsigned int numFaces;
+	unsigned int numLevels;
+	unsigned int isFlipped;
+	unsigned long long payloadSize;
+	// Of the levels and payload
+	unsigned long long checksum;
+};
+
+static const char TEXTURE_CONTAINER_MAGIC[4] = { 'F', 'S', 'T', 'X' };
+
+static bool checksumSources(const std::vector<std::string> &sourceFilenames, unsigned long long &size, unsigned long long &checksum) {
+	size = 0;
+	checksum = CHECKSUM_SEED;
+	for (int i = 0; i < sourceFilenames.size(); i++) {
+		MappedFile source;
+		if (!source.open(sourceFilenames[i])) {
+			return false;
+		}
+		size += source.getSize();
+		checksum = checksumBytes(source.getData(), source.getSize(), checksum);
+	}
+	return true;
+}
+
+static unsigned long long checksumContainer(const TextureContainerData &data) {
+	unsigned long long checksum = checksumBytes(data.levels, (size_t)data.numFaces * data.numLevels * sizeof(TextureContainerLevel));
+	return checksumBytes(data.payload, data.payloadSize, checksum);
+}
+
+std::string getCubemapContainerFilename(const std::string faces[6]) {
+	return faces[0] + ".cubemap" + TEXTURE_CONTAINER_EXTENSION;
+}
+
+bool openTextureContainer(const std::string &filename, const std::vector<std::string> &sourceFilenames, MappedFile &file, TextureContainerData &data) {
+	unsigned long long sourceSize, sourceChecksum;
+	if (!checksumSources(sourceFilenames, sourceSize, sourceChecksum) || !file.open(filename)) {
+		return false;
+	}
+	TextureContainerHeader header;
+	if (file.getSize() < sizeof(header)) {
+		file.close();
+		return false;
+	}
+	memcpy(&header, file.getData(), sizeof(header));
+	size_t levelsSize = (size_t)header.numFaces * header.numLevels * sizeof(TextureContainerLevel);
+	bool isValid = memcmp(header.magic, TEXTURE_CONTAINER_MAGIC, sizeof(header.magic)) == 0
+		&& header.version == TEXTURE_CONTAINER_VERSION
+		&& header.sourceSize == sourceSize
+		&& header.sourceChecksum == sourceChecksum
+		&& header.format <= TEXTURE_CONTAINER_BC5
+		&& (header.numFaces == 1 || header.numFaces == 6)
+		&& header.numLevels >= 1 && header.numLevels <= 32
+		&& file.getSize() == sizeof(header) + levelsSize + header.payloadSize;
+	if (!isValid) {
+		file.close();
+		return false;
+	}
+
+	data.format = (TextureContainerFormat)header.format;
+	data.numFaces = header.numFaces;
+	data.numLevels = header.numLevels;
+	data.isFlipped = header.isFlipped != 0;
+	data.levels = (const TextureContainerLevel*)(file.getData() + sizeof(header));
+	data.payload = file.getData() + sizeof(header) + levelsSize;
+	data.payloadSize = header.payloadSize;
+	if (checksumContainer(data) != header.checksum) {
+		file.close();
+		return false;
+	}
+	for (int i = 0; i < data.numFaces * data.numLevels; i++) {
+		if (data.levels[i].offset + data.levels[i].size > data.payloadSize) {
+			file.close();
+			return false;
+		}
+	}
+	return true;
+}
+
+TextureContainerFormat chooseContainerFormat(const std::string &filename, const DecodedImage &image, bool isCompressed) {
+	if (!isCompressed) {
+		return TEXTURE_CONTAINER_RGBA8;
+	}
+	if (filename.find("normalmap") != std::string::npos) {
+		return TEXTURE_CONTAINER_BC5;
+	}
+	for (size_t i = 3; i < image.pixels.size(); i += 4) {
+		if (image.pixels[i] != 255) {
+			return TEXTURE_CONTAINER_BC3;
+		}
+	}
+	return TEXTURE_CONTAINER_BC1;
+}
+
+void downsampleImage(const DecodedImage &source, DecodedImage &target) {
+	target.width = std::max(source.width / 2, 1u);
+	target.height = std::max(source.height / 2, 1u);
+	target.pixels.resize((size_t)target.width * target.height * 4);
+	for (unsigned int y = 0; y < target.height; y++) {
+		unsigned int y0 = std::min(y * 2, source.height - 1);
+		unsigned int y1 = std::min(y * 2 + 1, source.height - 1);
+		for (unsigned int x = 0; x < target.width; x++) {
+			unsigned int x0 = std::min(x * 2, source.width - 1);
+			unsigned int x1 = std::min(x * 2 + 1, source.width - 1);
+			for (int c = 0; c < 4; c++) {
+				int sum = source.pixels[((size_t)y0 * source.width + x0) * 4 + c] + source.pixels[((size_t)y0 * source.width + x1) * 4 + c]
+					+ source.pixels[((size_t)y1 * source.width + x0) * 4 + c] + source.pixels[((size_t)y1 * source.width + x1) * 4 + c];
+				target.pixels[((size_t)y * target.width + x) * 4 + c] = (unsigned char)((sum + 2) / 4);
+			}
+		}
+	}
+}
+
+static void appendLevel(const DecodedImage &image, TextureContainerFormat format, TextureContainerBuffers &baked) {
+	TextureContainerLevel level;
+	level.width = image.width;
+	level.height = image.height;
+	level.offset = baked.payload.size();
+	if (format == TEXTURE_CONTAINER_RGBA8) {
+		baked.payload.insert(baked.payload.end(), image.pixels.begin(), image.pixels.end());
+	} else {
+		std::vector<unsigned char> compressed;
+		compressImage(&image.pixels[0], image.width, image.height, (BlockFormat)(format - TEXTURE_CONTAINER_BC1), compressed);
+		baked.payload.insert(baked.payload.end(), compressed.begin(), compressed.end());
+	}
+	level.size = baked.payload.size() - level.offset;
+	baked.levels.push_back(level);
+}
+
+void bakeTextureContainer(const DecodedImage *faces, int numFaces, bool isFlipped, bool hasMipmaps, TextureContainerFormat format, TextureContainerBuffers &baked) {
+	int numLevels = 1;
+	if (hasMipmaps) {
+		for (unsigned int size = std::max(faces[0].width, faces[0].height); size > 1; size /= 2) {
+			numLevels++;
+		}
+	}
+	baked.levels.clear();
+	baked.payload.clear();
+	for (int face = 0; face < numFaces; face++) {
+		appendLevel(faces[face], format, baked);
+		DecodedImage level = faces[face];
+		for (int i = 1; i < numLevels; i++) {
+			DecodedImage smaller;
+			downsampleImage(level, smaller);
+			appendLevel(smaller, format, baked);
+			level.pixels.swap(smaller.pixels);
+			level.width = smaller.width;
+			level.height = smaller.height;
+		}
+	}
+
+	TextureContainerData &data = baked.data;
+	data.format = format;
+	data.numFaces = numFaces;
+	data.numLevels = numLevels;
+	data.isFlipped = isFlipped;
+	data.levels = &baked.levels[0];
+	data.payload = &baked.payload[0];
+	data.payloadSize = baked.payload.size();
+}
+
+bool writeTextureContainer(const std::string &filename, const std::vector<std::string> &sourceFilenames, const TextureContainerData &data) {
+	unsigned long long sourceSize, sourceChecksum;
+	if (!checksumSources(sourceFilenames, sourceSize, sourceChecksum)) {
+		return false;
+	}
+	TextureContainerHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, TEXTURE_CONTAINER_MAGIC, sizeof(header.magic));
+	header.version = TEXTURE_CONTAINER_VERSION;
+	header.sourceSize = sourceSize;
+	header.sourceChecksum = sourceChecksum;
+	header.format = data.format;
+	header.numFaces = data.numFaces;
+	header.numLevels = data.numLevels;
+	header.isFlipped = data.isFlipped;
+	header.payloadSize = data.payloadSize;
+	header.checksum = checksumContainer(data);
+
+	std::ofstream file(filename, std::ios::binary | std::ios::trunc);
+	if (!file) {
+		return false;
+	}
+	file.write((const char*)&header, sizeof(header));
+	file.write((const char*)data.levels, (std::streamsize)data.numFaces * data.numLevels * sizeof(TextureContainerLevel));
+	file.write((const char*)data.payload, (std::streamsize)data.payloadSize);
+	return (bool)file;
+}
+
+GLenum getContainerInternalFormat(TextureContainerFormat format) {
+	switch (format) {
+	case TEXTURE_CONTAINER_BC1:
+		return GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
+	case TEXTURE_CONTAINER_BC3:
+		return GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;
+	case TEXTURE_CONTAINER_BC5:
+		return GL_COMPRESSED_RG_RGTC2;
+	default:
+		return GL_RGBA8;
+	}
+}
+
+const char* getContainerFormatName(TextureContainerFormat format) {
+	const char *names[] = { "RGBA8", "BC1", "BC3", "BC5" };
+	return names[format];
+}
+
+void uploadTextureContainer(const TextureContainerData &data, const unsigned char *payload) {
+	GLenum internalFormat = getContainerInternalFormat(data.format);
+	GLenum target = data.numFaces == 6 ? GL_TEXTURE_CUBE_MAP : GL_TEXTURE_2D;
+	glTexParameteri(target, GL_TEXTURE_BASE_LEVEL, 0);
+	glTexParameteri(target, GL_TEXTURE_MAX_LEVEL, data.numLevels - 1);
+	for (int face = 0; face < data.numFaces; face++) {
+		GLenum faceTarget = data.numFaces == 6 ? GL_TEXTURE_CUBE_MAP_POSITIVE_X + face : GL_TEXTURE_2D;
+		for (int i = 0; i < data.numLevels; i++) {
+			const TextureContainerLevel &level = data.levels[face * data.numLevels + i];
+			if (data.format == TEXTURE_CONTAINER_RGBA8) {
+				glTexImage2D(faceTarget, i, internalFormat, level.width, level.height, 0, GL_RGBA, GL_UNSIGNED_BYTE, payload + level.offset);
+			} else {
+				glCompressedTexImage2D(faceTarget, i, internalFormat, level.width, level.height, 0, (GLsizei)level.size, payload + level.offset);
+			}
+		}
+	}
+}
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include <glad/glad.h>
+
+#include "BlockCompression.h"
+#include "MappedFile.h"
+#include "TextureLoader.h"
+
+// Change whenever the file layout or how images are baked changes, older containers are then stale
+const unsigned int TEXTURE_CONTAINER_VERSION = 1;
+
+// Appended to the source image's filename to get its baked container's
+const char TEXTURE_CONTAINER_EXTENSION[] = ".tex";
+
+#ifndef GL_COMPRESSED_RGB_S3TC_DXT1_EXT
+#define GL_COMPRESSED_RGB_S3TC_DXT1_EXT 0x83F0
+#endif
+#ifndef GL_COMPRESSED_RGBA_S3TC_DXT5_EXT
+#define GL_COMPRESSED_RGBA_S3TC_DXT5_EXT 0x83F3
+#endif
+
+enum TextureContainerFormat {
+	TEXTURE_CONTAINER_RGBA8,
+	TEXTURE_CONTAINER_BC1,
+	TEXTURE_CONTAINER_BC3,
+	TEXTURE_CONTAINER_BC5
+};
+
+// Where one mip level of one face is in the payload
+struct TextureContainerLevel {
+	unsigned int width;
+	unsigned int height;
+	unsigned long long offset;
+	unsigned long long size;
+};
+
+// A baked texture, pointing into the mapped container file or a TextureContainerBuffers
+struct TextureContainerData {
+	TextureContainerFormat format;
+	// 1, or 6 for a cubemap in the order of TextureLoader::requestCubemap
+	int numFaces;
+	int numLevels;
+	// Rows bottom to top, as TextureSettings::isFlipped
+	bool isFlipped;
+	// numLevels per face, face after face
+	const TextureContainerLevel *levels;
+	const unsigned char *payload;
+	size_t payloadSize;
+};
+
+// A texture baked in memory, data points into the arrays
+struct TextureContainerBuffers {
+	std::vector<TextureContainerLevel> levels;
+	std::vector<unsigned char> payload;
+	TextureContainerData data;
+};
+
+// The container a cubemap is baked to, named after its first face
+std::string getCubemapContainerFilename(const std::string faces[6]);
+
+// Maps the container and checks it against the images it was baked from and its own checksum.
+// Returns false if any file is missing or the container is stale or corrupted.
+bool openTextureContainer(const std::string &filename, const std::vector<std::string> &sourceFilenames, MappedFile &file, TextureContainerData &data);
+
+// BC5 for normal maps, recognized by their filename, BC3 for images with any transparency
+// and BC1 for the rest, or RGBA8 when not compressed
+TextureContainerFormat chooseContainerFormat(const std::string &filename, const DecodedImage &image, bool isCompressed);
+
+// Averages each 2x2 pixels into one, the last row or column of odd sizes with itself
+void downsampleImage(const DecodedImage &source, DecodedImage &target);
+
+// Box filters a full mip chain down to 1x1 when hasMipmaps and compresses every level. The
+// faces must all be the same size.
+void bakeTextureContainer(const DecodedImage *faces, int numFaces, bool isFlipped, bool hasMipmaps, TextureContainerFormat format, TextureContainerBuffers &baked);
+
+// Returns false if the file can't be written
+bool writeTextureContainer(const std::string &filename, const std::vector<std::string> &sourceFilenames, const TextureContainerData &data);
+
+GLenum getContainerInternalFormat(TextureContainerFormat format);
+
+const char* getContainerFormatName(TextureContainerFormat format);
+
+// Uploads every face and level to the bound 2D texture or cubemap, with pixels read from
+// payload, which is data.payload or the start of the payload in a bound pixel unpack buffer
+void uploadTextureContainer(const TextureContainerData &data, const unsigned char *payload);
@@ -0,0 +1,332 @@
+#include "TextureLoader.h"
+
+#include <algorithm>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+
+#include <lodepng.h>
+
+#include "Common.h"
+#include "TextureContainer.h"
+
+bool decodePNG(const std::string &filename, bool isFlipped, DecodedImage &image) {
+	// lodepng appends to the vector
+	image.pixels.clear();
+	unsigned error = lodepng::decode(image.pixels, image.width, image.height, filename);
+	if (error) {
+		std::cerr << "Error! Could not decode " << filename << ": " << lodepng_error_text(error) << std::endl;
+		image.pixels.assign(4, 255);
+		image.width = 1;
+		image.height = 1;
+		return false;
+	}
+	if (isFlipped) {
+		size_t rowSize = image.width * 4;
+		for (unsigned i = 0; i < image.height / 2; i++) {
+			std::swap_ranges(image.pixels.begin() + i * rowSize, image.pixels.begin() + (i + 1) * rowSize,
+				image.pixels.begin() + (image.height - i - 1) * rowSize);
+		}
+	}
+	return true;
+}
+
+static void setTextureImage(const DecodedImage &image, const TextureSettings &settings, const void *pixels) {
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, settings.minFilter);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, settings.magFilter);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, settings.wrap);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, settings.wrap);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, image.width, image.height, 0, GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+	if (settings.hasMipmaps) {
+		glGenerateMipmap(GL_TEXTURE_2D);
+	}
+}
+
+GLuint createTexture(const DecodedImage &image, const TextureSettings &settings) {
+	GLuint texId;
+	glGenTextures(1, &texId);
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_2D, texId);
+	setTextureImage(image, settings, &image.pixels[0]);
+	return texId;
+}
+
+TextureSettings getCubemapSettings() {
+	TextureSettings settings;
+	settings.isFlipped = false;
+	settings.hasMipmaps = false;
+	settings.minFilter = GL_LINEAR;
+	settings.wrap = GL_CLAMP_TO_EDGE;
+	return settings;
+}
+
+// A requested texture, decoded or read from its container by a job
+struct TextureLoader::Request {
+	std::string filename;
+	TextureSettings settings;
+	// Of a 2D texture, for a cubemap only its size
+	DecodedImage image;
+	// Six for a cubemap, empty otherwise
+	std::vector<std::string> faceFilenames;
+	std::vector<DecodedImage> faceImages;
+	// Index of the face whose image each face uses, the first one with the same file contents
+	int faceSources[6];
+	// Read from the container instead of decoded, the images then only have the size
+	bool isBaked;
+	MappedFile container;
+	TextureContainerData baked;
+	double decodeMilliseconds;
+	double waitMilliseconds;
+	double uploadMilliseconds;
+	size_t textureBytes;
+	JobCounter decoded;
+};
+
+// Bytes of an RGBA8 texture, with the mip chain glGenerateMipmap adds when hasMipmaps
+static size_t getImageBytes(size_t width, size_t height, bool hasMipmaps) {
+	size_t bytes = width * height * 4;
+	while (hasMipmaps && (width > 1 || height > 1)) {
+		width = std::max(width / 2, (size_t)1);
+		height = std::max(height / 2, (size_t)1);
+		bytes += width * height * 4;
+	}
+	return bytes;
+}
+
+TextureLoader::TextureLoader(bool usePixelBuffers, bool useContainers) : usePixelBuffers(usePixelBuffers), useContainers(useContainers), pixelBuffer(0) {
+}
+
+TextureLoader::~TextureLoader() {
+	for (int i = 0; i < requests.size(); i++) {
+		waitForCounter(requests[i]->decoded);
+		delete requests[i];
+	}
+	if (pixelBuffer) {
+		glDeleteBuffers(1, &pixelBuffer);
+	}
+}
+
+bool TextureLoader::openContainer(Request &request, const std::string &containerFilename, const std::vector<std::string> &sources) {
+	if (!openTextureContainer(containerFilename, sources, request.container, request.baked)) {
+		return false;
+	}
+	const TextureContainerData &baked = request.baked;
+	int numFaces = request.faceFilenames.empty() ? 1 : 6;
+	if (baked.numFaces != numFaces || baked.isFlipped != request.settings.isFlipped || (baked.numLevels > 1) != request.settings.hasMipmaps) {
+		request.container.close();
+		return false;
+	}
+	request.isBaked = true;
+	request.image.width = baked.levels[0].width;
+	request.image.height = baked.levels[0].height;
+	return true;
+}
+
+void TextureLoader::decodeCubemap(Request &request) {
+	unsigned long long sizes[6];
+	unsigned long long checksums[6];
+	for (int i = 0; i < 6; i++) {
+		MappedFile file;
+		sizes[i] = 0;
+		checksums[i] = i;
+		if (file.open(request.faceFilenames[i])) {
+			sizes[i] = file.getSize();
+			checksums[i] = checksumBytes(file.getData(), file.getSize());
+		}
+		request.faceSources[i] = i;
+		for (int j = 0; j < i; j++) {
+			if (sizes[j] == sizes[i] && checksums[j] == checksums[i]) {
+				request.faceSources[i] = j;
+				break;
+			}
+		}
+	}
+	request.faceImages.resize(6);
+	Request *decoding = &request;
+	parallelFor(0, 6, 6, [decoding](int first, int last) {
+		for (int i = first; i < last; i++) {
+			if (decoding->faceSources[i] == i) {
+				decodePNG(decoding->faceFilenames[i], false, decoding->faceImages[i]);
+			}
+		}
+	});
+	request.image.width = request.faceImages[0].width;
+	request.image.height = request.faceImages[0].height;
+}
+
+int TextureLoader::addRequest(const std::string &filename, const TextureSettings &settings, const std::string *faces) {
+	Request *request = new Request();
+	request->filename = filename;
+	request->settings = settings;
+	if (faces) {
+		request->faceFilenames.assign(faces, faces + 6);
+	}
+	request->isBaked = false;
+	request->decodeMilliseconds = 0;
+	request->waitMilliseconds = 0;
+	request->uploadMilliseconds = 0;
+	request->textureBytes = 0;
+	bool useContainer = useContainers;
+	runJob("Texture decode", [request, useContainer]() {
+		Timer timer;
+		if (request->faceFilenames.empty()) {
+			std::vector<std::string> sources(1, request->filename);
+			if (!useContainer || request->settings.isImageKept || !openContainer(*request, request->filename + TEXTURE_CONTAINER_EXTENSION, sources)) {
+				decodePNG(request->filename, request->settings.isFlipped, request->image);
+			}
+		} else {
+			if (!useContainer || !openContainer(*request, getCubemapContainerFilename(&request->faceFilenames[0]), request->faceFilenames)) {
+				decodeCubemap(*request);
+			}
+		}
+		request->decodeMilliseconds = timer.elapsedMilliseconds();
+	}, &request->decoded);
+	requests.push_back(request);
+	return requests.size() - 1;
+}
+
+int TextureLoader::request(const std::string &filename, const TextureSettings &settings) {
+	return addRequest(filename, settings, nullptr);
+}
+
+int TextureLoader::requestCubemap(const std::string faces[6]) {
+	return addRequest(faces[0], getCubemapSettings(), faces);
+}
+
+TextureLoader::Request& TextureLoader::waitForDecode(int request) {
+	Request &decoding = *requests[request];
+	if (!decoding.decoded.isDone()) {
+		Timer timer;
+		waitForCounter(decoding.decoded);
+		decoding.waitMilliseconds += timer.elapsedMilliseconds();
+	}
+	return decoding;
+}
+
+const unsigned char* TextureLoader::stagePixels(const unsigned char *pixels, size_t size) {
+	if (!usePixelBuffers) {
+		return pixels;
+	}
+	if (!pixelBuffer) {
+		glGenBuffers(1, &pixelBuffer);
+	}
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pixelBuffer);
+	// Orphans the storage of the previous upload, which the driver may still be reading from
+	glBufferData(GL_PIXEL_UNPACK_BUFFER, size, nullptr, GL_STREAM_DRAW);
+	void *mapped = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+	if (!mapped) {
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		return pixels;
+	}
+	memcpy(mapped, pixels, size);
+	glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+	return nullptr;
+}
+
+void TextureLoader::unstagePixels() {
+	if (usePixelBuffers) {
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	}
+}
+
+GLuint TextureLoader::getTexture(int request) {
+	Request &loaded = waitForDecode(request);
+	Timer timer;
+	bool isCubemap = !loaded.faceFilenames.empty();
+	GLenum target = isCubemap ? GL_TEXTURE_CUBE_MAP : GL_TEXTURE_2D;
+	GLuint texId;
+	glGenTextures(1, &texId);
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(target, texId);
+	const TextureSettings &settings = loaded.settings;
+	glTexParameteri(target, GL_TEXTURE_MIN_FILTER, settings.minFilter);
+	glTexParameteri(target, GL_TEXTURE_MAG_FILTER, settings.magFilter);
+	glTexParameteri(target, GL_TEXTURE_WRAP_S, settings.wrap);
+	glTexParameteri(target, GL_TEXTURE_WRAP_T, settings.wrap);
+	if (isCubemap) {
+		glTexParameteri(target, GL_TEXTURE_WRAP_R, settings.wrap);
+	}
+	if (loaded.isBaked) {
+		// All faces and levels from the mapped file, through one staging copy when using a pixel buffer
+		const TextureContainerData &baked = loaded.baked;
+		uploadTextureContainer(baked, stagePixels(baked.payload, baked.payloadSize));
+		unstagePixels();
+		loaded.textureBytes = baked.payloadSize;
+		loaded.container.close();
+	} else if (isCubemap) {
+		for (int i = 0; i < 6; i++) {
+			const DecodedImage &image = loaded.faceImages[loaded.faceSources[i]];
+			if (image.width != image.height || image.width != loaded.image.width) {
+				std::cerr << "Error! Cubemap face " << loaded.faceFilenames[i] << " is " << image.width << "x" << image.height
+					<< ", not square and the size of the other faces" << std::endl;
+			}
+			glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, 0, GL_RGBA8, image.width, image.height, 0, GL_RGBA, GL_UNSIGNED_BYTE, stagePixels(&image.pixels[0], image.pixels.size()));
+			unstagePixels();
+			loaded.textureBytes += getImageBytes(image.width, image.height, false);
+		}
+		std::vector<DecodedImage>().swap(loaded.faceImages);
+	} else {
+		const DecodedImage &image = loaded.image;
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, image.width, image.height, 0, GL_RGBA, GL_UNSIGNED_BYTE, stagePixels(&image.pixels[0], image.pixels.size()));
+		unstagePixels();
+		if (settings.hasMipmaps) {
+			glGenerateMipmap(GL_TEXTURE_2D);
+		}
+		loaded.textureBytes = getImageBytes(image.width, image.height, settings.hasMipmaps);
+		if (!settings.isImageKept) {
+			std::vector<unsigned char>().swap(loaded.image.pixels);
+		}
+	}
+	loaded.uploadMilliseconds += timer.elapsedMilliseconds();
+	return texId;
+}
+
+// Doesn't go through waitForDecode, whose wait time only counts for the uploading thread
+const DecodedImage& TextureLoader::getImage(int request) {
+	Request &decoding = *requests[request];
+	waitForCounter(decoding.decoded);
+	return decoding.image;
+}
+
+size_t TextureLoader::getTextureBytes(int request) const {
+	return requests[request]->textureBytes;
+}
+
+double TextureLoader::getDecodeMilliseconds(int request) const {
+	return requests[request]->decodeMilliseconds;
+}
+
+void TextureLoader::printStats() const {
+	double decodeMilliseconds = 0;
+	double waitMilliseconds = 0;
+	double uploadMilliseconds = 0;
+	size_t textureBytes = 0;
+	int numBaked = 0;
+	std::cout << std::fixed << std::setprecision(1);
+	for (int i = 0; i < requests.size(); i++) {
+		const Request &request = *requests[i];
+		bool isBaked = request.isBaked;
+		std::cout << "  " << request.filename << " " << request.image.width << "x" << request.image.height;
+		if (!request.faceFilenames.empty() && !isBaked) {
+			int numDecodedFaces = 0;
+			for (int j = 0; j < 6; j++) {
+				numDecodedFaces += request.faceSources[j] == j ? 1 : 0;
+			}
+			std::cout << " cubemap of " << numDecodedFaces << " distinct faces";
+		} else if (!request.faceFilenames.empty()) {
+			std::cout << " cubemap";
+		}
+		std::cout << (isBaked ? std::string(" baked ") + getContainerFormatName(request.baked.format) : std::string(" PNG"))
+			<< ": " << (isBaked ? "read" : "decoded") << " in " << request.decodeMilliseconds << " ms, waited " << request.waitMilliseconds
+			<< " ms, uploaded in " << request.uploadMilliseconds << " ms, " << request.textureBytes / 1024.0 << " kB" << std::endl;
+		decodeMilliseconds += request.decodeMilliseconds;
+		waitMilliseconds += request.waitMilliseconds;
+		uploadMilliseconds += request.uploadMilliseconds;
+		textureBytes += request.textureBytes;
+		numBaked += isBaked ? 1 : 0;
+	}
+	std::cout << requests.size() << " textures (" << numBaked << " baked) decoded in " << decodeMilliseconds << " ms on " << getNumWorkerThreads()
+		<< " threads, the main thread waited " << waitMilliseconds << " ms for decodes and uploaded " << textureBytes / (1024.0 * 1024.0)
+		<< " MB in " << uploadMilliseconds << " ms" << (usePixelBuffers ? " through a pixel buffer" : "") << std::endl;
+	std::cout << std::defaultfloat;
+}
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include <glad/glad.h>
+
+#include "Threading.h"
+
+// An image decoded to 8 bit RGBA, rows tightly packed
+struct DecodedImage {
+	std::vector<unsigned char> pixels;
+	unsigned int width;
+	unsigned int height;
+};
+
+// How a texture is stored and sampled
+struct TextureSettings {
+	TextureSettings() : isFlipped(true), hasMipmaps(true), minFilter(GL_LINEAR_MIPMAP_LINEAR), magFilter(GL_LINEAR), wrap(GL_REPEAT), isImageKept(false) {
+	}
+	// Rows bottom to top as OpenGL expects, off for cubemap faces which are top to bottom
+	bool isFlipped;
+	bool hasMipmaps;
+	GLenum minFilter;
+	GLenum magFilter;
+	GLenum wrap;
+	// Keeps the decoded image after the upload for use on the CPU. Such textures are always
+	// decoded from their PNG, a compressed container has no pixels to keep.
+	bool isImageKept;
+};
+
+// Unflipped faces without mipmaps, linear and clamped to the edges, for skyboxes
+TextureSettings getCubemapSettings();
+
+// Decodes a PNG, flipped when isFlipped so the first row is the bottom one as glTexImage2D
+// expects. Returns false if the file can't be read or decoded, image is then a white pixel.
+bool decodePNG(const std::string &filename, bool isFlipped, DecodedImage &image);
+
+// Uploads the image as a 2D texture, returns the texture
+GLuint createTexture(const DecodedImage &image, const TextureSettings &settings = TextureSettings());
+
+// Decodes PNGs as jobs from the moment they are requested and uploads each one on the thread
+// owning the OpenGL context when its texture is first asked for, so decoding overlaps whatever
+// that thread does in between. Unfinished decodes are waited for when it is destroyed.
+// A PNG with an up to date baked container next to it, filename + TEXTURE_CONTAINER_EXTENSION,
+// is loaded from the container instead, unless its settings differ from the requested ones.
+// Cubemaps are likewise loaded from getCubemapContainerFilename when it is up to date.
+class TextureLoader {
+public:
+	// usePixelBuffers stages uploads through a pixel buffer object, letting the driver copy
+	// them to the GPU asynchronously instead of from client memory during glTexImage2D.
+	// useContainers off always decodes the PNGs, to compare against the baked containers.
+	explicit TextureLoader(bool usePixelBuffers = false, bool useContainers = true);
+	~TextureLoader();
+	// Starts decoding filename, returns the request to get its texture with
+	int request(const std::string &filename, const TextureSettings &settings = TextureSettings());
+	// Starts decoding the faces of a cubemap, square and in the order +x, -x, +y, -y, +z, -z.
+	// The faces are decoded in parallel, each file contents only once.
+	int requestCubemap(const std::string faces[6]);
+	// Waits for the request's decode and uploads it as a 2D texture or cubemap. The decoded
+	// images are freed afterwards, each request can be uploaded once.
+	GLuint getTexture(int request);
+	// Waits for the decode of a 2D request with isImageKept and returns the decoded image, which
+	// lives as long as the loader. Can be called from any thread.
+	const DecodedImage& getImage(int request);
+	// Of a request that has been uploaded
+	size_t getTextureBytes(int request) const;
+	double getDecodeMilliseconds(int request) const;
+	// Per texture and in total, how long decoding took on the workers, how long the calling
+	// thread waited for decodes still running, how long uploading took and the memory used
+	void printStats() const;
+private:
+	TextureLoader(const TextureLoader&);
+	TextureLoader& operator=(const TextureLoader&);
+
+	struct Request;
+
+	// faces is nullptr for a 2D texture
+	int addRequest(const std::string &filename, const TextureSettings &settings, const std::string *faces);
+	// Maps the request's container if it is up to date and was baked with the request's settings
+	static bool openContainer(Request &request, const std::string &containerFilename, const std::vector<std::string> &sources);
+	static void decodeCubemap(Request &request);
+	Request& waitForDecode(int request);
+	// Returns what to pass glTexImage2D as its pixels, an offset into the pixel buffer when used
+	const unsigned char* stagePixels(const unsigned char *pixels, size_t size);
+	void unstagePixels();
+
+	std::vector<Request*> requests;
+	bool usePixelBuffers;
+	bool useContainers;
+	GLuint pixelBuffer;
+};
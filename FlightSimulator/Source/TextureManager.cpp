@@ -0,0 +1,196 @@
+#include "TextureManager.h"
+
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+
+#include "MappedFile.h"
+
+TextureHandle::TextureHandle() : manager(nullptr), entry(-1) {
+}
+
+TextureHandle::TextureHandle(TextureManager *manager, int entry) : manager(manager), entry(entry) {
+	manager->addReference(entry);
+}
+
+TextureHandle::TextureHandle(const TextureHandle &other) : manager(other.manager), entry(other.entry) {
+	if (manager) {
+		manager->addReference(entry);
+	}
+}
+
+TextureHandle& TextureHandle::operator=(const TextureHandle &other) {
+	if (other.manager) {
+		other.manager->addReference(other.entry);
+	}
+	reset();
+	manager = other.manager;
+	entry = other.entry;
+	return *this;
+}
+
+TextureHandle::~TextureHandle() {
+	reset();
+}
+
+GLuint TextureHandle::getId() const {
+	return manager ? manager->getId(entry) : 0;
+}
+
+const DecodedImage& TextureHandle::getImage() const {
+	return manager->getImage(entry);
+}
+
+void TextureHandle::reset() {
+	if (manager) {
+		manager->removeReference(entry);
+	}
+	manager = nullptr;
+	entry = -1;
+}
+
+TextureManager::TextureManager(TextureLoader &loader) : loader(loader), numSharedLoads(0), evictedSavedBytes(0), evictedSavedMilliseconds(0), numEvicted(0) {
+}
+
+// Identifies an image by its file's size and checksum, by its filename when the file can't be
+// read so that decoding reports the error
+static std::string getContentKey(const std::string &filename) {
+	std::ostringstream key;
+	MappedFile file;
+	if (file.open(filename)) {
+		key << file.getSize() << ":" << checksumBytes(file.getData(), file.getSize());
+	} else {
+		key << filename;
+	}
+	return key.str();
+}
+
+static std::string getSettingsKey(const TextureSettings &settings) {
+	std::ostringstream key;
+	key << settings.isFlipped << settings.hasMipmaps << settings.isImageKept << ":" << settings.minFilter << ":" << settings.magFilter << ":" << settings.wrap;
+	return key.str();
+}
+
+int TextureManager::addEntry(const std::string &key, const std::string &filename) {
+	int index;
+	if (freeEntries.empty()) {
+		index = entries.size();
+		entries.push_back(Entry());
+	} else {
+		index = freeEntries.back();
+		freeEntries.pop_back();
+	}
+	Entry &entry = entries[index];
+	entry.key = key;
+	entry.filename = filename;
+	entry.id = 0;
+	entry.numReferences = 0;
+	entry.numShared = 0;
+	entriesByKey[key] = index;
+	return index;
+}
+
+TextureHandle TextureManager::acquire(const std::string &filename, const TextureSettings &settings) {
+	std::string key = getContentKey(filename) + ":" + getSettingsKey(settings);
+	std::unordered_map<std::string, int>::iterator found = entriesByKey.find(key);
+	if (found != entriesByKey.end()) {
+		entries[found->second].numShared++;
+		numSharedLoads++;
+		return TextureHandle(this, found->second);
+	}
+	int index = addEntry(key, filename);
+	entries[index].request = loader.request(filename, settings);
+	return TextureHandle(this, index);
+}
+
+TextureHandle TextureManager::acquireCubemap(const std::string faces[6]) {
+	std::string key = "cubemap";
+	for (int i = 0; i < 6; i++) {
+		key += "|" + getContentKey(faces[i]);
+	}
+	std::unordered_map<std::string, int>::iterator found = entriesByKey.find(key);
+	if (found != entriesByKey.end()) {
+		entries[found->second].numShared++;
+		numSharedLoads++;
+		return TextureHandle(this, found->second);
+	}
+	int index = addEntry(key, faces[0]);
+	entries[index].request = loader.requestCubemap(faces);
+	return TextureHandle(this, index);
+}
+
+void TextureManager::addReference(int entry) {
+	entries[entry].numReferences++;
+}
+
+void TextureManager::removeReference(int index) {
+	Entry &entry = entries[index];
+	if (--entry.numReferences > 0) {
+		return;
+	}
+	if (entry.id) {
+		size_t savedBytes;
+		double savedMilliseconds;
+		getSavings(entry, savedBytes, savedMilliseconds);
+		evictedSavedBytes += savedBytes;
+		evictedSavedMilliseconds += savedMilliseconds;
+		glDeleteTextures(1, &entry.id);
+	}
+	numEvicted++;
+	entriesByKey.erase(entry.key);
+	entry = Entry();
+	entry.request = -1;
+	entry.id = 0;
+	freeEntries.push_back(index);
+}
+
+GLuint TextureManager::getId(int index) {
+	Entry &entry = entries[index];
+	if (!entry.id) {
+		entry.id = loader.getTexture(entry.request);
+	}
+	return entry.id;
+}
+
+const DecodedImage& TextureManager::getImage(int index) {
+	return loader.getImage(entries[index].request);
+}
+
+size_t TextureManager::getTextureBytes(const Entry &entry) const {
+	if (!entry.id) {
+		return 0;
+	}
+	return loader.getTextureBytes(entry.request);
+}
+
+void TextureManager::getSavings(const Entry &entry, size_t &bytes, double &milliseconds) const {
+	bytes = 0;
+	milliseconds = 0;
+	if (!entry.id) {
+		return;
+	}
+	bytes = entry.numShared * getTextureBytes(entry);
+	milliseconds = entry.numShared * loader.getDecodeMilliseconds(entry.request);
+}
+
+void TextureManager::printStats() const {
+	size_t savedBytes = evictedSavedBytes;
+	double savedMilliseconds = evictedSavedMilliseconds;
+	int numLoaded = 0;
+	for (int i = 0; i < entries.size(); i++) {
+		const Entry &entry = entries[i];
+		if (entry.request < 0) {
+			continue;
+		}
+		numLoaded++;
+		size_t bytes;
+		double milliseconds;
+		getSavings(entry, bytes, milliseconds);
+		savedBytes += bytes;
+		savedMilliseconds += milliseconds;
+	}
+	std::cout << std::fixed << std::setprecision(1) << numLoaded << " textures loaded, " << numSharedLoads << " loads shared an image instead, saving "
+		<< savedBytes / (1024.0 * 1024.0) << " MB of GPU memory and " << savedMilliseconds << " ms of decoding ("
+		<< numEvicted << " textures deleted since)" << std::endl;
+	std::cout << std::defaultfloat;
+}
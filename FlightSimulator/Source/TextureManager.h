@@ -0,0 +1,79 @@
+#pragma once
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "TextureLoader.h"
+
+class TextureManager;
+
+// A shared reference to one of a TextureManager's textures, which is deleted when its last
+// handle is destroyed or reset. Default constructed handles refer to no texture.
+class TextureHandle {
+public:
+	TextureHandle();
+	TextureHandle(const TextureHandle &other);
+	TextureHandle& operator=(const TextureHandle &other);
+	~TextureHandle();
+	// Uploads the texture when this is the first time it is asked for, waiting for its decode
+	GLuint getId() const;
+	// The decoded image of a texture acquired with isImageKept, see TextureLoader::getImage
+	const DecodedImage& getImage() const;
+	void reset();
+private:
+	friend class TextureManager;
+	TextureHandle(TextureManager *manager, int entry);
+
+	TextureManager *manager;
+	int entry;
+};
+
+// Loads each texture once however often it is acquired. Textures are identified by the contents
+// of their file, so copies under different names are shared too, and by their settings.
+class TextureManager {
+public:
+	// Textures are decoded and uploaded by loader, which must outlive the manager
+	explicit TextureManager(TextureLoader &loader);
+	// A handle to the texture of filename, starting its decode unless it is already loaded
+	TextureHandle acquire(const std::string &filename, const TextureSettings &settings = TextureSettings());
+	// A handle to the cubemap of the faces, in the order of TextureLoader::requestCubemap
+	TextureHandle acquireCubemap(const std::string faces[6]);
+	// Loaded textures and what sharing them saved, GPU memory counted for uploaded textures only
+	void printStats() const;
+private:
+	friend class TextureHandle;
+	TextureManager(const TextureManager&);
+	TextureManager& operator=(const TextureManager&);
+
+	struct Entry {
+		std::string key;
+		std::string filename;
+		// -1 when the entry is free
+		int request;
+		GLuint id;
+		int numReferences;
+		// Acquires after the first one, each a decode and upload that was not done
+		int numShared;
+	};
+
+	int addEntry(const std::string &key, const std::string &filename);
+	void addReference(int entry);
+	void removeReference(int entry);
+	GLuint getId(int entry);
+	const DecodedImage& getImage(int entry);
+	// Bytes of GPU memory the texture takes, 0 before it is uploaded
+	size_t getTextureBytes(const Entry &entry) const;
+	// GPU memory and decoding sharing the entry has saved, 0 before it is uploaded
+	void getSavings(const Entry &entry, size_t &bytes, double &milliseconds) const;
+
+	TextureLoader &loader;
+	std::vector<Entry> entries;
+	std::vector<int> freeEntries;
+	std::unordered_map<std::string, int> entriesByKey;
+	int numSharedLoads;
+	// Of textures that have been deleted
+	size_t evictedSavedBytes;
+	double evictedSavedMilliseconds;
+	int numEvicted;
+};
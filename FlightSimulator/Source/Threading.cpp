@@ -0,0 +1,264 @@
+#include "Threading.h"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <thread>
+
+int getNumWorkerThreads() {
+	int numThreads = (int)std::thread::hardware_concurrency();
+	return std::max(numThreads, 1);
+}
+
+// Threads that can queue jobs, the workers and any others that call runJob or waitForCounter
+const int MAX_JOB_THREADS = 64;
+
+// Index of the calling thread's JobQueue, -1 until it has one
+static thread_local int jobThreadIndex = -1;
+
+// Jobs queued by one thread, and what it ran while tracing
+struct JobQueue {
+	std::mutex mutex;
+	std::deque<Job> jobs;
+	std::mutex traceMutex;
+	std::vector<JobTraceEvent> trace;
+};
+
+static void finishJob(Job &job);
+
+class JobSystem {
+public:
+	JobSystem(int numWorkers) : numQueues(numWorkers), numQueuedJobs(0), isStopping(false), isTracing(false) {
+		start = std::chrono::high_resolution_clock::now();
+		for (int i = 0; i < numWorkers; i++) {
+			workers.push_back(std::thread(&JobSystem::work, this, i));
+		}
+	}
+	~JobSystem() {
+		{
+			std::lock_guard<std::mutex> lock(sleepMutex);
+			isStopping = true;
+		}
+		jobQueued.notify_all();
+		for (std::vector<std::thread>::iterator iter = workers.begin(); iter != workers.end(); iter++) {
+			iter->join();
+		}
+	}
+	void push(const Job &job) {
+		JobQueue &queue = queues[getThreadIndex()];
+		{
+			std::lock_guard<std::mutex> lock(queue.mutex);
+			queue.jobs.push_back(job);
+		}
+		numQueuedJobs++;
+		std::lock_guard<std::mutex> lock(sleepMutex);
+		jobQueued.notify_one();
+	}
+	// Runs the newest job of the calling thread, or steals the oldest of another
+	bool tryRunJob() {
+		int index = getThreadIndex();
+		Job job;
+		if (!pop(index, job)) {
+			return false;
+		}
+		numQueuedJobs--;
+		if (isTracing) {
+			double startMicroseconds = getMicroseconds();
+			job.function();
+			addTraceEvent(index, job.name, startMicroseconds, getMicroseconds());
+		} else {
+			job.function();
+		}
+		finishJob(job);
+		return true;
+	}
+	double getMicroseconds() const {
+		return std::chrono::duration<double, std::micro>(std::chrono::high_resolution_clock::now() - start).count();
+	}
+	void setTracing(bool isTracing) {
+		this->isTracing = isTracing;
+	}
+	bool getTracing() const {
+		return isTracing;
+	}
+	void addTraceEvent(int thread, const char *name, double startMicroseconds, double endMicroseconds) {
+		JobTraceEvent event = { name, thread, startMicroseconds, endMicroseconds - startMicroseconds };
+		std::lock_guard<std::mutex> lock(queues[thread].traceMutex);
+		queues[thread].trace.push_back(event);
+	}
+	void takeTrace(std::vector<JobTraceEvent> &events) {
+		int numThreads = std::min((int)numQueues, MAX_JOB_THREADS);
+		for (int i = 0; i < numThreads; i++) {
+			std::lock_guard<std::mutex> lock(queues[i].traceMutex);
+			events.insert(events.end(), queues[i].trace.begin(), queues[i].trace.end());
+			queues[i].trace.clear();
+		}
+	}
+	// Queue of the calling thread, threads outside the pool get one on first use
+	int getThreadIndex() {
+		if (jobThreadIndex < 0) {
+			jobThreadIndex = numQueues++;
+			if (jobThreadIndex >= MAX_JOB_THREADS) {
+				// Shared, which only costs the order jobs are taken in
+				jobThreadIndex = MAX_JOB_THREADS - 1;
+			}
+		}
+		return jobThreadIndex;
+	}
+private:
+	void work(int index) {
+		jobThreadIndex = index;
+		while (true) {
+			if (tryRunJob()) {
+				continue;
+			}
+			std::unique_lock<std::mutex> lock(sleepMutex);
+			jobQueued.wait(lock, [this]() { return isStopping || numQueuedJobs > 0; });
+			if (isStopping) {
+				return;
+			}
+		}
+	}
+	bool pop(int index, Job &job) {
+		{
+			JobQueue &queue = queues[index];
+			std::lock_guard<std::mutex> lock(queue.mutex);
+			if (!queue.jobs.empty()) {
+				job = queue.jobs.back();
+				queue.jobs.pop_back();
+				return true;
+			}
+		}
+		int numThreads = std::min((int)numQueues, MAX_JOB_THREADS);
+		for (int i = 1; i < numThreads; i++) {
+			JobQueue &victim = queues[(index + i) % numThreads];
+			std::lock_guard<std::mutex> lock(victim.mutex);
+			if (!victim.jobs.empty()) {
+				job = victim.jobs.front();
+				victim.jobs.pop_front();
+				return true;
+			}
+		}
+		return false;
+	}
+
+	JobQueue queues[MAX_JOB_THREADS];
+	std::atomic<int> numQueues;
+	std::atomic<int> numQueuedJobs;
+	std::vector<std::thread> workers;
+	std::mutex sleepMutex;
+	std::condition_variable jobQueued;
+	bool isStopping;
+	std::atomic<bool> isTracing;
+	std::chrono::high_resolution_clock::time_point start;
+};
+
+static JobSystem& getJobSystem() {
+	static JobSystem jobSystem(getNumWorkerThreads() - 1);
+	return jobSystem;
+}
+
+// Lowers the job's counter and queues the jobs that were waiting for it to reach zero
+static void finishJob(Job &job) {
+	JobCounter *counter = job.counter;
+	if (!counter) {
+		return;
+	}
+	std::vector<Job> readyJobs;
+	{
+		std::lock_guard<std::mutex> lock(counter->mutex);
+		if (--counter->count > 0) {
+			return;
+		}
+		readyJobs.swap(counter->waitingJobs);
+	}
+	for (int i = 0; i < readyJobs.size(); i++) {
+		getJobSystem().push(readyJobs[i]);
+	}
+}
+
+void runJob(const char *name, std::function<void()> function, JobCounter *counter, JobCounter *dependency) {
+	Job job = { name, function, counter };
+	if (counter) {
+		counter->count++;
+	}
+	if (dependency) {
+		std::lock_guard<std::mutex> lock(dependency->mutex);
+		// finishJob lowers the count with the mutex held, so it either sees this job or has already finished
+		if (dependency->count > 0) {
+			dependency->waitingJobs.push_back(job);
+			return;
+		}
+	}
+	getJobSystem().push(job);
+}
+
+void waitForCounter(JobCounter &counter) {
+	JobSystem &jobSystem = getJobSystem();
+	while (!counter.isDone()) {
+		if (!jobSystem.tryRunJob()) {
+			std::this_thread::yield();
+		}
+	}
+	// The thread that finished the last job may still hold the mutex, after this the counter can go
+	std::lock_guard<std::mutex> lock(counter.mutex);
+}
+
+void parallelFor(int begin, int end, int numThreads, const std::function<void(int, int)> &body) {
+	int count = end - begin;
+	if (count <= 0) {
+		return;
+	}
+	numThreads = std::max(1, std::min(numThreads, count));
+	if (numThreads == 1) {
+		body(begin, end);
+		return;
+	}
+
+	JobCounter counter;
+	int rangeSize = count / numThreads;
+	int remainder = count % numThreads;
+	int first = begin;
+	for (int i = 0; i < numThreads; i++) {
+		int last = first + rangeSize + (i < remainder ? 1 : 0);
+		const std::function<void(int, int)> *rangeBody = &body;
+		runJob("parallelFor", [rangeBody, first, last]() { (*rangeBody)(first, last); }, &counter);
+		first = last;
+	}
+	waitForCounter(counter);
+}
+
+double getJobTraceMicroseconds() {
+	return getJobSystem().getMicroseconds();
+}
+
+void setJobTracing(bool isTracing) {
+	getJobSystem().setTracing(isTracing);
+}
+
+void addJobTraceEvent(const char *name, double startMicroseconds, double endMicroseconds) {
+	JobSystem &jobSystem = getJobSystem();
+	if (jobSystem.getTracing()) {
+		jobSystem.addTraceEvent(jobSystem.getThreadIndex(), name, startMicroseconds, endMicroseconds);
+	}
+}
+
+void takeJobTrace(std::vector<JobTraceEvent> &events) {
+	getJobSystem().takeTrace(events);
+}
+
+void writeChromeTrace(const std::string &filename, const std::vector<JobTraceEvent> &events) {
+	std::ofstream file(filename);
+	file << std::fixed;
+	file.precision(3);
+	file << "{\"traceEvents\":[\n";
+	for (int i = 0; i < events.size(); i++) {
+		const JobTraceEvent &event = events[i];
+		file << "{\"name\":\"" << event.name << "\",\"ph\":\"X\",\"pid\":0,\"tid\":" << event.thread
+			<< ",\"ts\":" << event.startMicroseconds << ",\"dur\":" << event.durationMicroseconds << "}"
+			<< (i + 1 < events.size() ? ",\n" : "\n");
+	}
+	file << "]}\n";
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Number of threads parallel work is split over, including the calling thread
+int getNumWorkerThreads();
+
+struct JobCounter;
+
+struct Job {
+	const char *name; // For the trace, must outlive the job
+	std::function<void()> function;
+	JobCounter *counter;
+};
+
+// Counts the unfinished jobs given it. Jobs can also wait for a counter to reach zero before
+// they start. A counter must not be destroyed while jobs are counted by or waiting for it.
+// The members are only changed by the job system.
+struct JobCounter {
+	JobCounter() : count(0) {
+	}
+	bool isDone() const {
+		return count == 0;
+	}
+	std::atomic<int> count;
+	std::mutex mutex;
+	std::vector<Job> waitingJobs;
+};
+
+// Queues function to run on one of getNumWorkerThreads() - 1 worker threads, or on a thread
+// waiting in waitForCounter. Each thread takes the jobs it queued itself last in first out,
+// and steals the oldest jobs of other threads when it has none. counter, when given, is
+// raised until the job has run. dependency, when given, holds the job back until it is zero.
+void runJob(const char *name, std::function<void()> function, JobCounter *counter = nullptr, JobCounter *dependency = nullptr);
+
+// Runs jobs on the calling thread until counter reaches zero
+void waitForCounter(JobCounter &counter);
+
+// Splits [begin, end) into contiguous ranges and runs body(first, last) for each range,
+// as up to numThreads jobs. Returns when all ranges are done, running jobs meanwhile.
+void parallelFor(int begin, int end, int numThreads, const std::function<void(int, int)> &body);
+
+// One job run, or anything else timed with getJobTraceMicroseconds
+struct JobTraceEvent {
+	const char *name;
+	int thread; // 0 and up for the worker threads, then the other threads in order of their first job
+	double startMicroseconds;
+	double durationMicroseconds;
+};
+
+// Microseconds since the job system started, the clock of JobTraceEvent
+double getJobTraceMicroseconds();
+
+// Jobs are only recorded while tracing is on, it starts off
+void setJobTracing(bool isTracing);
+
+// Records an event on the calling thread's timeline when tracing
+void addJobTraceEvent(const char *name, double startMicroseconds, double endMicroseconds);
+
+// Moves the events recorded since the last call, from all threads, to the end of events
+void takeJobTrace(std::vector<JobTraceEvent> &events);
+
+// Writes events in the Chrome trace event format, for chrome://tracing or Perfetto
+void writeChromeTrace(const std::string &filename, const std::vector<JobTraceEvent> &events);
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+
+// Hands values from one producer thread to one consumer thread. Each side owns one of the
+// three buffers and the third is swapped between them, so the producer can write the next
+// value while the consumer still reads the previous one. The swaps are lock free, a side that
+// has to wait for the other sleeps on a condition variable until it publishes or acquires.
+template <typename T>
+class TripleBuffer {
+public:
+	TripleBuffer() : writeIndex(0), shared(1), readIndex(2), isClosed(false) {
+	}
+	// Only for the producer
+	T& getWriteBuffer() {
+		return buffers[writeIndex];
+	}
+	// Makes the write buffer the newest value and gives the producer the buffer it replaces
+	void publish() {
+		writeIndex = shared.exchange(writeIndex | NEW_VALUE, std::memory_order_acq_rel) & INDEX_MASK;
+		notify();
+	}
+	// Whether a published value hasn't been acquired yet
+	bool hasNewValue() const {
+		return (shared.load(std::memory_order_acquire) & NEW_VALUE) != 0;
+	}
+	// Only for the consumer. Takes the newest published value if there is one, returns whether it did.
+	bool acquire() {
+		if (!hasNewValue()) {
+			return false;
+		}
+		readIndex = shared.exchange(readIndex, std::memory_order_acq_rel) & INDEX_MASK;
+		notify();
+		return true;
+	}
+	// Only for the consumer, the value last acquired
+	const T& getReadBuffer() const {
+		return buffers[readIndex];
+	}
+
+	// Only for the consumer. Sleeps until there is a value to acquire or the buffer is closed,
+	// returns whether there is one.
+	bool waitForNewValue() {
+		std::unique_lock<std::mutex> lock(mutex);
+		changed.wait(lock, [this]() { return isClosed || hasNewValue(); });
+		return hasNewValue();
+	}
+	// Only for the producer. Sleeps until the consumer has acquired the last published value
+	// or the buffer is closed.
+	void waitUntilAcquired() {
+		std::unique_lock<std::mutex> lock(mutex);
+		changed.wait(lock, [this]() { return isClosed || !hasNewValue(); });
+	}
+	// Wakes both sides and makes them stop waiting from now on
+	void close() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			isClosed = true;
+		}
+		changed.notify_all();
+	}
+private:
+	// The index of the shared buffer is stored with a flag for whether it holds an unread value
+	static const int INDEX_MASK = 3;
+	static const int NEW_VALUE = 4;
+
+	// Taking the mutex orders the swap before a waiting side checks again, so no wake up is lost
+	void notify() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+		}
+		changed.notify_all();
+	}
+
+	T buffers[3];
+	int writeIndex;
+	std::atomic<int> shared;
+	int readIndex;
+	std::mutex mutex;
+	std::condition_variable changed;
+	bool isClosed;
+};
@@ -0,0 +1,153 @@
+#include "VirtualTexture.h"
+
+#include <algorithm>
+
+VirtualTextureCache::VirtualTextureCache(int pagesAcross, int slotsAcross) : pagesAcross(pagesAcross), slotsAcross(slotsAcross) {
+	numLevels = 1;
+	for (int size = pagesAcross; size > 1; size /= 2) {
+		numLevels++;
+	}
+	frame = 0;
+	pageSlots.resize(numLevels);
+	pendingPages.resize(numLevels);
+	pageTable.resize(numLevels);
+	for (int level = 0; level < numLevels; level++) {
+		int numPages = getPagesAcross(level) * getPagesAcross(level);
+		pageSlots[level].assign(numPages, -1);
+		pendingPages[level].assign(numPages, 0);
+		pageTable[level].assign(numPages, 0);
+	}
+	isPageTableDirty = true;
+	slots.resize(slotsAcross * slotsAcross);
+	numMappedSlots = 0;
+	numRequests = 0;
+	numMisses = 0;
+	numEvictions = 0;
+	frameRequests = 0;
+	frameMisses = 0;
+}
+
+void VirtualTextureCache::beginFrame() {
+	frame++;
+	frameRequests = 0;
+	frameMisses = 0;
+}
+
+void VirtualTextureCache::requestAround(float u, float v, int pageRadius, std::vector<VirtualPage> &faults) {
+	for (int level = numLevels - 1; level >= 0; level--) {
+		int size = getPagesAcross(level);
+		int centerX = std::max(0, std::min(size - 1, (int)(u * size)));
+		int centerY = std::max(0, std::min(size - 1, (int)(v * size)));
+		for (int y = std::max(0, centerY - pageRadius); y <= std::min(size - 1, centerY + pageRadius); y++) {
+			for (int x = std::max(0, centerX - pageRadius); x <= std::min(size - 1, centerX + pageRadius); x++) {
+				VirtualPage page = { level, x, y };
+				int index = getPageIndex(page);
+				numRequests++;
+				frameRequests++;
+				int slot = pageSlots[level][index];
+				if (slot >= 0) {
+					slots[slot].lastRequestedFrame = frame;
+					continue;
+				}
+				numMisses++;
+				frameMisses++;
+				if (!pendingPages[level][index]) {
+					faults.push_back(page);
+				}
+			}
+		}
+	}
+}
+
+void VirtualTextureCache::setPending(const VirtualPage &page) {
+	pendingPages[page.level][getPageIndex(page)] = 1;
+}
+
+int VirtualTextureCache::map(const VirtualPage &page) {
+	int index = getPageIndex(page);
+	pendingPages[page.level][index] = 0;
+	if (pageSlots[page.level][index] >= 0) {
+		return pageSlots[page.level][index];
+	}
+
+	int slot = -1;
+	if (numMappedSlots < slots.size()) {
+		slot = numMappedSlots++;
+	} else {
+		for (int i = 0; i < slots.size(); i++) {
+			if (slots[i].isPinned || slots[i].lastRequestedFrame == frame) {
+				continue;
+			}
+			if (slot < 0 || slots[i].lastRequestedFrame < slots[slot].lastRequestedFrame) {
+				slot = i;
+			}
+		}
+		if (slot < 0) {
+			return -1;
+		}
+		const VirtualPage &evicted = slots[slot].page;
+		pageSlots[evicted.level][getPageIndex(evicted)] = -1;
+		numEvictions++;
+	}
+	slots[slot].page = page;
+	slots[slot].lastRequestedFrame = frame;
+	slots[slot].isPinned = page.level == numLevels - 1;
+	pageSlots[page.level][index] = slot;
+	isPageTableDirty = true;
+	return slot;
+}
+
+int VirtualTextureCache::getSlot(const VirtualPage &page) const {
+	return pageSlots[page.level][getPageIndex(page)];
+}
+
+unsigned int VirtualTextureCache::getPageTableEntry(int slot, int level) const {
+	return (unsigned int)(slot % slotsAcross) | (unsigned int)(slot / slotsAcross) << 8 | (unsigned int)level << 16 | 0xff000000u;
+}
+
+// Coarsest level first, so unmapped pages copy the entry of their parent
+bool VirtualTextureCache::updatePageTable() {
+	if (!isPageTableDirty) {
+		return false;
+	}
+	for (int level = numLevels - 1; level >= 0; level--) {
+		int size = getPagesAcross(level);
+		for (int y = 0; y < size; y++) {
+			for (int x = 0; x < size; x++) {
+				int slot = pageSlots[level][y * size + x];
+				unsigned int entry = 0;
+				if (slot >= 0) {
+					entry = getPageTableEntry(slot, level);
+				} else if (level < numLevels - 1) {
+					entry = pageTable[level + 1][(y / 2) * (size / 2) + x / 2];
+				}
+				pageTable[level][y * size + x] = entry;
+			}
+		}
+	}
+	isPageTableDirty = false;
+	return true;
+}
+
+bool VirtualTextureCache::isPageTableConsistent() const {
+	for (int level = 0; level < numLevels; level++) {
+		int size = getPagesAcross(level);
+		for (int y = 0; y < size; y++) {
+			for (int x = 0; x < size; x++) {
+				unsigned int expected = 0;
+				for (int ancestor = level; ancestor < numLevels; ancestor++) {
+					VirtualPage page = { ancestor, x >> (ancestor - level), y >> (ancestor - level) };
+					int slot = getSlot(page);
+					if (slot >= 0) {
+						expected = getPageTableEntry(slot, ancestor);
+						break;
+					}
+				}
+				if (pageTable[level][y * size + x] != expected) {
+					return false;
+				}
+			}
+		}
+	}
+	return true;
+}
@@ -0,0 +1,105 @@
+#pragma once
+
+#include <vector>
+
+// A page of a virtual texture. Level 0 is the most detailed, x and y count pages from u = 0
+// and v = 0 on that level.
+struct VirtualPage {
+	int level;
+	int x;
+	int y;
+};
+
+// Which pages of a mipmapped virtual texture are mapped to the slots of a physical atlas, and
+// the page table that points every page at its own slot or the one of its closest mapped
+// ancestor. When all slots are taken the least recently used page is evicted. Level 0 is
+// pagesAcross pages wide, a power of two, and every level above half as wide, down to a single
+// page for the whole texture. That page is never evicted once mapped, so every lookup finds
+// something to sample. Knows nothing about OpenGL so it can be used without a context.
+class VirtualTextureCache {
+public:
+	VirtualTextureCache(int pagesAcross, int slotsAcross);
+
+	// Starts a frame, pages requested during it are not evicted until the next one
+	void beginFrame();
+	// Requests the pages within pageRadius pages of (u, v) on every level, the coarsest level
+	// first, and appends those that are neither mapped nor pending to faults
+	void requestAround(float u, float v, int pageRadius, std::vector<VirtualPage> &faults);
+	// A faulted page that is being baked, it is not reported as a fault again until mapped
+	void setPending(const VirtualPage &page);
+	// Gives a baked page a slot, evicting the least recently used page that was not requested
+	// this frame. Returns the slot, or -1 if every slot was requested this frame. The page is
+	// no longer pending either way.
+	int map(const VirtualPage &page);
+	// The slot of the page, -1 if it isn't mapped
+	int getSlot(const VirtualPage &page) const;
+
+	// Rebuilds the page table if pages were mapped or evicted since, returns whether it changed
+	bool updatePageTable();
+	// getPagesAcross(level) squared entries, row by row from v = 0. Each is the slot x, slot y
+	// and level of the page mapped for it in its lowest three bytes and 255 in the highest, or
+	// 0 when neither the page nor any of its ancestors is mapped. As RGBA8 texels on little
+	// endian machines.
+	const std::vector<unsigned int>& getPageTable(int level) const {
+		return pageTable[level];
+	}
+	// Whether every entry points at the right slot, for testing after updatePageTable
+	bool isPageTableConsistent() const;
+
+	int getNumLevels() const {
+		return numLevels;
+	}
+	int getPagesAcross(int level) const {
+		return pagesAcross >> level;
+	}
+	int getSlotsAcross() const {
+		return slotsAcross;
+	}
+	int getNumMappedSlots() const {
+		return numMappedSlots;
+	}
+
+	// Since the cache was created, a miss is a requested page that wasn't mapped
+	long long getNumRequests() const {
+		return numRequests;
+	}
+	long long getNumMisses() const {
+		return numMisses;
+	}
+	long long getNumEvictions() const {
+		return numEvictions;
+	}
+	// Of the requests since beginFrame
+	float getFrameMissRate() const {
+		return frameRequests > 0 ? (float)frameMisses / frameRequests : 0;
+	}
+private:
+	struct Slot {
+		VirtualPage page;
+		unsigned int lastRequestedFrame;
+		bool isPinned;
+	};
+
+	int getPageIndex(const VirtualPage &page) const {
+		return page.y * getPagesAcross(page.level) + page.x;
+	}
+	unsigned int getPageTableEntry(int slot, int level) const;
+
+	int pagesAcross;
+	int slotsAcross;
+	int numLevels;
+	unsigned int frame;
+	// Per level, the slot of each page or -1
+	std::vector<std::vector<int>> pageSlots;
+	std::vector<std::vector<char>> pendingPages;
+	std::vector<std::vector<unsigned int>> pageTable;
+	bool isPageTableDirty;
+	// Slots are taken in order, the first numMappedSlots hold a page
+	std::vector<Slot> slots;
+	int numMappedSlots;
+	long long numRequests;
+	long long numMisses;
+	long long numEvictions;
+	int frameRequests;
+	int frameMisses;
+};
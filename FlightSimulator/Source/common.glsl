@@ -1,14 +1,66 @@
 #version 460
 
+#ifdef LEGACY_UNIFORMS
+// Set per draw call, see setLegacyUniforms
+uniform mat4 worldToView;
+uniform mat4 projectionMatrix;
+uniform vec4 viewPosition;
+uniform vec3 Ka, Kd, Ks;
+uniform float specularExponent;
+uniform float dissolve;
+uniform bool useLights;
+uniform vec4 color;
+#else
+// Set once per frame, see bindCamera
+layout(std140, binding = 0) uniform Camera {
+	mat4 worldToView;
+	mat4 projectionMatrix;
+	vec4 viewPosition;
+};
+
+// Set per entity
+layout(std140, binding = 1) uniform Material {
+	vec3 Ka; // Ambient reflectivity
+	float specularExponent;
+	vec3 Kd; // Diffuse reflectivity
+	float dissolve;
+	vec3 Ks; // Specular reflectivity
+	bool useLights;
+	vec4 color;
+};
+#endif
+
+// Matches LightData in LightCulling.h
 struct Light {
-	int type; // 0 = directional, 1 = point light, 2 = spotlight
 	vec3 position;
+	int type; // 0 = directional, 1 = point light, 2 = spotlight
 	vec3 direction; // For directional light and spotlight
-	float cutoffAngle; // For spotlight, in radians
-	float intensity; // For directional light since they don't use attenuation
+	float cosCutoffAngle; // For spotlight
 	vec3 color;
+	float intensity;
 	float attenuationC1;
 	float attenuationC2;
+	float cosOuterCutoffAngle; // For spotlight, fades to zero between the two cutoff angles
+	float radius; // No contribution beyond this distance, FLT_MAX for directional and unattenuated lights
+};
+
+// Lights that can be seen this frame, culled and sorted on the CPU, see prepareLights
+layout(std430, binding = 2) readonly buffer Lights {
+	int numLights;
+	int numDirectionalLights; // The first lights, they reach every fragment
+	Light lights[];
+};
+
+// The view frustum split into a grid of clusters, each with the point lights and
+// spotlights that reach it, see LightClusters.h
+layout(std430, binding = 3) readonly buffer LightClusters {
+	ivec4 clusterGridSize;
+	vec4 clusterDepthSlice; // Slice = log(depth) * x + y
+	uvec2 clusters[]; // Offset into lightIndices and number of lights
+};
+
+layout(std430, binding = 4) readonly buffer LightIndices {
+	uint lightIndices[];
 };
 
 bool isDirectional(Light light) {
@@ -26,9 +78,6 @@ bool isSpot(Light light) {
 // diffuse = diffuse component of material
 // specilar = specular component of material
 vec4 calculateLight(Light light, vec3 diffuse, vec3 specular, vec3 fragment, vec3 normal, vec3 viewPosition) {
-	if (light.type == -1) {
-		return vec4(0, 0, 0, 0);
-	}
 	vec3 lightToFragment = normalize(fragment - light.position);
 	float attenuation = 1;
 	if (isDirectional(light)) {
@@ -37,17 +86,18 @@ vec4 calculateLight(Light light, vec3 diffuse, vec3 specular, vec3 fragment, vec
 
 	if (isPoint(light) || isSpot(light)) {
 		float lightToFragmentDistance = length(light.position - fragment);
+		if (lightToFragmentDistance > light.radius) {
+			return vec4(0, 0, 0, 0);
+		}
 		attenuation = 1 / (1.0 + light.attenuationC1 * lightToFragmentDistance + light.attenuationC1 * lightToFragmentDistance * lightToFragmentDistance);
 	}
 
 	if (isSpot(light)) {
-		float lambda = acos(dot(lightToFragment, light.direction)); // Current fragment "angle"
-		float outerCutoffAngle = light.cutoffAngle + 0.02;
-		if (lambda >= light.cutoffAngle) {
-			attenuation = (outerCutoffAngle - lambda) / (outerCutoffAngle - light.cutoffAngle) * attenuation;
-		}
-		if (lambda > outerCutoffAngle) {
-			attenuation = 0;
+		// Compare cosines instead of angles to avoid acos
+		float cosLambda = dot(lightToFragment, light.direction); // Current fragment "angle"
+		attenuation *= clamp((cosLambda - light.cosOuterCutoffAngle) / (light.cosCutoffAngle - light.cosOuterCutoffAngle), 0, 1);
+		if (attenuation == 0) {
+			return vec4(0, 0, 0, 0);
 		}
 	}
 
@@ -65,4 +115,28 @@ vec4 calculateLight(Light light, vec3 diffuse, vec3 specular, vec3 fragment, vec
 	result = clamp(result, 0, 1);
 
 	return vec4(result, 1);
+}
+
+// Index into clusters of the cluster containing a world space position
+int clusterIndex(vec3 position) {
+	vec4 positionViewSpace = worldToView * vec4(position, 1);
+	vec4 positionClipSpace = projectionMatrix * positionViewSpace;
+	vec2 tile = (positionClipSpace.xy / positionClipSpace.w * 0.5 + 0.5) * clusterGridSize.xy;
+	int x = clamp(int(tile.x), 0, clusterGridSize.x - 1);
+	int y = clamp(int(tile.y), 0, clusterGridSize.y - 1);
+	int z = clamp(int(log(-positionViewSpace.z) * clusterDepthSlice.x + clusterDepthSlice.y), 0, clusterGridSize.z - 1);
+	return (z * clusterGridSize.y + y) * clusterGridSize.x + x;
+}
+
+// Sum of the directional lights and the lights of the fragment's cluster
+vec4 calculateLights(vec3 diffuse, vec3 specular, vec3 fragment, vec3 normal, vec3 viewPosition) {
+	vec4 totalLight = vec4(0, 0, 0, 0);
+	for (int i = 0; i < numDirectionalLights; i++) {
+		totalLight = totalLight + calculateLight(lights[i], diffuse, specular, fragment, normal, viewPosition);
+	}
+	uvec2 cluster = clusters[clusterIndex(fragment)];
+	for (uint i = 0; i < cluster.y; i++) {
+		totalLight = totalLight + calculateLight(lights[lightIndices[cluster.x + i]], diffuse, specular, fragment, normal, viewPosition);
+	}
+	return totalLight;
 }
\ No newline at end of file
@@ -1,20 +1,26 @@
 layout(location = 0) in vec3 positionModelSpace;
 layout(location = 2) in vec2 textureTangentSpace;
+// Per particle, see ParticleInstance
+layout(location = 3) in vec4 instancePositionRotation;
+layout(location = 4) in vec4 instanceScaleProgress;
 
-uniform mat4 modelToWorld[100];
 uniform mat4 parentTransformation;
-uniform mat4 projectionMatrix;
-uniform mat4 worldToView;
-uniform float progress[100];
+uniform mat4 billboardRotation; // Turns the particles towards the camera
 
 out vec4 colorVS;
 out vec2 textureVS;
 out float progressVS;
 
 void main() {
-	progressVS = progress[gl_InstanceID];
+	progressVS = instanceScaleProgress.w;
 	textureVS = textureTangentSpace;
 
+	// Scale, rotate around the view direction, face the camera and move into place
+	vec3 position = positionModelSpace * instanceScaleProgress.xyz;
+	float rotation = instancePositionRotation.w;
+	position.xy = vec2(cos(rotation) * position.x - sin(rotation) * position.y, sin(rotation) * position.x + cos(rotation) * position.y);
+	position = mat3(billboardRotation) * position + instancePositionRotation.xyz;
+
 	mat4 viewcp = worldToView;
-	gl_Position = projectionMatrix * viewcp * parentTransformation * modelToWorld[gl_InstanceID] * vec4(positionModelSpace, 1);
+	gl_Position = projectionMatrix * viewcp * parentTransformation * vec4(position, 1);
 }
\ No newline at end of file
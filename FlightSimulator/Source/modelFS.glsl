@@ -1,14 +1,5 @@
 uniform sampler2D tex;
 uniform sampler2D normalMap;
-uniform mat4 worldToView;
-
-uniform bool useLights;
-
-uniform Light lights[10]; // Max 10 ligths
-uniform vec3 Ka, Kd, Ks;
-uniform float specularExponent;
-uniform float dissolve;
-uniform vec4 color;
 
 in vec3 fragmentPositionTangentSpaceVS;
 in vec3 viewPositionTangentSpaceVS;
@@ -32,7 +23,9 @@ void main() {
 
 	vec3 normal = normalize(normalVS);
 	float normalMapScale = 40;
-	vec3 normalTangentSpace = normalize(vec3(texture(normalMap, textureVS * normalMapScale).xyz) * 2 - 1); 
+	// Only x and y are read, so that two channel BC5 normal maps work too
+	vec2 normalXY = texture(normalMap, textureVS * normalMapScale).xy * 2 - 1;
+	vec3 normalTangentSpace = vec3(normalXY, sqrt(max(0, 1 - dot(normalXY, normalXY))));
 	vec3 lightDirection = lightDirectionVS;
 	vec3 fragment = fragmentVS;
 	vec3 viewPosition = viewPositionVS;
@@ -47,10 +40,7 @@ void main() {
 
 	vec4 totalLight = vec4(1, 1, 1, 1);
 	if (useLights) {
-		totalLight = vec4(0, 0, 0, 0);	
-		for (int i = 0; i < 10; i++) {
-			totalLight = totalLight + calculateLight(lights[i], vec3(0.5, 0.5, 0.5), vec3(0.8, 0.8, 0.8), fragmentVS, normalVS, viewPositionVS);
-		}
+		totalLight = calculateLights(vec3(0.5, 0.5, 0.5), vec3(0.8, 0.8, 0.8), fragmentVS, normalVS, viewPositionVS);
 	}
 
 	vec4 textureColor = texture(tex, textureVS) + color;
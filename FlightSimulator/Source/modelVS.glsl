@@ -5,8 +5,6 @@ layout(location = 3) in vec3 tangentModelSpace;
 layout(location = 4) in vec3 bitangentModelSpace;
 
 uniform mat4 modelToWorld;
-uniform mat4 projectionMatrix;
-uniform mat4 worldToView;
 uniform bool isSkybox;
 
 out vec3 viewPositionTangentSpaceVS;
@@ -27,8 +25,7 @@ void main(void) {
 
 	lightDirectionVS = normalize(vec3(1, -1, -1));
 	lightDirectionTangentSpaceVS = TBN * lightDirectionVS;
-	mat4 invView = inverse(worldToView);
-	viewPositionVS = vec3(invView[3][0], invView[3][1], invView[3][2]);
+	viewPositionVS = viewPosition.xyz;
 	viewPositionTangentSpaceVS = TBN * viewPositionVS;
 
 	textureVS = textureTangentSpace;
@@ -2,8 +2,6 @@
 layout(location = 0) in vec3 positionModelSpace;
 
 uniform mat4 modelToWorld;
-uniform mat4 worldToView;
-uniform mat4 projectionMatrix;
 
 out vec3 fragmentVS;
 
@@ -2,7 +2,19 @@ uniform sampler2D tex;
 uniform sampler2D tex2;
 uniform sampler2D tex3;
 uniform sampler2D tex4;
-uniform Light lights[10]; // Max 10 ligths
+uniform sampler2D virtualPageTable;
+uniform sampler2D virtualAtlas;
+
+// Must match TerrainVirtualTexture.h
+const float VIRTUAL_PAGES = 256;
+const float VIRTUAL_LEVELS = 9;
+const float PAGE_SIZE = 128;
+const float PAGE_BORDER = 1;
+const float ATLAS_SLOTS = 16;
+// The detail textures are blended directly up to this far, at full resolution, and fade into
+// the baked virtual texture until the end
+const float VIRTUAL_TEXTURE_START = 30;
+const float VIRTUAL_TEXTURE_END = 60;
 
 in vec3 viewPositionVS;
 in vec2 textureVS;
@@ -17,23 +29,49 @@ vec3 saturate(vec3 color, float saturate) {
     return mix(intensity, color, saturate);
 }
 
+// Baked terrain color at uv, from the page the page table maps for the level of detail the
+// fragment needs, or the closest coarser page that is resident. uvDx and uvDy are the screen
+// space derivatives of uv.
+vec4 sampleVirtualTexture(vec2 uv, vec2 uvDx, vec2 uvDy) {
+	uv = clamp(uv, 0, 0.99999);
+	vec2 dx = uvDx * VIRTUAL_PAGES * (PAGE_SIZE - 2 * PAGE_BORDER);
+	vec2 dy = uvDy * VIRTUAL_PAGES * (PAGE_SIZE - 2 * PAGE_BORDER);
+	float level = clamp(floor(0.5 * log2(max(dot(dx, dx), dot(dy, dy)))), 0, VIRTUAL_LEVELS - 1);
+	ivec2 page = ivec2(uv * VIRTUAL_PAGES / exp2(level));
+	vec4 entry = round(texelFetch(virtualPageTable, page, int(level)) * 255);
+	vec2 inPage = fract(uv * VIRTUAL_PAGES / exp2(entry.b));
+	vec2 atlasTexel = entry.xy * PAGE_SIZE + PAGE_BORDER + inPage * (PAGE_SIZE - 2 * PAGE_BORDER);
+	return textureLod(virtualAtlas, atlasTexel / (ATLAS_SLOTS * PAGE_SIZE), 0);
+}
+
 void main() {
-	vec4 terrain1 = texture(tex, textureVS);
-	vec4 terrain2 = texture(tex2, textureVS);
-	vec4 terrain3 = texture(tex3, textureVS);
-	vec4 splat = texture(tex4, textureVS / 500);
-	vec4 terrainColor = (splat.x * terrain1 + splat.y * terrain2 + splat.z * terrain3);
+	float camDistance = length(viewPositionVS - fragmentVS);
+	// Derivatives are taken before branching, the branches sample with them explicitly
+	vec2 textureDx = dFdx(textureVS);
+	vec2 textureDy = dFdy(textureVS);
+	float virtualWeight = smoothstep(VIRTUAL_TEXTURE_START, VIRTUAL_TEXTURE_END, camDistance);
+
+	// The direct samples are skipped beyond the fade, the page table lookup before it
+	vec4 detailColor = vec4(0);
+	if (virtualWeight < 1) {
+		vec4 terrain1 = textureGrad(tex, textureVS, textureDx, textureDy);
+		vec4 terrain2 = textureGrad(tex2, textureVS, textureDx, textureDy);
+		vec4 terrain3 = textureGrad(tex3, textureVS, textureDx, textureDy);
+		vec4 splat = textureGrad(tex4, textureVS / 500, textureDx / 500, textureDy / 500);
+		detailColor = (splat.x * terrain1 + splat.y * terrain2 + splat.z * terrain3);
+	}
+	vec4 virtualColor = vec4(0);
+	if (virtualWeight > 0) {
+		virtualColor = sampleVirtualTexture(textureVS / 500, textureDx / 500, textureDy / 500);
+	}
+	vec4 terrainColor = mix(detailColor, virtualColor, virtualWeight);
 
 
 	// Combine lights
-	vec4 totalLight = vec4(0, 0, 0, 0);
-	for (int i = 0; i < 10; i++) {
-		totalLight = totalLight + calculateLight(lights[i], vec3(0.5, 0.5, 0.5), vec3(0, 0, 0), fragmentVS, normalVS, viewPositionVS);
-	}
+	vec4 totalLight = calculateLights(vec3(0.5, 0.5, 0.5), vec3(0, 0, 0), fragmentVS, normalVS, viewPositionVS);
 	gl_Color = terrainColor * totalLight;
 
 	// Fade far away objects
-	float camDistance = length(viewPositionVS - fragmentVS);
 	float distanceStartFade = 100;
 	float distanceEndFade = 1000;
 	if (camDistance > distanceStartFade) {
@@ -5,8 +5,6 @@ layout(location = 1) in vec3 normalModelSpace;
 layout(location = 2) in vec2 textureTangentSpace;
 
 uniform mat4 modelToWorld;
-uniform mat4 projectionMatrix;
-uniform mat4 worldToView;
 
 out vec3 viewPositionVS;
 out vec2 textureVS;
@@ -16,8 +14,7 @@ out vec3 fragmentVS;
 void main(void) {
 	normalVS = normalize(mat3(modelToWorld) * normalModelSpace);
 
-	mat4 invView = inverse(worldToView);
-	viewPositionVS = vec3(invView[3][0], invView[3][1], invView[3][2]);
+	viewPositionVS = viewPosition.xyz;
 
 	textureVS = textureTangentSpace;
 	fragmentVS = vec3((modelToWorld * vec4(positionModelSpace, 1)).xyz);